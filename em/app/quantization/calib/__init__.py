@@ -0,0 +1,18 @@
+"""
+Native calibration of LinearQuant scales without sorting.
+
+|x| is counted into a fixed histogram of 16 bins per octave, read off the
+float32 bits; the overflow quantile exponent that compute_integral_part
+needs is exact from it. Histograms of several batches add up, so the
+scale can come from all calibration batches at once: percentile, min/max
+or KL divergence (calib.c).
+"""
+
+import numpy as np
+
+from _calib import BINS, hist_add, hist_exponent, hist_sf
+
+
+def histogram():
+    # empty histogram for hist_add
+    return np.zeros(BINS, dtype=np.int64)
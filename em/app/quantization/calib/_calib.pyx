@@ -0,0 +1,53 @@
+"""
+Cython wrapper of the native calibration histogram.
+"""
+
+import numpy as np
+from libc.stdint cimport int64_t
+
+cdef extern from 'calib.h':
+    int CALIB_BINS
+    int calib_hist_add(int64_t *hist, const float *x, long n, int num_thread) nogil
+    int calib_exponent(const int64_t *hist, double overflow_rate) nogil
+    int calib_sf_kl(const int64_t *hist, int bits) nogil
+
+BINS = CALIB_BINS
+
+
+def hist_add(hist, x, int num_thread=1):
+    """hist ((BINS,) int64, see calib.c) += the |x| of x, any shape, cast to float32."""
+    cdef int64_t [::1] h = hist
+    cdef float [::1] x_view = np.ascontiguousarray(x, dtype=np.float32).reshape(-1)
+    cdef int ret
+    assert h.shape[0] == CALIB_BINS
+    if x_view.shape[0] == 0:
+        return
+    with nogil:
+        ret = calib_hist_add(&h[0], &x_view[0], x_view.shape[0], num_thread)
+    if ret != 0:
+        raise MemoryError('cannot start calibration threads')
+
+
+def hist_exponent(hist, double overflow_rate=0.0):
+    """ceil(log2) of the overflow_rate quantile of |x| (compute_integral_part)."""
+    cdef int64_t [::1] h = hist
+    assert h.shape[0] == CALIB_BINS
+    return calib_exponent(&h[0], overflow_rate)
+
+
+def hist_sf(hist, int bits, method='percentile', double overflow_rate=0.0):
+    """
+    LinearQuant sf of the values counted in hist:
+      percentile: overflow_rate of |x| above the top level
+      minmax: no overflow
+      kl: least KL divergence between hist and its quantization
+    """
+    cdef int64_t [::1] h = hist
+    assert h.shape[0] == CALIB_BINS
+    if method == 'percentile':
+        return bits - 1 - calib_exponent(&h[0], overflow_rate)
+    if method == 'minmax':
+        return bits - 1 - calib_exponent(&h[0], 0.0)
+    if method == 'kl':
+        return calib_sf_kl(&h[0], bits)
+    raise ValueError('unknown calibration method: %s' % method)
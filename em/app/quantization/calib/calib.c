@@ -0,0 +1,229 @@
+/*
+Streaming calibration of the power-of-two scales of LinearQuant.
+
+|x| goes into a fixed histogram indexed by its float32 bits: the exponent
+and the top 4 mantissa bits of |x|, so that bin b covers [lo, hi) and its
+whole octave [2^(e-1), 2^e) has ceil(log2(|x| + 1e-12)) = e, the exponent
+compute_integral_part takes. The 1e-12 moves two kinds of values off that
+rule: from 2^11 up it no longer lifts an exact power of two to the next
+octave (counted in the top bin of its own), and below 2^-15 it lifts
+values near the top of an octave, so these get their exponent computed
+(and go to the lowest bin of it; zeros keep bin 0). The sf of a quantile only needs that
+exponent, so it is exact without a sort, and histograms of several
+batches merge by adding the counts.
+
+calib_sf_kl picks the sf whose quantization of the histogram is closest
+in KL divergence to the histogram itself (TensorRT-style): P folds the
+values above the clip level into its bin, Q quantizes the values below
+it and spreads each level back over its nonempty bins in proportion to
+their width (zeros, a point mass, stay apart).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "calib.h"
+
+#define KL_EPS 1e-4            // Q count of a bin Q leaves empty
+#define U_SMALL 0x38000000u    // float32 bits of 2^-15
+#define U_POW11 0x45000000u    // float32 bits of 2^11
+
+typedef struct {
+    int64_t *hist;
+    const float *x;
+    long i0, i1;
+} hist_block;
+
+/************************************************************************/
+// histogram
+
+static void *hist_block_run(void *arg) {
+    hist_block *b = (hist_block *)arg;
+    int64_t *h = b->hist;
+    uint32_t u;
+    long i;
+    int e;
+    for (i = b->i0; i < b->i1; i++) {
+        memcpy(&u, b->x + i, sizeof(u));
+        u &= 0x7fffffffu;
+        if (u < U_SMALL && u != 0) {
+            e = (int)ceil(log2(fabs((double)b->x[i]) + 1e-12));
+            h[(e + 126) * CALIB_SUB]++;
+        } else if (u >= U_POW11 && (u & 0x7fffffu) == 0 && u < 0x7f800000u) {
+            h[(u >> (23 - 4)) - 1]++;
+        } else {
+            h[u >> (23 - 4)]++;
+        }
+    }
+    return NULL;
+}
+
+/*
+hist (CALIB_BINS) += the |x| of x[0, n); threads count into private
+histograms. Returns 0 or -1 (memory).
+*/
+int calib_hist_add(int64_t *hist, const float *x, long n, int num_thread) {
+    hist_block *blk;
+    pthread_t *th;
+    long t, k, step;
+    int started = 0;
+
+    if (num_thread < 1) num_thread = 1;
+    if (n < (long)num_thread * CALIB_BINS) num_thread = 1;
+    blk = malloc(num_thread * sizeof(hist_block));
+    th = malloc(num_thread * sizeof(pthread_t));
+    if (blk == NULL || th == NULL) {
+        free(blk);
+        free(th);
+        return -1;
+    }
+    blk[0].hist = hist;
+    for (t = 1; t < num_thread; t++) {
+        blk[t].hist = calloc(CALIB_BINS, sizeof(int64_t));
+        if (blk[t].hist == NULL) {
+            num_thread = (int)t;
+            break;
+        }
+    }
+    step = (n + num_thread - 1) / num_thread;
+    for (t = 0; t < num_thread; t++) {
+        blk[t].x = x;
+        blk[t].i0 = t * step < n ? t * step : n;
+        blk[t].i1 = (t + 1) * step < n ? (t + 1) * step : n;
+    }
+    for (t = 1; t < num_thread; t++) {
+        if (pthread_create(th + t, NULL, hist_block_run, blk + t) != 0) {
+            break;
+        }
+        started++;
+    }
+    hist_block_run(blk);
+    for (t = 1; t <= started; t++) {
+        pthread_join(th[t], NULL);
+    }
+    // blocks whose thread did not start run here
+    for (t = started + 1; t < num_thread; t++) {
+        hist_block_run(blk + t);
+    }
+    for (t = 1; t < num_thread; t++) {
+        for (k = 0; k < CALIB_BINS; k++) {
+            hist[k] += blk[t].hist[k];
+        }
+        free(blk[t].hist);
+    }
+    free(blk);
+    free(th);
+    return 0;
+}
+
+// ceil(log2(|x| + 1e-12)) of the values of bin b, CALIB_EMIN for the zero bin
+static int bin_exponent(long b) {
+    int e = (int)(b / CALIB_SUB) - 126;
+    return b == 0 || e < CALIB_EMIN ? CALIB_EMIN : e;
+}
+
+// lower edge of bin b, as a value
+static double bin_lo(long b) {
+    long e = b / CALIB_SUB, s = b % CALIB_SUB;
+    if (e == 0) { // subnormal
+        return ldexp((double)s / CALIB_SUB, -126);
+    }
+    return ldexp(1.0 + (double)s / CALIB_SUB, (int)e - 127);
+}
+
+static double bin_width(long b) {
+    long e = b / CALIB_SUB;
+    return ldexp(1.0 / CALIB_SUB, (e == 0 ? 1 : (int)e) - 127);
+}
+
+/************************************************************************/
+// scale selection
+
+/*
+ceil(log2(v + 1e-12)) of v, the (floor(overflow_rate * n) + 1)-th largest
+|x|: the value compute_integral_part takes from the sorted tensor.
+*/
+int calib_exponent(const int64_t *hist, double overflow_rate) {
+    int64_t n = 0, k, cum = 0;
+    long b;
+    for (b = 0; b < CALIB_BINS; b++) {
+        n += hist[b];
+    }
+    k = (int64_t)(overflow_rate * (double)n);
+    for (b = CALIB_BINS - 1; b > 0; b--) {
+        cum += hist[b];
+        if (cum > k) break;
+    }
+    return bin_exponent(b);
+}
+
+// KL(P || Q) of sf, see the top of the file
+static double kl_divergence(const int64_t *hist, int bits, int sf, double *q, long *level) {
+    double delta = ldexp(1.0, -sf), mass, width, p, kl = 0.0, n = 0.0;
+    long L = (1L << (bits - 1)) - 1, top, b, i, lv, first;
+    double clip = ((double)L + 0.5) * delta;
+    int64_t over = 0;
+
+    // bins up to the one holding the clip level
+    for (top = CALIB_BINS - 1; top > 0 && bin_lo(top) >= clip; top--) {
+        over += hist[top];
+    }
+    for (b = 0; b <= top; b++) {
+        lv = (long)floor((bin_lo(b) + 0.5 * bin_width(b)) / delta + 0.5);
+        level[b] = lv < L ? lv : L;
+        n += (double)hist[b];
+    }
+    if (n == 0.0) return 0.0;
+    // Q: the bins below the clip level, quantized; levels are nondecreasing
+    // in b, one group of bins per level. Zeros are exact, a group of their
+    // own: not spread over the width of the level
+    q[0] = (double)hist[0];
+    for (first = 1; first <= top; first = b) {
+        mass = 0.0;
+        width = 0.0;
+        for (b = first; b <= top && level[b] == level[first]; b++) {
+            mass += (double)hist[b];
+            if (hist[b] > 0) width += bin_width(b);
+        }
+        for (i = first; i < b; i++) {
+            q[i] = hist[i] > 0 ? mass * bin_width(i) / width : 0.0;
+        }
+    }
+    // P: all values, those above the clip level in the top bin; Q lacks
+    // them, which is the cost of clipping
+    for (b = 0; b <= top; b++) {
+        p = (double)hist[b] + (b == top ? (double)over : 0.0);
+        if (p > 0.0) {
+            kl += p / (n + over) * log(p / (n + over) / ((q[b] > 0.0 ? q[b] : KL_EPS) / n));
+        }
+    }
+    return kl;
+}
+
+/*
+sf of the least KL divergence among those of the max |x| and the
+CALIB_KL_RANGE finer ones (more clipping); ties keep the coarser.
+Returns the sf, or the one of the max if out of memory.
+*/
+int calib_sf_kl(const int64_t *hist, int bits) {
+    int sf0 = bits - 1 - calib_exponent(hist, 0.0), sf, best = sf0;
+    double kl, best_kl = HUGE_VAL;
+    double *q = malloc(CALIB_BINS * sizeof(double));
+    long *level = malloc(CALIB_BINS * sizeof(long));
+    if (q != NULL && level != NULL) {
+        for (sf = sf0; sf <= sf0 + CALIB_KL_RANGE; sf++) {
+            kl = kl_divergence(hist, bits, sf, q, level);
+            if (kl < best_kl) {
+                best_kl = kl;
+                best = sf;
+            }
+        }
+    }
+    free(q);
+    free(level);
+    return best;
+}
@@ -0,0 +1,15 @@
+#ifndef EM_CALIB_H
+#define EM_CALIB_H
+
+#include <stdint.h>
+
+#define CALIB_SUB  16              // bins per octave (4 mantissa bits)
+#define CALIB_BINS (256 * CALIB_SUB) // every float32 exponent
+#define CALIB_EMIN -39             // exponent of 0, ceil(log2(1e-12)) as compute_integral_part
+#define CALIB_KL_RANGE 8           // kl: sf tried beyond that of the max
+
+int calib_hist_add(int64_t *hist, const float *x, long n, int num_thread);
+int calib_exponent(const int64_t *hist, double overflow_rate);
+int calib_sf_kl(const int64_t *hist, int bits);
+
+#endif
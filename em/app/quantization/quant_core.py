@@ -7,15 +7,20 @@ from numpy import log2
 
 from IPython import embed
 
+CALIB_THREADS = 4 # native calibration histogram
+
+def to_numpy(input):
+    if isinstance(input, Variable):
+        input = input.data
+    return input.cpu().numpy()
+
 def compute_integral_part(input, overflow_rate):
-    abs_value = input.abs().view(-1)
-    sorted_value = abs_value.sort(dim=0, descending=True)[0]
-    split_idx = int(overflow_rate * len(sorted_value))
-    v = sorted_value[split_idx]
-    if isinstance(v, Variable):
-        v = v.data.cpu().numpy()[0]
-    sf = math.ceil(log2(v+1e-12))
-    return sf
+    # ceil(log2) of the overflow_rate quantile of |input|, from a native
+    # histogram instead of a sort (calib/calib.c)
+    from .calib import histogram, hist_add, hist_exponent
+    hist = histogram()
+    hist_add(hist, to_numpy(input), CALIB_THREADS)
+    return hist_exponent(hist, overflow_rate)
 
 def linear_quantize(input, sf, bits):
     assert bits >= 1, bits
@@ -54,6 +59,26 @@ def log_linear_quantize(input, sf, bits):
     del input0 # save memory
     return v
 
+def log2_exponent(input):
+    # round(log2|v|) and its max
+    e = torch.floor(torch.log(torch.abs(input) + 1e-20) / math.log(2.0) + 0.5)
+    emax = e.max()
+    if isinstance(emax, Variable):
+        emax = emax.data.cpu().numpy()[0]
+    return e, float(emax)
+
+def log2_quantize(input, bits):
+    # signed powers of two, sign * 2^round(log2|v|): the 2^(bits-1)-1
+    # exponents up to that of the largest |v|, 0 below; unlike
+    # log_linear_quantize the values are exact shifts (native engine)
+    assert bits >= 2, bits
+    s = torch.sign(input)
+    e, emax = log2_exponent(input)
+    emin = emax - (math.pow(2.0, bits-1) - 2)
+    v = torch.pow(2.0, torch.clamp(e, emin, emax)) * s * (e >= emin).float()
+    del e # save memory
+    return v
+
 def min_max_quantize(input, bits):
     assert bits >= 1, bits
     if bits == 1:
@@ -90,7 +115,11 @@ def tanh_quantize(input, bits):
 
 
 class LinearQuant(nn.Module):
-    def __init__(self, name, bits, sf=None, overflow_rate=0.0, counter=10):
+    # calib: how the first counter batches set sf
+    #   batch: overflow quantile of each batch, the smallest sf of all
+    #   percentile, minmax, kl: one histogram of all the batches, sf set at
+    #     the last one (calib.hist_sf)
+    def __init__(self, name, bits, sf=None, overflow_rate=0.0, counter=10, calib='batch'):
         super(LinearQuant, self).__init__()
         self.name = name
         self._counter = counter
@@ -98,6 +127,8 @@ class LinearQuant(nn.Module):
         self.bits = bits
         self.sf = sf
         self.overflow_rate = overflow_rate
+        self.calib = calib
+        self.hist = None # calib.histogram of the batches so far
 
     @property
     def counter(self):
@@ -106,8 +137,17 @@ class LinearQuant(nn.Module):
     def forward(self, input):
         if self._counter > 0:
             self._counter -= 1
-            sf_new = self.bits - 1 - compute_integral_part(input, self.overflow_rate)
-            self.sf = min(self.sf, sf_new) if self.sf is not None else sf_new
+            if getattr(self, 'calib', 'batch') == 'batch': # older pickles: no calib
+                sf_new = self.bits - 1 - compute_integral_part(input, self.overflow_rate)
+                self.sf = min(self.sf, sf_new) if self.sf is not None else sf_new
+                return input
+            from .calib import histogram, hist_add, hist_sf
+            if self.hist is None:
+                self.hist = histogram()
+            hist_add(self.hist, to_numpy(input), CALIB_THREADS)
+            if self._counter == 0:
+                self.sf = hist_sf(self.hist, self.bits, self.calib, self.overflow_rate)
+                self.hist = None
             return input
         elif self._counter == -10: # magic number to let it pass
             return input 
@@ -168,7 +208,9 @@ class NormalQuant(nn.Module):
     def __repr__(self):
         return '{}(bits={})'.format(self.__class__.__name__, self.bits)
 
-def quantize_weight(state_dict, bits=8, do_bias=True, overflow_rate=0.0, quant_method='linear'):
+def quantize_weight(state_dict, bits=8, do_bias=True, overflow_rate=0.0, quant_method='linear', sf=None):
+    # sf: dict, gets the scale factor of each linear-quantized tensor (native int8 engine),
+    # or for log2 the exponent offset: |v| = 2^(e-sf), e in [0, 2^(bits-1)-2]
     state_dict_quant = OrderedDict()
     for k, v in state_dict.items():
         if not do_bias and '.bias' in k:
@@ -176,10 +218,16 @@ def quantize_weight(state_dict, bits=8, do_bias=True, overflow_rate=0.0, quant_m
             continue
 
         if quant_method == 'linear':
-            sf = bits - 1. - compute_integral_part(v, overflow_rate=overflow_rate)
-            v_quant  = linear_quantize(v, sf, bits=bits)
+            sf_v = bits - 1. - compute_integral_part(v, overflow_rate=overflow_rate)
+            v_quant  = linear_quantize(v, sf_v, bits=bits)
+            if sf is not None:
+                sf[k] = int(sf_v)
         elif quant_method == 'log':
             v_quant = log_minmax_quantize(v, bits=bits)
+        elif quant_method == 'log2':
+            v_quant = log2_quantize(v, bits=bits)
+            if sf is not None:
+                sf[k] = int(math.pow(2.0, bits-1) - 2 - log2_exponent(v)[1])
         elif quant_method == 'minmax':
             v_quant = min_max_quantize(v, bits=bits)
         else:
@@ -187,10 +235,10 @@ def quantize_weight(state_dict, bits=8, do_bias=True, overflow_rate=0.0, quant_m
         state_dict_quant[k] = v_quant
     return state_dict_quant
 
-def get_quantize_layer(quant_method, layer_name, bits, overflow_rate=0.0, counter=10):
+def get_quantize_layer(quant_method, layer_name, bits, overflow_rate=0.0, counter=10, calib='batch'):
     quant_layer = []
     if quant_method == 'linear':
-        quant_layer = LinearQuant('{}_quant'.format(layer_name), bits=bits, overflow_rate=overflow_rate, counter=counter)
+        quant_layer = LinearQuant('{}_quant'.format(layer_name), bits=bits, overflow_rate=overflow_rate, counter=counter, calib=calib)
     elif quant_method == 'log':
         quant_layer = NormalQuant('{}_quant'.format(layer_name), bits=bits, quant_func=log_minmax_quantize)
     elif quant_method == 'minmax':
@@ -199,7 +247,8 @@ def get_quantize_layer(quant_method, layer_name, bits, overflow_rate=0.0, counte
         quant_layer = NormalQuant('{}_quant'.format(layer_name), bits=bits, quant_func=tanh_quantize)
     return quant_layer
 
-def quantize_feat(model, bits=8, overflow_rate=0.0, quant_method='linear', counter=10):
+def quantize_feat(model, bits=8, overflow_rate=0.0, quant_method='linear', counter=10, calib='batch'):
+    # calib: LinearQuant calibration
     assert quant_method in ['linear', 'minmax', 'log', 'tanh']
     for seq_id in range(model.seq_num):
         seq = model.getLearnableSeq(seq_id)
@@ -207,5 +256,5 @@ def quantize_feat(model, bits=8, overflow_rate=0.0, quant_method='linear', count
         for k, v in seq._modules.items():
             l[k] = v
             if isinstance(v, (nn.Conv3d, nn.Linear, nn.BatchNorm3d, nn.AvgPool3d, nn.LeakyReLU)):
-                l['{}_{}_quant'.format(k, quant_method)] = get_quantize_layer(quant_method, k, bits, overflow_rate, counter)
+                l['{}_{}_quant'.format(k, quant_method)] = get_quantize_layer(quant_method, k, bits, overflow_rate, counter, calib)
         model.setLearnableSeq(seq_id, nn.Sequential(l))
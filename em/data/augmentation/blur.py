@@ -10,6 +10,7 @@ import numpy as np
 from scipy.ndimage.filters import gaussian_filter
 
 import augmentor
+from .section import section
 
 class Blur(augmentor.DataAugment):
     """
@@ -81,36 +82,37 @@ class Blur(augmentor.DataAugment):
                     # DEBUG(kisuk)
                     # print 'z = {}, sigma = {}'.format(z+1,sigma)
         else:
+            # Blurred sections are pasted (fully or by quadrant) by the
+            # native section engine; each record copies from its own slot.
+            rec, vals = [], []
+            slots = dict((key, []) for key in imgs)
             for z in zlocs:
                 # Random sigma.
                 sigma = np.random.rand() * self.sigma_max
                 # DEBUG(kisuk)
                 # print 'z = {}, sigma = {}'.format(z+1,sigma)
                 # Blurring.
-                for key in imgs:
+                for k, key in enumerate(imgs):
                     img = sample[key][...,z,:,:]
                     img = gaussian_filter(img, sigma=sigma)
+                    vals.append(len(slots[key]))  # Source slot.
+                    slots[key].append(img)
                     # Full or partial?
                     if self.mode == 'mix' and np.random.rand() > 0.5:
                         # Full image blurring.
-                        sample[key][...,z,:,:] = img
+                        rec.append(section.make_record(z, op=section.COPY, key=k))
                     else:
                         # Draw a random xy-coordinate.
                         x = np.random.randint(0, xdim)
                         y = np.random.randint(0, ydim)
                         rule = np.random.rand(4) > 0.5
-                        # 1st quadrant.
-                        if rule[0]:
-                            sample[key][...,z,:y,:x] = img[...,:y,:x]
-                        # 2nd quadrant.
-                        if rule[1]:
-                            sample[key][...,z,y:,:x] = img[...,y:,:x]
-                        # 3nd quadrant.
-                        if rule[2]:
-                            sample[key][...,z,:y,x:] = img[...,:y,x:]
-                        # 4nd quadrant.
-                        if rule[3]:
-                            sample[key][...,z,y:,x:] = img[...,y:,x:]
+                        rec.append(section.make_record(z, y, x,
+                                section.quadrant_mask(rule), section.COPY, k))
+
+            src = [np.stack(slots[key]).astype('float32') for key in imgs]
+            for key in imgs:
+                sample[key] = np.ascontiguousarray(sample[key], dtype='float32')
+            section.apply_sections([sample[key] for key in imgs], rec, vals, src)
 
         return sample
 
@@ -12,6 +12,7 @@ from scipy.ndimage.filters import gaussian_filter
 
 import augmentor
 from ..box import *
+from .occlusion import occlusion
 
 class BoxOcclusion(augmentor.DataAugment):
     """
@@ -66,73 +67,34 @@ class BoxOcclusion(augmentor.DataAugment):
             # else:
             #     msk = np.zeros(sample[key].shape, 'float32')
 
-            # Random box augmentation.
-            count   = 0
+            # Random box augmentation: draw all boxes up front.
             density = self.max_density*np.random.rand()
             goal    = bbox.volume()*density
             # DEBUG(kisuk):
             # print 'density: %.2f' % density
-            while True:
-                # Random location.
-                m = self.min_dim  # Margin.
-                z = np.random.randint(0, self.dim[0])
-                y = np.random.randint(0, self.dim[1])
-                x = np.random.randint(0, self.dim[2])
-                loc = Vec3d(z,y,x) + self.offset
-                # Random box size.
-                dim = np.random.randint(self.min_dim, self.max_dim + 1, 3)
-                # Anisotropy.
-                dim[0] /= int(self.aspect_ratio)
-                # Box.
-                box = bbox.intersect(centered_box(loc, dim))
-                # Local coordiate.
-                box.translate(-self.offset)
-                vmin = box.min()
-                vmax = box.max()
-                sz   = box.size()
-
-                # Random choice.
-                enabled = self.mode > 0
-                rule = np.random.rand(5)
-                rule[np.logical_not(enabled)] = 0
-                rule = rule >= rule.max()
-
-                # Slices.
-                # s0 = vmin[0]:vmax[0]
-                # s1 = vmin[1]:vmax[1]
-                # s2 = vmin[2]:vmax[2]
+            box, rule = occlusion.draw_boxes(self.dim, self.min_dim,
+                            self.max_dim, self.aspect_ratio, goal, self.mode)
+            op, param = self.draw_params(rule)
+
+            # Fill-out, alpha and Gaussian noise are applied natively, in
+            # order; boxes needing scipy blur are handed back to us.
+            img = np.ascontiguousarray(sample[key], dtype='float32')
+            occluder = occlusion.BoxOccluder(np.random.randint(2**31))
+            b = occluder.apply(img, box, op, param)
+            while b < len(op):
+                # Clipped to this image, as in the native apply.
+                vmin = np.maximum(box[b,:3], 0)
+                vmax = np.minimum(box[b,3:], img.shape[-3:])
                 s0 = slice(vmin[0],vmax[0])
                 s1 = slice(vmin[1],vmax[1])
                 s2 = slice(vmin[2],vmax[2])
-
-                # (1) Random fill-out.
-                if rule[0]:
-                    assert enabled[0]
-                    val = self.mode[0]  # Fill-out value.
-                    if val > 1:
-                        val = np.random.rand()
-                    sample[key][...,s0,s1,s2] = val
-
-                # (2) Alpha.
-                if rule[1]:
-                    assert enabled[1]
-                    alpha = np.random.rand() * self.mode[1]
-                    sample[key][...,s0,s1,s2] *= alpha
-
-                # (3) Gaussian white noise (additive or multiplicative).
-                if rule[2]:
-                    assert enabled[2]
-                    scale = self.mode[2]
-                    if np.random.rand() < 0.5:
-                        val = np.random.normal(loc=0.0, scale=scale, size=sz)
-                        sample[key][...,s0,s1,s2] += val[...]
-                    else:
-                        val = np.random.normal(loc=1.0, scale=scale, size=sz)
-                        sample[key][...,s0,s1,s2] *= val[...]
+                sz = vmax - vmin
+                if (sz <= 0).any():
+                    b = occluder.apply(img, box, op, param, b + 1)
+                    continue
 
                 # (4) Uniform white noise.
-                if rule[3]:
-                    assert enabled[3]
+                if op[b] == occlusion.BOX_UNIFORM:
                     val = np.random.rand(sz[0],sz[1],sz[2])
                     # Random Gaussian blur.
                     sigma = [0,0,0]
@@ -142,38 +104,61 @@ class BoxOcclusion(augmentor.DataAugment):
                     # Anisotropy.
                     sigma[0] /= self.aspect_ratio
                     val = gaussian_filter(val, sigma=sigma)
-                    sample[key][...,s0,s1,s2] = val[...]
+                    img[...,s0,s1,s2] = val[...]
 
                 # (5) 3D blur.
-                if rule[4]:
-                    assert enabled[4]
-                    img = sample[key][...,s0,s1,s2]
+                if op[b] == occlusion.BOX_BLUR:
+                    blk = img[...,s0,s1,s2]
                     # Random Gaussian blur.
-                    sigma = [0] * img.ndim
+                    sigma = [0] * blk.ndim
                     sigma[-3] = np.random.rand() * self.sigma_max
                     sigma[-2] = np.random.rand() * self.sigma_max
                     sigma[-1] = np.random.rand() * self.sigma_max
                     # Anisotropy.
                     sigma[-3] /= self.aspect_ratio
-                    img = gaussian_filter(img, sigma=sigma)
-                    sample[key][...,s0,s1,s2] = img
+                    blk = gaussian_filter(blk, sigma=sigma)
+                    img[...,s0,s1,s2] = blk
 
                 # # Update augmentation mask.
                 # msk[...,s0,s1,s2] = 1
 
-                # Stop condition.
-                count += box.volume()
-                if count > goal:
-                    break;
+                b = occluder.apply(img, box, op, param, b + 1)
 
             # Clip.
-            sample[key] = np.clip(sample[key], 0, 1)
+            sample[key] = occlusion.clip(img, 0, 1)
 
             # # Augmentation mask.
             # sample[key+'_augmask'] = msk
 
         return sample
 
+    def draw_params(self, rule):
+        """Map chosen modes to native op codes and draw their parameters."""
+        num = len(rule)
+        op = np.zeros(num, dtype='int32')
+        param = np.zeros(num, dtype='float32')
+        # (1) Random fill-out.
+        idx = rule == 0
+        op[idx] = occlusion.BOX_FILL
+        if self.mode[0] > 1:
+            param[idx] = np.random.rand(np.count_nonzero(idx))
+        else:
+            param[idx] = self.mode[0]  # Fill-out value.
+        # (2) Alpha.
+        idx = rule == 1
+        op[idx] = occlusion.BOX_ALPHA
+        param[idx] = np.random.rand(np.count_nonzero(idx)) * self.mode[1]
+        # (3) Gaussian white noise (additive or multiplicative).
+        idx = rule == 2
+        additive = np.random.rand(num) < 0.5
+        op[idx & additive] = occlusion.BOX_NOISE_ADD
+        op[idx & ~additive] = occlusion.BOX_NOISE_MUL
+        param[idx] = self.mode[2]
+        # (4) Uniform white noise, (5) 3D blur: applied in python.
+        op[rule == 3] = occlusion.BOX_UNIFORM
+        op[rule == 4] = occlusion.BOX_BLUR
+        return op, param
+
     ####################################################################
     ## Setters.
     ####################################################################
@@ -9,6 +9,7 @@ Kisuk Lee <kisuklee@mit.edu>, 2017
 import numpy as np
 
 import augmentor
+from .section import section
 
 class MissingSection(augmentor.DataAugment):
     """
@@ -83,9 +84,13 @@ class MissingSection(augmentor.DataAugment):
         val = np.random.rand() if self.random_color else 0
 
         # Apply full or partial missing sections according to the mode.
+        # Sections are collected as records and filled natively in one call.
+        rec = []
+        vals = []
         if self.mode == 'full':
-            for key in imgs:
-                sample[key][...,zlocs,:,:] = val
+            for z in zlocs:
+                rec.append(section.make_record(z))
+                vals.append(val)
         else:
             # Draw a random xy-coordinate.
             x = np.random.randint(0, xdim)
@@ -95,30 +100,20 @@ class MissingSection(augmentor.DataAugment):
             for z in zlocs:
                 val = np.random.rand() if self.random_color else 0
                 if self.mode == 'mix' and np.random.rand() > 0.5:
-                    for key in imgs:
-                        sample[key][...,z,:,:] = val
+                    rec.append(section.make_record(z))
                 else:
                     # Independent coordinates across sections.
                     if not self.consecutive:
                         x = np.random.randint(0, xdim)
                         y = np.random.randint(0, ydim)
                         rule = np.random.rand(4) > 0.5
-                    # 1st quadrant.
-                    if rule[0]:
-                        for key in imgs:
-                            sample[key][...,z,:y,:x] = val
-                    # 2nd quadrant.
-                    if rule[1]:
-                        for key in imgs:
-                            sample[key][...,z,y:,:x] = val
-                    # 3nd quadrant.
-                    if rule[2]:
-                        for key in imgs:
-                            sample[key][...,z,:y,x:] = val
-                    # 4nd quadrant.
-                    if rule[3]:
-                        for key in imgs:
-                            sample[key][...,z,y:,x:] = val
+                    rec.append(section.make_record(z, y, x,
+                                    section.quadrant_mask(rule)))
+                vals.append(val)
+
+        for key in imgs:
+            sample[key] = np.ascontiguousarray(sample[key], dtype='float32')
+        section.apply_sections([sample[key] for key in imgs], rec, vals)
 
         return sample
 
@@ -0,0 +1,57 @@
+"""
+Cython wrapper of the native box occlusion kernels.
+"""
+
+import numpy as np
+
+cdef extern from 'occlusion.c':
+    ctypedef struct rng_state:
+        pass
+    void rng_seed(rng_state *st, unsigned long long seed)
+    int box_occlusion_apply(float *img, const int sh[4], const int *box,
+                            const int *op, const float *param, int start,
+                            int num_box, rng_state *st, float *noise)
+    void clip_inplace(float *img, long n, float lo, float hi)
+
+
+cdef class BoxOccluder:
+    """
+    Apply a list of boxes to a float32 image, keeping the noise generator
+    state across calls so that boxes handled in python can be interleaved.
+    """
+    cdef rng_state st
+
+    def __cinit__(self, unsigned long long seed):
+        rng_seed(&self.st, seed)
+
+    def apply(self, img, box, op, param, int start=0):
+        """
+        img:   c-contiguous float32 array (..., z, y, x), modified in place
+        box:   (N,6) int32 array of (z0,y0,x0,z1,y1,x1) in local coordinates
+        op:    (N,) int32 op codes
+        param: (N,) float32 op parameters
+
+        Returns the index of the first box that needs to be applied by the
+        caller, or N when done.
+        """
+        assert img.dtype == np.float32 and img.flags['C_CONTIGUOUS']
+        cdef float [:, :, :, ::1] img_view = img.reshape((-1,) + img.shape[-3:])
+        cdef int [:, ::1] box_view = np.ascontiguousarray(box, dtype=np.int32)
+        cdef int [::1] op_view = np.ascontiguousarray(op, dtype=np.int32)
+        cdef float [::1] param_view = np.ascontiguousarray(param, dtype=np.float32)
+        cdef int [::1] sh_view = np.array([img_view.shape[d] for d in range(4)], dtype=np.int32)
+        cdef float [::1] noise = np.empty(img.shape[-1], dtype=np.float32)
+        cdef int num_box = op_view.shape[0]
+        if num_box == 0 or start >= num_box:
+            return num_box
+        return box_occlusion_apply(&img_view[0, 0, 0, 0], &sh_view[0],
+                                   &box_view[0, 0], &op_view[0], &param_view[0],
+                                   start, num_box, &self.st, &noise[0])
+
+
+def clip(img, float lo=0.0, float hi=1.0):
+    """In-place clip of a c-contiguous float32 array."""
+    assert img.dtype == np.float32 and img.flags['C_CONTIGUOUS']
+    cdef float [::1] img_view = img.reshape(-1)
+    clip_inplace(&img_view[0], img_view.shape[0], lo, hi)
+    return img
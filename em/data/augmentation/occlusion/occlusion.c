@@ -0,0 +1,166 @@
+/*
+Box occlusion kernels.
+
+Boxes are drawn up front (in python) and applied here in order, one pass per
+box over all channels. Gaussian noise comes from an 8-lane xoshiro128+
+generator with Box-Muller transform; the lanes are kept in separate arrays so
+the inner loops vectorize.
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BOX_FILL      0
+#define BOX_ALPHA     1
+#define BOX_NOISE_ADD 2
+#define BOX_NOISE_MUL 3
+// op codes >= BOX_NATIVE_END are left to the caller (uniform noise, blur)
+#define BOX_NATIVE_END 4
+
+#define RNG_LANES 8
+
+typedef struct {
+    uint32_t s0[RNG_LANES];
+    uint32_t s1[RNG_LANES];
+    uint32_t s2[RNG_LANES];
+    uint32_t s3[RNG_LANES];
+} rng_state;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(rng_state *st, uint64_t seed) {
+    int l;
+    uint64_t a, b;
+    for (l = 0; l < RNG_LANES; l++) {
+        a = splitmix64(&seed);
+        b = splitmix64(&seed);
+        st->s0[l] = (uint32_t)a;
+        st->s1[l] = (uint32_t)(a >> 32);
+        st->s2[l] = (uint32_t)b;
+        st->s3[l] = (uint32_t)(b >> 32) | 1; // state must not be all zero
+    }
+}
+
+static inline uint32_t rotl32(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+// one uniform float in (0,1] per lane
+static inline void rng_uniform8(rng_state *st, float *out) {
+    int l;
+    uint32_t r, t;
+    for (l = 0; l < RNG_LANES; l++) {
+        r = st->s0[l] + st->s3[l];
+        t = st->s1[l] << 9;
+        st->s2[l] ^= st->s0[l];
+        st->s3[l] ^= st->s1[l];
+        st->s1[l] ^= st->s2[l];
+        st->s0[l] ^= st->s3[l];
+        st->s2[l] ^= t;
+        st->s3[l] = rotl32(st->s3[l], 11);
+        // top 24 bits -> (0,1]
+        out[l] = ((r >> 8) + 1) * (1.0f / 16777216.0f);
+    }
+}
+
+// fill out[0:n] with N(mu, sigma) samples
+void rng_normal(rng_state *st, float *out, int n, float mu, float sigma) {
+    float u1[RNG_LANES], u2[RNG_LANES], buf[2 * RNG_LANES];
+    float r;
+    int i, l, m;
+    const float two_pi = 6.28318530717958647692f;
+    for (i = 0; i < n; i += 2 * RNG_LANES) {
+        rng_uniform8(st, u1);
+        rng_uniform8(st, u2);
+        for (l = 0; l < RNG_LANES; l++) {
+            r = sqrtf(-2.0f * logf(u1[l]));
+            buf[l] = mu + sigma * r * cosf(two_pi * u2[l]);
+            buf[RNG_LANES + l] = mu + sigma * r * sinf(two_pi * u2[l]);
+        }
+        m = n - i < 2 * RNG_LANES ? n - i : 2 * RNG_LANES;
+        memcpy(out + i, buf, m * sizeof(float));
+    }
+}
+
+/*
+Apply boxes [start, num_box) to img in order.
+
+img:   float32, c-contiguous (ch, z, y, x)
+sh:    (ch, z, y, x)
+box:   num_box x 6 ints, (z0, y0, x0, z1, y1, x1) half-open, clipped here
+       to the image (boxes are drawn in the union box of all keys)
+op:    num_box op codes
+param: num_box floats (fill value, alpha or noise scale)
+noise: scratch buffer of at least sh[3] floats
+
+Noise is shared across channels, as in the python reference.
+Returns the index of the first box whose op has to be applied by the caller,
+or num_box if all remaining boxes were applied.
+*/
+int box_occlusion_apply(float *img, const int sh[4], const int *box,
+                        const int *op, const float *param, int start,
+                        int num_box, rng_state *st, float *noise) {
+    int b, d, ch, z, y, x, len;
+    int lo[3], hi[3];
+    float *row;
+    const int *bb;
+    float v;
+    long strd[3] = {(long)sh[1] * sh[2] * sh[3], (long)sh[2] * sh[3], sh[3]};
+
+    for (b = start; b < num_box; b++) {
+        if (op[b] >= BOX_NATIVE_END) {
+            return b;
+        }
+        bb = box + 6 * b;
+        for (d = 0; d < 3; d++) {
+            lo[d] = bb[d] < 0 ? 0 : bb[d];
+            hi[d] = bb[3 + d] > sh[1 + d] ? sh[1 + d] : bb[3 + d];
+        }
+        len = hi[2] - lo[2];
+        if (len <= 0 || hi[1] <= lo[1] || hi[0] <= lo[0]) {
+            continue;
+        }
+        v = param[b];
+        for (z = lo[0]; z < hi[0]; z++) {
+            for (y = lo[1]; y < hi[1]; y++) {
+                if (op[b] == BOX_NOISE_ADD) {
+                    rng_normal(st, noise, len, 0.0f, v);
+                } else if (op[b] == BOX_NOISE_MUL) {
+                    rng_normal(st, noise, len, 1.0f, v);
+                }
+                for (ch = 0; ch < sh[0]; ch++) {
+                    row = img + ch * strd[0] + z * strd[1] + y * strd[2] + lo[2];
+                    switch (op[b]) {
+                    case BOX_FILL:
+                        for (x = 0; x < len; x++) row[x] = v;
+                        break;
+                    case BOX_ALPHA:
+                        for (x = 0; x < len; x++) row[x] *= v;
+                        break;
+                    case BOX_NOISE_ADD:
+                        for (x = 0; x < len; x++) row[x] += noise[x];
+                        break;
+                    case BOX_NOISE_MUL:
+                        for (x = 0; x < len; x++) row[x] *= noise[x];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return num_box;
+}
+
+// in-place clip to [lo, hi]
+void clip_inplace(float *img, long n, float lo, float hi) {
+    long i;
+    for (i = 0; i < n; i++) {
+        img[i] = img[i] < lo ? lo : (img[i] > hi ? hi : img[i]);
+    }
+}
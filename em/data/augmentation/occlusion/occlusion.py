@@ -0,0 +1,56 @@
+"""
+Vectorized box drawing for BoxOcclusion, applied by the native kernels.
+"""
+
+import numpy as np
+
+from _occlusion import BoxOccluder, clip
+
+# op codes, see occlusion.c
+BOX_FILL      = 0
+BOX_ALPHA     = 1
+BOX_NOISE_ADD = 2
+BOX_NOISE_MUL = 3
+BOX_UNIFORM   = 4  # uniform noise + blur, applied in python
+BOX_BLUR      = 5  # 3D blur, applied in python
+
+
+def draw_boxes(dim, min_dim, max_dim, aspect_ratio, goal, mode):
+    """
+    Draw random boxes until their total volume exceeds goal.
+
+    Args:
+        dim: (z,y,x) size of the sample.
+        goal: Target number of occluded voxels (with repetition).
+        mode: Per-mode value as in BoxOcclusion (0 disables the mode).
+
+    Returns:
+        box: (N,6) int32 of clipped (z0,y0,x0,z1,y1,x1).
+        rule: (N,) index of the chosen mode per box.
+    """
+    dim = np.asarray(dim, dtype=int)
+    mean_vol = np.prod((min_dim + max_dim) / 2.0 * np.array([1.0/int(aspect_ratio),1,1]))
+    boxes = []
+    total = 0
+    while total <= goal:
+        num = max(16, int(1.2 * (goal - total) / max(mean_vol, 1.0)) + 1)
+        # Random location and size.
+        loc = np.random.randint(0, dim, (num, 3))
+        sz = np.random.randint(min_dim, max_dim + 1, (num, 3))
+        # Anisotropy.
+        sz[:, 0] //= int(aspect_ratio)
+        lo = loc - sz // 2
+        hi = np.minimum(lo + sz, dim)
+        lo = np.maximum(lo, 0)
+        vol = np.prod(np.maximum(hi - lo, 0), axis=1)
+        csum = total + np.cumsum(vol)
+        stop = np.flatnonzero(csum > goal)
+        if stop.size > 0:
+            num = stop[0] + 1
+        boxes.append(np.hstack([lo[:num], hi[:num]]))
+        total = csum[num - 1]
+    box = np.vstack(boxes).astype(np.int32)
+    # Random choice among the enabled modes.
+    enabled = np.flatnonzero(np.asarray(mode) > 0)
+    rule = enabled[np.random.randint(0, len(enabled), box.shape[0])]
+    return box, rule
@@ -0,0 +1,7 @@
+# Native section engine, cimport-able from other extensions.
+cdef extern from 'section.c':
+    int SEC_FILL
+    int SEC_COPY
+    int SEC_REC_LEN
+    void section_apply(float *img, const int sh[4], int key, const int *rec,
+                       const float *val, int num_rec, const float *src)
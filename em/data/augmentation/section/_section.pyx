@@ -0,0 +1,42 @@
+"""
+Cython wrapper of the native section engine.
+"""
+
+import numpy as np
+
+FILL = SEC_FILL
+COPY = SEC_COPY
+
+
+def apply_sections(imgs, rec, val, src=None):
+    """
+    Apply section records to a list of images in one call.
+
+    imgs: list of c-contiguous float32 arrays (..., z, y, x), modified in place
+    rec:  (N,6) int32 records (key, z, y, x, quadrant mask, op); key indexes
+          imgs, -1 applies to all
+    val:  (N,) float32 fill value (FILL) or source slot (COPY)
+    src:  list (per image) of float32 (M, ..., y, x) source slices for COPY
+    """
+    cdef int [:, ::1] rec_view = np.ascontiguousarray(rec, dtype=np.int32).reshape(-1, SEC_REC_LEN)
+    cdef float [::1] val_view = np.ascontiguousarray(val, dtype=np.float32)
+    cdef int num_rec = rec_view.shape[0]
+    cdef float [:, :, :, ::1] img_view
+    cdef float [:, :, :, ::1] src_view
+    cdef int [::1] sh_view
+    cdef const float *src_ptr
+    if num_rec == 0:
+        return imgs
+    for k in range(len(imgs)):
+        img = imgs[k]
+        assert img.dtype == np.float32 and img.flags['C_CONTIGUOUS']
+        img_view = img.reshape((-1,) + img.shape[-3:])
+        sh_view = np.array([img_view.shape[d] for d in range(4)], dtype=np.int32)
+        src_ptr = NULL
+        if src is not None and src[k] is not None and src[k].size > 0:
+            src_k = np.ascontiguousarray(src[k], dtype=np.float32)
+            src_view = src_k.reshape((-1, img_view.shape[0]) + img.shape[-2:])
+            src_ptr = &src_view[0, 0, 0, 0]
+        section_apply(&img_view[0, 0, 0, 0], &sh_view[0], k, &rec_view[0, 0],
+                      &val_view[0], num_rec, src_ptr)
+    return imgs
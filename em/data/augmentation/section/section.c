@@ -0,0 +1,70 @@
+/*
+Section-wise fill/copy engine for MissingSection and partial Blur.
+
+A record is (key, z, y, x, mask, op): the section z of image key (-1 for all
+keys) is split at (y, x) into four quadrants and the ones selected by mask
+are filled with a constant (SEC_FILL) or copied from a source slice
+(SEC_COPY). Quadrant bits follow the python rule order:
+  bit 0: [:y, :x], bit 1: [y:, :x], bit 2: [:y, x:], bit 3: [y:, x:]
+*/
+
+#include <string.h>
+
+#define SEC_FILL 0
+#define SEC_COPY 1
+
+#define SEC_REC_LEN 6
+
+static void section_quadrant(int q, int y, int x, const int sh[4],
+                             int *y0, int *y1, int *x0, int *x1) {
+    *y0 = (q & 1) ? y : 0;
+    *y1 = (q & 1) ? sh[2] : y;
+    *x0 = (q & 2) ? x : 0;
+    *x1 = (q & 2) ? sh[3] : x;
+}
+
+/*
+Apply all records targeting key (or -1) to img.
+
+img: float32, c-contiguous (ch, z, y, x)
+sh:  (ch, z, y, x)
+rec: num_rec x SEC_REC_LEN ints
+val: num_rec floats; fill value for SEC_FILL, source slot for SEC_COPY
+src: float32 (num_slot, ch, y, x), only read by SEC_COPY records
+*/
+void section_apply(float *img, const int sh[4], int key, const int *rec,
+                   const float *val, int num_rec, const float *src) {
+    int r, q, ch, yy, xx, y0, y1, x0, x1;
+    const int *rr;
+    float *row;
+    const float *srow;
+    long strd[3] = {(long)sh[1] * sh[2] * sh[3], (long)sh[2] * sh[3], sh[3]};
+    long slot_sz = (long)sh[0] * sh[2] * sh[3];
+
+    for (r = 0; r < num_rec; r++) {
+        rr = rec + SEC_REC_LEN * r;
+        if ((rr[0] != -1 && rr[0] != key) || rr[1] < 0 || rr[1] >= sh[1]) {
+            continue;
+        }
+        for (q = 0; q < 4; q++) {
+            if (!(rr[4] & (1 << q))) {
+                continue;
+            }
+            section_quadrant(q, rr[2], rr[3], sh, &y0, &y1, &x0, &x1);
+            if (x1 <= x0) {
+                continue;
+            }
+            for (ch = 0; ch < sh[0]; ch++) {
+                for (yy = y0; yy < y1; yy++) {
+                    row = img + ch * strd[0] + rr[1] * strd[1] + yy * strd[2];
+                    if (rr[5] == SEC_FILL) {
+                        for (xx = x0; xx < x1; xx++) row[xx] = val[r];
+                    } else {
+                        srow = src + (long)val[r] * slot_sz + ch * strd[1] + yy * strd[2];
+                        memcpy(row + x0, srow + x0, (x1 - x0) * sizeof(float));
+                    }
+                }
+            }
+        }
+    }
+}
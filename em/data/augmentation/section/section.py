@@ -0,0 +1,19 @@
+"""
+Section-wise fill/copy records for MissingSection and Blur.
+"""
+
+import numpy as np
+
+from _section import apply_sections, FILL, COPY
+
+# All quadrants.
+FULL = 15
+
+
+def quadrant_mask(rule):
+    """Pack the 4-quadrant boolean rule into a record mask."""
+    return int(np.dot(np.asarray(rule, dtype=int), [1, 2, 4, 8]))
+
+
+def make_record(z, y=0, x=0, mask=FULL, op=FILL, key=-1):
+    return (key, z, y, x, mask, op)
@@ -0,0 +1,77 @@
+"""
+Declarations shared with the extensions reading chunked volumes natively.
+"""
+
+from libc.stdint cimport uint64_t
+
+cdef extern from 'chunk.h':
+    ctypedef struct chunk_header:
+        char dtype[8]
+        unsigned int itemsize
+        unsigned int ndim
+        unsigned long long shape[4]
+        unsigned int chunk[3]
+        unsigned int codec
+    ctypedef struct chunkvol:
+        chunk_header hdr
+        long nchunk[3]
+        long nchunk_all
+        long chunk_bytes
+    int chunkvol_open(chunkvol *cv, const char *path)
+    void chunkvol_close(chunkvol *cv)
+    int chunkvol_crop(const chunkvol *cv, const long st[3], const long sz[3],
+                      unsigned char *out)
+
+cdef extern from 'chunkcache.h':
+    ctypedef struct chunkcache:
+        void *base
+    int chunkcache_create(chunkcache *cc, long long budget, long long slot_bytes)
+    void chunkcache_destroy(chunkcache *cc)
+    void chunkcache_stats(chunkcache *cc, uint64_t out[4])
+    void chunkcache_clear(chunkcache *cc)
+    int chunkvol_crop_cached(const chunkvol *cv, chunkcache *cc, const long st[3],
+                             const long sz[3], unsigned char *out)
+
+cdef extern from 'normalize.h':
+    int NORM_F32, NORM_F16
+    ctypedef struct norm_param:
+        float offset
+        float scale
+        int down[3]
+        int out_type
+    # aliased: the python crop_normalize of _chunk.pyx wraps it
+    int c_crop_normalize "crop_normalize"(const unsigned char *data, const long shape[4],
+                                          const long st[3], const long sz[3],
+                                          const norm_param *p, void *out) nogil
+    int chunkvol_crop_normalize(const chunkvol *cv, chunkcache *cc, const long st[3],
+                                const long sz[3], const norm_param *p, void *out) nogil
+
+cdef extern from 'transpose.h':
+    void transpose_channels_last(const void *inp, long nc, long n, int itemsize, void *out) nogil
+    void transpose_channels_first(const void *inp, long nc, long n, int itemsize, void *out) nogil
+
+cdef extern from 'chunkwriter.h':
+    int WRITER_COPY, WRITER_F32_TO_U8
+    ctypedef struct chunkwriter:
+        chunk_header hdr
+    int chunkwriter_open(chunkwriter *w, const char *path, const char *dtype,
+                         int itemsize, int ndim, const long shape[4],
+                         const long chunk[3], int codec, int level, int in_type,
+                         int num_thread, int max_pending)
+    int chunkwriter_push(chunkwriter *w, const unsigned char *slab, long nz) nogil
+    int chunkwriter_close(chunkwriter *w) nogil
+
+
+cdef class ChunkCache:
+    cdef chunkcache cc
+    cdef readonly long long budget
+    cdef readonly long long slot_bytes
+
+
+cdef class ChunkVolume:
+    cdef chunkvol cv
+    cdef readonly object filename
+    cdef readonly object shape
+    cdef readonly object dtype
+    cdef readonly object chunk_size
+    cdef public ChunkCache cache
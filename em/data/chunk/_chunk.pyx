@@ -0,0 +1,265 @@
+"""
+Cython wrapper of the chunked volume reader.
+"""
+
+import numpy as np
+
+cdef class ChunkCache:
+    """
+    LRU cache of decompressed chunks in shared memory.
+
+    budget: memory budget in bytes
+    slot_bytes: largest decoded chunk to cache (bigger chunks bypass it)
+
+    Create it before the DataLoader forks its workers: all of them then
+    share the cached chunks and the counters. A pickled cache (spawned
+    workers) is a new, empty one of the same size in each process.
+    """
+
+    def __cinit__(self, long long budget, long long slot_bytes):
+        if budget <= 0 or slot_bytes <= 0 or budget < slot_bytes:
+            raise ValueError('chunk cache: need 0 < slot_bytes <= budget, got %d, %d'
+                             % (slot_bytes, budget))
+        if chunkcache_create(&self.cc, budget, slot_bytes) != 0:
+            raise MemoryError('cannot allocate chunk cache of %d bytes' % budget)
+        self.budget = budget
+        self.slot_bytes = slot_bytes
+
+    def __dealloc__(self):
+        chunkcache_destroy(&self.cc)
+
+    def stats(self):
+        cdef uint64_t out[4]
+        chunkcache_stats(&self.cc, out)
+        return dict(hits=out[0], misses=out[1], evictions=out[2], used=out[3])
+
+    def clear(self):
+        chunkcache_clear(&self.cc)
+
+    def __reduce__(self):
+        return (ChunkCache, (self.budget, self.slot_bytes))
+
+
+cdef class ChunkVolume:
+    """
+    Memory-mapped chunked volume.
+
+    Only the chunks overlapping a crop are read (and decompressed), and the
+    mapping is shared by all processes reading the same file.
+    """
+
+    def __cinit__(self, filename):
+        self.filename = filename
+        ret = chunkvol_open(&self.cv, filename.encode())
+        if ret != 0:
+            raise IOError('cannot open chunked volume [%s] (%d)' % (filename, ret))
+        self.dtype = np.dtype(self.cv.hdr.dtype[:8].decode().strip('\0'))
+        sh = tuple(int(self.cv.hdr.shape[x]) for x in range(4))
+        self.shape = sh if self.cv.hdr.ndim == 4 else sh[1:]
+        self.chunk_size = tuple(int(self.cv.hdr.chunk[x]) for x in range(3))
+
+    def __dealloc__(self):
+        chunkvol_close(&self.cv)
+
+    def __reduce__(self):
+        # re-open (and re-map) in the receiving process; volumes pickled
+        # together keep sharing their (new) cache
+        return (_reopen, (self.filename, self.cache))
+
+    property chunk_bytes:
+        def __get__(self):
+            return self.cv.chunk_bytes
+
+    property ndim:
+        def __get__(self):
+            return len(self.shape)
+
+    def crop(self, st, sz, out=None):
+        """Read the box [st, st+sz) in zyx; out-of-volume voxels are 0."""
+        cdef long st_c[3]
+        cdef long sz_c[3]
+        for x in range(3):
+            st_c[x] = st[x]
+            sz_c[x] = sz[x]
+        out_shape = tuple(int(x) for x in sz)
+        if self.cv.hdr.ndim == 4:
+            out_shape = (int(self.cv.hdr.shape[0]),) + out_shape
+        if out is None:
+            out = np.empty(out_shape, dtype=self.dtype)
+        assert out.shape == out_shape and out.dtype == self.dtype \
+                and out.flags['C_CONTIGUOUS']
+        cdef unsigned char [::1] out_view = out.reshape(-1).view(np.uint8)
+        if self.cache is None:
+            ret = chunkvol_crop(&self.cv, st_c, sz_c, &out_view[0])
+        else:
+            ret = chunkvol_crop_cached(&self.cv, &self.cache.cc, st_c, sz_c, &out_view[0])
+        if ret != 0:
+            raise IOError('corrupted chunk in [%s] (%d)' % (self.filename, ret))
+        return out
+
+    def __array__(self):
+        return self.crop((0, 0, 0), self.shape[-3:])
+
+
+def _reopen(filename, cache):
+    vol = ChunkVolume(filename)
+    vol.cache = cache
+    return vol
+
+
+def crop_normalize(vol, st, sz, offset=0., scale=1./255, down=(1, 1, 1),
+                   out=None, dtype=np.float32):
+    """
+    Read the box [st, st+sz) (zyx, in the grid down-sampled by down) of a
+    uint8 array or ChunkVolume and write (v - offset) * scale as float32 or
+    float16, in one pass. down=(1,2,2) reads _half volumes from full
+    resolution. Out-of-volume voxels read as 0 before normalization.
+    """
+    cdef norm_param p
+    cdef long st_c[3]
+    cdef long sz_c[3]
+    cdef long shape[4]
+    cdef unsigned char [::1] data_view
+    cdef unsigned char [::1] out_view
+    cdef ChunkVolume cv
+    cdef chunkcache *cc = NULL
+    cdef int ret
+    dtype = np.dtype(dtype)
+    assert dtype in (np.float32, np.float16) and vol.dtype == np.uint8
+    p.offset = offset
+    p.scale = scale
+    p.out_type = NORM_F16 if dtype == np.float16 else NORM_F32
+    for x in range(3):
+        st_c[x] = st[x]
+        sz_c[x] = sz[x]
+        p.down[x] = down[x]
+    sh = (1,) * (4 - len(vol.shape)) + tuple(vol.shape)
+    out_shape = tuple(int(x) for x in sz)
+    if len(vol.shape) == 4:
+        out_shape = (int(sh[0]),) + out_shape
+    if out is None:
+        out = np.empty(out_shape, dtype=dtype)
+    assert out.shape == out_shape and out.dtype == dtype and out.flags['C_CONTIGUOUS']
+    out_view = out.reshape(-1).view(np.uint8)
+    if isinstance(vol, ChunkVolume):
+        cv = vol
+        if cv.cache is not None:
+            cc = &cv.cache.cc
+        with nogil:
+            ret = chunkvol_crop_normalize(&cv.cv, cc, st_c, sz_c, &p, &out_view[0])
+    else:
+        assert vol.flags['C_CONTIGUOUS']
+        for x in range(4):
+            shape[x] = sh[x]
+        data_view = vol.reshape(-1)
+        with nogil:
+            ret = c_crop_normalize(&data_view[0], shape, st_c, sz_c, &p, &out_view[0])
+    if ret != 0:
+        raise IOError('cannot crop and normalize (%d)' % ret)
+    return out
+
+
+def transpose_channels(data, last=True, out=None):
+    """
+    Blocked (c,z,y,x) -> (z,y,x,c) transpose (last=True), or back.
+    Returns a c-contiguous array.
+    """
+    cdef unsigned char [::1] in_view
+    cdef unsigned char [::1] out_view
+    cdef long nc, n
+    cdef int itemsize = data.dtype.itemsize
+    cdef bint to_last = last
+    data = np.ascontiguousarray(data)
+    if to_last:
+        nc = data.shape[0]
+        out_shape = data.shape[1:] + data.shape[:1]
+    else:
+        nc = data.shape[-1]
+        out_shape = data.shape[-1:] + data.shape[:-1]
+    n = data.size // nc
+    if out is None:
+        out = np.empty(out_shape, dtype=data.dtype)
+    assert out.shape == out_shape and out.dtype == data.dtype and out.flags['C_CONTIGUOUS']
+    if n == 0:
+        return out
+    in_view = data.reshape(-1).view(np.uint8)
+    out_view = out.reshape(-1).view(np.uint8)
+    with nogil:
+        if to_last:
+            transpose_channels_last(&in_view[0], nc, n, itemsize, &out_view[0])
+        else:
+            transpose_channels_first(&in_view[0], nc, n, itemsize, &out_view[0])
+    return out
+
+
+cdef class ChunkWriter:
+    """
+    Streaming writer of a chunked volume (readable with readchunk).
+
+    shape: (z,y,x) or (c,z,y,x); push z-slabs in order with write(). Full
+    chunk rows are compressed and written by num_thread background threads;
+    at most max_pending rows are buffered, so memory does not grow with the
+    volume.
+    quantize: store float32 [0,1] input as uint8 round(255*v), NaN as 0
+    """
+    cdef chunkwriter w
+    cdef readonly object shape
+    cdef readonly object dtype
+    cdef object in_dtype
+    cdef int is_open
+
+    def __cinit__(self, filename, shape, dtype=np.float32, chunk_size=(8, 64, 64),
+                  compress=True, int level=1, int num_thread=2, int max_pending=4,
+                  quantize=False):
+        cdef long shape_c[4]
+        cdef long chunk_c[3]
+        assert len(shape) in [3, 4]
+        sh = tuple(shape) if len(shape) == 4 else (1,) + tuple(shape)
+        for x in range(4):
+            shape_c[x] = sh[x]
+        for x in range(3):
+            chunk_c[x] = chunk_size[x]
+        self.shape = tuple(shape)
+        self.in_dtype = np.dtype(np.float32) if quantize else np.dtype(dtype)
+        self.dtype = np.dtype(np.uint8) if quantize else np.dtype(dtype)
+        ret = chunkwriter_open(&self.w, filename.encode(), self.dtype.str.encode(),
+                               self.dtype.itemsize, len(shape), shape_c, chunk_c,
+                               1 if compress else 0, level,
+                               WRITER_F32_TO_U8 if quantize else WRITER_COPY,
+                               num_thread, max_pending)
+        if ret != 0:
+            raise IOError('cannot create chunked volume [%s] (%d)' % (filename, ret))
+        self.is_open = 1
+
+    def __dealloc__(self):
+        if self.is_open:
+            chunkwriter_close(&self.w)
+
+    def write(self, slab):
+        """Append slab, (nz,y,x) or (c,nz,y,x) following the volume shape."""
+        cdef unsigned char [::1] view
+        cdef long nz = slab.shape[-3]
+        cdef int ret
+        assert self.is_open
+        assert slab.shape[-2:] == self.shape[-2:] and slab.ndim == len(self.shape)
+        if slab.ndim == 4:
+            assert slab.shape[0] == self.shape[0]
+        if nz == 0:
+            return
+        slab = np.ascontiguousarray(slab, dtype=self.in_dtype)
+        view = slab.reshape(-1).view(np.uint8)
+        with nogil:
+            ret = chunkwriter_push(&self.w, &view[0], nz)
+        if ret != 0:
+            raise IOError('chunked volume write failed (%d)' % ret)
+
+    def close(self):
+        """Wait for the background threads, then write index and header."""
+        cdef int ret
+        if not self.is_open:
+            return
+        self.is_open = 0
+        with nogil:
+            ret = chunkwriter_close(&self.w)
+        if ret != 0:
+            raise IOError('chunked volume close failed (%d)' % ret)
@@ -0,0 +1,213 @@
+/*
+Chunked volume store.
+
+File layout (little-endian):
+  header (CHUNK_HEADER_SIZE bytes, see chunk_header)
+  blobs, each 64-byte aligned
+  index: nchunk x (uint64 offset, uint64 nbytes), at header.index_offset
+
+The volume is (c, z, y, x); chunks tile (z, y, x) in c-order and hold all
+channels. Edge chunks are stored truncated to the volume. Blobs are raw or
+zlib-compressed. Files are mmap-ed read-only, so page cache is shared by
+every process reading the same volume.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "chunk.h"
+
+static long chunk_extent(const chunkvol *cv, int d, long i) {
+    long e = (long)cv->hdr.shape[1 + d] - i * cv->hdr.chunk[d];
+    return e < (long)cv->hdr.chunk[d] ? e : (long)cv->hdr.chunk[d];
+}
+
+int chunkvol_open(chunkvol *cv, const char *path) {
+    struct stat st;
+    int d;
+    memset(cv, 0, sizeof(chunkvol));
+    cv->fd = open(path, O_RDONLY);
+    if (cv->fd < 0) {
+        return CHUNK_ERR_IO;
+    }
+    if (fstat(cv->fd, &st) != 0 || st.st_size < CHUNK_HEADER_SIZE) {
+        chunkvol_close(cv);
+        return CHUNK_ERR_FORMAT;
+    }
+    cv->size = st.st_size;
+    cv->vid = ((uint64_t)st.st_dev << 48) ^ (uint64_t)st.st_ino;
+    cv->base = mmap(NULL, cv->size, PROT_READ, MAP_SHARED, cv->fd, 0);
+    if (cv->base == MAP_FAILED) {
+        chunkvol_close(cv);
+        return CHUNK_ERR_IO;
+    }
+    memcpy(&cv->hdr, cv->base, sizeof(chunk_header));
+    if (memcmp(cv->hdr.magic, CHUNK_MAGIC, 4) != 0 ||
+        cv->hdr.version != CHUNK_VERSION || cv->hdr.itemsize == 0 ||
+        cv->hdr.chunk[0] == 0 || cv->hdr.chunk[1] == 0 || cv->hdr.chunk[2] == 0) {
+        chunkvol_close(cv);
+        return CHUNK_ERR_FORMAT;
+    }
+    cv->nchunk_all = 1;
+    for (d = 0; d < 3; d++) {
+        cv->nchunk[d] = (cv->hdr.shape[1 + d] + cv->hdr.chunk[d] - 1) / cv->hdr.chunk[d];
+        cv->nchunk_all *= cv->nchunk[d];
+    }
+    if (cv->hdr.index_offset > (uint64_t)cv->size ||
+        16 * (uint64_t)cv->nchunk_all > (uint64_t)cv->size - cv->hdr.index_offset) {
+        chunkvol_close(cv);
+        return CHUNK_ERR_FORMAT;
+    }
+    cv->index = (const uint64_t *)(cv->base + cv->hdr.index_offset);
+    cv->chunk_bytes = (long)cv->hdr.shape[0] * cv->hdr.chunk[0] *
+                      cv->hdr.chunk[1] * cv->hdr.chunk[2] * cv->hdr.itemsize;
+    return 0;
+}
+
+void chunkvol_close(chunkvol *cv) {
+    if (cv->base != NULL && cv->base != MAP_FAILED) {
+        munmap((void *)cv->base, cv->size);
+    }
+    if (cv->fd >= 0) {
+        close(cv->fd);
+    }
+    cv->base = NULL;
+    cv->fd = -1;
+}
+
+void chunkvol_chunk_shape(const chunkvol *cv, long cid, long ext[3]) {
+    long i[3];
+    int d;
+    i[2] = cid % cv->nchunk[2];
+    i[1] = (cid / cv->nchunk[2]) % cv->nchunk[1];
+    i[0] = cid / (cv->nchunk[2] * cv->nchunk[1]);
+    for (d = 0; d < 3; d++) {
+        ext[d] = chunk_extent(cv, d, i[d]);
+    }
+}
+
+/*
+Pointer to the decoded chunk cid, (c, ez, ey, ex) c-contiguous.
+Raw chunks point into the mapping; compressed chunks are inflated into buf
+(at least chunk_bytes). Returns NULL on error, including a blob that does
+not decode to exactly the chunk's extent.
+*/
+const uint8_t *chunkvol_chunk(const chunkvol *cv, long cid, uint8_t *buf) {
+    uint64_t off = cv->index[2 * cid];
+    uint64_t nbytes = cv->index[2 * cid + 1];
+    uLongf dst_len = cv->chunk_bytes;
+    long ext[3];
+    uint64_t expect;
+    if (off > (uint64_t)cv->size || nbytes > (uint64_t)cv->size - off) {
+        return NULL;
+    }
+    chunkvol_chunk_shape(cv, cid, ext);
+    expect = (uint64_t)cv->hdr.shape[0] * ext[0] * ext[1] * ext[2] * cv->hdr.itemsize;
+    if (cv->hdr.codec == CHUNK_CODEC_RAW) {
+        return nbytes == expect ? cv->base + off : NULL;
+    }
+    if (uncompress(buf, &dst_len, cv->base + off, nbytes) != Z_OK || dst_len != expect) {
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+Copy the part of a decoded chunk overlapping the box [st, st+sz) into out
+(c, sz) c-contiguous.
+*/
+void chunkvol_paste(const chunkvol *cv, long cid, const uint8_t *src,
+                    const long st[3], const long sz[3], uint8_t *out) {
+    long ext[3], org[3], lo[3], hi[3];
+    long ch, z, y, nrow;
+    int d, isz = cv->hdr.itemsize;
+    const uint8_t *srow;
+    uint8_t *drow;
+
+    chunkvol_chunk_shape(cv, cid, ext);
+    org[2] = (cid % cv->nchunk[2]) * cv->hdr.chunk[2];
+    org[1] = ((cid / cv->nchunk[2]) % cv->nchunk[1]) * cv->hdr.chunk[1];
+    org[0] = (cid / (cv->nchunk[2] * cv->nchunk[1])) * cv->hdr.chunk[0];
+    for (d = 0; d < 3; d++) {
+        lo[d] = st[d] > org[d] ? st[d] : org[d];
+        hi[d] = st[d] + sz[d] < org[d] + ext[d] ? st[d] + sz[d] : org[d] + ext[d];
+        if (hi[d] <= lo[d]) {
+            return;
+        }
+    }
+    nrow = (hi[2] - lo[2]) * isz;
+    for (ch = 0; ch < (long)cv->hdr.shape[0]; ch++) {
+        for (z = lo[0]; z < hi[0]; z++) {
+            for (y = lo[1]; y < hi[1]; y++) {
+                srow = src + (((ch * ext[0] + z - org[0]) * ext[1] + y - org[1]) * ext[2]
+                              + lo[2] - org[2]) * isz;
+                drow = out + (((ch * sz[0] + z - st[0]) * sz[1] + y - st[1]) * sz[2]
+                              + lo[2] - st[2]) * isz;
+                memcpy(drow, srow, nrow);
+            }
+        }
+    }
+}
+
+/*
+Chunk range [c0, c1) overlapped by the box [st, st+sz). Zero-fills out when
+the box is not fully inside the volume.
+*/
+void chunkvol_range(const chunkvol *cv, const long st[3], const long sz[3],
+                    long c0[3], long c1[3], uint8_t *out) {
+    int d;
+    for (d = 0; d < 3; d++) {
+        if (st[d] < 0 || st[d] + sz[d] > (long)cv->hdr.shape[1 + d]) {
+            memset(out, 0, cv->hdr.shape[0] * sz[0] * sz[1] * sz[2] * cv->hdr.itemsize);
+            break;
+        }
+    }
+    for (d = 0; d < 3; d++) {
+        c0[d] = st[d] < 0 ? 0 : st[d] / cv->hdr.chunk[d];
+        c1[d] = (st[d] + sz[d] + cv->hdr.chunk[d] - 1) / cv->hdr.chunk[d];
+        c1[d] = c1[d] < cv->nchunk[d] ? c1[d] : cv->nchunk[d];
+    }
+}
+
+/*
+Read the box [st, st+sz) of all channels into out (c, sz), touching only
+the chunks it overlaps. Voxels outside the volume are zero.
+*/
+int chunkvol_crop(const chunkvol *cv, const long st[3], const long sz[3],
+                  uint8_t *out) {
+    long c0[3], c1[3], i, j, k, cid;
+    const uint8_t *src;
+    uint8_t *buf = NULL;
+    int ret = 0;
+
+    chunkvol_range(cv, st, sz, c0, c1, out);
+    if (cv->hdr.codec != CHUNK_CODEC_RAW) {
+        buf = malloc(cv->chunk_bytes);
+        if (buf == NULL) {
+            return CHUNK_ERR_MEMORY;
+        }
+    }
+    for (i = c0[0]; i < c1[0] && ret == 0; i++) {
+        for (j = c0[1]; j < c1[1] && ret == 0; j++) {
+            for (k = c0[2]; k < c1[2]; k++) {
+                cid = (i * cv->nchunk[1] + j) * cv->nchunk[2] + k;
+                src = chunkvol_chunk(cv, cid, buf);
+                if (src == NULL) {
+                    ret = CHUNK_ERR_FORMAT;
+                    break;
+                }
+                chunkvol_paste(cv, cid, src, st, sz, out);
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef EM_CHUNK_H
+#define EM_CHUNK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_MAGIC "EMCV"
+#define CHUNK_VERSION 1
+#define CHUNK_HEADER_SIZE 128
+#define CHUNK_ALIGN 64
+
+#define CHUNK_CODEC_RAW  0
+#define CHUNK_CODEC_ZLIB 1
+
+#define CHUNK_ERR_IO     -1
+#define CHUNK_ERR_FORMAT -2
+#define CHUNK_ERR_MEMORY -3
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    char dtype[8];         // numpy dtype.str, e.g. "|u1", "<f4"
+    uint32_t itemsize;
+    uint32_t ndim;         // 3 or 4, as written by the user
+    uint64_t shape[4];     // c, z, y, x (c=1 for 3D volumes)
+    uint32_t chunk[3];     // z, y, x
+    uint32_t codec;
+    uint64_t index_offset;
+} chunk_header;
+
+typedef struct {
+    int fd;
+    uint64_t vid;          // volume id (device, inode), used as cache key
+    const uint8_t *base;
+    size_t size;
+    chunk_header hdr;
+    const uint64_t *index;
+    long nchunk[3];
+    long nchunk_all;
+    long chunk_bytes;      // bytes of a full decoded chunk
+} chunkvol;
+
+int chunkvol_open(chunkvol *cv, const char *path);
+void chunkvol_close(chunkvol *cv);
+void chunkvol_chunk_shape(const chunkvol *cv, long cid, long ext[3]);
+const uint8_t *chunkvol_chunk(const chunkvol *cv, long cid, uint8_t *buf);
+void chunkvol_paste(const chunkvol *cv, long cid, const uint8_t *src,
+                    const long st[3], const long sz[3], uint8_t *out);
+void chunkvol_range(const chunkvol *cv, const long st[3], const long sz[3],
+                    long c0[3], long c1[3], uint8_t *out);
+int chunkvol_crop(const chunkvol *cv, const long st[3], const long sz[3],
+                  uint8_t *out);
+
+#endif
@@ -0,0 +1,88 @@
+"""
+Chunked volume store: writer and python entry points.
+
+See chunk.c for the file layout. Volumes are (z,y,x) or (c,z,y,x); chunks
+tile zyx and hold all channels.
+"""
+
+import struct
+import zlib
+import numpy as np
+
+from _chunk import ChunkVolume, ChunkCache, ChunkWriter
+
+CHUNK_MAGIC = 'EMCV'
+CHUNK_VERSION = 1
+CHUNK_HEADER_SIZE = 128
+CHUNK_ALIGN = 64
+CODEC_RAW = 0
+CODEC_ZLIB = 1
+
+# magic, version, dtype, itemsize, ndim, shape[4], chunk[3], codec, index_offset
+HEADER_FMT = '<4sI8sII4Q3IIQ'
+
+
+def pack_header(dtype, shape, chunk_size, codec, index_offset):
+    dtype = np.dtype(dtype)
+    sh = tuple(shape) if len(shape) == 4 else (1,) + tuple(shape)
+    hdr = struct.pack(HEADER_FMT, CHUNK_MAGIC, CHUNK_VERSION, dtype.str,
+                      dtype.itemsize, len(shape), sh[0], sh[1], sh[2], sh[3],
+                      chunk_size[0], chunk_size[1], chunk_size[2],
+                      codec, index_offset)
+    return hdr + '\0' * (CHUNK_HEADER_SIZE - len(hdr))
+
+
+def align(fid):
+    pad = -fid.tell() % CHUNK_ALIGN
+    if pad > 0:
+        fid.write('\0' * pad)
+
+
+def writechunk(filename, data, chunk_size=(8,64,64), compress=True, level=1):
+    """
+    Write data (ndarray or h5py dataset, (z,y,x) or (c,z,y,x)) as a chunked
+    volume. Data is read one chunk-row slab of z at a time.
+    """
+    shape = data.shape
+    assert len(shape) in [3, 4]
+    codec = CODEC_ZLIB if compress else CODEC_RAW
+    nchunk = [(shape[-3+d] + chunk_size[d] - 1) // chunk_size[d] for d in range(3)]
+    index = np.zeros((np.prod(nchunk), 2), dtype=np.uint64)
+
+    fid = open(filename, 'wb')
+    fid.write(pack_header(data.dtype, shape, chunk_size, codec, 0))
+    cid = 0
+    for i in range(nchunk[0]):
+        z0 = i * chunk_size[0]
+        slab = np.asarray(data[..., z0:z0+chunk_size[0], :, :])
+        for j in range(nchunk[1]):
+            y0 = j * chunk_size[1]
+            for k in range(nchunk[2]):
+                x0 = k * chunk_size[2]
+                blob = np.ascontiguousarray(slab[..., y0:y0+chunk_size[1],
+                                                 x0:x0+chunk_size[2]]).tostring()
+                if compress:
+                    blob = zlib.compress(blob, level)
+                align(fid)
+                index[cid] = [fid.tell(), len(blob)]
+                fid.write(blob)
+                cid += 1
+    align(fid)
+    index_offset = fid.tell()
+    fid.write(index.astype('<u8').tostring())
+    fid.seek(0)
+    fid.write(pack_header(data.dtype, shape, chunk_size, codec, index_offset))
+    fid.close()
+
+
+def readchunk(filename, cache=None):
+    """Open a chunked volume; nothing is read until it is cropped.
+    Decoded chunks are kept in cache (ChunkCache) if given."""
+    vol = ChunkVolume(filename)
+    vol.cache = cache
+    return vol
+
+
+def ischunk(filename):
+    with open(filename, 'rb') as fid:
+        return fid.read(4) == CHUNK_MAGIC
@@ -0,0 +1,240 @@
+/*
+Process-shared LRU cache of decompressed chunks.
+
+Random patch sampling from compressed volumes keeps decompressing the same
+chunks; this keeps the most recently used ones, decoded, in shared memory
+under a fixed byte budget. All DataLoader workers forked after creation see
+the same cache. A robust mutex guards it: if a worker dies while holding
+the lock, the cache is emptied and reused.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "chunkcache.h"
+
+static void cache_reset(chunkcache *cc) {
+    int32_t i;
+    cache_header *h = cc->hdr;
+    for (i = 0; i < h->num_bucket; i++) {
+        cc->bucket[i] = CACHE_NIL;
+    }
+    for (i = 0; i < h->num_slot; i++) {
+        cc->slot[i].cid = CACHE_NIL;
+        cc->slot[i].prev = CACHE_NIL;
+        cc->slot[i].hnext = CACHE_NIL;
+        cc->slot[i].next = i + 1 < h->num_slot ? i + 1 : CACHE_NIL;
+    }
+    h->free_head = h->num_slot > 0 ? 0 : CACHE_NIL;
+    h->head = h->tail = CACHE_NIL;
+}
+
+static void cache_lock(chunkcache *cc) {
+    if (pthread_mutex_lock(&cc->hdr->lock) == EOWNERDEAD) {
+        cache_reset(cc);
+        pthread_mutex_consistent(&cc->hdr->lock);
+    }
+}
+
+static void cache_unlock(chunkcache *cc) {
+    pthread_mutex_unlock(&cc->hdr->lock);
+}
+
+static int32_t cache_bucket(const chunkcache *cc, uint64_t vid, int64_t cid) {
+    uint64_t k = (vid * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)cid;
+    k ^= k >> 29;
+    return (int32_t)(k % (uint64_t)cc->hdr->num_bucket);
+}
+
+static int32_t cache_find(const chunkcache *cc, uint64_t vid, int64_t cid) {
+    int32_t s = cc->bucket[cache_bucket(cc, vid, cid)];
+    while (s != CACHE_NIL && (cc->slot[s].vid != vid || cc->slot[s].cid != cid)) {
+        s = cc->slot[s].hnext;
+    }
+    return s;
+}
+
+static void lru_unlink(chunkcache *cc, int32_t s) {
+    cache_slot *e = cc->slot + s;
+    if (e->prev != CACHE_NIL) cc->slot[e->prev].next = e->next;
+    else cc->hdr->head = e->next;
+    if (e->next != CACHE_NIL) cc->slot[e->next].prev = e->prev;
+    else cc->hdr->tail = e->prev;
+    e->prev = e->next = CACHE_NIL;
+}
+
+static void lru_push_front(chunkcache *cc, int32_t s) {
+    cache_slot *e = cc->slot + s;
+    e->prev = CACHE_NIL;
+    e->next = cc->hdr->head;
+    if (cc->hdr->head != CACHE_NIL) cc->slot[cc->hdr->head].prev = s;
+    cc->hdr->head = s;
+    if (cc->hdr->tail == CACHE_NIL) cc->hdr->tail = s;
+}
+
+static void hash_remove(chunkcache *cc, int32_t s) {
+    int32_t *p = cc->bucket + cache_bucket(cc, cc->slot[s].vid, cc->slot[s].cid);
+    while (*p != s) {
+        p = &cc->slot[*p].hnext;
+    }
+    *p = cc->slot[s].hnext;
+    cc->slot[s].hnext = CACHE_NIL;
+}
+
+static void cache_insert(chunkcache *cc, int32_t s, uint64_t vid, int64_t cid) {
+    int32_t b = cache_bucket(cc, vid, cid);
+    cc->slot[s].vid = vid;
+    cc->slot[s].cid = cid;
+    cc->slot[s].hnext = cc->bucket[b];
+    cc->bucket[b] = s;
+    lru_push_front(cc, s);
+}
+
+// take a free slot, or evict the least recently used one
+static int32_t cache_alloc(chunkcache *cc) {
+    int32_t s = cc->hdr->free_head;
+    if (s != CACHE_NIL) {
+        cc->hdr->free_head = cc->slot[s].next;
+        cc->slot[s].next = CACHE_NIL;
+        return s;
+    }
+    s = cc->hdr->tail;
+    lru_unlink(cc, s);
+    hash_remove(cc, s);
+    cc->hdr->evictions++;
+    return s;
+}
+
+int chunkcache_create(chunkcache *cc, int64_t budget, int64_t slot_bytes) {
+    pthread_mutexattr_t attr;
+    int32_t num_slot, num_bucket;
+    size_t off_bucket, off_slot, off_data;
+
+    memset(cc, 0, sizeof(chunkcache));
+    if (budget <= 0 || slot_bytes <= 0 || budget < slot_bytes) {
+        return CHUNK_ERR_MEMORY;
+    }
+    // slot ids and the 2 * num_slot + 1 buckets are int32
+    num_slot = budget / slot_bytes > (INT32_MAX - 1) / 2 ? (INT32_MAX - 1) / 2
+                                                          : (int32_t)(budget / slot_bytes);
+    num_bucket = 2 * num_slot + 1;
+    off_bucket = (sizeof(cache_header) + 63) & ~(size_t)63;
+    off_slot = off_bucket + (((size_t)num_bucket * sizeof(int32_t) + 63) & ~(size_t)63);
+    off_data = off_slot + (((size_t)num_slot * sizeof(cache_slot) + 63) & ~(size_t)63);
+    cc->size = off_data + (size_t)num_slot * slot_bytes;
+    cc->base = mmap(NULL, cc->size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cc->base == MAP_FAILED) {
+        cc->base = NULL;
+        return CHUNK_ERR_MEMORY;
+    }
+    cc->hdr = (cache_header *)cc->base;
+    cc->bucket = (int32_t *)((uint8_t *)cc->base + off_bucket);
+    cc->slot = (cache_slot *)((uint8_t *)cc->base + off_slot);
+    cc->data = (uint8_t *)cc->base + off_data;
+    cc->hdr->slot_bytes = slot_bytes;
+    cc->hdr->num_slot = num_slot;
+    cc->hdr->num_bucket = num_bucket;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cc->hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    cache_reset(cc);
+    return 0;
+}
+
+// unmaps this process' view; the memory goes away with the last process
+void chunkcache_destroy(chunkcache *cc) {
+    if (cc->base != NULL) {
+        munmap(cc->base, cc->size);
+    }
+    memset(cc, 0, sizeof(chunkcache));
+}
+
+// hits, misses, evictions, slots in use
+void chunkcache_stats(chunkcache *cc, uint64_t out[4]) {
+    int32_t s, n = 0;
+    cache_lock(cc);
+    for (s = cc->hdr->head; s != CACHE_NIL; s = cc->slot[s].next) {
+        n++;
+    }
+    out[0] = cc->hdr->hits;
+    out[1] = cc->hdr->misses;
+    out[2] = cc->hdr->evictions;
+    out[3] = n;
+    cache_unlock(cc);
+}
+
+void chunkcache_clear(chunkcache *cc) {
+    cache_lock(cc);
+    cache_reset(cc);
+    cc->hdr->hits = cc->hdr->misses = cc->hdr->evictions = 0;
+    cache_unlock(cc);
+}
+
+/*
+chunkvol_crop through the cache. Raw volumes and volumes whose chunks do
+not fit a slot bypass it: their chunks are read straight from the mapping.
+*/
+int chunkvol_crop_cached(const chunkvol *cv, chunkcache *cc, const long st[3],
+                         const long sz[3], uint8_t *out) {
+    long c0[3], c1[3], i, j, k, cid;
+    const uint8_t *src;
+    uint8_t *buf;
+    int32_t s;
+    int ret = 0;
+
+    if (cc == NULL || cc->base == NULL || cv->hdr.codec == CHUNK_CODEC_RAW ||
+        cv->chunk_bytes > cc->hdr->slot_bytes) {
+        return chunkvol_crop(cv, st, sz, out);
+    }
+    buf = malloc(cv->chunk_bytes);
+    if (buf == NULL) {
+        return CHUNK_ERR_MEMORY;
+    }
+    chunkvol_range(cv, st, sz, c0, c1, out);
+    for (i = c0[0]; i < c1[0] && ret == 0; i++) {
+        for (j = c0[1]; j < c1[1] && ret == 0; j++) {
+            for (k = c0[2]; k < c1[2]; k++) {
+                cid = (i * cv->nchunk[1] + j) * cv->nchunk[2] + k;
+                cache_lock(cc);
+                s = cache_find(cc, cv->vid, cid);
+                if (s != CACHE_NIL) {
+                    cc->hdr->hits++;
+                    lru_unlink(cc, s);
+                    lru_push_front(cc, s);
+                    chunkvol_paste(cv, cid, cc->data + s * cc->hdr->slot_bytes, st, sz, out);
+                    cache_unlock(cc);
+                    continue;
+                }
+                cc->hdr->misses++;
+                cache_unlock(cc);
+
+                // decode outside the lock
+                src = chunkvol_chunk(cv, cid, buf);
+                if (src == NULL) {
+                    ret = CHUNK_ERR_FORMAT;
+                    break;
+                }
+                chunkvol_paste(cv, cid, src, st, sz, out);
+
+                cache_lock(cc);
+                if (cache_find(cc, cv->vid, cid) == CACHE_NIL) {
+                    s = cache_alloc(cc);
+                    memcpy(cc->data + s * cc->hdr->slot_bytes, src, cv->chunk_bytes);
+                    cache_insert(cc, s, cv->vid, cid);
+                }
+                cache_unlock(cc);
+            }
+        }
+    }
+    free(buf);
+    return ret;
+}
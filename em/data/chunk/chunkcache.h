@@ -0,0 +1,49 @@
+#ifndef EM_CHUNKCACHE_H
+#define EM_CHUNKCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+#define CACHE_NIL -1
+
+typedef struct {
+    uint64_t vid;          // volume id
+    int64_t cid;           // chunk id, CACHE_NIL if the slot is free
+    int32_t prev, next;    // LRU list, head = most recent
+    int32_t hnext;         // hash chain
+} cache_slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int64_t slot_bytes;
+    int32_t num_slot;
+    int32_t num_bucket;
+    int32_t head, tail;
+    int32_t free_head;     // free slots, chained by next
+    uint64_t hits, misses, evictions;
+} cache_header;
+
+/*
+Process-shared LRU cache of decoded chunks, living in one anonymous shared
+mapping: header, num_bucket hash heads, num_slot slot records, then the
+slot data. Create it before forking the workers that share it.
+*/
+typedef struct {
+    void *base;
+    size_t size;
+    cache_header *hdr;
+    int32_t *bucket;
+    cache_slot *slot;
+    uint8_t *data;
+} chunkcache;
+
+int chunkcache_create(chunkcache *cc, int64_t budget, int64_t slot_bytes);
+void chunkcache_destroy(chunkcache *cc);
+void chunkcache_stats(chunkcache *cc, uint64_t out[4]);
+void chunkcache_clear(chunkcache *cc);
+int chunkvol_crop_cached(const chunkvol *cv, chunkcache *cc, const long st[3],
+                         const long sz[3], uint8_t *out);
+
+#endif
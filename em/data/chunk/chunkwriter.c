@@ -0,0 +1,325 @@
+/*
+Streaming chunked volume writer, same file layout as chunk.c.
+
+Slabs are staged one chunk row at a time (converted to the output dtype on
+the way in). Finished rows go to a bounded job ring served by compression
+threads; each thread reserves file space for a blob under the lock and
+writes it with pwrite, so blobs land in completion order and the index
+records where. The index and header are written on close.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "chunkwriter.h"
+
+static long row_depth(const chunkwriter *w, long row) {
+    long e = (long)w->hdr.shape[1] - row * w->hdr.chunk[0];
+    return e < (long)w->hdr.chunk[0] ? e : (long)w->hdr.chunk[0];
+}
+
+static int write_all(int fd, const void *buf, size_t n, uint64_t off) {
+    const uint8_t *p = buf;
+    ssize_t r;
+    while (n > 0) {
+        r = pwrite(fd, p, n, off);
+        if (r <= 0) {
+            return -1;
+        }
+        p += r;
+        off += r;
+        n -= r;
+    }
+    return 0;
+}
+
+/************************************************************************/
+// compression threads
+
+// cut, compress and write every chunk of one chunk row
+static int write_row(chunkwriter *w, const writer_job *job, uint8_t *cbuf,
+                     uint8_t *zbuf, uLong zcap) {
+    long nc = w->hdr.shape[0], sy = w->hdr.shape[2], sx = w->hdr.shape[3];
+    long isz = w->hdr.itemsize;
+    long j, k, ch, z, y, y0, x0, ey, ex, nbytes;
+    uLongf zlen;
+    const uint8_t *blob;
+    uint64_t off;
+    long cid;
+
+    for (j = 0; j < w->nchunk[1]; j++) {
+        y0 = j * w->hdr.chunk[1];
+        ey = sy - y0 < (long)w->hdr.chunk[1] ? sy - y0 : (long)w->hdr.chunk[1];
+        for (k = 0; k < w->nchunk[2]; k++) {
+            x0 = k * w->hdr.chunk[2];
+            ex = sx - x0 < (long)w->hdr.chunk[2] ? sx - x0 : (long)w->hdr.chunk[2];
+            for (ch = 0; ch < nc; ch++) {
+                for (z = 0; z < job->nz; z++) {
+                    for (y = 0; y < ey; y++) {
+                        memcpy(cbuf + ((ch * job->nz + z) * ey + y) * ex * isz,
+                               job->buf + (((ch * job->nz + z) * sy + y0 + y) * sx + x0) * isz,
+                               ex * isz);
+                    }
+                }
+            }
+            nbytes = nc * job->nz * ey * ex * isz;
+            blob = cbuf;
+            if (w->hdr.codec == CHUNK_CODEC_ZLIB) {
+                zlen = zcap;
+                if (compress2(zbuf, &zlen, cbuf, nbytes, w->level) != Z_OK) {
+                    return CHUNK_ERR_MEMORY;
+                }
+                blob = zbuf;
+                nbytes = zlen;
+            }
+            pthread_mutex_lock(&w->lock);
+            off = w->end;
+            w->end = (off + nbytes + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+            pthread_mutex_unlock(&w->lock);
+            if (write_all(w->fd, blob, nbytes, off) != 0) {
+                return CHUNK_ERR_IO;
+            }
+            cid = (job->row * w->nchunk[1] + j) * w->nchunk[2] + k;
+            w->index[2 * cid] = off;
+            w->index[2 * cid + 1] = nbytes;
+        }
+    }
+    return 0;
+}
+
+static void *writer_run(void *arg) {
+    chunkwriter *w = (chunkwriter *)arg;
+    long chunk_bytes = (long)w->hdr.shape[0] * w->hdr.chunk[0] * w->hdr.chunk[1] *
+                       w->hdr.chunk[2] * w->hdr.itemsize;
+    uLong zcap = compressBound(chunk_bytes);
+    uint8_t *cbuf = malloc(chunk_bytes);
+    uint8_t *zbuf = malloc(zcap);
+    writer_job job;
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    if (cbuf == NULL || zbuf == NULL) {
+        w->error = CHUNK_ERR_MEMORY;
+    }
+    for (;;) {
+        while (w->count == 0 && !w->stop) {
+            pthread_cond_wait(&w->more, &w->lock);
+        }
+        if (w->count == 0) {
+            break;
+        }
+        job = w->job[w->head];
+        w->head = (w->head + 1) % w->max_pending;
+        w->count--;
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+
+        ret = w->error == 0 ? write_row(w, &job, cbuf, zbuf, zcap) : 0;
+        free(job.buf);
+
+        pthread_mutex_lock(&w->lock);
+        if (ret != 0 && w->error == 0) {
+            w->error = ret;
+        }
+        w->busy--;
+        pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(cbuf);
+    free(zbuf);
+    return NULL;
+}
+
+/************************************************************************/
+// writer
+
+int chunkwriter_open(chunkwriter *w, const char *path, const char *dtype,
+                     int itemsize, int ndim, const long shape[4],
+                     const long chunk[3], int codec, int level, int in_type,
+                     int num_thread, int max_pending) {
+    long nall = 1;
+    int d, i;
+    memset(w, 0, sizeof(chunkwriter));
+    w->fd = -1;
+    memcpy(w->hdr.magic, CHUNK_MAGIC, 4);
+    w->hdr.version = CHUNK_VERSION;
+    memcpy(w->hdr.dtype, dtype, strnlen(dtype, sizeof(w->hdr.dtype)));
+    w->hdr.itemsize = itemsize;
+    w->hdr.ndim = ndim;
+    for (d = 0; d < 4; d++) {
+        w->hdr.shape[d] = shape[d];
+    }
+    for (d = 0; d < 3; d++) {
+        w->hdr.chunk[d] = chunk[d];
+        w->nchunk[d] = (shape[1 + d] + chunk[d] - 1) / chunk[d];
+        nall *= w->nchunk[d];
+    }
+    w->hdr.codec = codec;
+    w->level = level;
+    w->in_type = in_type;
+    w->max_pending = max_pending > 0 ? max_pending : 1;
+    w->end = CHUNK_HEADER_SIZE;
+    num_thread = num_thread > 0 ? num_thread : 1;
+
+    w->index = calloc(2 * nall, sizeof(uint64_t));
+    w->job = calloc(w->max_pending, sizeof(writer_job));
+    w->stage = malloc(shape[0] * chunk[0] * shape[2] * shape[3] * itemsize);
+    w->thread = calloc(num_thread, sizeof(pthread_t));
+    if (w->index == NULL || w->job == NULL || w->stage == NULL || w->thread == NULL) {
+        free(w->index);
+        free(w->job);
+        free(w->stage);
+        free(w->thread);
+        return CHUNK_ERR_MEMORY;
+    }
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        free(w->index);
+        free(w->job);
+        free(w->stage);
+        free(w->thread);
+        return CHUNK_ERR_IO;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->more, NULL);
+    pthread_cond_init(&w->done, NULL);
+    // fewer threads than asked only cost speed; none would block submit_row
+    for (i = 0; i < num_thread; i++) {
+        if (pthread_create(w->thread + i, NULL, writer_run, w) != 0) {
+            break;
+        }
+        w->num_thread++;
+    }
+    if (w->num_thread == 0) {
+        close(w->fd);
+        unlink(path);
+        w->fd = -1;
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->more);
+        pthread_cond_destroy(&w->done);
+        free(w->index);
+        free(w->job);
+        free(w->stage);
+        free(w->thread);
+        return CHUNK_ERR_MEMORY;
+    }
+    return 0;
+}
+
+// hand the staged chunk row to the pool, waiting while max_pending rows are queued
+static int submit_row(chunkwriter *w) {
+    writer_job job;
+    long row_bytes = (long)w->hdr.shape[0] * w->hdr.chunk[0] * w->hdr.shape[2] *
+                     w->hdr.shape[3] * w->hdr.itemsize;
+    job.buf = w->stage;
+    job.row = w->row;
+    job.nz = w->stage_z;
+    w->stage = malloc(row_bytes);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->max_pending && w->error == 0) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    if (w->error != 0 || w->num_thread == 0) {
+        pthread_mutex_unlock(&w->lock);
+        free(job.buf);
+        return w->error != 0 ? w->error : CHUNK_ERR_MEMORY;
+    }
+    w->job[(w->head + w->count) % w->max_pending] = job;
+    w->count++;
+    pthread_cond_signal(&w->more);
+    pthread_mutex_unlock(&w->lock);
+
+    w->row++;
+    w->stage_z = 0;
+    return w->stage == NULL ? CHUNK_ERR_MEMORY : 0;
+}
+
+static void convert(const chunkwriter *w, const uint8_t *src, uint8_t *dst, long n) {
+    const float *s = (const float *)src;
+    long i;
+    float v;
+    if (w->in_type == WRITER_COPY) {
+        memcpy(dst, src, n * w->hdr.itemsize);
+        return;
+    }
+    // NaN fails every comparison: map it to 0 before the cast
+    for (i = 0; i < n; i++) {
+        v = s[i] * 255.0f + 0.5f;
+        dst[i] = !(v > 0.0f) ? 0 : (v >= 255.0f ? 255 : (uint8_t)v);
+    }
+}
+
+/*
+Append nz z-slices, slab (c, nz, y, x) c-contiguous in the input type.
+Slabs may have any depth; the whole volume must be pushed, in order.
+*/
+int chunkwriter_push(chunkwriter *w, const uint8_t *slab, long nz) {
+    long nc = w->hdr.shape[0];
+    long plane = (long)w->hdr.shape[2] * w->hdr.shape[3];
+    long in_isz = w->in_type == WRITER_F32_TO_U8 ? 4 : w->hdr.itemsize;
+    long ch, n, depth, done = 0;
+    int ret;
+    while (done < nz) {
+        if (w->row >= w->nchunk[0]) {
+            return CHUNK_ERR_FORMAT;  // past the end of the volume
+        }
+        depth = row_depth(w, w->row);
+        n = depth - w->stage_z < nz - done ? depth - w->stage_z : nz - done;
+        for (ch = 0; ch < nc; ch++) {
+            convert(w, slab + (ch * nz + done) * plane * in_isz,
+                    w->stage + (ch * depth + w->stage_z) * plane * w->hdr.itemsize,
+                    n * plane);
+        }
+        w->stage_z += n;
+        done += n;
+        if (w->stage_z == depth && (ret = submit_row(w)) != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// wait for the pool, then write index and header; returns the first error
+int chunkwriter_close(chunkwriter *w) {
+    uint8_t hdr[CHUNK_HEADER_SIZE];
+    long nall = w->nchunk[0] * w->nchunk[1] * w->nchunk[2];
+    int i, ret;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->more);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->num_thread; i++) {
+        pthread_join(w->thread[i], NULL);
+    }
+    ret = w->error;
+    if (ret == 0 && w->row < w->nchunk[0]) {
+        ret = CHUNK_ERR_FORMAT;  // volume not complete
+    }
+    if (ret == 0) {
+        w->hdr.index_offset = w->end;
+        memset(hdr, 0, sizeof(hdr));
+        memcpy(hdr, &w->hdr, sizeof(chunk_header));
+        if (write_all(w->fd, w->index, 16 * nall, w->end) != 0 ||
+            write_all(w->fd, hdr, sizeof(hdr), 0) != 0) {
+            ret = CHUNK_ERR_IO;
+        }
+    }
+    if (close(w->fd) != 0 && ret == 0) {
+        ret = CHUNK_ERR_IO;
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->more);
+    pthread_cond_destroy(&w->done);
+    free(w->index);
+    free(w->job);
+    free(w->stage);
+    free(w->thread);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef EM_CHUNKWRITER_H
+#define EM_CHUNKWRITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "chunk.h"
+
+#define WRITER_COPY     0  // input already has the output dtype
+#define WRITER_F32_TO_U8 1  // float32 in [0,1] -> uint8 round(255*v)
+
+typedef struct {
+    uint8_t *buf;          // (c, nz, y, x) in the output dtype
+    long row;              // chunk row in z
+    long nz;
+} writer_job;
+
+/*
+Streaming writer of a chunked volume. The caller pushes z-slabs in order;
+each full chunk row is handed to a pool of threads that cut, compress and
+pwrite its chunks. At most max_pending rows wait for compression, so memory
+stays bounded whatever the volume size.
+*/
+typedef struct {
+    int fd;
+    chunk_header hdr;
+    long nchunk[3];
+    int level;
+    int in_type;
+    uint64_t *index;       // nchunk_all x (offset, nbytes)
+    uint64_t end;          // next free file offset
+    // staging chunk row
+    uint8_t *stage;
+    long stage_z;          // z slices filled
+    long row;              // chunk row being staged
+    // thread pool
+    pthread_mutex_t lock;
+    pthread_cond_t more;   // a job was queued, or stop
+    pthread_cond_t done;   // a job finished
+    writer_job *job;       // ring of max_pending jobs
+    int max_pending, head, count, busy;
+    int stop, error;
+    int num_thread;
+    pthread_t *thread;
+} chunkwriter;
+
+int chunkwriter_open(chunkwriter *w, const char *path, const char *dtype,
+                     int itemsize, int ndim, const long shape[4],
+                     const long chunk[3], int codec, int level, int in_type,
+                     int num_thread, int max_pending);
+int chunkwriter_push(chunkwriter *w, const uint8_t *slab, long nz);
+int chunkwriter_close(chunkwriter *w);
+
+#endif
@@ -0,0 +1,166 @@
+/*
+Fused crop + normalize + dtype conversion of uint8 volumes.
+
+The box is read once and written as float32 or fp16 through a lookup
+table indexed by the sum of the down[0] x down[1] x down[2] source voxels,
+so _half (2x2 in xy) volumes are produced on the fly from full resolution
+without a float copy of the volume. Source voxels outside the volume count
+as 0.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "normalize.h"
+
+// round to nearest even, with overflow to inf and subnormals
+uint16_t float_to_half(float f) {
+    uint32_t x, sign, mant;
+    int32_t e;
+    memcpy(&x, &f, 4);
+    sign = (x >> 16) & 0x8000;
+    e = (int32_t)((x >> 23) & 0xFF) - 127 + 15;
+    mant = x & 0x7FFFFF;
+    if (((x >> 23) & 0xFF) == 0xFF) {
+        return sign | 0x7C00 | (mant ? 0x200 : 0);
+    }
+    if (e >= 31) {
+        return sign | 0x7C00;
+    }
+    if (e <= 0) {
+        if (e < -10) {
+            return sign;
+        }
+        mant |= 0x800000;
+        uint32_t shift = 14 - e;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1))) h++;
+        return sign | h;
+    }
+    uint32_t h = ((uint32_t)e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+    return sign | h;
+}
+
+static uint16_t run_sum(const uint8_t *row, long sx, int n, long len) {
+    uint16_t s = 0;
+    int k;
+    for (k = 0; k < n; k++) {
+        if (sx + k >= 0 && sx + k < len) s += row[sx + k];
+    }
+    return s;
+}
+
+/*
+Normalize the box [st, st+sz) of the down-sampled grid of a c-contiguous
+uint8 (c,z,y,x) array into out (c, sz).
+*/
+int crop_normalize(const uint8_t *data, const long shape[4], const long st[3],
+                   const long sz[3], const norm_param *p, void *out) {
+    long n = (long)p->down[0] * p->down[1] * p->down[2];
+    long ch, z, y, x, i, j, k, iz, iy, sx, x0, x1, o;
+    float *lut, *of = (float *)out;
+    uint16_t *lut16, *oh = (uint16_t *)out, *acc;
+    const uint8_t *row;
+
+    if (n < 1 || n > 256) {
+        return -1;
+    }
+    lut = malloc((255 * n + 1) * sizeof(float));
+    lut16 = malloc((255 * n + 1) * sizeof(uint16_t));
+    acc = malloc(sz[2] * sizeof(uint16_t));
+    if (lut == NULL || lut16 == NULL || acc == NULL) {
+        free(lut);
+        free(lut16);
+        free(acc);
+        return CHUNK_ERR_MEMORY;
+    }
+    for (i = 0; i <= 255 * n; i++) {
+        lut[i] = ((float)i / n - p->offset) * p->scale;
+        lut16[i] = float_to_half(lut[i]);
+    }
+    // output x range [x0, x1) whose source runs are inside the volume
+    x0 = 0;
+    while (x0 < sz[2] && (st[2] + x0) * p->down[2] < 0) x0++;
+    x1 = x0;
+    while (x1 < sz[2] && (st[2] + x1 + 1) * p->down[2] <= shape[3]) x1++;
+
+    for (ch = 0; ch < shape[0]; ch++) {
+        for (z = 0; z < sz[0]; z++) {
+            for (y = 0; y < sz[1]; y++) {
+                memset(acc, 0, sz[2] * sizeof(uint16_t));
+                for (i = 0; i < p->down[0]; i++) {
+                    iz = (st[0] + z) * p->down[0] + i;
+                    if (iz < 0 || iz >= shape[1]) continue;
+                    for (j = 0; j < p->down[1]; j++) {
+                        iy = (st[1] + y) * p->down[1] + j;
+                        if (iy < 0 || iy >= shape[2]) continue;
+                        row = data + ((ch * shape[1] + iz) * shape[2] + iy) * shape[3];
+                        if (p->down[2] == 1) {
+                            for (x = x0; x < x1; x++) {
+                                acc[x] += row[st[2] + x];
+                            }
+                        } else {
+                            for (x = x0; x < x1; x++) {
+                                sx = (st[2] + x) * p->down[2];
+                                for (k = 0; k < p->down[2]; k++) {
+                                    acc[x] += row[sx + k];
+                                }
+                            }
+                        }
+                        for (x = 0; x < x0; x++) {
+                            acc[x] += run_sum(row, (st[2] + x) * p->down[2], p->down[2], shape[3]);
+                        }
+                        for (x = x1; x < sz[2]; x++) {
+                            acc[x] += run_sum(row, (st[2] + x) * p->down[2], p->down[2], shape[3]);
+                        }
+                    }
+                }
+                o = ((ch * sz[0] + z) * sz[1] + y) * sz[2];
+                if (p->out_type == NORM_F16) {
+                    for (x = 0; x < sz[2]; x++) oh[o + x] = lut16[acc[x]];
+                } else {
+                    for (x = 0; x < sz[2]; x++) of[o + x] = lut[acc[x]];
+                }
+            }
+        }
+    }
+    free(lut);
+    free(lut16);
+    free(acc);
+    return 0;
+}
+
+/*
+Same from a uint8 chunked volume: the source box is cropped through the
+cache into a uint8 scratch (a quarter of the float output), then converted.
+*/
+int chunkvol_crop_normalize(const chunkvol *cv, chunkcache *cc, const long st[3],
+                            const long sz[3], const norm_param *p, void *out) {
+    long sst[3], ssz[3], shape[4], zero[3] = {0, 0, 0};
+    uint8_t *buf;
+    int d, ret;
+    if (cv->hdr.itemsize != 1) {
+        return CHUNK_ERR_FORMAT;
+    }
+    shape[0] = cv->hdr.shape[0];
+    for (d = 0; d < 3; d++) {
+        sst[d] = st[d] * p->down[d];
+        ssz[d] = sz[d] * p->down[d];
+        shape[1 + d] = ssz[d];
+    }
+    buf = malloc(shape[0] * ssz[0] * ssz[1] * ssz[2]);
+    if (buf == NULL) {
+        return CHUNK_ERR_MEMORY;
+    }
+    ret = chunkvol_crop_cached(cv, cc, sst, ssz, buf);
+    if (ret == 0) {
+        ret = crop_normalize(buf, shape, zero, sz, p, out);
+    }
+    free(buf);
+    return ret;
+}
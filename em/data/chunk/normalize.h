@@ -0,0 +1,27 @@
+#ifndef EM_NORMALIZE_H
+#define EM_NORMALIZE_H
+
+#include <stdint.h>
+
+#include "chunk.h"
+#include "chunkcache.h"
+
+#define NORM_F32 0
+#define NORM_F16 1
+
+// out = (mean of the down box - offset) * scale, as float32 or fp16;
+// down[0] * down[1] * down[2] <= 256
+typedef struct {
+    float offset;
+    float scale;
+    int down[3];
+    int out_type;
+} norm_param;
+
+uint16_t float_to_half(float f);
+int crop_normalize(const uint8_t *data, const long shape[4], const long st[3],
+                   const long sz[3], const norm_param *p, void *out);
+int chunkvol_crop_normalize(const chunkvol *cv, chunkcache *cc, const long st[3],
+                            const long sz[3], const norm_param *p, void *out);
+
+#endif
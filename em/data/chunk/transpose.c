@@ -0,0 +1,70 @@
+/*
+Cache-blocked channel transpose, (c, n) <-> (n, c) with n = z*y*x.
+
+Channels are few (3 for affinities), so the transpose is an interleave:
+it walks TRANSPOSE_BLOCK voxels at a time, reading each channel's run
+sequentially while the interleaved block stays in cache.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "transpose.h"
+
+#define TRANSPOSE_BLOCK 2048
+
+#define INTERLEAVE(T)                                                          \
+    do {                                                                       \
+        const T *src = (const T *)in;                                          \
+        T *dst = (T *)out;                                                     \
+        for (b = 0; b < n; b += TRANSPOSE_BLOCK) {                             \
+            e = b + TRANSPOSE_BLOCK < n ? b + TRANSPOSE_BLOCK : n;             \
+            for (c = 0; c < nc; c++) {                                         \
+                const T *s = src + c * n;                                      \
+                for (i = b; i < e; i++) dst[i * nc + c] = s[i];                \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+#define DEINTERLEAVE(T)                                                        \
+    do {                                                                       \
+        const T *src = (const T *)in;                                          \
+        T *dst = (T *)out;                                                     \
+        for (b = 0; b < n; b += TRANSPOSE_BLOCK) {                             \
+            e = b + TRANSPOSE_BLOCK < n ? b + TRANSPOSE_BLOCK : n;             \
+            for (c = 0; c < nc; c++) {                                         \
+                T *d = dst + c * n;                                            \
+                for (i = b; i < e; i++) d[i] = src[i * nc + c];                \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+// (c, n) -> (n, c)
+void transpose_channels_last(const void *in, long nc, long n, int itemsize, void *out) {
+    long b, e, c, i;
+    if (nc == 1) {
+        memcpy(out, in, n * itemsize);
+        return;
+    }
+    switch (itemsize) {
+    case 1: INTERLEAVE(uint8_t); break;
+    case 2: INTERLEAVE(uint16_t); break;
+    case 4: INTERLEAVE(uint32_t); break;
+    default: INTERLEAVE(uint64_t); break;
+    }
+}
+
+// (n, c) -> (c, n)
+void transpose_channels_first(const void *in, long nc, long n, int itemsize, void *out) {
+    long b, e, c, i;
+    if (nc == 1) {
+        memcpy(out, in, n * itemsize);
+        return;
+    }
+    switch (itemsize) {
+    case 1: DEINTERLEAVE(uint8_t); break;
+    case 2: DEINTERLEAVE(uint16_t); break;
+    case 4: DEINTERLEAVE(uint32_t); break;
+    default: DEINTERLEAVE(uint64_t); break;
+    }
+}
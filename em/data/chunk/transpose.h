@@ -0,0 +1,7 @@
+#ifndef EM_TRANSPOSE_H
+#define EM_TRANSPOSE_H
+
+void transpose_channels_last(const void *in, long nc, long n, int itemsize, void *out);
+void transpose_channels_first(const void *in, long nc, long n, int itemsize, void *out);
+
+#endif
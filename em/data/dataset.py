@@ -1,15 +1,22 @@
 import numpy as np
 import json
+import os
 import torch.utils.data
-from segLib.seg_core import connected_components_affgraph
-from em.data.io import countVolume, cropVolume
+from em.util.seg.seg import connected_components_affgraph
+from em.data.io import countVolume, cropVolume, cropNormVolume
 from em.data.augmentor import buildAugmentor
 from em.data.sampler import buildSampler
 from em.data.data_loader import buildLoader
+from em.data.mosaic.mosaic import readmosaic
 
 # based on: https://github.com/ELEKTRONN/ELEKTRONN/blob/master/elektronn/training/CNNData.py
 class VolumeDataset(torch.utils.data.Dataset):
     # assume for test, no warping [hassle to warp it back..]
+    norm = None # per-volume (offset, scale) of uint8 images (getNorm); raw crops if None
+
+    def setNorm(self, norm):
+        self.norm = norm
+
     def __init__(self,
                  opt_data,
                  opt_sample,
@@ -50,7 +57,10 @@ class VolumeDataset(torch.utils.data.Dataset):
         pos = self.getPos(index, vol_size) 
 
         # 2. get initial volume
-        out_img = cropVolume(self.img[pos[0]], vol_size, pos[1:])
+        if self.norm is not None: # crop + normalize to float32 in one pass
+            out_img = cropNormVolume(self.img[pos[0]], vol_size, pos[1:], self.norm[pos[0]])
+        else:
+            out_img = cropVolume(self.img[pos[0]], vol_size, pos[1:])
         out_label = None
         out_seg = None
         if self.label is not None:
@@ -62,7 +72,7 @@ class VolumeDataset(torch.utils.data.Dataset):
 
         # 4. from gt affinity -> gt segmentation
         if self.nhood is not None: # for malis loss, need local segmentation
-            out_seg = connected_components_affgraph(out_label.astype(np.int32))[0].astype(np.uint64)
+            out_seg = connected_components_affgraph(out_label)[0]
 
         # print(out_img.shape, out_label.shape, pos)
         return out_img, out_label, out_seg, pos
@@ -95,11 +105,19 @@ class VolumeDataset(torch.utils.data.Dataset):
         raise NotImplementedError("Need to implement getPos() !")
  
 class VolumeDatasetTrain(VolumeDataset):
+    sample_index = None # per-volume SampleIndex; uniform positions if None
+
+    def setSampleIndex(self, sample_index):
+        self.sample_index = sample_index
+
     def getPos(self, index, vol_size):
         # index: not used
         pos = [0,0,0,0]
         did = np.random.randint(len(self.img_size)) if len(self.img_size)>1 else 0
         pos[0] = did
+        if self.sample_index is not None: # boundary-weighted
+            pos[1:] = self.sample_index[did].sample(self.img_size[did], vol_size, self.sample_stride)
+            return pos
         tmp_size = countVolume(self.img_size[did], vol_size, self.sample_stride)
         # print('num_vol',tmp_size)
         index = np.random.randint(np.prod(tmp_size))
@@ -144,6 +162,9 @@ class VolumeDatasetTestJson(VolumeDataset):
         self.data_tile_name = data_stat['sections']
         self.data_tile_size = [1,data_stat['dimensions']['width'],data_stat['dimensions']['height']]
         self.data_tile_num = [data_stat['dimensions']['depth'],data_stat['dimensions']['n_columns'],data_stat['dimensions']['n_rows']]
+        # tiles are decoded natively and assembled across tile borders by cropVolume
+        self.img = [readmosaic(data_stat, root=os.path.dirname(getattr(data, 'name', '')))]
+        self.img_size = [np.array(self.img[0].shape, dtype=int)]
 
     def getPos(self, index):
         pos = self.index2zyx(index)
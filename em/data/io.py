@@ -9,10 +9,51 @@ import h5py
 import os
 from ..util.misc import writeh5, segToAffinity
 
-def setPred(pred, y_pred, pred_sz, pos, lt=None, st=0, pred_ww=None, ww=None):
+def cropVolume(data, sz, st=[0,0,0]):
+    # data: (...,z,y,x) array or chunked volume (reads only the needed chunks)
+    st = [int(x) for x in st]
+    if hasattr(data, 'crop'):
+        return data.crop(st, sz)
+    return data[..., st[0]:st[0]+sz[0], st[1]:st[1]+sz[1], st[2]:st[2]+sz[2]]
+
+def getNorm(data, mode='unit', slab=8):
+    # per-volume (offset, scale) for cropNormVolume, out = (v-offset)*scale
+    # mode: 'unit' (v/255), 'minmax' (to [0,1]), 'meanstd' (zero mean, unit std)
+    # computed slab by slab in z: no float copy of the volume
+    if mode == 'unit':
+        return 0., 1./255
+    sh = data.shape
+    lo, hi, s1, s2, n = 255, 0, 0., 0., 0
+    for z in range(0, sh[-3], slab):
+        sz = [min(slab, sh[-3]-z), sh[-2], sh[-1]]
+        v = cropVolume(data, sz, [z,0,0])
+        lo, hi = min(lo, int(v.min())), max(hi, int(v.max()))
+        hist = np.bincount(v.reshape(-1), minlength=256).astype(np.float64)
+        s1 += np.dot(hist, np.arange(256))
+        s2 += np.dot(hist, np.arange(256)**2)
+        n += v.size
+    if mode == 'minmax':
+        return float(lo), 1./max(hi-lo, 1)
+    mean = s1/n
+    return mean, 1./max(np.sqrt(s2/n-mean**2), 1e-6)
+
+def cropNormVolume(data, sz, st=[0,0,0], norm=(0., 1./255), down=(1,1,1), out=None, dtype=np.float32):
+    # uint8 crop -> normalized float32/float16 in one pass, e.g. into a batch slot
+    #   norm: (offset, scale) from getNorm
+    #   down: (1,2,2) reads the _half volume from full resolution; st, sz are in the down-sampled grid
+    from .chunk._chunk import crop_normalize
+    st = [int(x) for x in st]
+    return crop_normalize(data, st, sz, norm[0], norm[1], down, out, dtype)
+
+def setPred(pred, y_pred, pred_sz, pos, lt=None, st=0, pred_ww=None, ww=None, num_thread=4):
     if lt is None:
         lt = pos.shape[0]
-    if pred_ww is None: # simply assign
+    if pred.dtype == np.float32 and pred.flags['C_CONTIGUOUS'] and \
+       (pred_ww is None or (pred_ww.dtype == np.float32 and pred_ww.flags['C_CONTIGUOUS'])):
+        # native: fused multiply-add, threads split the output z-planes
+        from .stitch.stitch import blend_patches
+        blend_patches(pred, y_pred[st:lt], pred_sz, pos[st:lt], pred_ww, ww, num_thread)
+    elif pred_ww is None: # simply assign
         for j in range(st,lt):
             pp = pos[j] 
             pred[:,pp[1]:pp[1]+pred_sz[0],
@@ -28,6 +69,108 @@ def setPred(pred, y_pred, pred_sz, pos, lt=None, st=0, pred_ww=None, ww=None):
                   pp[2]:pp[2]+pred_sz[1],
                   pp[3]:pp[3]+pred_sz[2]] += ww
 
+def setPredSep(pred, y_pred, pred_sz, pos, ww_sep, lt=None, st=0, num_thread=4):
+    # setPred with separable weights ww_sep=(wz,wy,wx): no pred_ww, see normPredSep
+    from .stitch.stitch import blend_patches_sep
+    if lt is None:
+        lt = pos.shape[0]
+    blend_patches_sep(pred, y_pred[st:lt], pred_sz, pos[st:lt], ww_sep, num_thread)
+
+def normPredSep(pred, inv_sep, nz=None, z0=0):
+    # in place: divide the first nz planes of pred (output planes from z0) by the weight sum
+    from .stitch.stitch import normalize_sep
+    normalize_sep(pred, pred.shape[1] if nz is None else nz, z0, inv_sep)
+    return pred
+
+class SlabStitcher(object):
+    # test-time stitching into a sliding z-window instead of whole-volume pred/pred_ww
+    # patches must come in z order (VolumeDatasetTest): all z below the current
+    # patch are final, so they are normalized and passed to writer.write (ChunkWriter)
+    # ww_sep: separable weights (wz,wy,wx) on the stride grid, normalized without pred_ww
+    def __init__(self, output_size, pred_sz, writer, ww=None, ww_sep=None, stride=None):
+        self.shape = list(output_size)
+        self.pred_sz = pred_sz
+        self.writer = writer
+        self.ww = ww
+        self.ww_sep = ww_sep
+        self.depth = min(pred_sz[0], self.shape[1])
+        win = [self.shape[0], self.depth] + self.shape[2:]
+        self.pred = np.zeros(win, dtype=np.float32)
+        self.pred_ww = np.zeros(win, dtype=np.float32) if ww is not None and ww_sep is None else None
+        self.inv_sep = None
+        if ww_sep is not None:
+            from .stitch.stitch import inverse_weight_sum
+            self.inv_sep = inverse_weight_sum(ww_sep, self.shape[1:], pred_sz, stride)
+        self.z0 = 0 # output z of the window start
+
+    def add(self, y_pred, pos, lt=None, st=0):
+        if lt is None:
+            lt = pos.shape[0]
+        j = st
+        while j < lt:
+            if pos[j][1] > self.z0:
+                self.flush(pos[j][1])
+            # run of patches at the same z: one blend call
+            k = j+1
+            while k < lt and pos[k][1] == pos[j][1]:
+                k += 1
+            pp = np.array(pos[j:k])
+            pp[:,1] -= self.z0
+            if self.ww_sep is not None:
+                setPredSep(self.pred, y_pred[j:k], self.pred_sz, pp, self.ww_sep)
+            else:
+                setPred(self.pred, y_pred[j:k], self.pred_sz, pp, None, 0, self.pred_ww, self.ww)
+            j = k
+
+    def flush(self, z):
+        # write [z0, z) and slide the window
+        while self.z0 < z:
+            n = min(z-self.z0, self.depth)
+            if self.inv_sep is not None:
+                normPredSep(self.pred, self.inv_sep, n, self.z0)
+            out = self.pred[:,:n]
+            if self.pred_ww is not None:
+                out = out/np.maximum(self.pred_ww[:,:n], 1e-6)
+            self.writer.write(out)
+            self.pred[:,:self.depth-n] = self.pred[:,n:].copy()
+            self.pred[:,self.depth-n:] = 0
+            if self.pred_ww is not None:
+                self.pred_ww[:,:self.depth-n] = self.pred_ww[:,n:].copy()
+                self.pred_ww[:,self.depth-n:] = 0
+            self.z0 += n
+
+    def close(self):
+        # unpredicted z (early stop) is written as 0
+        if self.writer is None:
+            return
+        self.flush(self.shape[1])
+        self.writer.close()
+        self.writer = None
+
+def chunkName(filename):
+    # chunked copy of an h5 volume (misc.h52chunk), preferred when it exists
+    return os.path.splitext(filename)[0] + '.chunk'
+
+def getImg(img_name, img_dataset_name='main', cache=None):
+    # image volumes (c,z,y,x) through readvol: a chunked file, given or next
+    # to the h5 file, stays on disk and crops read only its chunks; h5
+    # volumes are read into memory, (z,y,x) ones with a channel axis added
+    from ..util.misc import readvol
+    if not isinstance(img_dataset_name, (list, tuple)):
+        img_dataset_name = [img_dataset_name]*len(img_name)
+    img = [None]*len(img_name)
+    for i in range(len(img_name)):
+        fn = img_name[i]
+        if not fn.endswith('.chunk') and os.path.exists(chunkName(fn)):
+            fn = chunkName(fn)
+        img[i] = readvol(fn, img_dataset_name[i], cache)
+        if not hasattr(img[i], 'crop') and img[i].ndim == 3:
+            img[i] = img[i][None]
+    return img
+
+def getData(dir_name, data_name, data_dataset_name='main', cache=None):
+    # test images: data_name in each of the dir_name directories
+    return getImg([x+data_name for x in dir_name], data_dataset_name, cache)
 
 def getVar(batch_size, model_io_size, do_input=[True, False, False]):
     import torch
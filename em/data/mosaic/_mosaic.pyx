@@ -0,0 +1,95 @@
+"""
+Cython wrapper of the tiled mosaic reader.
+"""
+
+import numpy as np
+from libc.stdlib cimport malloc, free
+
+cdef extern from 'mosaic.h':
+    ctypedef struct mosaic:
+        int depth, n_rows, n_cols
+        int tile_h, tile_w
+        int num_resident
+        unsigned long long decoded, failed, evicted
+    int mosaic_open(mosaic *m, int depth, int n_rows, int n_cols, int tile_h,
+                    int tile_w, char **path, int num_thread, int max_section)
+    void mosaic_close(mosaic *m)
+    int mosaic_read(mosaic *m, const long st[3], const long sz[3],
+                    unsigned char *out) nogil
+
+
+cdef class MosaicVolume:
+    """
+    uint8 (z,y,x) volume over a grid of image tiles (PNG or JPEG).
+
+    paths: depth x n_rows x n_cols nested lists of tile files (None or ''
+    for missing tiles, which read as zeros)
+    tile_size: (height, width) of a tile
+    num_thread: decoder threads, started by the first crop of each process
+    (0: decode in the reading thread)
+    cache_section: sections kept decoded in memory
+    """
+    cdef mosaic m
+    cdef int opened
+    cdef object args
+    cdef readonly object shape
+    cdef readonly object dtype
+    cdef readonly object tile_size
+
+    def __cinit__(self, paths, tile_size, int num_thread=4, int cache_section=8):
+        depth = len(paths)
+        n_rows = len(paths[0])
+        n_cols = len(paths[0][0])
+        flat = [(p or '').encode() for sec in paths for row in sec for p in row]
+        assert len(flat) == depth * n_rows * n_cols
+        cdef char **cpath = <char **>malloc(len(flat) * sizeof(char *))
+        if cpath == NULL:
+            raise MemoryError()
+        for i in range(len(flat)):
+            cpath[i] = flat[i]
+        ret = mosaic_open(&self.m, depth, n_rows, n_cols, tile_size[0], tile_size[1],
+                          cpath, num_thread, cache_section)
+        free(cpath)
+        if ret != 0:
+            raise MemoryError('cannot open mosaic')
+        self.opened = 1
+        self.args = (paths, tuple(tile_size), num_thread, cache_section)
+        self.dtype = np.dtype(np.uint8)
+        self.tile_size = tuple(tile_size)
+        self.shape = (depth, n_rows * tile_size[0], n_cols * tile_size[1])
+
+    def __dealloc__(self):
+        if self.opened:
+            mosaic_close(&self.m)
+
+    def __reduce__(self):
+        # re-open in the receiving process, with an empty cache
+        return (MosaicVolume, self.args)
+
+    property ndim:
+        def __get__(self):
+            return 3
+
+    def stats(self):
+        return dict(decoded=self.m.decoded, failed=self.m.failed,
+                    evicted=self.m.evicted, resident=self.m.num_resident)
+
+    def crop(self, st, sz, out=None):
+        """Read the box [st, st+sz) in zyx; voxels outside or in missing tiles are 0."""
+        cdef long st_c[3]
+        cdef long sz_c[3]
+        for x in range(3):
+            st_c[x] = st[x]
+            sz_c[x] = sz[x]
+        out_shape = tuple(int(x) for x in sz)
+        if out is None:
+            out = np.empty(out_shape, dtype=np.uint8)
+        assert out.shape == out_shape and out.dtype == np.uint8 \
+                and out.flags['C_CONTIGUOUS']
+        cdef unsigned char [::1] out_view = out.reshape(-1)
+        with nogil:
+            mosaic_read(&self.m, st_c, sz_c, &out_view[0])
+        return out
+
+    def __array__(self):
+        return self.crop((0, 0, 0), self.shape)
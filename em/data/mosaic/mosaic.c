@@ -0,0 +1,411 @@
+/*
+Tiled mosaic reader.
+
+A read of a zyx box pins the sections it spans, queues the missing tiles
+on the decoder pool, waits for them and assembles the box across tile
+borders. Sections are evicted whole, least recently used first, once more
+than max_section are resident; pinned sections are never evicted.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "mosaic.h"
+
+/************************************************************************/
+// decoders: 8-bit gray, cropped or zero-padded to the tile size
+
+static void blit(const uint8_t *src, long h, long w, int tile_h, int tile_w,
+                 uint8_t *out) {
+    long y, nw = w < tile_w ? w : tile_w;
+    for (y = 0; y < h && y < tile_h; y++) {
+        memcpy(out + y * tile_w, src + y * w, nw);
+    }
+}
+
+static int decode_png(const char *path, int tile_h, int tile_w, uint8_t *out) {
+    png_image img;
+    uint8_t *buf;
+    int ret = -1;
+    memset(&img, 0, sizeof(img));
+    img.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&img, path)) {
+        return -1;
+    }
+    img.format = PNG_FORMAT_GRAY;
+    buf = malloc(PNG_IMAGE_SIZE(img));
+    if (buf != NULL && png_image_finish_read(&img, NULL, buf, 0, NULL)) {
+        blit(buf, img.height, img.width, tile_h, tile_w, out);
+        ret = 0;
+    } else {
+        png_image_free(&img);
+    }
+    free(buf);
+    return ret;
+}
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jb;
+} jpeg_err;
+
+static void jpeg_fail(j_common_ptr c) {
+    longjmp(((jpeg_err *)c->err)->jb, 1);
+}
+
+static int decode_jpeg(const char *path, int tile_h, int tile_w, uint8_t *out) {
+    struct jpeg_decompress_struct cinfo;
+    jpeg_err err;
+    uint8_t *volatile row = NULL;
+    JSAMPROW rp;
+    long y, nw;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_fail;
+    if (setjmp(err.jb)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        free(row);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    jpeg_start_decompress(&cinfo);
+    row = malloc(cinfo.output_width);
+    if (row == NULL) {
+        jpeg_fail((j_common_ptr)&cinfo);
+    }
+    nw = (long)cinfo.output_width < tile_w ? (long)cinfo.output_width : tile_w;
+    rp = row;
+    while (cinfo.output_scanline < cinfo.output_height) {
+        y = cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, &rp, 1);
+        if (y < tile_h) {
+            memcpy(out + y * tile_w, row, nw);
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
+    free(row);
+    return 0;
+}
+
+int mosaic_decode(const char *path, int tile_h, int tile_w, uint8_t *out) {
+    unsigned char sig[8];
+    size_t n;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    n = fread(sig, 1, 8, f);
+    fclose(f);
+    memset(out, 0, (size_t)tile_h * tile_w);
+    if (n == 8 && png_sig_cmp(sig, 0, 8) == 0) {
+        return decode_png(path, tile_h, tile_w, out);
+    }
+    if (n >= 2 && sig[0] == 0xFF && sig[1] == 0xD8) {
+        return decode_jpeg(path, tile_h, tile_w, out);
+    }
+    return -1;
+}
+
+/************************************************************************/
+// decoder pool
+
+// decode the next queued tile; called with the lock held, dropped meanwhile
+static void decode_task(mosaic *m) {
+    uint8_t *pix = NULL;
+    int t, ok = 0;
+    t = m->task[m->task_head % m->task_cap];
+    m->task_head++;
+    pthread_mutex_unlock(&m->lock);
+
+    if (m->path[t] != NULL && m->path[t][0] != '\0') {
+        pix = malloc((size_t)m->tile_h * m->tile_w);
+        ok = pix != NULL && mosaic_decode(m->path[t], m->tile_h, m->tile_w, pix) == 0;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    if (ok) {
+        m->tile[t].pix = pix;
+        m->tile[t].state = TILE_READY;
+        m->decoded++;
+    } else {
+        free(pix);
+        m->tile[t].state = TILE_MISSING;
+        m->failed++;
+    }
+    pthread_cond_broadcast(&m->done);
+}
+
+static void *mosaic_worker(void *arg) {
+    mosaic *m = (mosaic *)arg;
+    pthread_mutex_lock(&m->lock);
+    for (;;) {
+        while (m->task_head == m->task_tail && !m->stop) {
+            pthread_cond_wait(&m->more, &m->lock);
+        }
+        if (m->stop) {
+            break;
+        }
+        decode_task(m);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+/*
+Start the pool in the calling process. A forked copy has none of the
+parent's threads and may have copied the lock held, or tiles LOADING that
+no one decodes: its lock and queue are reset first. The first read after
+a fork must not race another read of the same mosaic (a DataLoader worker
+is single-threaded). If no thread starts, readers decode inline.
+*/
+static void pool_start(mosaic *m) {
+    pid_t pid = getpid();
+    long i, num_tile = (long)m->depth * m->n_rows * m->n_cols;
+    if (m->pid == pid) {
+        return;
+    }
+    if (m->pid != 0) {
+        pthread_mutex_init(&m->lock, NULL);
+        pthread_cond_init(&m->done, NULL);
+        pthread_cond_init(&m->more, NULL);
+        for (i = 0; i < num_tile; i++) {
+            if (m->tile[i].state == TILE_LOADING) {
+                m->tile[i].state = TILE_EMPTY;
+            }
+        }
+        for (i = 0; i < m->depth; i++) {
+            m->section[i].pin = 0;
+        }
+        m->task_head = m->task_tail = 0;
+        m->num_thread = 0;
+    }
+    pthread_mutex_lock(&m->lock);
+    if (m->pid != pid) {
+        m->pid = pid;
+        for (i = 0; i < m->max_thread; i++) {
+            if (pthread_create(m->thread + i, NULL, mosaic_worker, m) != 0) {
+                break;
+            }
+            m->num_thread++;
+        }
+    }
+    pthread_mutex_unlock(&m->lock);
+}
+
+int mosaic_open(mosaic *m, int depth, int n_rows, int n_cols, int tile_h,
+                int tile_w, char **path, int num_thread, int max_section) {
+    long i, num_tile = (long)depth * n_rows * n_cols;
+    memset(m, 0, sizeof(mosaic));
+    m->depth = depth;
+    m->n_rows = n_rows;
+    m->n_cols = n_cols;
+    m->tile_h = tile_h;
+    m->tile_w = tile_w;
+    m->max_thread = num_thread > 0 ? num_thread : 0;
+    m->max_section = max_section > 0 ? max_section : 1;
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->done, NULL);
+    pthread_cond_init(&m->more, NULL);
+    m->path = calloc(num_tile, sizeof(char *));
+    m->tile = calloc(num_tile, sizeof(mosaic_tile));
+    m->section = calloc(depth, sizeof(mosaic_section));
+    // a tile is queued at most once while LOADING
+    m->task_cap = num_tile > 0 ? num_tile : 1;
+    m->task = malloc(m->task_cap * sizeof(int));
+    m->thread = calloc(m->max_thread > 0 ? m->max_thread : 1, sizeof(pthread_t));
+    if (m->path == NULL || m->tile == NULL || m->section == NULL ||
+        m->task == NULL || m->thread == NULL) {
+        mosaic_close(m);
+        return -1;
+    }
+    for (i = 0; i < num_tile; i++) {
+        if (path[i] != NULL && (m->path[i] = strdup(path[i])) == NULL) {
+            mosaic_close(m);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void mosaic_close(mosaic *m) {
+    long i, num_tile = (long)m->depth * m->n_rows * m->n_cols;
+    // the threads of another process (before a fork) are not ours to join
+    if (m->pid == getpid()) {
+        pthread_mutex_lock(&m->lock);
+        m->stop = 1;
+        pthread_cond_broadcast(&m->more);
+        pthread_mutex_unlock(&m->lock);
+        for (i = 0; i < m->num_thread; i++) {
+            pthread_join(m->thread[i], NULL);
+        }
+    }
+    m->num_thread = 0;
+    for (i = 0; i < num_tile; i++) {
+        if (m->path != NULL) free(m->path[i]);
+        if (m->tile != NULL) free(m->tile[i].pix);
+    }
+    free(m->path);
+    free(m->tile);
+    free(m->section);
+    free(m->task);
+    free(m->thread);
+    m->path = NULL;
+    m->tile = NULL;
+    m->section = NULL;
+    m->task = NULL;
+    m->thread = NULL;
+    pthread_cond_destroy(&m->done);
+    pthread_cond_destroy(&m->more);
+    pthread_mutex_destroy(&m->lock);
+}
+
+/************************************************************************/
+// reads
+
+static void section_evict(mosaic *m) {
+    long i, t, per = (long)m->n_rows * m->n_cols;
+    int z, best;
+    while (m->num_resident > m->max_section) {
+        best = -1;
+        for (z = 0; z < m->depth; z++) {
+            if (m->section[z].resident && m->section[z].pin == 0 &&
+                (best < 0 || m->section[z].stamp < m->section[best].stamp)) {
+                best = z;
+            }
+        }
+        if (best < 0) {
+            return; // everything resident is being read
+        }
+        // unpinned sections have no LOADING tiles
+        for (i = 0; i < per; i++) {
+            t = best * per + i;
+            free(m->tile[t].pix);
+            m->tile[t].pix = NULL;
+            m->tile[t].state = TILE_EMPTY;
+        }
+        m->section[best].resident = 0;
+        m->num_resident--;
+        m->evicted++;
+    }
+}
+
+/*
+Read the box [st, st+sz) in zyx into out (uint8, sz). Voxels outside the
+mosaic or in missing tiles are zero.
+*/
+int mosaic_read(mosaic *m, const long st[3], const long sz[3], uint8_t *out) {
+    long z, r, c, t, y, y0, y1, x0, x1;
+    long z0, z1, r0, r1, c0, c1;
+    long per = (long)m->n_rows * m->n_cols;
+    long vol_h = (long)m->n_rows * m->tile_h, vol_w = (long)m->n_cols * m->tile_w;
+    int busy;
+    const mosaic_tile *tl;
+
+    memset(out, 0, sz[0] * sz[1] * sz[2]);
+    z0 = st[0] > 0 ? st[0] : 0;
+    z1 = st[0] + sz[0] < m->depth ? st[0] + sz[0] : m->depth;
+    y0 = st[1] > 0 ? st[1] : 0;
+    y1 = st[1] + sz[1] < vol_h ? st[1] + sz[1] : vol_h;
+    x0 = st[2] > 0 ? st[2] : 0;
+    x1 = st[2] + sz[2] < vol_w ? st[2] + sz[2] : vol_w;
+    if (z1 <= z0 || y1 <= y0 || x1 <= x0) {
+        return 0;
+    }
+    pool_start(m);
+    r0 = y0 / m->tile_h;
+    r1 = (y1 + m->tile_h - 1) / m->tile_h;
+    c0 = x0 / m->tile_w;
+    c1 = (x1 + m->tile_w - 1) / m->tile_w;
+
+    pthread_mutex_lock(&m->lock);
+    for (z = z0; z < z1; z++) {
+        m->section[z].pin++;
+        m->section[z].stamp = ++m->clock;
+        if (!m->section[z].resident) {
+            m->section[z].resident = 1;
+            m->num_resident++;
+        }
+    }
+    section_evict(m);
+    for (z = z0; z < z1; z++) {
+        for (r = r0; r < r1; r++) {
+            for (c = c0; c < c1; c++) {
+                t = z * per + r * m->n_cols + c;
+                if (m->tile[t].state == TILE_EMPTY) {
+                    m->tile[t].state = TILE_LOADING;
+                    m->task[m->task_tail % m->task_cap] = (int)t;
+                    m->task_tail++;
+                }
+            }
+        }
+    }
+    pthread_cond_broadcast(&m->more);
+    if (m->num_thread == 0) {
+        while (m->task_head != m->task_tail) {
+            decode_task(m);
+        }
+    }
+    do {
+        busy = 0;
+        for (z = z0; z < z1 && !busy; z++) {
+            for (r = r0; r < r1 && !busy; r++) {
+                for (c = c0; c < c1; c++) {
+                    if (m->tile[z * per + r * m->n_cols + c].state == TILE_LOADING) {
+                        busy = 1;
+                        break;
+                    }
+                }
+            }
+        }
+        if (busy) {
+            pthread_cond_wait(&m->done, &m->lock);
+        }
+    } while (busy);
+    pthread_mutex_unlock(&m->lock);
+
+    // pinned tiles do not change until unpinned
+    for (z = z0; z < z1; z++) {
+        for (r = r0; r < r1; r++) {
+            for (c = c0; c < c1; c++) {
+                tl = m->tile + z * per + r * m->n_cols + c;
+                if (tl->state != TILE_READY) {
+                    continue;
+                }
+                long ty0 = r * m->tile_h > y0 ? r * m->tile_h : y0;
+                long ty1 = (r + 1) * m->tile_h < y1 ? (r + 1) * m->tile_h : y1;
+                long tx0 = c * m->tile_w > x0 ? c * m->tile_w : x0;
+                long tx1 = (c + 1) * m->tile_w < x1 ? (c + 1) * m->tile_w : x1;
+                for (y = ty0; y < ty1; y++) {
+                    memcpy(out + ((z - st[0]) * sz[1] + y - st[1]) * sz[2] + tx0 - st[2],
+                           tl->pix + (y - r * m->tile_h) * m->tile_w + tx0 - c * m->tile_w,
+                           tx1 - tx0);
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&m->lock);
+    for (z = z0; z < z1; z++) {
+        m->section[z].pin--;
+    }
+    section_evict(m);
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef EM_MOSAIC_H
+#define EM_MOSAIC_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TILE_EMPTY   0
+#define TILE_LOADING 1
+#define TILE_READY   2
+#define TILE_MISSING 3     // absent or undecodable: reads as zeros
+
+typedef struct {
+    uint8_t *pix;          // tile_h x tile_w gray, NULL unless READY
+    int state;
+} mosaic_tile;
+
+typedef struct {
+    int resident;          // has (or is loading) tiles
+    int pin;               // reads in progress
+    long stamp;            // last use, for LRU eviction
+} mosaic_section;
+
+/*
+Tiled acquisition: depth sections of n_rows x n_cols tiles of 8-bit images
+(PNG or JPEG). Tiles are decoded on demand by a thread pool and kept per
+section; at most max_section sections stay resident. The pool is started
+by the first read of each process (pid), so a forked copy (DataLoader
+worker) starts its own; without threads, readers decode inline.
+*/
+typedef struct {
+    int depth, n_rows, n_cols;
+    int tile_h, tile_w;
+    char **path;           // depth x n_rows x n_cols
+    mosaic_tile *tile;
+    mosaic_section *section;
+    int max_section, num_resident;
+    long clock;
+    uint64_t decoded, failed, evicted;
+    pthread_mutex_t lock;
+    pthread_cond_t done;   // a tile left LOADING
+    pthread_cond_t more;   // a task was queued
+    int *task;             // ring of tile ids
+    long task_head, task_tail, task_cap;
+    int max_thread;        // pool size asked for
+    int num_thread;        // threads running in process pid
+    pthread_t *thread;
+    pid_t pid;             // process that started the pool, 0 before
+    int stop;
+} mosaic;
+
+int mosaic_open(mosaic *m, int depth, int n_rows, int n_cols, int tile_h,
+                int tile_w, char **path, int num_thread, int max_section);
+void mosaic_close(mosaic *m);
+int mosaic_read(mosaic *m, const long st[3], const long sz[3], uint8_t *out);
+int mosaic_decode(const char *path, int tile_h, int tile_w, uint8_t *out);
+
+#endif
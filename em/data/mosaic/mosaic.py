@@ -0,0 +1,41 @@
+"""
+Tiled acquisitions described by a JSON layout, read without conversion.
+
+{"sections": ["sec001/tile_{row}_{column}.png", ...],
+ "dimensions": {"depth": D, "n_rows": R, "n_columns": C,
+                "width": W, "height": H}}
+
+Each section is a path template; row and column are 1-based. Width and
+height are the tile size in pixels.
+"""
+
+import json
+import os
+
+from _mosaic import MosaicVolume
+
+
+def tilePaths(sections, n_rows, n_cols, root=''):
+    out = []
+    for sec in sections:
+        out.append([[os.path.join(root, sec.format(row=r+1, column=c+1))
+                     for c in range(n_cols)] for r in range(n_rows)])
+    return out
+
+
+def readmosaic(layout, num_thread=4, cache_section=8, root=''):
+    """
+    layout: JSON file name, open file or parsed dict; relative tile paths
+    are taken from the JSON file's folder (or root for a dict).
+    """
+    if isinstance(layout, basestring):
+        root = os.path.dirname(layout)
+        layout = json.load(open(layout))
+    elif hasattr(layout, 'read'):
+        root = os.path.dirname(getattr(layout, 'name', ''))
+        layout = json.load(layout)
+    dim = layout['dimensions']
+    sections = layout['sections'][:dim['depth']]
+    paths = tilePaths(sections, dim['n_rows'], dim['n_columns'], root)
+    return MosaicVolume(paths, (dim['height'], dim['width']),
+                        num_thread=num_thread, cache_section=cache_section)
@@ -0,0 +1,306 @@
+"""
+Cython wrapper of the multi-threaded patch sampler.
+"""
+
+import numpy as np
+from libc.stdlib cimport calloc, free
+from libc.string cimport memset
+from libc.stdint cimport uint64_t
+from em.data.chunk._chunk cimport chunkvol, chunkcache, ChunkVolume
+
+cdef extern from 'prefetch.h':
+    ctypedef struct vol_source:
+        int kind
+        const unsigned char *data
+        const chunkvol *cv
+        chunkcache *cc
+        long shape[4]
+        int itemsize
+    ctypedef struct sampler:
+        int num_vol
+        const vol_source *img
+        const vol_source *label
+        long img_sz[3]
+        long label_sz[3]
+        long stride[3]
+        int do_flip
+        int label_aff
+        int num_slot
+        int batch
+        unsigned char *img_slot
+        unsigned char *label_slot
+        long *pos_slot
+        long img_bytes, label_bytes
+    int SRC_ARRAY, SRC_CHUNK
+    int sampler_start(sampler *sp, int num_worker, unsigned long long seed)
+    void sampler_stop(sampler *sp)
+    int sampler_get(sampler *sp, int *slot) nogil
+    void sampler_release(sampler *sp, int slot)
+
+
+cdef int set_source(vol_source *src, vol) except -1:
+    """Fill src from a (c,)z,y,x c-contiguous ndarray or a ChunkVolume."""
+    cdef unsigned char [::1] view
+    cdef ChunkVolume cv
+    sh = tuple(vol.shape)
+    sh = (1,) * (4 - len(sh)) + sh
+    for x in range(4):
+        src.shape[x] = sh[x]
+    src.itemsize = vol.dtype.itemsize
+    if isinstance(vol, ChunkVolume):
+        cv = vol
+        src.kind = SRC_CHUNK
+        src.cv = &cv.cv
+        src.cc = &cv.cache.cc if cv.cache is not None else NULL
+    else:
+        assert vol.flags['C_CONTIGUOUS']
+        view = vol.reshape(-1).view(np.uint8)
+        src.kind = SRC_ARRAY
+        src.data = &view[0]
+    return 0
+
+
+cdef class PatchSampler:
+    """
+    Random patch sampler running in native threads.
+
+    imgs/labels: lists of c-contiguous arrays or ChunkVolumes, (c,)z,y,x
+    img_size/label_size: patch size in zyx; the label patch is centered in
+    the image patch
+    batch_size: patches per slot
+    depth: number of preallocated slots (batches in flight)
+    flip: random z/y/x flips and y/x transpose (square patches) of each patch
+    label_aff: labels are (3,z,y,x) affinities, flipped with their edges
+
+    get() hands out a slot without copying; give it back with release().
+    """
+    cdef sampler sp
+    cdef vol_source *img_src
+    cdef vol_source *label_src
+    cdef readonly object img_slot
+    cdef readonly object label_slot
+    cdef readonly object pos_slot
+    cdef object vols          # keeps the sources alive
+    cdef int running
+
+    def __cinit__(self, imgs, labels=None, img_size=(31, 204, 204),
+                  label_size=None, int num_thread=4, int depth=16,
+                  stride=(1, 1, 1), seed=0, flip=False, int batch_size=1,
+                  label_aff=False):
+        cdef unsigned char [::1] view
+        cdef long [::1] pos_view
+        cdef Py_ssize_t i
+        memset(&self.sp, 0, sizeof(sampler))
+        label_size = img_size if label_size is None else label_size
+        num_vol = len(imgs)
+        assert num_vol > 0 and (labels is None or len(labels) == num_vol)
+        assert batch_size > 0 and depth > 0
+        self.vols = (list(imgs), None if labels is None else list(labels))
+        self.img_src = <vol_source *>calloc(num_vol, sizeof(vol_source))
+        self.label_src = <vol_source *>calloc(num_vol, sizeof(vol_source))
+        if self.img_src == NULL or self.label_src == NULL:
+            raise MemoryError()
+        for i in range(num_vol):
+            set_source(self.img_src + i, imgs[i])
+            for x in range(3):
+                assert self.img_src[i].shape[1 + x] >= img_size[x], \
+                        'volume %d smaller than the patch' % i
+            if labels is not None:
+                set_source(self.label_src + i, labels[i])
+                for x in range(3):
+                    assert self.label_src[i].shape[1 + x] == self.img_src[i].shape[1 + x]
+
+        self.sp.num_vol = num_vol
+        self.sp.img = self.img_src
+        self.sp.label = self.label_src if labels is not None else NULL
+        for x in range(3):
+            self.sp.img_sz[x] = img_size[x]
+            self.sp.label_sz[x] = label_size[x]
+            self.sp.stride[x] = stride[x]
+        self.sp.do_flip = 1 if flip else 0
+        self.sp.label_aff = 1 if label_aff else 0
+        if label_aff:
+            assert labels is not None
+            for i in range(num_vol):
+                assert self.label_src[i].shape[0] == 3, 'affinity labels have 3 channels'
+        self.sp.num_slot = depth
+        self.sp.batch = batch_size
+
+        img_ch = self.img_src[0].shape[0]
+        self.img_slot = np.empty((depth, batch_size, img_ch) + tuple(img_size),
+                                 dtype=imgs[0].dtype)
+        view = self.img_slot.reshape(-1).view(np.uint8)
+        self.sp.img_slot = &view[0]
+        self.sp.img_bytes = self.img_slot[0, 0].nbytes
+        if labels is not None:
+            label_ch = self.label_src[0].shape[0]
+            self.label_slot = np.empty((depth, batch_size, label_ch) + tuple(label_size),
+                                       dtype=labels[0].dtype)
+            view = self.label_slot.reshape(-1).view(np.uint8)
+            self.sp.label_slot = &view[0]
+            self.sp.label_bytes = self.label_slot[0, 0].nbytes
+        self.pos_slot = np.zeros((depth, batch_size, 4), dtype=np.int_)
+        pos_view = self.pos_slot.reshape(-1)
+        self.sp.pos_slot = &pos_view[0]
+
+        if sampler_start(&self.sp, num_thread, seed) != 0:
+            raise RuntimeError('cannot start sampler threads')
+        self.running = 1
+
+    def __dealloc__(self):
+        if self.running:
+            sampler_stop(&self.sp)
+        free(self.img_src)
+        free(self.label_src)
+
+    def close(self):
+        if self.running:
+            sampler_stop(&self.sp)
+            self.running = 0
+
+    def get(self):
+        """
+        Wait for the next batch: returns (slot, img, label, pos). img and
+        label are (batch_size, c, z, y, x) views of the slot, valid until
+        release(slot).
+        """
+        cdef int slot, ret
+        assert self.running
+        with nogil:
+            ret = sampler_get(&self.sp, &slot)
+        if ret != 0:
+            raise IOError('patch sampler failed to read a volume')
+        label = self.label_slot[slot] if self.label_slot is not None else None
+        return slot, self.img_slot[slot], label, self.pos_slot[slot]
+
+    def release(self, int slot):
+        sampler_release(&self.sp, slot)
+
+    def batches(self, int num_batch=-1):
+        """
+        Yield [img, label, seg, pos] batches like np_collate (seg is None).
+        The arrays are views of a slot, valid until the next iteration,
+        which releases it.
+        """
+        held = -1
+        it = 0
+        try:
+            while num_batch < 0 or it < num_batch:
+                if held >= 0:
+                    self.release(held)
+                    held = -1
+                held, img, label, pos = self.get()
+                yield [img, label, None, pos]
+                it += 1
+        finally:
+            if held >= 0:
+                self.release(held)
+
+
+cdef extern from 'ring.h':
+    ctypedef struct batch_ring:
+        size_t size
+        unsigned char *data
+    int ring_create(batch_ring *r, int num_slot, long long slot_bytes)
+    void ring_destroy(batch_ring *r)
+    int ring_claim(batch_ring *r) nogil
+    void ring_publish(batch_ring *r, int s, int count)
+    int ring_acquire(batch_ring *r, int s)
+    void ring_release(batch_ring *r, int s)
+    void ring_stats(batch_ring *r, uint64_t out[4])
+
+
+cdef class BatchRing:
+    """
+    Shared-memory ring of preallocated batches, replacing np_collate.
+
+    fields: one (shape, dtype) per sample field, None for fields that are
+    always None (e.g. seg without malis)
+
+    Pass ring.collate as the DataLoader collate_fn: workers write the batch
+    into a free slot and return only its index. Iterate ring.batches(loader)
+    in the trainer to get views of the slots; a slot is given back when the
+    next batch is requested. Create the ring before the workers start.
+    """
+    cdef batch_ring r
+    cdef readonly object fields
+    cdef readonly int batch_size
+    cdef readonly int num_slot
+    cdef object views
+
+    def __cinit__(self, fields, int batch_size, int num_slot):
+        cdef unsigned char [::1] data
+        sample_bytes = [0 if f is None else int(np.prod(f[0])) * np.dtype(f[1]).itemsize
+                        for f in fields]
+        offset = [0]
+        for nb in sample_bytes:
+            offset.append(offset[-1] + (nb * batch_size + 63) // 64 * 64)
+        slot_bytes = max(offset[-1], 64)
+        if ring_create(&self.r, num_slot, slot_bytes) != 0:
+            raise MemoryError('cannot allocate batch ring of %d x %d bytes' % (num_slot, slot_bytes))
+        self.fields = list(fields)
+        self.batch_size = batch_size
+        self.num_slot = num_slot
+        data = <unsigned char[:num_slot * slot_bytes]> self.r.data
+        buf = np.asarray(data)
+        self.views = []
+        for f, nb, off in zip(fields, sample_bytes, offset):
+            if f is None:
+                self.views.append(None)
+                continue
+            dt = np.dtype(f[1])
+            shape = tuple(int(x) for x in f[0])
+            st = [dt.itemsize]
+            for x in reversed(shape[1:]):
+                st.insert(0, st[0] * x)
+            self.views.append(np.ndarray((num_slot, batch_size) + shape, dt, buf, off,
+                                         (slot_bytes, nb) + tuple(st[:len(shape)])))
+
+    def __dealloc__(self):
+        ring_destroy(&self.r)
+
+    def collate(self, batch):
+        """Worker side: copy the samples into a free slot, return its index."""
+        cdef int s
+        with nogil:
+            s = ring_claim(&self.r)
+        for b in range(len(batch)):
+            for v, x in zip(self.views, batch[b]):
+                if v is not None:
+                    v[s, b] = x
+        ring_publish(&self.r, s, len(batch))
+        return s
+
+    def acquire(self, int s):
+        """Trainer side: views of the batch in slot s, valid until release(s)."""
+        count = ring_acquire(&self.r, s)
+        if count < 0:
+            raise RuntimeError('batch slot %d is not ready' % s)
+        return [None if v is None else v[s, :count] for v in self.views]
+
+    def release(self, int s):
+        ring_release(&self.r, s)
+
+    def batches(self, loader):
+        held = -1
+        try:
+            for s in loader:
+                if held >= 0:
+                    self.release(held)
+                held = int(s)
+                yield self.acquire(held)
+        finally:
+            if held >= 0:
+                self.release(held)
+
+    def stats(self):
+        cdef uint64_t out[4]
+        ring_stats(&self.r, out)
+        return dict(claimed=out[0], released=out[1], waits=out[2], busy=out[3])
+
+
+def ring_from_sample(sample, int batch_size, int num_slot):
+    """BatchRing laid out after one sample, e.g. dataset[0]."""
+    fields = [None if x is None else (np.asarray(x).shape, np.asarray(x).dtype)
+              for x in sample]
+    return BatchRing(fields, batch_size, num_slot)
@@ -0,0 +1,372 @@
+/*
+Multi-threaded prefetching patch sampler.
+
+Slots are preallocated by the caller. Free and ready slot indices travel
+through two bounded lock-free MPMC queues, so neither the workers nor the
+trainer take a lock on the hot path; an empty queue is waited on with a
+short sleep.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "prefetch.h"
+
+/************************************************************************/
+// queue: D. Vyukov, bounded MPMC queue
+
+int mpmc_init(mpmc_queue *q, size_t capacity) {
+    size_t i, n = 1;
+    while (n < capacity) {
+        n <<= 1;
+    }
+    memset(q, 0, sizeof(mpmc_queue));
+    q->cell = malloc(n * sizeof(mpmc_cell));
+    if (q->cell == NULL) {
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        q->cell[i].seq = i;
+    }
+    q->mask = n - 1;
+    return 0;
+}
+
+void mpmc_free(mpmc_queue *q) {
+    free(q->cell);
+    q->cell = NULL;
+}
+
+// returns 1 on success, 0 if full
+int mpmc_push(mpmc_queue *q, int val) {
+    mpmc_cell *c;
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    size_t seq;
+    long dif;
+    for (;;) {
+        c = q->cell + (pos & q->mask);
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    c->val = val;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// returns 1 on success, 0 if empty
+int mpmc_pop(mpmc_queue *q, int *val) {
+    mpmc_cell *c;
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    size_t seq;
+    long dif;
+    for (;;) {
+        c = q->cell + (pos & q->mask);
+        seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return 0;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    *val = c->val;
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void backoff(int *n) {
+    struct timespec ts = {0, 0};
+    if (*n < 64) {
+        (*n)++;
+        return;
+    }
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+}
+
+/************************************************************************/
+// sources
+
+int source_crop(const vol_source *s, const long st[3], const long sz[3],
+                uint8_t *out) {
+    long ch, z, y, row, lo[3], hi[3];
+    int d, inside = 1;
+    if (s->kind == SRC_CHUNK) {
+        return chunkvol_crop_cached(s->cv, s->cc, st, sz, out);
+    }
+    for (d = 0; d < 3; d++) {
+        lo[d] = st[d] > 0 ? st[d] : 0;
+        hi[d] = st[d] + sz[d] < s->shape[1 + d] ? st[d] + sz[d] : s->shape[1 + d];
+        if (lo[d] != st[d] || hi[d] != st[d] + sz[d]) inside = 0;
+        if (hi[d] < lo[d]) hi[d] = lo[d];
+    }
+    if (!inside) {
+        memset(out, 0, s->shape[0] * sz[0] * sz[1] * sz[2] * s->itemsize);
+    }
+    row = (hi[2] - lo[2]) * s->itemsize;
+    if (row == 0) {
+        return 0;
+    }
+    for (ch = 0; ch < s->shape[0]; ch++) {
+        for (z = lo[0]; z < hi[0]; z++) {
+            for (y = lo[1]; y < hi[1]; y++) {
+                memcpy(out + (((ch * sz[0] + z - st[0]) * sz[1] + y - st[1]) * sz[2]
+                              + lo[2] - st[2]) * s->itemsize,
+                       s->data + (((ch * s->shape[1] + z) * s->shape[2] + y)
+                                  * s->shape[3] + lo[2]) * s->itemsize,
+                       row);
+            }
+        }
+    }
+    return 0;
+}
+
+/************************************************************************/
+// flip: bit 0/1/2 flip z/y/x, bit 3 transposes y and x (square patches)
+
+#define FLIP_COPY(T)                                                         \
+    do {                                                                     \
+        const T *s = (const T *)src;                                         \
+        T *d = (T *)dst;                                                     \
+        for (ch = 0; ch < nch; ch++) {                                       \
+            for (z = 0; z < sz[0]; z++) {                                    \
+                zs = (rule & 1) ? sz[0] - 1 - z : z;                         \
+                for (y = 0; y < sz[1]; y++) {                                \
+                    T *drow = d + ((ch * sz[0] + z) * sz[1] + y) * sz[2];    \
+                    if (rule & 8) {                                          \
+                        xs = (rule & 4) ? sz[2] - 1 - y : y;                 \
+                        for (x = 0; x < sz[2]; x++) {                        \
+                            ys = (rule & 2) ? sz[1] - 1 - x : x;             \
+                            drow[x] = s[((ch * sz[0] + zs) * sz[1] + ys) * sz[2] + xs]; \
+                        }                                                    \
+                    } else {                                                 \
+                        ys = (rule & 2) ? sz[1] - 1 - y : y;                 \
+                        const T *srow = s + ((ch * sz[0] + zs) * sz[1] + ys) * sz[2]; \
+                        if (rule & 4) {                                      \
+                            for (x = 0; x < sz[2]; x++) drow[x] = srow[sz[2] - 1 - x]; \
+                        } else {                                             \
+                            memcpy(drow, srow, sz[2] * sizeof(T));           \
+                        }                                                    \
+                    }                                                        \
+                }                                                            \
+            }                                                                \
+        }                                                                    \
+    } while (0)
+
+static void flip_copy(const uint8_t *src, uint8_t *dst, long nch,
+                      const long sz[3], int itemsize, int rule) {
+    long ch, z, y, x, zs, ys, xs;
+    switch (itemsize) {
+    case 1: FLIP_COPY(uint8_t); break;
+    case 2: FLIP_COPY(uint16_t); break;
+    case 4: FLIP_COPY(uint32_t); break;
+    default: FLIP_COPY(uint64_t); break;
+    }
+}
+
+/*
+Affinity channel c of voxel v is the edge between v and v - e_c (malis
+nhood -I). Flipping axis a turns the edge of v - e_a, v into that of
+v', v' + e_a: the a channel moves by one voxel, read from src, which is
+cropped one voxel larger on the high side of each axis (sz + 1). The
+y/x transpose also swaps channels 1 and 2.
+*/
+#define FLIP_COPY_AFF(T)                                                     \
+    do {                                                                     \
+        const T *s = (const T *)src;                                         \
+        T *d = (T *)dst;                                                     \
+        for (ch = 0; ch < 3; ch++) {                                         \
+            cs = (rule & 8) && ch > 0 ? 3 - ch : ch;                         \
+            for (z = 0; z < sz[0]; z++) {                                    \
+                zs = (rule & 1) ? sz[0] - 1 - z + (cs == 0) : z;             \
+                for (y = 0; y < sz[1]; y++) {                                \
+                    T *drow = d + ((ch * sz[0] + z) * sz[1] + y) * sz[2];    \
+                    for (x = 0; x < sz[2]; x++) {                            \
+                        if (rule & 8) {                                      \
+                            ys = (rule & 2) ? sz[1] - 1 - x + (cs == 1) : x; \
+                            xs = (rule & 4) ? sz[2] - 1 - y + (cs == 2) : y; \
+                        } else {                                             \
+                            ys = (rule & 2) ? sz[1] - 1 - y + (cs == 1) : y; \
+                            xs = (rule & 4) ? sz[2] - 1 - x + (cs == 2) : x; \
+                        }                                                    \
+                        drow[x] = s[((cs * (sz[0] + 1) + zs) * (sz[1] + 1) + ys) \
+                                    * (sz[2] + 1) + xs];                     \
+                    }                                                        \
+                }                                                            \
+            }                                                                \
+        }                                                                    \
+    } while (0)
+
+static void flip_copy_aff(const uint8_t *src, uint8_t *dst, const long sz[3],
+                          int itemsize, int rule) {
+    long ch, cs, z, y, x, zs, ys, xs;
+    switch (itemsize) {
+    case 1: FLIP_COPY_AFF(uint8_t); break;
+    case 2: FLIP_COPY_AFF(uint16_t); break;
+    case 4: FLIP_COPY_AFF(uint32_t); break;
+    default: FLIP_COPY_AFF(uint64_t); break;
+    }
+}
+
+/************************************************************************/
+// sampler
+
+static uint64_t rng_next(uint64_t *x) {
+    // xorshift64*
+    *x ^= *x >> 12;
+    *x ^= *x << 25;
+    *x ^= *x >> 27;
+    return *x * 0x2545F4914F6CDD1DULL;
+}
+
+static void *sampler_run(void *arg) {
+    sampler_worker *w = (sampler_worker *)arg;
+    sampler *sp = w->sp;
+    uint8_t *img_buf = malloc(sp->img_bytes);
+    long pos[3], lpos[3], lsz[3], cnt, b;
+    uint8_t *label_buf = NULL;
+    int slot, vol, d, rule, wait = 0;
+
+    // affinity labels: one more voxel on the high side of each axis
+    for (d = 0; d < 3; d++) {
+        lsz[d] = sp->label_sz[d] + (sp->label_aff ? 1 : 0);
+    }
+    if (sp->label != NULL) {
+        label_buf = malloc(sp->label[0].shape[0] * lsz[0] * lsz[1] * lsz[2] *
+                           sp->label[0].itemsize);
+    }
+    if (img_buf == NULL || (sp->label != NULL && label_buf == NULL)) {
+        __atomic_store_n(&sp->error, 1, __ATOMIC_RELEASE);
+    }
+    while (!__atomic_load_n(&sp->stop, __ATOMIC_ACQUIRE) &&
+           !__atomic_load_n(&sp->error, __ATOMIC_ACQUIRE)) {
+        if (!mpmc_pop(&sp->free_q, &slot)) {
+            backoff(&wait);
+            continue;
+        }
+        wait = 0;
+        for (b = slot * sp->batch; b < (slot + 1) * sp->batch; b++) {
+            // Random position, as in VolumeDatasetTrain.getPos.
+            vol = rng_next(&w->rng) % sp->num_vol;
+            for (d = 0; d < 3; d++) {
+                cnt = (sp->img[vol].shape[1 + d] - sp->img_sz[d]) / sp->stride[d] + 1;
+                pos[d] = (rng_next(&w->rng) % cnt) * sp->stride[d];
+                lpos[d] = pos[d] + (sp->img_sz[d] - sp->label_sz[d]) / 2;
+            }
+            rule = sp->do_flip ? (int)(rng_next(&w->rng) & 15) : 0;
+            if (sp->img_sz[1] != sp->img_sz[2] || sp->label_sz[1] != sp->label_sz[2]) {
+                rule &= 7;
+            }
+            if (source_crop(sp->img + vol, pos, sp->img_sz, img_buf) != 0) {
+                __atomic_store_n(&sp->error, 1, __ATOMIC_RELEASE);
+                break;
+            }
+            flip_copy(img_buf, sp->img_slot + b * sp->img_bytes,
+                      sp->img[vol].shape[0], sp->img_sz, sp->img[vol].itemsize, rule);
+            if (sp->label != NULL) {
+                if (source_crop(sp->label + vol, lpos, lsz, label_buf) != 0) {
+                    __atomic_store_n(&sp->error, 1, __ATOMIC_RELEASE);
+                    break;
+                }
+                if (sp->label_aff) {
+                    flip_copy_aff(label_buf, sp->label_slot + b * sp->label_bytes,
+                                  sp->label_sz, sp->label[vol].itemsize, rule);
+                } else {
+                    flip_copy(label_buf, sp->label_slot + b * sp->label_bytes,
+                              sp->label[vol].shape[0], sp->label_sz,
+                              sp->label[vol].itemsize, rule);
+                }
+            }
+            sp->pos_slot[4 * b] = vol;
+            for (d = 0; d < 3; d++) {
+                sp->pos_slot[4 * b + 1 + d] = pos[d];
+            }
+        }
+        if (b < (slot + 1) * sp->batch) {
+            break;
+        }
+        mpmc_push(&sp->ready_q, slot);
+    }
+    free(img_buf);
+    free(label_buf);
+    return NULL;
+}
+
+int sampler_start(sampler *sp, int num_worker, uint64_t seed) {
+    int i;
+    sp->stop = 0;
+    sp->error = 0;
+    if (mpmc_init(&sp->free_q, sp->num_slot) != 0 ||
+        mpmc_init(&sp->ready_q, sp->num_slot) != 0) {
+        return -1;
+    }
+    for (i = 0; i < sp->num_slot; i++) {
+        mpmc_push(&sp->free_q, i);
+    }
+    sp->worker = calloc(num_worker, sizeof(sampler_worker));
+    if (sp->worker == NULL) {
+        return -1;
+    }
+    sp->num_worker = 0;
+    for (i = 0; i < num_worker; i++) {
+        sp->worker[i].sp = sp;
+        sp->worker[i].id = i;
+        sp->worker[i].rng = (seed + 1) * 0x9E3779B97F4A7C15ULL + i * 0xBF58476D1CE4E5B9ULL;
+        if (sp->worker[i].rng == 0) {
+            sp->worker[i].rng = 1;
+        }
+        if (pthread_create(&sp->worker[i].thread, NULL, sampler_run, sp->worker + i) != 0) {
+            sampler_stop(sp);
+            return -1;
+        }
+        sp->num_worker++;
+    }
+    return 0;
+}
+
+void sampler_stop(sampler *sp) {
+    int i;
+    __atomic_store_n(&sp->stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < sp->num_worker; i++) {
+        pthread_join(sp->worker[i].thread, NULL);
+    }
+    sp->num_worker = 0;
+    free(sp->worker);
+    sp->worker = NULL;
+    mpmc_free(&sp->free_q);
+    mpmc_free(&sp->ready_q);
+}
+
+// wait for a ready slot; returns -1 if the workers failed
+int sampler_get(sampler *sp, int *slot) {
+    int wait = 0;
+    while (!mpmc_pop(&sp->ready_q, slot)) {
+        if (__atomic_load_n(&sp->error, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        backoff(&wait);
+    }
+    return 0;
+}
+
+void sampler_release(sampler *sp, int slot) {
+    mpmc_push(&sp->free_q, slot);
+}
@@ -0,0 +1,94 @@
+#ifndef EM_PREFETCH_H
+#define EM_PREFETCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chunk.h"
+#include "chunkcache.h"
+
+#define CACHE_LINE 64
+
+// bounded lock-free multi-producer multi-consumer queue of ints (Vyukov)
+typedef struct {
+    size_t seq;
+    int val;
+} mpmc_cell;
+
+typedef struct {
+    mpmc_cell *cell;
+    size_t mask;
+    char pad0[CACHE_LINE];
+    size_t head;           // next push
+    char pad1[CACHE_LINE];
+    size_t tail;           // next pop
+    char pad2[CACHE_LINE];
+} mpmc_queue;
+
+int mpmc_init(mpmc_queue *q, size_t capacity);
+void mpmc_free(mpmc_queue *q);
+int mpmc_push(mpmc_queue *q, int val);
+int mpmc_pop(mpmc_queue *q, int *val);
+
+#define SRC_ARRAY 0
+#define SRC_CHUNK 1
+
+// a volume to crop from: c-contiguous (c,z,y,x) array or chunked volume;
+// out-of-volume voxels of a crop are 0
+typedef struct {
+    int kind;
+    const uint8_t *data;
+    const chunkvol *cv;
+    chunkcache *cc;
+    long shape[4];
+    int itemsize;
+} vol_source;
+
+int source_crop(const vol_source *s, const long st[3], const long sz[3],
+                uint8_t *out);
+
+typedef struct sampler sampler;
+
+typedef struct {
+    sampler *sp;
+    int id;
+    pthread_t thread;
+    uint64_t rng;
+} sampler_worker;
+
+/*
+Patch sampler: worker threads take a free slot, crop batch random patches
+of image (and label) into it, apply a random flip/xy-transpose to each and
+publish the slot on the ready queue. Affinity labels are flipped with their
+edges: see flip_copy_aff.
+*/
+struct sampler {
+    int num_vol;
+    const vol_source *img;
+    const vol_source *label;   // NULL if no label
+    long img_sz[3];
+    long label_sz[3];
+    long stride[3];
+    int do_flip;
+    int label_aff;             // label is a (3,z,y,x) affinity, see flip_copy_aff
+    int num_slot;
+    int batch;                 // patches per slot
+    uint8_t *img_slot;         // num_slot x batch x img_bytes
+    uint8_t *label_slot;
+    long *pos_slot;            // num_slot x batch x 4 (vol, z, y, x)
+    long img_bytes, label_bytes;   // one patch
+    mpmc_queue free_q;
+    mpmc_queue ready_q;
+    int num_worker;
+    sampler_worker *worker;
+    int stop;
+    int error;
+};
+
+int sampler_start(sampler *sp, int num_worker, uint64_t seed);
+void sampler_stop(sampler *sp);
+int sampler_get(sampler *sp, int *slot);
+void sampler_release(sampler *sp, int slot);
+
+#endif
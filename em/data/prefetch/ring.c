@@ -0,0 +1,106 @@
+/*
+Shared-memory ring of batch slots.
+
+DataLoader workers write their batch straight into a free slot and only
+send the slot index through the pipe; the trainer reads the slot in place.
+Each slot moves FREE -> FILLING (worker) -> READY -> IN_USE (trainer) ->
+FREE through atomic compare-and-swap, so no lock is shared between
+processes.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "ring.h"
+
+static size_t ring_align(size_t n) {
+    return (n + RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN;
+}
+
+int ring_create(batch_ring *r, int num_slot, int64_t slot_bytes) {
+    size_t off_slot = ring_align(sizeof(ring_header));
+    size_t off_data = off_slot + ring_align(num_slot * sizeof(ring_slot));
+    memset(r, 0, sizeof(batch_ring));
+    if (num_slot <= 0 || slot_bytes <= 0) {
+        return -1;
+    }
+    slot_bytes = ring_align(slot_bytes);
+    r->size = off_data + (size_t)num_slot * slot_bytes;
+    r->base = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (r->base == MAP_FAILED) {
+        r->base = NULL;
+        return -1;
+    }
+    r->hdr = (ring_header *)r->base;
+    r->slot = (ring_slot *)((uint8_t *)r->base + off_slot);
+    r->data = (uint8_t *)r->base + off_data;
+    r->hdr->num_slot = num_slot;
+    r->hdr->slot_bytes = slot_bytes;
+    return 0;
+}
+
+void ring_destroy(batch_ring *r) {
+    if (r->base != NULL) {
+        munmap(r->base, r->size);
+    }
+    r->base = NULL;
+}
+
+// worker: take any free slot, waiting for the trainer if none is left
+int ring_claim(batch_ring *r) {
+    struct timespec ts = {0, 100000};
+    int s, expect, waited = 0;
+    for (;;) {
+        for (s = 0; s < r->hdr->num_slot; s++) {
+            expect = RING_FREE;
+            if (__atomic_compare_exchange_n(&r->slot[s].state, &expect, RING_FILLING, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                __atomic_fetch_add(&r->hdr->claimed, 1, __ATOMIC_RELAXED);
+                return s;
+            }
+        }
+        if (!waited) {
+            __atomic_fetch_add(&r->hdr->waits, 1, __ATOMIC_RELAXED);
+            waited = 1;
+        }
+        nanosleep(&ts, NULL);
+    }
+}
+
+// worker: the slot data is complete
+void ring_publish(batch_ring *r, int s, int count) {
+    r->slot[s].count = count;
+    __atomic_store_n(&r->slot[s].state, RING_READY, __ATOMIC_RELEASE);
+}
+
+// trainer: take a published slot; returns its sample count, -1 if not ready
+int ring_acquire(batch_ring *r, int s) {
+    int expect = RING_READY;
+    if (!__atomic_compare_exchange_n(&r->slot[s].state, &expect, RING_IN_USE, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    return r->slot[s].count;
+}
+
+// trainer: done with the slot views
+void ring_release(batch_ring *r, int s) {
+    __atomic_fetch_add(&r->slot[s].gen, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&r->hdr->released, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->slot[s].state, RING_FREE, __ATOMIC_RELEASE);
+}
+
+void ring_stats(batch_ring *r, uint64_t out[4]) {
+    int s;
+    out[0] = __atomic_load_n(&r->hdr->claimed, __ATOMIC_RELAXED);
+    out[1] = __atomic_load_n(&r->hdr->released, __ATOMIC_RELAXED);
+    out[2] = __atomic_load_n(&r->hdr->waits, __ATOMIC_RELAXED);
+    out[3] = 0;
+    for (s = 0; s < r->hdr->num_slot; s++) {
+        out[3] += __atomic_load_n(&r->slot[s].state, __ATOMIC_RELAXED) != RING_FREE;
+    }
+}
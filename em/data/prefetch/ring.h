@@ -0,0 +1,50 @@
+#ifndef EM_RING_H
+#define EM_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_FREE    0
+#define RING_FILLING 1
+#define RING_READY   2
+#define RING_IN_USE  3
+
+#define RING_ALIGN 64
+
+typedef struct {
+    int32_t state;         // RING_*
+    int32_t count;         // samples written
+    uint64_t gen;          // times the slot was released
+    char pad[RING_ALIGN - 16];
+} ring_slot;
+
+typedef struct {
+    int32_t num_slot;
+    int64_t slot_bytes;
+    uint64_t claimed;      // batches written
+    uint64_t released;     // batches consumed
+    uint64_t waits;        // claims that found no free slot
+} ring_header;
+
+/*
+Ring of preallocated batch slots in one anonymous shared mapping: header,
+num_slot slot records, then the slot data (RING_ALIGN aligned). Create it
+before forking the workers that fill it.
+*/
+typedef struct {
+    void *base;
+    size_t size;
+    ring_header *hdr;
+    ring_slot *slot;
+    uint8_t *data;
+} batch_ring;
+
+int ring_create(batch_ring *r, int num_slot, int64_t slot_bytes);
+void ring_destroy(batch_ring *r);
+int ring_claim(batch_ring *r);
+void ring_publish(batch_ring *r, int s, int count);
+int ring_acquire(batch_ring *r, int s);
+void ring_release(batch_ring *r, int s);
+void ring_stats(batch_ring *r, uint64_t out[4]);
+
+#endif
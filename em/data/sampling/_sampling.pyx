@@ -0,0 +1,58 @@
+"""
+Cython wrapper of the sampling index kernels.
+"""
+
+import numpy as np
+from libc.stdint cimport uint64_t, int64_t
+
+cdef extern from 'sampling.h':
+    void boundary_count_seg(const uint64_t *seg, const uint64_t *prev,
+                            long nz, long ny, long nx, long z0, const long cell[3],
+                            const long grid[3], unsigned int *count) nogil
+    void boundary_count_aff(const float *aff, long nc, long nz, long ny, long nx,
+                            long z0, float thres, const long cell[3],
+                            const long grid[3], unsigned int *count) nogil
+    int alias_build(const double *prob, long n, double *q, int64_t *alias)
+
+
+def count_boundary(slab, prev, long z0, cell, count, float thres=0.5):
+    """
+    Add the boundary voxels of a label slab to count (grid, uint32).
+    slab: (z,y,x) segmentation (cast to uint64) or (c,z,y,x) float32 affinity
+    prev: last slice of the previous segmentation slab, or None
+    """
+    cdef long cell_c[3]
+    cdef long grid_c[3]
+    cdef unsigned int [:, :, ::1] cnt = count
+    cdef uint64_t [:, :, ::1] seg
+    cdef uint64_t [:, ::1] prev_v
+    cdef const uint64_t *prev_p = NULL
+    cdef float [:, :, :, ::1] aff
+    for x in range(3):
+        cell_c[x] = cell[x]
+        grid_c[x] = count.shape[x]
+    if slab.ndim == 3:
+        seg = np.ascontiguousarray(slab, dtype=np.uint64)
+        if prev is not None:
+            prev_v = np.ascontiguousarray(prev, dtype=np.uint64)
+            prev_p = &prev_v[0, 0]
+        with nogil:
+            boundary_count_seg(&seg[0, 0, 0], prev_p, seg.shape[0], seg.shape[1],
+                               seg.shape[2], z0, cell_c, grid_c, &cnt[0, 0, 0])
+    else:
+        aff = np.ascontiguousarray(slab, dtype=np.float32)
+        with nogil:
+            boundary_count_aff(&aff[0, 0, 0, 0], aff.shape[0], aff.shape[1], aff.shape[2],
+                               aff.shape[3], z0, thres, cell_c, grid_c, &cnt[0, 0, 0])
+
+
+def alias_table(prob):
+    """Vose's alias table (q, alias) of a 1-D probability vector."""
+    cdef double [::1] p = np.ascontiguousarray(prob, dtype=np.float64)
+    q = np.empty(p.shape[0], dtype=np.float64)
+    alias = np.empty(p.shape[0], dtype=np.int64)
+    cdef double [::1] q_v = q
+    cdef int64_t [::1] a_v = alias
+    if alias_build(&p[0], p.shape[0], &q_v[0], &a_v[0]) != 0:
+        raise MemoryError()
+    return q, alias
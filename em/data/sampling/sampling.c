@@ -0,0 +1,100 @@
+/*
+Importance sampling index of training patch positions.
+
+The label volume is streamed in z slabs; each coarse grid cell counts its
+boundary voxels (segment borders, background, or affinity below a
+threshold). Positions are then drawn cell-first with Vose's alias method,
+O(1) per draw.
+*/
+
+#include <stdlib.h>
+
+#include "sampling.h"
+
+/*
+Count boundary voxels of a uint64 segmentation slab (nz, ny, nx) starting
+at z0. prev is the slice just above the slab (NULL for the first slab).
+A voxel is boundary if it is background or differs from its -x, -y or -z
+neighbour.
+*/
+void boundary_count_seg(const uint64_t *seg, const uint64_t *prev, long nz,
+                        long ny, long nx, long z0, const long cell[3],
+                        const long grid[3], uint32_t *count) {
+    long z, y, x, gz, gy, i;
+    const uint64_t *s, *up, *above;
+    uint32_t *crow;
+    for (z = 0; z < nz; z++) {
+        gz = (z0 + z) / cell[0];
+        above = z > 0 ? seg + (z - 1) * ny * nx : prev;
+        for (y = 0; y < ny; y++) {
+            gy = y / cell[1];
+            i = (z * ny + y) * nx;
+            s = seg + i;
+            up = y > 0 ? s - nx : NULL;
+            crow = count + (gz * grid[1] + gy) * grid[2];
+            for (x = 0; x < nx; x++) {
+                if (s[x] == 0 || (x > 0 && s[x] != s[x - 1]) ||
+                    (up != NULL && s[x] != up[x]) ||
+                    (above != NULL && s[x] != above[y * nx + x])) {
+                    crow[x / cell[2]]++;
+                }
+            }
+        }
+    }
+}
+
+// same for an affinity slab (nc, nz, ny, nx): boundary if any channel < thres
+void boundary_count_aff(const float *aff, long nc, long nz, long ny, long nx,
+                        long z0, float thres, const long cell[3],
+                        const long grid[3], uint32_t *count) {
+    long c, z, y, x, n = nz * ny * nx;
+    uint32_t *crow;
+    for (z = 0; z < nz; z++) {
+        for (y = 0; y < ny; y++) {
+            crow = count + (((z0 + z) / cell[0]) * grid[1] + y / cell[1]) * grid[2];
+            for (x = 0; x < nx; x++) {
+                for (c = 0; c < nc; c++) {
+                    if (aff[c * n + (z * ny + y) * nx + x] < thres) {
+                        crow[x / cell[2]]++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*
+Vose's alias table for prob (n entries, sum 1): draw i uniform in [0,n),
+u uniform in [0,1); take i if u < q[i], else alias[i].
+*/
+int alias_build(const double *prob, long n, double *q, int64_t *alias) {
+    long i, ns = 0, nl = 0, s, l;
+    long *small = malloc(n * sizeof(long));
+    long *large = malloc(n * sizeof(long));
+    if (small == NULL || large == NULL) {
+        free(small);
+        free(large);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        q[i] = prob[i] * n;
+        alias[i] = i;
+        if (q[i] < 1.0) small[ns++] = i;
+        else large[nl++] = i;
+    }
+    while (ns > 0 && nl > 0) {
+        s = small[--ns];
+        l = large[--nl];
+        alias[s] = l;
+        q[l] -= 1.0 - q[s];
+        if (q[l] < 1.0) small[ns++] = l;
+        else large[nl++] = l;
+    }
+    // leftovers are 1 up to rounding
+    while (nl > 0) q[large[--nl]] = 1.0;
+    while (ns > 0) q[small[--ns]] = 1.0;
+    free(small);
+    free(large);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef EM_SAMPLING_H
+#define EM_SAMPLING_H
+
+#include <stdint.h>
+
+void boundary_count_seg(const uint64_t *seg, const uint64_t *prev, long nz,
+                        long ny, long nx, long z0, const long cell[3],
+                        const long grid[3], uint32_t *count);
+void boundary_count_aff(const float *aff, long nc, long nz, long ny, long nx,
+                        long z0, float thres, const long cell[3],
+                        const long grid[3], uint32_t *count);
+int alias_build(const double *prob, long n, double *q, int64_t *alias);
+
+#endif
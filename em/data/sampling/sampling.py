@@ -0,0 +1,113 @@
+"""
+Importance sampling of training patch positions.
+
+A coarse grid over the label volume scores each cell by its density of
+boundary voxels; positions are drawn cell-first (alias method, O(1)) with
+a uniform share alpha so the easy interior is still visited. The index is
+built in one streaming pass over the label and saved next to it.
+"""
+
+import os
+import zlib
+import numpy as np
+
+from _sampling import count_boundary, alias_table
+from ..io import cropVolume
+
+
+class SampleIndex(object):
+    def __init__(self, score, cell, alpha=0.2, key=''):
+        self.score = np.asarray(score, dtype=np.float32)  # (gz,gy,gx) boundary density
+        self.cell = np.array(cell, dtype=int)
+        self.key = key  # labelKey of the label it was built from
+        self.setAlpha(alpha)
+
+    def setAlpha(self, alpha):
+        self.alpha = alpha
+        s = self.score.reshape(-1).astype(np.float64)
+        p = s/s.sum() if s.sum() > 0 else np.full(s.size, 1./s.size)
+        p = (1-alpha)*p + alpha/s.size
+        self.q, self.alias = alias_table(p)
+
+    def sampleCell(self):
+        n = self.q.size
+        u = np.random.random()*n
+        i = int(u)
+        if u-i >= self.q[i]:
+            i = self.alias[i]
+        return np.unravel_index(i, self.score.shape)
+
+    def sample(self, img_size, vol_size, stride=(1,1,1)):
+        # patch start: a random voxel of the drawn cell at the patch center
+        cz = self.sampleCell()
+        pos = [0,0,0]
+        for i in range(3):
+            c = cz[i]*self.cell[i] + np.random.randint(self.cell[i])
+            p = min(max(c - vol_size[i]//2, 0), img_size[i]-vol_size[i])
+            pos[i] = int(p//stride[i]*stride[i])
+        return pos
+
+    def save(self, filename):
+        np.savez(filename, score=self.score, cell=self.cell, key=np.array(self.key))
+
+    @staticmethod
+    def load(filename, alpha=0.2):
+        d = np.load(filename)
+        key = str(d['key']) if 'key' in d.files else ''
+        return SampleIndex(d['score'], d['cell'], alpha, key)
+
+
+def indexName(label_name):
+    return label_name + '.sidx.npz'
+
+
+def labelKey(label_name, label):
+    # identifies the label an index was built from: shape, file mtime/size
+    # and a checksum of a sparse voxel sample (catches crops and edits)
+    sh = label.shape
+    key = 'shape=%s' % ','.join(str(x) for x in sh)
+    if os.path.exists(label_name):
+        st = os.stat(label_name)
+        key += ' mtime=%d size=%d' % (int(st.st_mtime*1e6), st.st_size)
+    crc = 0
+    for z in sorted(set([0, sh[-3]//2, sh[-3]-1])):
+        sl = np.asarray(cropVolume(label, [1, sh[-2], sh[-1]], [z,0,0]))
+        crc = zlib.crc32(np.ascontiguousarray(sl[..., ::7, ::7]).tobytes(), crc)
+    return key + ' crc=%08x' % (crc & 0xffffffff)
+
+
+def buildIndex(label, cell=(4,32,32), slab=16, thres=0.5, alpha=0.2):
+    # label: (z,y,x) segmentation or (c,z,y,x) affinity, array/h5 dataset/chunked volume
+    sh = label.shape[-3:]
+    grid = [(sh[i]+cell[i]-1)//cell[i] for i in range(3)]
+    count = np.zeros(grid, dtype=np.uint32)
+    slab = max(slab//cell[0], 1)*cell[0]
+    prev = None
+    for z in range(0, sh[0], slab):
+        sl = np.asarray(cropVolume(label, [min(slab, sh[0]-z), sh[1], sh[2]], [z,0,0]))
+        count_boundary(sl, prev, z, cell, count, thres)
+        if sl.ndim == 3:
+            prev = sl[-1]
+    vox = np.ones(grid)
+    for i in range(3):
+        ext = np.minimum(cell[i], sh[i]-np.arange(grid[i])*cell[i])
+        vox *= ext.reshape([-1 if j == i else 1 for j in range(3)])
+    return SampleIndex(count/vox, cell, alpha)
+
+
+def getIndex(label_name, label=None, cell=(4,32,32), alpha=0.2):
+    # load the index stored next to the label file, building it if needed
+    # (or if it does not match the label, e.g. after a crop)
+    if label is None:
+        import h5py
+        label = h5py.File(label_name, 'r')['main']
+    fn = indexName(label_name)
+    key = labelKey(label_name, label)
+    if os.path.exists(fn):
+        index = SampleIndex.load(fn, alpha)
+        if index.key == key and tuple(index.cell) == tuple(cell):
+            return index
+    index = buildIndex(label, cell, alpha=alpha)
+    index.key = key
+    index.save(fn)
+    return index
@@ -0,0 +1,114 @@
+"""
+Cython wrapper of the native stitching kernels.
+"""
+
+import numpy as np
+
+cdef extern from 'stitch.h':
+    int blend_accumulate(float *pred, float *pred_ww, const long shape[4], int ww_nc,
+                         const float *y_pred, const long psz[3], const long *pos,
+                         long num, const float *ww, int num_thread) nogil
+
+
+def blend_patches(pred, y_pred, pred_sz, pos, pred_ww=None, ww=None, int num_thread=1):
+    """
+    In-place setPred: pred += y_pred*ww and pred_ww += ww at pos, or
+    pred = y_pred if pred_ww is None.
+    pred, pred_ww: (c,z,y,x) float32 c-contiguous (pred_ww may have 1 channel)
+    y_pred: (n,c)+pred_sz; pos: (n,4) dataset,z,y,x
+    """
+    cdef float [:, :, :, ::1] pred_view = pred
+    cdef float [:, :, :, ::1] pww_view
+    cdef float [:, :, :, :, ::1] y_view
+    cdef float [:, :, ::1] ww_view
+    cdef long [:, ::1] pos_view
+    cdef long shape[4]
+    cdef long psz[3]
+    cdef float *pww_p = NULL
+    cdef float *ww_p = NULL
+    cdef int ww_nc = 0
+    cdef long num = y_pred.shape[0]
+    cdef int ret
+    if num == 0:
+        return
+    y_view = np.ascontiguousarray(y_pred, dtype=np.float32)
+    pos_view = np.ascontiguousarray(pos, dtype=np.int_)
+    for x in range(4):
+        shape[x] = pred.shape[x]
+    for x in range(3):
+        psz[x] = pred_sz[x]
+        assert y_view.shape[2 + x] == psz[x]
+    assert y_view.shape[1] == shape[0] and pos_view.shape[0] == num
+    if pred_ww is not None:
+        pww_view = pred_ww
+        ww_view = np.ascontiguousarray(ww, dtype=np.float32)
+        assert pred_ww.shape[1:] == pred.shape[1:]
+        pww_p = &pww_view[0, 0, 0, 0]
+        ww_p = &ww_view[0, 0, 0]
+        ww_nc = pred_ww.shape[0]
+    with nogil:
+        ret = blend_accumulate(&pred_view[0, 0, 0, 0], pww_p, shape, ww_nc, &y_view[0, 0, 0, 0, 0],
+                               psz, &pos_view[0, 0], num, ww_p, num_thread)
+    if ret != 0:
+        raise MemoryError('cannot start blend threads')
+
+
+cdef extern from 'stitch.h':
+    int blend_accumulate_sep(float *pred, const long shape[4], const float *y_pred,
+                             const long psz[3], const long *pos, long num,
+                             const float *wz, const float *wy, const float *wx,
+                             int num_thread) nogil
+    void blend_normalize(float *pred, const long shape[4], long nz, long z0,
+                         const float *inv_z, const float *inv_y, const float *inv_x) nogil
+
+
+def blend_patches_sep(pred, y_pred, pred_sz, pos, ww_sep, int num_thread=1):
+    """
+    pred += y_pred * wz[z]*wy[y]*wx[x] at pos; ww_sep: (wz, wy, wx).
+    No weight volume: normalize finished planes with normalize_sep.
+    """
+    cdef float [:, :, :, ::1] pred_view = pred
+    cdef float [:, :, :, :, ::1] y_view
+    cdef long [:, ::1] pos_view
+    cdef float [::1] wz = np.ascontiguousarray(ww_sep[0], dtype=np.float32)
+    cdef float [::1] wy = np.ascontiguousarray(ww_sep[1], dtype=np.float32)
+    cdef float [::1] wx = np.ascontiguousarray(ww_sep[2], dtype=np.float32)
+    cdef long shape[4]
+    cdef long psz[3]
+    cdef long num = y_pred.shape[0]
+    cdef int ret
+    if num == 0:
+        return
+    y_view = np.ascontiguousarray(y_pred, dtype=np.float32)
+    pos_view = np.ascontiguousarray(pos, dtype=np.int_)
+    for x in range(4):
+        shape[x] = pred.shape[x]
+    for x in range(3):
+        psz[x] = pred_sz[x]
+        assert y_view.shape[2 + x] == psz[x] and len(ww_sep[x]) == psz[x]
+    assert y_view.shape[1] == shape[0] and pos_view.shape[0] == num
+    with nogil:
+        ret = blend_accumulate_sep(&pred_view[0, 0, 0, 0], shape, &y_view[0, 0, 0, 0, 0], psz,
+                                   &pos_view[0, 0], num, &wz[0], &wy[0], &wx[0], num_thread)
+    if ret != 0:
+        raise MemoryError('cannot start blend threads')
+
+
+def normalize_sep(pred, long nz, long z0, inv_sep):
+    """
+    In place: pred[:, :nz] *= inv_z[z0+z]*inv_y[y]*inv_x[x]; pred (c,z,y,x)
+    holds output planes from z0, inv_sep = (inv_z, inv_y, inv_x).
+    """
+    cdef float [:, :, :, ::1] pred_view = pred
+    cdef float [::1] inv_z = np.ascontiguousarray(inv_sep[0], dtype=np.float32)
+    cdef float [::1] inv_y = np.ascontiguousarray(inv_sep[1], dtype=np.float32)
+    cdef float [::1] inv_x = np.ascontiguousarray(inv_sep[2], dtype=np.float32)
+    cdef long shape[4]
+    for x in range(4):
+        shape[x] = pred.shape[x]
+    assert 0 <= nz <= shape[1] and z0 + nz <= inv_z.shape[0]
+    assert inv_y.shape[0] == shape[2] and inv_x.shape[0] == shape[3]
+    if nz == 0:
+        return
+    with nogil:
+        blend_normalize(&pred_view[0, 0, 0, 0], shape, nz, z0, &inv_z[0], &inv_y[0], &inv_x[0])
@@ -0,0 +1,219 @@
+/*
+Test-time stitching: blending patch predictions into the output volume.
+
+Patches overlap, so threads never split patches: each thread owns a band of
+output z-planes and adds the part of every patch falling into it. Writes
+are disjoint whatever the overlap, and no lock or atomic is needed.
+
+With separable weights w(z,y,x) = wz[z]*wy[y]*wx[x] and patches on a full
+grid of starts, the weight sum is separable too, S = Sz[z]*Sy[y]*Sx[x]: no
+pred_ww is kept and finished blocks are scaled by 1/S (blend_normalize).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stitch.h"
+
+typedef struct {
+    float *pred, *pred_ww;     // (c, z, y, x), pred_ww (ww_nc, z, y, x)
+    const long *shape;
+    int ww_nc;
+    const float *y_pred;       // (num, c, pz, py, px)
+    const long *psz;
+    const long *pos;           // (num, 4): dataset, z, y, x
+    long num;
+    const float *ww;           // (pz, py, px), NULL: assign
+    const float *wz, *wy, *wx; // separable weights, used if ww is NULL
+    long z0, z1;               // owned output planes
+} blend_job;
+
+/************************************************************************/
+// rows: plain loops over restrict pointers, vectorized by the compiler
+
+static void row_copy(float *restrict p, const float *restrict y, long n) {
+    memcpy(p, y, n * sizeof(float));
+}
+
+static void row_fma(float *restrict p, const float *restrict y,
+                    const float *restrict w, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        p[i] += y[i] * w[i];
+    }
+}
+
+static void row_add(float *restrict p, const float *restrict w, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        p[i] += w[i];
+    }
+}
+
+static void row_fma_scaled(float *restrict p, const float *restrict y,
+                           const float *restrict w, float s, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        p[i] += s * y[i] * w[i];
+    }
+}
+
+static void row_scale(float *restrict p, const float *restrict w, float s, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        p[i] *= s * w[i];
+    }
+}
+
+static void *blend_run(void *arg) {
+    blend_job *j = (blend_job *)arg;
+    long nc = j->shape[0], sy = j->shape[2], sx = j->shape[3];
+    long pz = j->psz[0], py = j->psz[1], px = j->psz[2];
+    long b, ch, z, y, za, zb, ny, nx;
+    const long *pp;
+    const float *yp, *wrow;
+    float *prow;
+
+    for (b = 0; b < j->num; b++) {
+        pp = j->pos + 4 * b;
+        za = pp[1] > j->z0 ? pp[1] : j->z0;
+        zb = pp[1] + pz < j->z1 ? pp[1] + pz : j->z1;
+        if (za >= zb) {
+            continue;
+        }
+        ny = sy - pp[2] < py ? sy - pp[2] : py;
+        nx = sx - pp[3] < px ? sx - pp[3] : px;
+        for (ch = 0; ch < nc; ch++) {
+            for (z = za; z < zb; z++) {
+                for (y = 0; y < ny; y++) {
+                    yp = j->y_pred + (((b * nc + ch) * pz + z - pp[1]) * py + y) * px;
+                    prow = j->pred + ((ch * j->shape[1] + z) * sy + pp[2] + y) * sx + pp[3];
+                    if (j->wz != NULL) {
+                        row_fma_scaled(prow, yp, j->wx, j->wz[z - pp[1]] * j->wy[y], nx);
+                        continue;
+                    }
+                    if (j->ww == NULL) {
+                        row_copy(prow, yp, nx);
+                        continue;
+                    }
+                    wrow = j->ww + ((z - pp[1]) * py + y) * px;
+                    row_fma(prow, yp, wrow, nx);
+                    if (j->pred_ww != NULL && ch < j->ww_nc) {
+                        row_add(j->pred_ww + ((ch * j->shape[1] + z) * sy + pp[2] + y) * sx + pp[3],
+                                wrow, nx);
+                    }
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// split the output planes covered by the patches over num_thread copies of tmpl
+static int run_bands(const blend_job *tmpl, int num_thread) {
+    blend_job *jobs;
+    pthread_t *th;
+    long zmin = tmpl->shape[1], zmax = 0, step, b, t;
+    int started = 0;
+
+    for (b = 0; b < tmpl->num; b++) {
+        if (tmpl->pos[4 * b + 1] < zmin) zmin = tmpl->pos[4 * b + 1];
+        if (tmpl->pos[4 * b + 1] + tmpl->psz[0] > zmax) zmax = tmpl->pos[4 * b + 1] + tmpl->psz[0];
+    }
+    if (zmax > tmpl->shape[1]) zmax = tmpl->shape[1];
+    if (zmin >= zmax) {
+        return 0;
+    }
+    if (num_thread < 1) num_thread = 1;
+    if (num_thread > zmax - zmin) num_thread = (int)(zmax - zmin);
+    jobs = malloc(num_thread * sizeof(blend_job));
+    th = malloc(num_thread * sizeof(pthread_t));
+    if (jobs == NULL || th == NULL) {
+        free(jobs);
+        free(th);
+        return -1;
+    }
+    step = (zmax - zmin + num_thread - 1) / num_thread;
+    for (t = 0; t < num_thread; t++) {
+        jobs[t] = *tmpl;
+        jobs[t].z0 = zmin + t * step < zmax ? zmin + t * step : zmax;
+        jobs[t].z1 = zmin + (t + 1) * step < zmax ? zmin + (t + 1) * step : zmax;
+    }
+    // the calling thread takes the first band
+    for (t = 1; t < num_thread; t++) {
+        if (pthread_create(th + t, NULL, blend_run, jobs + t) != 0) {
+            break;
+        }
+        started++;
+    }
+    blend_run(jobs);
+    for (t = 1; t <= started; t++) {
+        pthread_join(th[t], NULL);
+    }
+    for (t = started + 1; t < num_thread; t++) {
+        blend_run(jobs + t);
+    }
+    free(jobs);
+    free(th);
+    return 0;
+}
+
+/*
+Add num patches y_pred at pos into pred: pred += y_pred*ww, pred_ww += ww
+(the first ww_nc channels of pred_ww), or pred = y_pred if ww is NULL.
+*/
+int blend_accumulate(float *pred, float *pred_ww, const long shape[4], int ww_nc,
+                     const float *y_pred, const long psz[3], const long *pos,
+                     long num, const float *ww, int num_thread) {
+    blend_job j;
+    memset(&j, 0, sizeof(j));
+    j.pred = pred;
+    j.pred_ww = pred_ww;
+    j.shape = shape;
+    j.ww_nc = ww_nc;
+    j.y_pred = y_pred;
+    j.psz = psz;
+    j.pos = pos;
+    j.num = num;
+    j.ww = ww;
+    return run_bands(&j, num_thread);
+}
+
+// pred += y_pred * wz[z]*wy[y]*wx[x], patch coordinates
+int blend_accumulate_sep(float *pred, const long shape[4], const float *y_pred,
+                         const long psz[3], const long *pos, long num,
+                         const float *wz, const float *wy, const float *wx,
+                         int num_thread) {
+    blend_job j;
+    memset(&j, 0, sizeof(j));
+    j.pred = pred;
+    j.shape = shape;
+    j.y_pred = y_pred;
+    j.psz = psz;
+    j.pos = pos;
+    j.num = num;
+    j.wz = wz;
+    j.wy = wy;
+    j.wx = wx;
+    return run_bands(&j, num_thread);
+}
+
+/*
+Scale the finished planes [0, nz) of pred (c, z, y, x), whose plane 0 is
+output plane z0, by inv_z[z0+z]*inv_y[y]*inv_x[x] (the inverse weight sums).
+*/
+void blend_normalize(float *pred, const long shape[4], long nz, long z0,
+                     const float *inv_z, const float *inv_y, const float *inv_x) {
+    long ch, z, y;
+    for (ch = 0; ch < shape[0]; ch++) {
+        for (z = 0; z < nz; z++) {
+            for (y = 0; y < shape[2]; y++) {
+                row_scale(pred + ((ch * shape[1] + z) * shape[2] + y) * shape[3], inv_x,
+                          inv_z[z0 + z] * inv_y[y], shape[3]);
+            }
+        }
+    }
+}
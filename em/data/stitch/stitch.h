@@ -0,0 +1,14 @@
+#ifndef EM_STITCH_H
+#define EM_STITCH_H
+
+int blend_accumulate(float *pred, float *pred_ww, const long shape[4], int ww_nc,
+                     const float *y_pred, const long psz[3], const long *pos,
+                     long num, const float *ww, int num_thread);
+int blend_accumulate_sep(float *pred, const long shape[4], const float *y_pred,
+                         const long psz[3], const long *pos, long num,
+                         const float *wz, const float *wy, const float *wx,
+                         int num_thread);
+void blend_normalize(float *pred, const long shape[4], long nz, long z0,
+                     const float *inv_z, const float *inv_y, const float *inv_x);
+
+#endif
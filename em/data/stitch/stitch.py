@@ -0,0 +1,30 @@
+"""
+Test-time stitching with separable blend weights.
+
+For patches on the regular test grid (VolumeDatasetTest) with weights
+wz[z]*wy[y]*wx[x], the weight sum at each voxel is the product of three 1D
+sums, so no pred_ww volume is needed.
+"""
+
+import numpy as np
+
+from _stitch import blend_patches, blend_patches_sep, normalize_sep
+
+
+def grid_starts(size, psz, stride):
+    # patch starts along one axis, as VolumeDatasetTest.getPos
+    assert size >= psz, 'volume (%d) smaller than the patch (%d)' % (size, psz)
+    num = 1 + int(np.ceil(max(size-psz, 0)/float(stride)))
+    starts = [x*stride for x in range(num-1)] + [size-psz]
+    return np.array(starts, dtype=int)
+
+
+def inverse_weight_sum(ww_sep, size, psz, stride):
+    # (inv_z, inv_y, inv_x): 1/sum of the 1D weights over the grid, per axis
+    inv = []
+    for d in range(3):
+        s = np.zeros(size[d], dtype=np.float64)
+        for st in grid_starts(size[d], psz[d], stride[d]):
+            s[st:st+psz[d]] += ww_sep[d]
+        inv.append((1.0/s).astype(np.float32))
+    return inv
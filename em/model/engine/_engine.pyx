@@ -0,0 +1,537 @@
+"""
+Cython wrapper of the native CPU inference engine.
+"""
+
+import numpy as np
+from libc.stdint cimport uint8_t, uint32_t, uint64_t
+from libc.string cimport memcpy
+
+cdef extern from 'engine.h':
+    ctypedef struct tpool:
+        int num_thread
+    int tpool_create(tpool *p, int num_thread)
+    void tpool_destroy(tpool *p)
+    ctypedef struct conv_param:
+        const float *w
+        const float *b
+        int co, ci
+        int k[3]
+        float *wino
+        float wino_err
+        int wino_ext
+    ctypedef struct unet_m1:
+        int depth, in_num, out_num
+        int filters[7]
+        float slope
+        conv_param down[6][2]
+        conv_param center[2]
+        const float *up_w[6]
+        conv_param up[6]
+        conv_param upc[6][2]
+        conv_param final
+        tpool *pool
+        int up_fused[6]
+        int wino_min
+        float wino_tol
+    ctypedef struct act_plan:
+        long in_sz[3]
+        int num
+        long size[64]
+        int first[64]
+        int last[64]
+        long offset[64]
+        long peak, live, total
+    int ENGINE_MAX_DEPTH
+    int unet_m1_prepare(unet_m1 *net)
+    void unet_m1_release(unet_m1 *net)
+    int unet_m1_shape(const unet_m1 *net, const long in_sz[3], long out_sz[3])
+    int unet_m1_plan(const unet_m1 *net, const long in_sz[3], act_plan *pl)
+    int unet_m1_forward_plan(const unet_m1 *net, act_plan *pl, float *arena,
+                             const float *inp, float *out) nogil
+    int unet_m1_max_input(const unet_m1 *net, long budget, long in_sz[3])
+    ctypedef struct qconv_param:
+        const signed char *w
+        const float *b
+        int co, ci
+        int k[3]
+        int sf_w, sf_out, sf_act
+        double mult
+        int wlog
+        short *wt
+    ctypedef struct unet_q8:
+        int depth, in_num, out_num
+        float slope
+        float in_scale
+        qconv_param down[6][2]
+        qconv_param center[2]
+        qconv_param up[6]
+        qconv_param upc[6][2]
+        qconv_param final
+        tpool *pool
+    int unet_q8_prepare(unet_q8 *net)
+    void unet_q8_release(unet_q8 *net)
+    int unet_q8_shape(const unet_q8 *net, const long in_sz[3], long out_sz[3])
+    int unet_q8_plan(const unet_q8 *net, const long in_sz[3], act_plan *pl)
+    int unet_q8_forward_plan(const unet_q8 *net, act_plan *pl, float *arena,
+                             const float *inp, float *out) nogil
+    ctypedef struct wfile_header:
+        uint32_t count
+    ctypedef struct wfile_entry:
+        char name[48]
+        char dtype[8]
+        uint32_t itemsize
+        uint32_t ndim
+        uint64_t shape[6]
+        uint64_t offset
+        uint64_t nbytes
+    ctypedef struct wfile:
+        const uint8_t *base
+        size_t size
+        wfile_header hdr
+        const wfile_entry *table
+    int wfile_open(wfile *wf, const char *path)
+    void wfile_close(wfile *wf)
+    long wfile_find(const wfile *wf, const char *name)
+
+
+cdef int set_conv(conv_param *cp, w, b) except -1:
+    cdef const float [::1] w_view = w.reshape(-1)
+    cdef const float [::1] b_view
+    assert w.ndim == 5
+    cp.w = &w_view[0]
+    cp.b = NULL
+    if b is not None:
+        b_view = b
+        assert b.shape[0] == w.shape[0]
+        cp.b = &b_view[0]
+    cp.wino = NULL
+    cp.wino_ext = 0
+    cp.co = w.shape[0]
+    cp.ci = w.shape[1]
+    for x in range(3):
+        cp.k[x] = w.shape[2 + x]
+    return 0
+
+
+def conv3_names(depth):
+    # the 3x3x3 convs, in the order of conv3_layer
+    names = []
+    for i in range(depth):
+        for j in range(2):
+            names += ['downC.%d.%d' % (i, 2 * j), 'upC.%d.%d' % (i, 2 * j)]
+    return names + ['center.0', 'center.2']
+
+
+cdef conv_param *conv3_layer(unet_m1 *net, int k):
+    # k-th 3x3x3 conv, the order of conv3_list in unet.c
+    if k >= 4 * net.depth:
+        return &net.center[k - 4 * net.depth]
+    if k % 2 == 0:
+        return &net.down[k // 4][k % 4 // 2]
+    return &net.upc[k // 4][k % 4 // 2]
+
+
+cdef int set_qconv(qconv_param *cp, w, b, sf, int wlog) except -1:
+    cdef const signed char [::1] w_view = w.reshape(-1)
+    cdef const float [::1] b_view
+    assert w.ndim == 5
+    cp.w = &w_view[0]
+    cp.b = NULL
+    if b is not None:
+        b_view = b
+        assert b.shape[0] == w.shape[0]
+        cp.b = &b_view[0]
+    cp.co = w.shape[0]
+    cp.ci = w.shape[1]
+    for x in range(3):
+        cp.k[x] = w.shape[2 + x]
+    cp.sf_w, cp.sf_out, cp.sf_act = sf
+    cp.mult = 1
+    cp.wlog = wlog
+    return 0
+
+
+cdef class UNetM1:
+    """
+    unet3D_m1 forward pass on CPU threads.
+
+    weights: float32 c-contiguous arrays in the order of
+    engine.weight_names(depth); they are referenced, not copied, and may be
+    read-only (WeightFile tensors).
+    The activations of a forward pass live in one arena laid out by a
+    static plan (see plan()), kept for the last input size.
+    winograd: 3x3x3 convs with at least this many input and output channels
+    run as Winograd F(2x2x2, 3x3x3) (0: never), each kept only if its
+    relative error against direct conv is below winograd_tol.
+    wino: {layer: (Winograd weights, error)} of winograd_weights() to use as
+    they are, referenced like weights; these layers skip the transform and
+    the check.
+    """
+    cdef unet_m1 net
+    cdef tpool pool
+    cdef int has_pool
+    cdef int prepared
+    cdef act_plan act
+    cdef object arena
+    cdef readonly object weights
+    cdef readonly object wino
+    cdef readonly object filters
+
+    def __cinit__(self, weights, filters=(24, 72, 216, 648), int in_num=1, int out_num=3,
+                  float relu_slope=0.005, int num_thread=1, int winograd=16,
+                  float winograd_tol=1e-3, wino=None):
+        cdef const float [::1] up_view
+        cdef const float [::1] wino_view
+        cdef conv_param *cp
+        depth = len(filters) - 1
+        assert 0 < depth <= ENGINE_MAX_DEPTH
+        self.weights = [np.ascontiguousarray(w, dtype=np.float32) for w in weights]
+        self.filters = tuple(filters)
+        w = iter(self.weights)
+        self.net.depth = depth
+        self.net.in_num = in_num
+        self.net.out_num = out_num
+        self.net.slope = relu_slope
+        for i in range(depth + 1):
+            self.net.filters[i] = filters[i]
+        for i in range(depth):
+            for j in range(2):
+                set_conv(&self.net.down[i][j], next(w), next(w))
+        for j in range(2):
+            set_conv(&self.net.center[j], next(w), next(w))
+        for i in range(depth):
+            up_w = next(w)
+            assert up_w.size == 4 * filters[depth - i]
+            up_view = up_w.reshape(-1)
+            self.net.up_w[i] = &up_view[0]
+            set_conv(&self.net.up[i], next(w), next(w))
+            for j in range(2):
+                set_conv(&self.net.upc[i][j], next(w), next(w))
+        set_conv(&self.net.final, next(w), next(w))
+        self.wino = {}
+        for k, name in enumerate(conv3_names(depth)):
+            if wino is None or name not in wino:
+                continue
+            cp = conv3_layer(&self.net, k)
+            wi = np.ascontiguousarray(wino[name][0], dtype=np.float32)
+            assert wi.shape == (64, cp.co, cp.ci)
+            self.wino[name] = wi
+            wino_view = wi.reshape(-1)
+            cp.wino = <float *>&wino_view[0]
+            cp.wino_err = wino[name][1]
+            cp.wino_ext = 1
+        if tpool_create(&self.pool, num_thread) != 0:
+            raise MemoryError('cannot start engine threads')
+        self.has_pool = 1
+        self.net.pool = &self.pool
+        # upS with constant upsampling weights: 1x1 conv on the coarse grid;
+        # Winograd weights for the wide 3x3x3 convs
+        self.net.wino_min = winograd
+        self.net.wino_tol = winograd_tol
+        if unet_m1_prepare(&self.net) != 0:
+            raise MemoryError('cannot prepare the engine weights')
+        self.prepared = 1
+
+    def __dealloc__(self):
+        if self.has_pool:
+            tpool_destroy(&self.pool)
+        if self.prepared:
+            unet_m1_release(&self.net)
+
+    property up_fused:
+        def __get__(self):
+            return [bool(self.net.up_fused[i]) for i in range(self.net.depth)]
+
+    property winograd:
+        def __get__(self):
+            # {layer: relative error vs direct conv} for the checked 3x3x3 convs;
+            # layers above winograd_tol run direct
+            out = {}
+            for k, name in enumerate(conv3_names(self.net.depth)):
+                if conv3_layer(&self.net, k).wino_err >= 0:
+                    out[name] = conv3_layer(&self.net, k).wino_err
+            return out
+
+    def winograd_weights(self):
+        """{layer: (Winograd weights (64, co, ci), error)} of the layers run as Winograd."""
+        cdef conv_param *cp
+        cdef float [::1] view
+        out = {}
+        for k, name in enumerate(conv3_names(self.net.depth)):
+            cp = conv3_layer(&self.net, k)
+            if cp.wino == NULL:
+                continue
+            wi = np.empty((64, cp.co, cp.ci), dtype=np.float32)
+            view = wi.reshape(-1)
+            memcpy(&view[0], cp.wino, 64 * cp.co * cp.ci * sizeof(float))
+            out[name] = (wi, cp.wino_err)
+        return out
+
+    def output_size(self, in_size):
+        cdef long in_sz[3]
+        cdef long out_sz[3]
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_m1_shape(&self.net, in_sz, out_sz) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        return tuple(int(out_sz[x]) for x in range(3))
+
+    cdef int set_plan(self, in_size) except -1:
+        cdef long in_sz[3]
+        if self.arena is not None and list(in_size) == [self.act.in_sz[0],
+                                                         self.act.in_sz[1], self.act.in_sz[2]]:
+            return 0
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_m1_plan(&self.net, in_sz, &self.act) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        self.arena = None
+        self.arena = np.empty(max(self.act.peak, 1), dtype=np.float32)
+        return 0
+
+    def plan(self, in_size):
+        """
+        Activation memory for an input patch, in bytes: peak (arena size),
+        live (most bytes live at once, a lower bound of peak), total (no
+        reuse) and the buffers as (bytes, first step, last step, offset).
+        """
+        cdef act_plan pl
+        cdef long in_sz[3]
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_m1_plan(&self.net, in_sz, &pl) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        return dict(peak=4 * pl.peak, live=4 * pl.live, total=4 * pl.total,
+                    buffers=[(4 * pl.size[i], pl.first[i], pl.last[i], 4 * pl.offset[i])
+                             for i in range(pl.num)])
+
+    def max_input(self, budget, int z=31):
+        """Largest (z, n, n) patch whose input, output and activations fit in budget bytes."""
+        cdef long in_sz[3]
+        in_sz[0] = z
+        if unet_m1_max_input(&self.net, budget, in_sz) != 0:
+            raise ValueError('no patch of depth %d fits in %d bytes' % (z, budget))
+        return tuple(int(in_sz[x]) for x in range(3))
+
+    def forward(self, x, out=None):
+        """x: (n, in_num, z, y, x) or (in_num, z, y, x) -> sigmoid affinities."""
+        cdef float [:, :, :, :, ::1] x_view
+        cdef float [:, :, :, :, ::1] out_view
+        cdef float [::1] arena
+        cdef int b, ret = 0
+        single = x.ndim == 4
+        if single:
+            x = x[None]
+        x_view = np.ascontiguousarray(x, dtype=np.float32)
+        assert x_view.shape[1] == self.net.in_num
+        self.set_plan(x.shape[2:])
+        arena = self.arena
+        out_size = self.output_size(x.shape[2:])
+        if out is None:
+            out = np.empty((x.shape[0], self.net.out_num) + out_size, dtype=np.float32)
+        out_view = out
+        for b in range(x_view.shape[0]):
+            with nogil:
+                ret = unet_m1_forward_plan(&self.net, &self.act, &arena[0],
+                                           &x_view[b, 0, 0, 0, 0], &out_view[b, 0, 0, 0, 0])
+            if ret != 0:
+                raise MemoryError('engine forward failed (%d)' % ret)
+        return out[0] if single else out
+
+    def __call__(self, x):
+        return self.forward(x)
+
+
+cdef class UNetM1Q8:
+    """
+    Quantized unet3D_m1 forward pass in fixed point: int8 weights and
+    activations, int32 accumulation, shift requantization (qconv.c).
+
+    weights: (int8 weight, float32 bias) per conv in the order of
+    engine.conv_names(depth), upsampling weights folded into the upS 1x1;
+    sf: (sf_w, sf_out, sf_act) per conv, see engine.from_quant_model;
+    wlog: per conv, 1 if its weights are log2 codes (engine.log2_weight),
+    run with shifts and adds.
+    The input is quantized to uint8 as round(x * in_scale).
+    """
+    cdef unet_q8 net
+    cdef tpool pool
+    cdef int has_pool
+    cdef int prepared
+    cdef act_plan act
+    cdef object arena
+    cdef readonly object weights
+    cdef readonly object sf
+    cdef readonly object wlog
+    cdef readonly object filters
+
+    def __cinit__(self, weights, sf, filters=(24, 72, 216, 648), int in_num=1, int out_num=3,
+                  float relu_slope=0.005, int num_thread=1, float in_scale=255, wlog=None):
+        depth = len(filters) - 1
+        assert 0 < depth <= ENGINE_MAX_DEPTH
+        assert len(weights) == len(sf) == 5 * depth + 3
+        self.weights = [(np.ascontiguousarray(w, dtype=np.int8),
+                         None if b is None else np.ascontiguousarray(b, dtype=np.float32))
+                        for w, b in weights]
+        self.sf = [tuple(int(x) for x in s) for s in sf]
+        self.wlog = [0] * len(sf) if wlog is None else [int(x) for x in wlog]
+        assert len(self.wlog) == len(sf)
+        self.filters = tuple(filters)
+        w = iter(zip(self.weights, self.sf, self.wlog))
+        self.net.depth = depth
+        self.net.in_num = in_num
+        self.net.out_num = out_num
+        self.net.slope = relu_slope
+        self.net.in_scale = in_scale
+        for i in range(depth):
+            for j in range(2):
+                (wi, bi), si, li = next(w)
+                set_qconv(&self.net.down[i][j], wi, bi, si, li)
+        for j in range(2):
+            (wi, bi), si, li = next(w)
+            set_qconv(&self.net.center[j], wi, bi, si, li)
+        for i in range(depth):
+            (wi, bi), si, li = next(w)
+            assert wi.shape[2:] == (1, 1, 1)
+            set_qconv(&self.net.up[i], wi, bi, si, li)
+            for j in range(2):
+                (wi, bi), si, li = next(w)
+                set_qconv(&self.net.upc[i][j], wi, bi, si, li)
+        (wi, bi), si, li = next(w)
+        set_qconv(&self.net.final, wi, bi, si, li)
+        # uint8 input at sf 8: the first conv scales by 256 / in_scale
+        self.net.down[0][0].mult = 256.0 / in_scale
+        if tpool_create(&self.pool, num_thread) != 0:
+            raise MemoryError('cannot start engine threads')
+        self.has_pool = 1
+        self.net.pool = &self.pool
+        if unet_q8_prepare(&self.net) != 0:
+            raise MemoryError('cannot prepare the engine weights')
+        self.prepared = 1
+
+    def __dealloc__(self):
+        if self.has_pool:
+            tpool_destroy(&self.pool)
+        if self.prepared:
+            unet_q8_release(&self.net)
+
+    def output_size(self, in_size):
+        cdef long in_sz[3]
+        cdef long out_sz[3]
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_q8_shape(&self.net, in_sz, out_sz) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        return tuple(int(out_sz[x]) for x in range(3))
+
+    cdef int set_plan(self, in_size) except -1:
+        cdef long in_sz[3]
+        if self.arena is not None and list(in_size) == [self.act.in_sz[0],
+                                                         self.act.in_sz[1], self.act.in_sz[2]]:
+            return 0
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_q8_plan(&self.net, in_sz, &self.act) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        self.arena = None
+        self.arena = np.empty(max(self.act.peak, 1), dtype=np.float32)
+        return 0
+
+    def plan(self, in_size):
+        """Activation memory for an input patch in bytes, as UNetM1.plan."""
+        cdef act_plan pl
+        cdef long in_sz[3]
+        for x in range(3):
+            in_sz[x] = in_size[x]
+        if unet_q8_plan(&self.net, in_sz, &pl) != 0:
+            raise ValueError('input size %s too small for the model' % (tuple(in_size),))
+        return dict(peak=4 * pl.peak, live=4 * pl.live, total=4 * pl.total,
+                    buffers=[(4 * pl.size[i], pl.first[i], pl.last[i], 4 * pl.offset[i])
+                             for i in range(pl.num)])
+
+    def forward(self, x, out=None):
+        """x: (n, in_num, z, y, x) or (in_num, z, y, x) -> sigmoid affinities."""
+        cdef float [:, :, :, :, ::1] x_view
+        cdef float [:, :, :, :, ::1] out_view
+        cdef float [::1] arena
+        cdef int b, ret = 0
+        single = x.ndim == 4
+        if single:
+            x = x[None]
+        x_view = np.ascontiguousarray(x, dtype=np.float32)
+        assert x_view.shape[1] == self.net.in_num
+        self.set_plan(x.shape[2:])
+        arena = self.arena
+        out_size = self.output_size(x.shape[2:])
+        if out is None:
+            out = np.empty((x.shape[0], self.net.out_num) + out_size, dtype=np.float32)
+        out_view = out
+        for b in range(x_view.shape[0]):
+            with nogil:
+                ret = unet_q8_forward_plan(&self.net, &self.act, &arena[0],
+                                           &x_view[b, 0, 0, 0, 0], &out_view[b, 0, 0, 0, 0])
+            if ret != 0:
+                raise MemoryError('engine forward failed (%d)' % ret)
+        return out[0] if single else out
+
+    def __call__(self, x):
+        return self.forward(x)
+
+
+cdef class WeightFile:
+    """
+    Memory-mapped flat weight file (wfile.c, written by weights.py).
+
+    Tensors are read-only numpy arrays over the mapping, not copies, and
+    keep it open; its pages are shared by all processes using the file.
+    """
+    cdef wfile wf
+    cdef int is_open
+    cdef readonly object filename
+
+    def __cinit__(self, filename):
+        self.filename = filename
+        ret = wfile_open(&self.wf, filename.encode())
+        if ret != 0:
+            raise IOError('cannot open weight file [%s] (%d)' % (filename, ret))
+        self.is_open = 1
+
+    def __dealloc__(self):
+        if self.is_open:
+            wfile_close(&self.wf)
+
+    def __reduce__(self):
+        # re-open (and re-map) in the receiving process
+        return (WeightFile, (self.filename,))
+
+    property __array_interface__:
+        # the whole mapping as read-only bytes; arrays over it keep self alive
+        def __get__(self):
+            return dict(shape=(self.wf.size,), typestr='|u1', version=3,
+                        data=(<size_t>self.wf.base, True))
+
+    def __len__(self):
+        return self.wf.hdr.count
+
+    def __contains__(self, name):
+        return wfile_find(&self.wf, name.encode()) >= 0
+
+    def __getitem__(self, name):
+        cdef long i = wfile_find(&self.wf, name.encode())
+        if i < 0:
+            raise KeyError(name)
+        return self.tensor(i)
+
+    def names(self):
+        return [(<const char *>self.wf.table[i].name).decode() for i in range(self.wf.hdr.count)]
+
+    cdef tensor(self, long i):
+        cdef const wfile_entry *e = &self.wf.table[i]
+        dtype = np.dtype(e.dtype[:8].decode().strip('\0'))
+        assert dtype.itemsize == e.itemsize
+        shape = tuple(int(e.shape[d]) for d in range(e.ndim))
+        return np.asarray(self)[e.offset:e.offset + e.nbytes].view(dtype).reshape(shape)
+
+    def tensors(self):
+        """{name: array} of all the tensors."""
+        return dict((name, self.tensor(i)) for i, name in enumerate(self.names()))
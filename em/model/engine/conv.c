@@ -0,0 +1,210 @@
+/*
+Direct 3D convolution, valid padding, stride 1.
+
+Work is split into tasks of CONV_CO_BLOCK output channels x one output
+plane x CONV_Y_BLOCK rows. A task streams each input row once per kernel
+tap and adds it into the rows of all channels of its block, so the input
+row stays in L1 while the block of output rows stays in L2.
+
+conv3d_cat reads its input channels from two sources, as if they were
+concatenated: in (full extent) then in1 at an offset (a crop view). The
+mergeCrop concatenation is never materialized.
+
+3x3x3 layers prepared with conv_winograd_prepare go to conv3d_winograd
+(winograd.c) instead.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "engine.h"
+
+#define CONV_CO_BLOCK 8
+#define CONV_Y_BLOCK 8
+
+typedef struct {
+    const conv_param *cp;
+    const tensor *in;
+    const tensor *in1;         // channels in->c.. (may be NULL)
+    const long *off1;          // crop offset into in1
+    tensor *out;
+    int act;
+    float slope;
+    long nco_block, ny_block;
+} conv_job;
+
+static void axpy(float *restrict out, const float *restrict in, float w, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        out[i] += w * in[i];
+    }
+}
+
+static void leaky(float *restrict v, float slope, long n) {
+    long i;
+    for (i = 0; i < n; i++) {
+        v[i] = v[i] > 0 ? v[i] : v[i] * slope;
+    }
+}
+
+static void conv_task(void *arg, long t) {
+    conv_job *j = (conv_job *)arg;
+    const conv_param *cp = j->cp;
+    const tensor *in = j->in;
+    tensor *out = j->out;
+    long yb = t % j->ny_block;
+    long z = (t / j->ny_block) % out->z;
+    long cb = t / (j->ny_block * out->z);
+    long co0 = cb * CONV_CO_BLOCK, co1 = co0 + CONV_CO_BLOCK;
+    long y0 = yb * CONV_Y_BLOCK, y1 = y0 + CONV_Y_BLOCK;
+    long plane = out->y * out->x;
+    long ci, co, dz, dy, dx, y;
+    const float *src;
+    const float *w;
+    float *dst;
+
+    if (co1 > cp->co) co1 = cp->co;
+    if (y1 > out->y) y1 = out->y;
+    for (co = co0; co < co1; co++) {
+        for (y = y0; y < y1; y++) {
+            dst = out->data + (co * out->z + z) * plane + y * out->x;
+            for (dx = 0; dx < out->x; dx++) {
+                dst[dx] = cp->b != NULL ? cp->b[co] : 0.0f;
+            }
+        }
+    }
+    for (ci = 0; ci < cp->ci; ci++) {
+        for (dz = 0; dz < cp->k[0]; dz++) {
+            for (dy = 0; dy < cp->k[1]; dy++) {
+                for (y = y0; y < y1; y++) {
+                    if (ci < in->c) {
+                        src = in->data + ((ci * in->z + z + dz) * in->y + y + dy) * in->x;
+                    } else {
+                        src = j->in1->data + (((ci - in->c) * j->in1->z + j->off1[0] + z + dz) *
+                                              j->in1->y + j->off1[1] + y + dy) * j->in1->x + j->off1[2];
+                    }
+                    for (co = co0; co < co1; co++) {
+                        w = cp->w + (((co * cp->ci + ci) * cp->k[0] + dz) * cp->k[1] + dy) * cp->k[2];
+                        dst = out->data + (co * out->z + z) * plane + y * out->x;
+                        for (dx = 0; dx < cp->k[2]; dx++) {
+                            axpy(dst, src + dx, w[dx], out->x);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    if (j->act == ACT_LEAKY) {
+        for (co = co0; co < co1; co++) {
+            dst = out->data + (co * out->z + z) * plane;
+            leaky(dst + y0 * out->x, j->slope, (y1 - y0) * out->x);
+        }
+    }
+}
+
+/*
+out (co, z-kz+1, y-ky+1, x-kx+1) = act(conv(in) + b); out->data is
+allocated by the caller, its shape is set here.
+*/
+int conv3d(tpool *p, const conv_param *cp, const tensor *in, int act, float slope,
+           tensor *out) {
+    return conv3d_cat(p, cp, in, NULL, NULL, act, slope, out);
+}
+
+/*
+conv3d of cat([in, in1[:, off1 + extent of in]]) along channels; in1 may
+be NULL. Returns 0, or ENGINE_ERR_MEMORY from the Winograd path.
+*/
+int conv3d_cat(tpool *p, const conv_param *cp, const tensor *in, const tensor *in1,
+               const long off1[3], int act, float slope, tensor *out) {
+    conv_job j;
+    if (cp->wino != NULL) {
+        return conv3d_winograd(p, cp, in, in1, off1, act, slope, out);
+    }
+    out->c = cp->co;
+    out->z = in->z - cp->k[0] + 1;
+    out->y = in->y - cp->k[1] + 1;
+    out->x = in->x - cp->k[2] + 1;
+    j.cp = cp;
+    j.in = in;
+    j.in1 = in1;
+    j.off1 = off1;
+    j.out = out;
+    j.act = act;
+    j.slope = slope;
+    j.nco_block = (cp->co + CONV_CO_BLOCK - 1) / CONV_CO_BLOCK;
+    j.ny_block = (out->y + CONV_Y_BLOCK - 1) / CONV_Y_BLOCK;
+    tpool_run(p, conv_task, &j, j.nco_block * out->z * j.ny_block);
+    return 0;
+}
+
+/************************************************************************/
+// 1x1 conv followed by (1,2,2) nearest replication
+
+static void conv1x1_up2_task(void *arg, long t) {
+    conv_job *j = (conv_job *)arg;
+    const conv_param *cp = j->cp;
+    const tensor *in = j->in;
+    tensor *out = j->out;
+    long yb = t % j->ny_block;
+    long z = (t / j->ny_block) % in->z;
+    long cb = t / (j->ny_block * in->z);
+    long co0 = cb * CONV_CO_BLOCK, co1 = co0 + CONV_CO_BLOCK;
+    long y0 = yb * CONV_Y_BLOCK, y1 = y0 + CONV_Y_BLOCK;
+    long ci, co, y, x;
+    const float *src;
+    float *r0, *r1;
+
+    if (co1 > cp->co) co1 = cp->co;
+    if (y1 > in->y) y1 = in->y;
+    for (y = y0; y < y1; y++) {
+        // coarse result in the first half of output row 2y+1
+        for (co = co0; co < co1; co++) {
+            r1 = out->data + ((co * out->z + z) * out->y + 2 * y + 1) * out->x;
+            for (x = 0; x < in->x; x++) {
+                r1[x] = cp->b != NULL ? cp->b[co] : 0.0f;
+            }
+        }
+        for (ci = 0; ci < cp->ci; ci++) {
+            src = in->data + ((ci * in->z + z) * in->y + y) * in->x;
+            for (co = co0; co < co1; co++) {
+                r1 = out->data + ((co * out->z + z) * out->y + 2 * y + 1) * out->x;
+                axpy(r1, src, cp->w[co * cp->ci + ci], in->x);
+            }
+        }
+        // replicate: right to left, so row 2y+1 expands in place
+        for (co = co0; co < co1; co++) {
+            r0 = out->data + ((co * out->z + z) * out->y + 2 * y) * out->x;
+            r1 = r0 + out->x;
+            for (x = in->x - 1; x >= 0; x--) {
+                r0[2 * x] = r0[2 * x + 1] = r1[x];
+            }
+            for (x = in->x - 1; x >= 0; x--) {
+                r1[2 * x + 1] = r1[x];
+                r1[2 * x] = r1[x];
+            }
+        }
+    }
+}
+
+/*
+out (co, z, 2y, 2x) = nearest (1,2,2) upsampling of conv1x1(in) + b: the
+1x1 conv runs on the coarse grid, a quarter of the work of conv after
+upsampling.
+*/
+void conv1x1_up2(tpool *p, const conv_param *cp, const tensor *in, tensor *out) {
+    conv_job j;
+    out->c = cp->co;
+    out->z = in->z;
+    out->y = in->y * 2;
+    out->x = in->x * 2;
+    j.cp = cp;
+    j.in = in;
+    j.in1 = NULL;
+    j.off1 = NULL;
+    j.out = out;
+    j.act = ACT_NONE;
+    j.slope = 0.0f;
+    j.nco_block = (cp->co + CONV_CO_BLOCK - 1) / CONV_CO_BLOCK;
+    j.ny_block = (in->y + CONV_Y_BLOCK - 1) / CONV_Y_BLOCK;
+    tpool_run(p, conv1x1_up2_task, &j, j.nco_block * in->z * j.ny_block);
+}
@@ -0,0 +1,246 @@
+#ifndef EM_ENGINE_H
+#define EM_ENGINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define ENGINE_MAX_DEPTH 6
+
+#define ENGINE_ERR_SHAPE  -1
+#define ENGINE_ERR_MEMORY -2
+
+/************************************************************************/
+// thread pool: tpool_run calls fn(arg, i) for i in [0, n) on all threads
+
+typedef void (*tpool_fn)(void *arg, long i);
+
+typedef struct {
+    int num_thread;        // including the caller
+    pthread_t *thread;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    tpool_fn fn;
+    void *arg;
+    long n;
+    long next;             // next task, taken with an atomic add
+    int active;            // workers still in the current run
+    long gen;              // run counter, wakes the workers
+    int stop;
+} tpool;
+
+int tpool_create(tpool *p, int num_thread);
+void tpool_destroy(tpool *p);
+void tpool_run(tpool *p, tpool_fn fn, void *arg, long n);
+
+/************************************************************************/
+// tensors: one sample, (c, z, y, x) c-contiguous float32
+
+typedef struct {
+    float *data;
+    long c, z, y, x;
+    int buf;               // act_plan buffer, -1 if not from the arena
+} tensor;
+
+// fixed-point tensors (qconv.c): (z, y, x, c) channel-last, value = q * 2^-sf
+#define QT_S8  0
+#define QT_U8  1
+#define QT_F32 2               // dequantized (c, z, y, x), final layer output
+
+typedef struct {
+    void *data;
+    long c, z, y, x;
+    int type;
+    int sf;
+    int buf;
+} qtensor;
+
+typedef struct {
+    const float *w;        // (co, ci, kz, ky, kx)
+    const float *b;        // (co), may be NULL
+    int co, ci;
+    int k[3];
+    float *wino;           // Winograd weights (64, co, ci) or NULL, conv_winograd_prepare
+    float wino_err;        // relative error of the Winograd path, -1 if not checked
+    int wino_ext;          // wino and wino_err set by the caller (a weight file), kept
+                           // by unet_m1_prepare and not freed
+} conv_param;
+
+#define ACT_NONE  0
+#define ACT_LEAKY 1
+
+int conv3d(tpool *p, const conv_param *cp, const tensor *in, int act, float slope,
+           tensor *out);
+int conv3d_cat(tpool *p, const conv_param *cp, const tensor *in, const tensor *in1,
+               const long off1[3], int act, float slope, tensor *out);
+int conv3d_winograd(tpool *p, const conv_param *cp, const tensor *in, const tensor *in1,
+                    const long off1[3], int act, float slope, tensor *out);
+int conv_winograd_prepare(tpool *p, conv_param *cp, float tol);
+void conv1x1_up2(tpool *p, const conv_param *cp, const tensor *in, tensor *out);
+void maxpool_122(tpool *p, const tensor *in, tensor *out);
+void upsample_122(tpool *p, const float *w, const tensor *in, tensor *out);
+void sigmoid_inplace(tensor *t);
+
+/************************************************************************/
+// activation memory plan (plan.c): every intermediate tensor of a forward
+// pass gets an offset in one arena, shared by tensors whose lifetimes do
+// not overlap
+
+#define PLAN_MAX_BUF 64
+#define PLAN_ALIGN 16          // floats, 64 bytes
+
+typedef struct {
+    long in_sz[3];             // input patch the plan was made for
+    int num;                   // buffers, in allocation order
+    long size[PLAN_MAX_BUF];   // floats
+    int first[PLAN_MAX_BUF];   // step of the allocation
+    int last[PLAN_MAX_BUF];    // step of the release
+    long offset[PLAN_MAX_BUF]; // floats from the arena start
+    long peak;                 // arena size, floats
+    long live;                 // max floats live at once, lower bound of peak
+    long total;                // sum of the sizes, without reuse
+    // recording / replay
+    int record, step, next;
+    float *arena;
+} act_plan;
+
+void plan_reset(act_plan *pl, int record);
+int plan_alloc(act_plan *pl, tensor *t, long c, const long sz[3]);
+void plan_release(act_plan *pl, tensor *t);
+int plan_alloc_q(act_plan *pl, qtensor *t, int type, long c, const long sz[3]);
+void plan_release_q(act_plan *pl, qtensor *t);
+void plan_assign(act_plan *pl);
+
+/************************************************************************/
+// unet3D_m1 (em/model/deploy.py)
+
+int unet_sizes(int depth, const long in_sz[3], long out_sz[3], long skip_sz[][3]);
+
+typedef struct {
+    int depth, in_num, out_num;
+    int filters[ENGINE_MAX_DEPTH + 1];
+    float slope;
+    conv_param down[ENGINE_MAX_DEPTH][2];
+    conv_param center[2];
+    const float *up_w[ENGINE_MAX_DEPTH];  // depthwise ConvTranspose3d, (c, 1, 1, 2, 2)
+    conv_param up[ENGINE_MAX_DEPTH];      // 1x1 after the upsampling
+    conv_param upc[ENGINE_MAX_DEPTH][2];
+    conv_param final;
+    tpool *pool;
+    // unet_m1_prepare: upS levels whose upsampling weights are constant per
+    // channel run as conv1x1_up2 with the weights folded into upf
+    int up_fused[ENGINE_MAX_DEPTH];
+    conv_param upf[ENGINE_MAX_DEPTH];
+    // 3x3x3 convs with ci and co >= wino_min (0: never) run as Winograd
+    // F(2x2x2, 3x3x3) if they pass the check against direct conv at wino_tol;
+    // convs with wino_ext keep their given Winograd weights
+    int wino_min;
+    float wino_tol;
+} unet_m1;
+
+int unet_m1_prepare(unet_m1 *net);
+void unet_m1_release(unet_m1 *net);
+int unet_m1_shape(const unet_m1 *net, const long in_sz[3], long out_sz[3]);
+int unet_m1_forward(const unet_m1 *net, const float *in, const long in_sz[3], float *out);
+int unet_m1_plan(const unet_m1 *net, const long in_sz[3], act_plan *pl);
+int unet_m1_forward_plan(const unet_m1 *net, act_plan *pl, float *arena, const float *in,
+                         float *out);
+int unet_m1_max_input(const unet_m1 *net, long budget, long in_sz[3]);
+
+/************************************************************************/
+// int8 inference (qconv.c, qunet.c): int8 weights and activations, int32
+// accumulation, power-of-two scales from LinearQuant / quantize_weight
+// (em/app/quantization/quant_core.py); log2-quantized weights are
+// (sign, exponent) codes and their convs use shifts and adds only
+
+typedef struct {
+    const int8_t *w;       // (co, ci, kz, ky, kx), value w * 2^-sf_w, or log2 codes
+    const float *b;        // (co), may be NULL
+    int co, ci;
+    int k[3];
+    int sf_w;
+    int sf_out;            // LinearQuant after the conv
+    int sf_act;            // LinearQuant after the LeakyReLU
+    double mult;           // factor on the accumulator of in: 1, but 256 / in_scale for
+                           // the uint8 input (sf 8)
+    int wlog;              // w are log2 codes: bits 0-2 exponent e (7: zero), bit 3
+                           // sign, value +-2^(e - sf_w)
+    int16_t *wt;           // w as (co, kz, ky, kx, ci), qconv_prepare
+} qconv_param;
+
+int qconv_prepare(qconv_param *cp);
+void qconv_release(qconv_param *cp);
+void qconv3d_cat(tpool *p, const qconv_param *cp, const qtensor *in, const qtensor *in1,
+                 const long off1[3], int act, float slope, qtensor *out);
+void qconv1x1_up2(tpool *p, const qconv_param *cp, const qtensor *in, qtensor *out);
+void qmaxpool_122(tpool *p, const qtensor *in, qtensor *out);
+void quantize_u8(tpool *p, const float *in, float scale, qtensor *out);
+
+// unet3D_m1 after quantize_weight + quantize_feat; upS must have constant
+// upsampling weights, folded into up (see unet_m1_prepare)
+typedef struct {
+    int depth, in_num, out_num;
+    float slope;
+    float in_scale;        // uint8 input q = round(x * in_scale), 255 for x in [0, 1]
+    qconv_param down[ENGINE_MAX_DEPTH][2];
+    qconv_param center[2];
+    qconv_param up[ENGINE_MAX_DEPTH];     // 1x1 on the coarse grid + nearest replication
+    qconv_param upc[ENGINE_MAX_DEPTH][2];
+    qconv_param final;
+    tpool *pool;
+} unet_q8;
+
+int unet_q8_prepare(unet_q8 *net);
+void unet_q8_release(unet_q8 *net);
+int unet_q8_shape(const unet_q8 *net, const long in_sz[3], long out_sz[3]);
+int unet_q8_plan(const unet_q8 *net, const long in_sz[3], act_plan *pl);
+int unet_q8_forward_plan(const unet_q8 *net, act_plan *pl, float *arena, const float *in,
+                         float *out);
+int unet_q8_forward(const unet_q8 *net, const float *in, const long in_sz[3], float *out);
+
+/************************************************************************/
+// flat weight files (wfile.c): header, tensor table, 64-byte aligned blobs,
+// mmap-ed read-only so the engines use the weights in place
+
+#define WFILE_MAGIC "EMWT"
+#define WFILE_VERSION 1
+#define WFILE_HEADER_SIZE 64
+#define WFILE_ALIGN 64
+#define WFILE_MAX_NAME 48
+#define WFILE_MAX_DIM 6
+
+#define WFILE_ERR_IO     -1
+#define WFILE_ERR_FORMAT -2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;        // tensors
+    uint32_t align;        // WFILE_ALIGN
+    uint64_t table_offset; // count x wfile_entry
+    uint64_t size;         // file size
+} wfile_header;
+
+typedef struct {
+    char name[WFILE_MAX_NAME];  // NUL-terminated, e.g. "downC.0.0.weight"
+    char dtype[8];         // numpy dtype.str, e.g. "<f4", "|i1"
+    uint32_t itemsize;
+    uint32_t ndim;
+    uint64_t shape[WFILE_MAX_DIM];
+    uint64_t offset;       // multiple of WFILE_ALIGN
+    uint64_t nbytes;
+} wfile_entry;
+
+typedef struct {
+    int fd;
+    const uint8_t *base;
+    size_t size;
+    wfile_header hdr;
+    const wfile_entry *table;
+} wfile;
+
+int wfile_open(wfile *wf, const char *path);
+void wfile_close(wfile *wf);
+long wfile_find(const wfile *wf, const char *name);
+
+#endif
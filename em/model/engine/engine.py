@@ -0,0 +1,235 @@
+"""
+Native CPU inference of the deployed models, without torch at run time.
+"""
+
+import numpy as np
+
+from _engine import UNetM1, UNetM1Q8, conv3_names
+from weights import readweights, writeweights
+
+
+def weight_names(depth):
+    # unet3D_m1 state_dict keys in the order the engine reads them
+    names = []
+    for i in range(depth):
+        for j in [0, 2]:
+            names += ['downC.%d.%d.weight' % (i, j), 'downC.%d.%d.bias' % (i, j)]
+    for j in [0, 2]:
+        names += ['center.%d.weight' % j, 'center.%d.bias' % j]
+    for i in range(depth):
+        names += ['upS.%d.0.weight' % i, 'upS.%d.1.weight' % i, 'upS.%d.1.bias' % i]
+        for j in [0, 2]:
+            names += ['upC.%d.%d.weight' % (i, j), 'upC.%d.%d.bias' % (i, j)]
+    names += ['final.0.weight', 'final.0.bias']
+    return names
+
+
+def to_numpy(state_dict):
+    out = {}
+    for k, v in state_dict.items():
+        if k[:7] == 'module.': # DataParallel
+            k = k[7:]
+        if hasattr(v, 'cpu'):
+            v = v.cpu().numpy()
+        out[k] = np.ascontiguousarray(v, dtype=np.float32)
+    return out
+
+
+def from_state_dict(state_dict, filters=[24,72,216,648], in_num=1, out_num=3,
+                    relu_slope=0.005, num_thread=1, winograd=16):
+    sd = to_numpy(state_dict)
+    weights = [sd[k] for k in weight_names(len(filters)-1)]
+    return UNetM1(weights, filters, in_num, out_num, relu_slope, num_thread, winograd)
+
+
+def from_model(model, num_thread=1, winograd=16):
+    # model: unet3D_m1
+    return from_state_dict(model.state_dict(), model.filters, model.io_num[0],
+                           model.io_num[1], model.relu_slope, num_thread, winograd)
+
+
+def state_config(sd):
+    # filters, in_num, out_num of unet3D_m1 weights
+    depth = len([k for k in sd if k[:6] == 'downC.' and k[-9:] == '.0.weight'])
+    filters = [sd['downC.%d.0.weight' % i].shape[0] for i in range(depth)]
+    filters.append(sd['center.0.weight'].shape[0])
+    return filters, sd['downC.0.0.weight'].shape[1], sd['final.0.weight'].shape[0]
+
+
+def config_tensors(filters, in_num, out_num, relu_slope):
+    return [('config.filters', np.array(filters, dtype=np.int32)),
+            ('config.io_num', np.array([in_num, out_num], dtype=np.int32)),
+            ('config.relu_slope', np.array([relu_slope], dtype=np.float32))]
+
+
+def save_state_dict(filename, state_dict, filters=None, in_num=None, out_num=None,
+                    relu_slope=0.005, num_thread=1, winograd=16):
+    # unet3D_m1 weights as a flat weight file for from_file; filters and
+    # in/out channels default to those of the weight shapes. The Winograd
+    # weights of the convs that pass the check (UNetM1) are stored too:
+    # from_file then neither transforms nor checks them
+    sd = to_numpy(state_dict)
+    config = state_config(sd)
+    filters = config[0] if filters is None else filters
+    in_num = config[1] if in_num is None else in_num
+    out_num = config[2] if out_num is None else out_num
+    weights = [(k, sd[k]) for k in weight_names(len(filters)-1)]
+    wino = []
+    if winograd > 0:
+        net = UNetM1([w for k, w in weights], filters, in_num, out_num, relu_slope,
+                     num_thread, winograd)
+        for k, (w, err) in sorted(net.winograd_weights().items()):
+            wino += [(k + '.wino', w), (k + '.wino_err', np.array([err], dtype=np.float32))]
+    writeweights(filename, config_tensors(filters, in_num, out_num, relu_slope) + weights +
+                 wino)
+
+
+def save_model(filename, model, num_thread=1, winograd=16):
+    # model: unet3D_m1
+    save_state_dict(filename, model.state_dict(), model.filters, model.io_num[0],
+                    model.io_num[1], model.relu_slope, num_thread, winograd)
+
+
+def conv_names(depth):
+    # unet3D_m1 convs in the order of UNetM1Q8
+    names = ['downC.%d.%d' % (i, j) for i in range(depth) for j in [0, 2]]
+    names += ['center.0', 'center.2']
+    for i in range(depth):
+        names += ['upS.%d.1' % i, 'upC.%d.0' % i, 'upC.%d.2' % i]
+    names += ['final.0']
+    return names
+
+
+def int8_weight(w, sf=None):
+    # linear_quantize to int8; sf as quantize_weight with overflow_rate=0,
+    # which also recovers the sf of weights it already quantized
+    if sf is None:
+        sf = 7 - int(np.ceil(np.log2(np.abs(w).max() + 1e-12)))
+    return np.clip(np.floor(w * 2.0**sf + 0.5), -128, 127).astype(np.int8), sf
+
+
+def log2_weight(w, sf=None):
+    # log2_quantize (4 bits) to the codes of the shift kernels (engine.h):
+    # bits 0-2 exponent e, |w| = 2^(e-sf), 7 for 0, bit 3 sign; sf as
+    # quantize_weight, which recovers the exponents of already quantized weights
+    e = np.floor(np.log2(np.abs(w).astype(np.float64) + 1e-20) + 0.5)
+    if sf is None:
+        sf = 6 - int(e.max())
+    elif e.max() + sf > 6:
+        raise ValueError('shift kernels: log2 weights of at most 4 bits')
+    e = e + sf
+    code = np.where(e < 0, 7, e).astype(np.int8)
+    return code | (np.signbit(w) & (e >= 0)).astype(np.int8) << 3, sf
+
+
+def feat_sf(model, quant_method='linear'):
+    # {conv: (sf_out, sf_act)} of a unet3D_m1 after quantize_feat and
+    # calibration: the quantizers after each conv and LeakyReLU
+    mods = dict(model.named_modules())
+    out = {}
+    for name in conv_names(len(model.filters)-1):
+        seq, k = name.rsplit('.', 1)
+        q = [mods.get('%s.%d_%s_quant' % (seq, int(k)+d, quant_method)) for d in [0, 1]]
+        if q[0] is None or q[0].sf is None:
+            raise ValueError('%s: no calibrated %s quantizer' % (name, quant_method))
+        sf_act = q[1].sf if q[1] is not None and q[1].sf is not None else q[0].sf
+        out[name] = (int(q[0].sf), int(sf_act))
+    return out
+
+
+def quant_weights(state_dict, feat_sf, weight_sf={}, depth=3, weight_method='linear'):
+    # (weights, sf, wlog) of UNetM1Q8, see from_quant_state
+    sd = to_numpy(state_dict)
+    weights, sf, wlog = [], [], []
+    for name in conv_names(depth):
+        w = sd[name + '.weight']
+        if name[:3] == 'upS':
+            # constant upsampling weights fold into the 1x1 conv
+            u = sd[name[:-1] + '0.weight'].reshape(w.shape[1], -1)
+            if (u != u[:, :1]).any():
+                raise ValueError('%s: int8 engine needs constant upsampling weights' % name)
+            w = w * u[:, 0].reshape(1, -1, 1, 1, 1)
+        if name[:3] == 'upS':
+            wq, sf_w = int8_weight(w)
+        elif weight_method == 'log2':
+            wq, sf_w = log2_weight(w, weight_sf.get(name + '.weight'))
+        else:
+            wq, sf_w = int8_weight(w, weight_sf.get(name + '.weight'))
+        weights.append((wq, sd.get(name + '.bias')))
+        sf.append((sf_w,) + tuple(feat_sf[name]))
+        wlog.append(int(weight_method == 'log2' and name[:3] != 'upS'))
+    return weights, sf, wlog
+
+
+def from_quant_state(state_dict, feat_sf, weight_sf={}, filters=[24,72,216,648], in_num=1,
+                     out_num=3, relu_slope=0.005, num_thread=1, in_scale=255,
+                     weight_method='linear'):
+    # feat_sf: {conv: (sf_out, sf_act)}; weight_sf: {key: sf} from quantize_weight,
+    # missing ones are computed
+    # weight_method: 'linear' (int8) or 'log2' (shift kernels); upS, whose
+    # weights are folded, is always int8
+    weights, sf, wlog = quant_weights(state_dict, feat_sf, weight_sf, len(filters)-1,
+                                      weight_method)
+    return UNetM1Q8(weights, sf, filters, in_num, out_num, relu_slope, num_thread, in_scale,
+                    wlog)
+
+
+def quant_net(model):
+    # unet3D_m1 of a unet3D_m1_quant wrapper
+    if hasattr(model, 'rescale_skip'):
+        if model.rescale_skip != '':
+            raise ValueError('int8 engine: rescale_skip is not supported')
+        model = model.net
+    return model
+
+
+def from_quant_model(model, weight_sf={}, num_thread=1, in_scale=255, weight_method='linear'):
+    # model: unet3D_m1 after quantize_weight + quantize_feat (scripts/quant.py)
+    # with the linear quantizers calibrated, or its unet3D_m1_quant wrapper;
+    # weight_method: that of quantize_weight, 'linear' or 'log2'
+    model = quant_net(model)
+    return from_quant_state(model.state_dict(), feat_sf(model), weight_sf, model.filters,
+                            model.io_num[0], model.io_num[1], model.relu_slope, num_thread,
+                            in_scale, weight_method)
+
+
+def save_quant_model(filename, model, weight_sf={}, in_scale=255, weight_method='linear'):
+    # the int8 / log2 weights and scales of from_quant_model as a flat weight
+    # file for from_file: workers skip torch and the quantization
+    model = quant_net(model)
+    names = conv_names(len(model.filters)-1)
+    weights, sf, wlog = quant_weights(model.state_dict(), feat_sf(model), weight_sf,
+                                      len(model.filters)-1, weight_method)
+    tensors = config_tensors(model.filters, model.io_num[0], model.io_num[1], model.relu_slope)
+    tensors += [('config.in_scale', np.array([in_scale], dtype=np.float32)),
+                ('quant.sf', np.array(sf, dtype=np.int32)),
+                ('quant.wlog', np.array(wlog, dtype=np.int32))]
+    for name, (w, b) in zip(names, weights):
+        tensors.append((name + '.weight', w))
+        if b is not None:
+            tensors.append((name + '.bias', b))
+    writeweights(filename, tensors)
+
+
+def from_file(filename, num_thread=1, winograd=None):
+    # UNetM1 or UNetM1Q8 of a save_model / save_quant_model file; the weights
+    # are used in place in its mapping, shared by all processes running it.
+    # winograd: None for the Winograd convs stored in the file, else as UNetM1
+    wf = readweights(filename)
+    filters = [int(x) for x in wf['config.filters']]
+    in_num, out_num = [int(x) for x in wf['config.io_num']]
+    relu_slope = float(wf['config.relu_slope'][0])
+    depth = len(filters)-1
+    if 'quant.sf' not in wf:
+        wino = {}
+        if winograd is None:
+            winograd = 0
+            for k in conv3_names(depth):
+                if k + '.wino' in wf:
+                    wino[k] = (wf[k + '.wino'], float(wf[k + '.wino_err'][0]))
+        return UNetM1([wf[k] for k in weight_names(depth)], filters, in_num, out_num,
+                      relu_slope, num_thread, winograd, wino=wino)
+    weights = [(wf[k + '.weight'], wf[k + '.bias'] if k + '.bias' in wf else None)
+               for k in conv_names(depth)]
+    return UNetM1Q8(weights, wf['quant.sf'], filters, in_num, out_num, relu_slope,
+                    num_thread, float(wf['config.in_scale'][0]), wf['quant.wlog'])
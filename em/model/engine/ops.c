@@ -0,0 +1,87 @@
+/*
+Non-convolution layers of the deployed models.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+
+#include "engine.h"
+
+typedef struct {
+    const tensor *in;
+    tensor *out;
+    const float *w;
+} op_job;
+
+// MaxPool3d((1,2,2), (1,2,2)), odd sizes floored as in torch
+static void pool_task(void *arg, long t) {
+    op_job *j = (op_job *)arg;
+    const tensor *in = j->in;
+    tensor *out = j->out;
+    long y, x;
+    const float *r0, *r1;
+    float *d, a, b;
+    for (y = 0; y < out->y; y++) {
+        r0 = in->data + (t * in->y + 2 * y) * in->x;
+        r1 = r0 + in->x;
+        d = out->data + (t * out->y + y) * out->x;
+        for (x = 0; x < out->x; x++) {
+            a = r0[2 * x] > r0[2 * x + 1] ? r0[2 * x] : r0[2 * x + 1];
+            b = r1[2 * x] > r1[2 * x + 1] ? r1[2 * x] : r1[2 * x + 1];
+            d[x] = a > b ? a : b;
+        }
+    }
+}
+
+void maxpool_122(tpool *p, const tensor *in, tensor *out) {
+    op_job j;
+    out->c = in->c;
+    out->z = in->z;
+    out->y = in->y / 2;
+    out->x = in->x / 2;
+    j.in = in;
+    j.out = out;
+    tpool_run(p, pool_task, &j, in->c * in->z);
+}
+
+// ConvTranspose3d((1,2,2), stride (1,2,2), groups=c): out[2y+i, 2x+k] = in[y, x] * w[c, i, k]
+static void up_task(void *arg, long t) {
+    op_job *j = (op_job *)arg;
+    const tensor *in = j->in;
+    tensor *out = j->out;
+    const float *w = j->w + 4 * (t / in->z);
+    long y, x;
+    const float *s;
+    float *d0, *d1;
+    for (y = 0; y < in->y; y++) {
+        s = in->data + (t * in->y + y) * in->x;
+        d0 = out->data + (t * out->y + 2 * y) * out->x;
+        d1 = d0 + out->x;
+        for (x = 0; x < in->x; x++) {
+            d0[2 * x] = s[x] * w[0];
+            d0[2 * x + 1] = s[x] * w[1];
+            d1[2 * x] = s[x] * w[2];
+            d1[2 * x + 1] = s[x] * w[3];
+        }
+    }
+}
+
+void upsample_122(tpool *p, const float *w, const tensor *in, tensor *out) {
+    op_job j;
+    out->c = in->c;
+    out->z = in->z;
+    out->y = in->y * 2;
+    out->x = in->x * 2;
+    j.in = in;
+    j.out = out;
+    j.w = w;
+    tpool_run(p, up_task, &j, in->c * in->z);
+}
+
+void sigmoid_inplace(tensor *t) {
+    long i, n = t->c * t->z * t->y * t->x;
+    for (i = 0; i < n; i++) {
+        t->data[i] = 1.0f / (1.0f + expf(-t->data[i]));
+    }
+}
@@ -0,0 +1,143 @@
+/*
+Static activation memory plan.
+
+unet_m1_forward is first run with pl->record set: the kernels are skipped
+and every plan_alloc / plan_release only logs the size and lifetime of a
+buffer. plan_assign then gives each buffer an offset in one arena, with
+greedy best fit by decreasing size: a buffer may share memory with any
+buffer whose lifetime it does not overlap (e.g. the downC temporaries
+reuse the space freed by earlier levels while the skips stay live). The
+second, real run replays the same allocation sequence into the arena.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "engine.h"
+
+void plan_reset(act_plan *pl, int record) {
+    pl->record = record;
+    pl->step = 0;
+    pl->next = 0;
+    if (record) {
+        pl->num = 0;
+    }
+}
+
+// n floats: logged (record) or placed at its recorded offset (replay)
+static int plan_buf(act_plan *pl, long n, float **data, int *buf) {
+    int b;
+    n = (n + PLAN_ALIGN - 1) / PLAN_ALIGN * PLAN_ALIGN;
+    *data = NULL;
+    if (pl->record) {
+        if (pl->num == PLAN_MAX_BUF) return ENGINE_ERR_MEMORY;
+        b = pl->num++;
+        pl->size[b] = n;
+        pl->first[b] = pl->step++;
+        pl->last[b] = -1;
+    } else {
+        b = pl->next++;
+        // the replay must follow the recorded sequence
+        if (b >= pl->num || pl->size[b] != n || pl->arena == NULL) return ENGINE_ERR_SHAPE;
+        *data = pl->arena + pl->offset[b];
+    }
+    *buf = b;
+    return 0;
+}
+
+static void plan_free(act_plan *pl, int *buf) {
+    if (*buf < 0) {
+        return;
+    }
+    if (pl->record) {
+        pl->last[*buf] = pl->step++;
+    }
+    *buf = -1;
+}
+
+int plan_alloc(act_plan *pl, tensor *t, long c, const long sz[3]) {
+    t->c = c;
+    t->z = sz[0];
+    t->y = sz[1];
+    t->x = sz[2];
+    return plan_buf(pl, c * sz[0] * sz[1] * sz[2], &t->data, &t->buf);
+}
+
+void plan_release(act_plan *pl, tensor *t) {
+    plan_free(pl, &t->buf);
+    t->data = NULL;
+}
+
+// fixed-point tensors take 1 byte per value, float ones 4
+int plan_alloc_q(act_plan *pl, qtensor *t, int type, long c, const long sz[3]) {
+    long n = c * sz[0] * sz[1] * sz[2];
+    float *data;
+    int ret;
+    t->c = c;
+    t->z = sz[0];
+    t->y = sz[1];
+    t->x = sz[2];
+    t->type = type;
+    ret = plan_buf(pl, type == QT_F32 ? n : (n + 3) / 4, &data, &t->buf);
+    t->data = data;
+    return ret;
+}
+
+void plan_release_q(act_plan *pl, qtensor *t) {
+    plan_free(pl, &t->buf);
+    t->data = NULL;
+}
+
+static int overlap(const act_plan *pl, int a, int b) {
+    return pl->first[a] < pl->last[b] && pl->first[b] < pl->last[a];
+}
+
+void plan_assign(act_plan *pl) {
+    int order[PLAN_MAX_BUF], placed[PLAN_MAX_BUF];
+    int i, j, k, b, np = 0, t;
+    long off, live;
+
+    for (i = 0; i < pl->num; i++) {
+        if (pl->last[i] < 0) pl->last[i] = pl->step; // live to the end
+        order[i] = i;
+    }
+    // decreasing size, ties by allocation order
+    for (i = 1; i < pl->num; i++) {
+        for (j = i; j > 0 && pl->size[order[j]] > pl->size[order[j - 1]]; j--) {
+            t = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = t;
+        }
+    }
+    pl->peak = pl->total = 0;
+    for (i = 0; i < pl->num; i++) {
+        b = order[i];
+        // lowest offset clear of all placed buffers live at the same time;
+        // placed[] is kept sorted by offset
+        off = 0;
+        for (k = 0; k < np; k++) {
+            j = placed[k];
+            if (!overlap(pl, b, j)) continue;
+            if (off + pl->size[b] <= pl->offset[j]) break;
+            if (pl->offset[j] + pl->size[j] > off) off = pl->offset[j] + pl->size[j];
+        }
+        pl->offset[b] = off;
+        for (k = np; k > 0 && pl->offset[placed[k - 1]] > off; k--) {
+            placed[k] = placed[k - 1];
+        }
+        placed[k] = b;
+        np++;
+        if (off + pl->size[b] > pl->peak) pl->peak = off + pl->size[b];
+        pl->total += pl->size[b];
+    }
+    // sum of the live buffers at each step: no arena can be smaller
+    pl->live = 0;
+    for (t = 0; t < pl->step; t++) {
+        live = 0;
+        for (i = 0; i < pl->num; i++) {
+            if (pl->first[i] <= t && t < pl->last[i]) live += pl->size[i];
+        }
+        if (live > pl->live) pl->live = live;
+    }
+}
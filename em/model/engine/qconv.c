@@ -0,0 +1,487 @@
+/*
+Fixed-point kernels for quantized models (quant_core.py): int8 weights,
+int8 activations (uint8 for the network input), int32 accumulation.
+
+All scales are powers of two as LinearQuant records them: a value v is
+stored as q = clamp(floor(v * 2^sf + 0.5)), so a conv accumulates
+sum q_w * q_in at 2^-(sf_w + sf_in) and requantizes with a rounding shift.
+The two steps the simulated model rounds at are kept:
+  conv + bias -> LinearQuant at sf_out -> LeakyReLU -> LinearQuant at sf_act
+with the leaky slope in fixed point (LEAKY_Q). Only the uint8 input layer
+scales its accumulator by a factor (cp->mult): 1/in_scale is not a power
+of two. The accumulator goes to Q16 in double there, exact but for values
+within 2^-17 of a rounding tie.
+
+Activations are channel-last, (z, y, x, c): for one output voxel the
+kx * ci inputs of a kernel row are contiguous, as are the weights once
+qconv_prepare has laid them out as (co, kz, ky, kx, ci). The conv is then
+kz * ky dot products per voxel and output channel, on int16 operands so
+that the compiler can use the pairwise multiply-add of plain SSE2
+(pmaddwd). Four output channels share each input load.
+
+Log2-quantized weights (cp->wlog) are (sign, exponent) codes and their
+dot products multiply nothing: each input is doubled under the masks of
+the exponent bits and negated under the sign mask, in 16 bits, then
+added. The accumulator scale is that of int8 weights, the requantization
+is shared.
+
+A task computes QCONV_X_BLOCK voxels of one output row for all channels.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+#define QCONV_CO 4
+#define QCONV_X_BLOCK 16
+#define LEAKY_Q 24
+#define LOG_ZERO 7             // exponent code of a zero log2 weight
+
+// dot product kinds: weights x input type
+#define DOT_S8     0
+#define DOT_U8     1
+#define DOT_LOG_S8 2
+#define DOT_LOG_U8 3
+
+typedef struct {
+    const qconv_param *cp;
+    const qtensor *in;
+    const qtensor *in1;        // channels in->c.. (may be NULL)
+    const long *off1;          // crop offset into in1
+    qtensor *out;
+    int act;
+    int64_t slope;             // Q LEAKY_Q
+    int sf_in;                 // common scale of in and in1
+    long nx_block;
+    int dot;                   // DOT_* for in
+    int dot1;                  // for in1 (int8)
+} qconv_job;
+
+/************************************************************************/
+// weights
+
+static long co_pad(int co) {
+    return (co + QCONV_CO - 1) / QCONV_CO * QCONV_CO;
+}
+
+/*
+cp->wt: cp->w as int16 (co, kz, ky, kx, ci), co padded with zero weights
+to a multiple of QCONV_CO. Returns 0 or ENGINE_ERR_MEMORY.
+*/
+int qconv_prepare(qconv_param *cp) {
+    long n = (long)cp->k[0] * cp->k[1] * cp->k[2], co, ci, k;
+    long size = co_pad(cp->co) * n * cp->ci;
+    cp->wt = calloc(size, sizeof(int16_t));
+    if (cp->wt == NULL) {
+        return ENGINE_ERR_MEMORY;
+    }
+    if (cp->wlog) {
+        for (k = cp->co * n * cp->ci; k < size; k++) {
+            cp->wt[k] = LOG_ZERO;
+        }
+    }
+    for (co = 0; co < cp->co; co++) {
+        for (ci = 0; ci < cp->ci; ci++) {
+            for (k = 0; k < n; k++) {
+                cp->wt[(co * n + k) * cp->ci + ci] = cp->w[(co * cp->ci + ci) * n + k];
+            }
+        }
+    }
+    return 0;
+}
+
+void qconv_release(qconv_param *cp) {
+    free(cp->wt);
+    cp->wt = NULL;
+}
+
+/************************************************************************/
+// arithmetic
+
+// s[k] += sum_i w[k * ws + i] * x[i], k < QCONV_CO
+static void dot4_s8(const int16_t *restrict w, long ws, const void *restrict xv, long n,
+                    int32_t *s) {
+    const int8_t *x = (const int8_t *)xv;
+    const int16_t *w0 = w, *w1 = w + ws, *w2 = w + 2 * ws, *w3 = w + 3 * ws;
+    int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int16_t v;
+    long i;
+    for (i = 0; i < n; i++) {
+        v = x[i];
+        s0 += w0[i] * v;
+        s1 += w1[i] * v;
+        s2 += w2[i] * v;
+        s3 += w3[i] * v;
+    }
+    s[0] += s0;
+    s[1] += s1;
+    s[2] += s2;
+    s[3] += s3;
+}
+
+static void dot4_u8(const int16_t *restrict w, long ws, const void *restrict xv, long n,
+                    int32_t *s) {
+    const uint8_t *x = (const uint8_t *)xv;
+    const int16_t *w0 = w, *w1 = w + ws, *w2 = w + 2 * ws, *w3 = w + 3 * ws;
+    int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int16_t v;
+    long i;
+    for (i = 0; i < n; i++) {
+        v = x[i];
+        s0 += w0[i] * v;
+        s1 += w1[i] * v;
+        s2 += w2[i] * v;
+        s3 += w3[i] * v;
+    }
+    s[0] += s0;
+    s[1] += s1;
+    s[2] += s2;
+    s[3] += s3;
+}
+
+/*
+x * +-2^e for the log2 code c (engine.h); e <= 6, so an uint8 input stays
+within 16 bits. Each exponent bit adds t, 3t or 15t under its mask.
+*/
+static inline int16_t log_term(int16_t x, int16_t c) {
+    uint16_t t = (uint16_t)x & (uint16_t)(0 - ((c & 7) != LOG_ZERO));
+    uint16_t sg = (uint16_t)(0 - ((c >> 3) & 1));
+    t += t & (uint16_t)(0 - (c & 1));
+    t += (uint16_t)((t << 1) + t) & (uint16_t)(0 - ((c >> 1) & 1));
+    t += (uint16_t)((t << 4) - t) & (uint16_t)(0 - ((c >> 2) & 1));
+    return (int16_t)((t ^ sg) - sg);
+}
+
+// dot4_s8 / dot4_u8 with log2 codes in w
+static void dot4_log_s8(const int16_t *restrict w, long ws, const void *restrict xv, long n,
+                        int32_t *s) {
+    const int8_t *x = (const int8_t *)xv;
+    const int16_t *w0 = w, *w1 = w + ws, *w2 = w + 2 * ws, *w3 = w + 3 * ws;
+    int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int16_t v;
+    long i;
+    for (i = 0; i < n; i++) {
+        v = x[i];
+        s0 += log_term(v, w0[i]);
+        s1 += log_term(v, w1[i]);
+        s2 += log_term(v, w2[i]);
+        s3 += log_term(v, w3[i]);
+    }
+    s[0] += s0;
+    s[1] += s1;
+    s[2] += s2;
+    s[3] += s3;
+}
+
+static void dot4_log_u8(const int16_t *restrict w, long ws, const void *restrict xv, long n,
+                        int32_t *s) {
+    const uint8_t *x = (const uint8_t *)xv;
+    const int16_t *w0 = w, *w1 = w + ws, *w2 = w + 2 * ws, *w3 = w + 3 * ws;
+    int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int16_t v;
+    long i;
+    for (i = 0; i < n; i++) {
+        v = x[i];
+        s0 += log_term(v, w0[i]);
+        s1 += log_term(v, w1[i]);
+        s2 += log_term(v, w2[i]);
+        s3 += log_term(v, w3[i]);
+    }
+    s[0] += s0;
+    s[1] += s1;
+    s[2] += s2;
+    s[3] += s3;
+}
+
+// a switch rather than a function pointer: the kernels stay inlined
+static inline void dot4(int kind, const int16_t *w, long ws, const void *x, long n,
+                        int32_t *s) {
+    switch (kind) {
+    case DOT_S8:
+        dot4_s8(w, ws, x, n, s);
+        break;
+    case DOT_U8:
+        dot4_u8(w, ws, x, n, s);
+        break;
+    case DOT_LOG_S8:
+        dot4_log_s8(w, ws, x, n, s);
+        break;
+    default:
+        dot4_log_u8(w, ws, x, n, s);
+    }
+}
+
+// floor(v * 2^-s + 0.5)
+static int64_t round_shift(int64_t v, int s) {
+    if (s > 0) {
+        return (v + ((int64_t)1 << (s - 1))) >> s;
+    }
+    return v * ((int64_t)1 << (-s < 32 ? -s : 32));
+}
+
+static int8_t sat8(int64_t v) {
+    return v < -128 ? -128 : v > 127 ? 127 : (int8_t)v;
+}
+
+// bias of channel co at the Q16 accumulator scale
+static int64_t qbias(const qconv_job *j, long co) {
+    if (j->cp->b == NULL) return 0;
+    return llrint(ldexp(j->cp->b[co], j->sf_in + j->cp->sf_w + 16));
+}
+
+/*
+accumulators of in (a0) and in1 (a1) of one channel -> output value at
+index pos, see the top of the file
+*/
+static void requant(const qconv_job *j, int64_t bias, int32_t a0, int32_t a1, long pos) {
+    const qconv_param *cp = j->cp;
+    qtensor *out = j->out;
+    int d0 = j->sf_in - j->in->sf;
+    int64_t v;
+    int8_t q;
+    if (cp->mult == 1.0) {
+        v = ((int64_t)a0 << (d0 + 16)) + bias;
+    } else {
+        v = llrint(ldexp((double)a0 * cp->mult, d0 + 16)) + bias;
+    }
+    if (j->in1 != NULL) v += (int64_t)a1 << (j->sf_in - j->in1->sf + 16);
+    q = sat8(round_shift(v, j->sf_in + cp->sf_w + 16 - cp->sf_out));
+    if (out->type == QT_F32) {
+        ((float *)out->data)[pos] = ldexpf(q, -cp->sf_out);
+        return;
+    }
+    if (j->act == ACT_LEAKY) {
+        v = q >= 0 ? (int64_t)q << LEAKY_Q : q * j->slope;
+        q = sat8(round_shift(v, cp->sf_out + LEAKY_Q - cp->sf_act));
+    }
+    ((int8_t *)out->data)[pos] = q;
+}
+
+/************************************************************************/
+// conv
+
+static void qconv_task(void *arg, long t) {
+    qconv_job *j = (qconv_job *)arg;
+    const qconv_param *cp = j->cp;
+    const qtensor *in = j->in, *in1 = j->in1;
+    qtensor *out = j->out;
+    long xb = t % j->nx_block;
+    long y = (t / j->nx_block) % out->y;
+    long z = t / (j->nx_block * out->y);
+    long x0 = xb * QCONV_X_BLOCK, x1 = x0 + QCONV_X_BLOCK;
+    long c0 = in->c, c1 = cp->ci - in->c;
+    long ws = (long)cp->k[0] * cp->k[1] * cp->k[2] * cp->ci;
+    long co, k, x, dz, dy, dx, pos, r0;
+    int32_t s0[QCONV_X_BLOCK][QCONV_CO], s1[QCONV_X_BLOCK][QCONV_CO];
+    int64_t bias[QCONV_CO];
+    const int16_t *w;
+    const int8_t *r1;
+
+    if (x1 > out->x) x1 = out->x;
+    for (co = 0; co < cp->co; co += QCONV_CO) {
+        memset(s0, 0, sizeof(s0));
+        memset(s1, 0, sizeof(s1));
+        for (x = x0; x < x1; x++) {
+            for (dz = 0; dz < cp->k[0]; dz++) {
+                for (dy = 0; dy < cp->k[1]; dy++) {
+                    w = cp->wt + co * ws + (dz * cp->k[1] + dy) * cp->k[2] * cp->ci;
+                    r0 = (((z + dz) * in->y + y + dy) * in->x + x) * c0;
+                    if (in1 == NULL) {
+                        // kx * ci contiguous; int8 and uint8 are both one byte
+                        dot4(j->dot, w, ws, (const int8_t *)in->data + r0, cp->k[2] * c0,
+                             s0[x - x0]);
+                        continue;
+                    }
+                    r1 = (const int8_t *)in1->data +
+                         (((j->off1[0] + z + dz) * in1->y + j->off1[1] + y + dy) * in1->x +
+                          j->off1[2] + x) * c1;
+                    for (dx = 0; dx < cp->k[2]; dx++) {
+                        dot4(j->dot, w + dx * cp->ci, ws, (const int8_t *)in->data + r0 + dx * c0,
+                             c0, s0[x - x0]);
+                        dot4(j->dot1, w + dx * cp->ci + c0, ws, r1 + dx * c1, c1, s1[x - x0]);
+                    }
+                }
+            }
+        }
+        for (k = 0; k < QCONV_CO && co + k < cp->co; k++) {
+            bias[k] = qbias(j, co + k);
+        }
+        for (x = x0; x < x1; x++) {
+            for (k = 0; k < QCONV_CO && co + k < cp->co; k++) {
+                if (out->type == QT_F32) {
+                    pos = (((co + k) * out->z + z) * out->y + y) * out->x + x;
+                } else {
+                    pos = ((z * out->y + y) * out->x + x) * out->c + co + k;
+                }
+                requant(j, bias[k], s0[x - x0][k], s1[x - x0][k], pos);
+            }
+        }
+    }
+}
+
+static void qjob_init(qconv_job *j, const qconv_param *cp, const qtensor *in, const qtensor *in1,
+                      const long off1[3], int act, float slope, qtensor *out) {
+    j->cp = cp;
+    j->in = in;
+    j->in1 = in1;
+    j->off1 = off1;
+    j->out = out;
+    j->act = act;
+    j->slope = llrint(ldexp(slope, LEAKY_Q));
+    j->sf_in = in1 != NULL && in1->sf > in->sf ? in1->sf : in->sf;
+    j->dot1 = cp->wlog ? DOT_LOG_S8 : DOT_S8;
+    j->dot = j->dot1 + (in->type == QT_U8);
+    out->sf = act == ACT_LEAKY ? cp->sf_act : cp->sf_out;
+}
+
+/*
+conv3d_cat on fixed-point tensors: out (z-kz+1, y-ky+1, x-kx+1, co) at
+sf_act (LeakyReLU) or sf_out, or dequantized and channel-first
+(co, z, y, x) if out->type is QT_F32; out->data and out->type are set by
+the caller, the weights by qconv_prepare.
+*/
+void qconv3d_cat(tpool *p, const qconv_param *cp, const qtensor *in, const qtensor *in1,
+                 const long off1[3], int act, float slope, qtensor *out) {
+    qconv_job j;
+    out->c = cp->co;
+    out->z = in->z - cp->k[0] + 1;
+    out->y = in->y - cp->k[1] + 1;
+    out->x = in->x - cp->k[2] + 1;
+    qjob_init(&j, cp, in, in1, off1, act, slope, out);
+    j.nx_block = (out->x + QCONV_X_BLOCK - 1) / QCONV_X_BLOCK;
+    tpool_run(p, qconv_task, &j, out->z * out->y * j.nx_block);
+}
+
+/************************************************************************/
+// 1x1 conv on the coarse grid followed by (1,2,2) nearest replication
+
+static void qconv1x1_up2_task(void *arg, long t) {
+    qconv_job *j = (qconv_job *)arg;
+    const qconv_param *cp = j->cp;
+    const qtensor *in = j->in;
+    qtensor *out = j->out;
+    long xb = t % j->nx_block;
+    long y = (t / j->nx_block) % in->y;
+    long z = t / (j->nx_block * in->y);
+    long x0 = xb * QCONV_X_BLOCK, x1 = x0 + QCONV_X_BLOCK;
+    long co, k, x, pos;
+    int32_t s[QCONV_X_BLOCK][QCONV_CO];
+    int64_t bias[QCONV_CO];
+    int8_t *d;
+
+    if (x1 > in->x) x1 = in->x;
+    for (co = 0; co < cp->co; co += QCONV_CO) {
+        memset(s, 0, sizeof(s));
+        for (x = x0; x < x1; x++) {
+            dot4(j->dot, cp->wt + co * cp->ci, cp->ci,
+                 (const int8_t *)in->data + ((z * in->y + y) * in->x + x) * in->c, cp->ci,
+                 s[x - x0]);
+        }
+        for (k = 0; k < QCONV_CO && co + k < cp->co; k++) {
+            bias[k] = qbias(j, co + k);
+        }
+        // coarse value at (2y, 2x), copied to its three neighbours below
+        for (x = x0; x < x1; x++) {
+            pos = ((z * out->y + 2 * y) * out->x + 2 * x) * out->c;
+            for (k = 0; k < QCONV_CO && co + k < cp->co; k++) {
+                requant(j, bias[k], s[x - x0][k], 0, pos + co + k);
+            }
+        }
+    }
+    for (x = x0; x < x1; x++) {
+        d = (int8_t *)out->data + ((z * out->y + 2 * y) * out->x + 2 * x) * out->c;
+        memcpy(d + out->c, d, out->c);
+        memcpy(d + out->x * out->c, d, 2 * out->c);
+    }
+}
+
+/*
+out (z, 2y, 2x, co) = nearest (1,2,2) upsampling of conv1x1(in) + b at
+sf_out, see conv1x1_up2.
+*/
+void qconv1x1_up2(tpool *p, const qconv_param *cp, const qtensor *in, qtensor *out) {
+    qconv_job j;
+    out->c = cp->co;
+    out->z = in->z;
+    out->y = in->y * 2;
+    out->x = in->x * 2;
+    qjob_init(&j, cp, in, NULL, NULL, ACT_NONE, 0.0f, out);
+    j.nx_block = (in->x + QCONV_X_BLOCK - 1) / QCONV_X_BLOCK;
+    tpool_run(p, qconv1x1_up2_task, &j, in->z * in->y * j.nx_block);
+}
+
+/************************************************************************/
+// pooling and input quantization
+
+typedef struct {
+    const qtensor *in;
+    qtensor *out;
+    const float *src;
+    float scale;
+} qop_job;
+
+static void qpool_task(void *arg, long t) {
+    qop_job *j = (qop_job *)arg;
+    const qtensor *in = j->in;
+    qtensor *out = j->out;
+    long y = t % out->y, z = t / out->y, x, c, n = in->c;
+    const int8_t *r0, *r1;
+    int8_t *d, a, b;
+    for (x = 0; x < out->x; x++) {
+        r0 = (const int8_t *)in->data + ((z * in->y + 2 * y) * in->x + 2 * x) * n;
+        r1 = r0 + in->x * n;
+        d = (int8_t *)out->data + ((z * out->y + y) * out->x + x) * n;
+        for (c = 0; c < n; c++) {
+            a = r0[c] > r0[n + c] ? r0[c] : r0[n + c];
+            b = r1[c] > r1[n + c] ? r1[c] : r1[n + c];
+            d[c] = a > b ? a : b;
+        }
+    }
+}
+
+// maxpool_122 on int8, same scale
+void qmaxpool_122(tpool *p, const qtensor *in, qtensor *out) {
+    qop_job j;
+    out->c = in->c;
+    out->z = in->z;
+    out->y = in->y / 2;
+    out->x = in->x / 2;
+    out->sf = in->sf;
+    j.in = in;
+    j.out = out;
+    tpool_run(p, qpool_task, &j, out->z * out->y);
+}
+
+static void quant_task(void *arg, long t) {
+    qop_job *j = (qop_job *)arg;
+    const qtensor *out = j->out;
+    long n = out->y * out->x, plane = out->z * n, i, c;
+    const float *s = j->src + t * n;
+    uint8_t *d = (uint8_t *)out->data + t * n * out->c;
+    float v;
+    for (c = 0; c < out->c; c++) {
+        for (i = 0; i < n; i++) {
+            v = floorf(s[c * plane + i] * j->scale + 0.5f);
+            d[i * out->c + c] = v < 0.0f ? 0 : v > 255.0f ? 255 : (uint8_t)v;
+        }
+    }
+}
+
+/*
+float input (c, z, y, x) -> uint8 (z, y, x, c), q = round(in * scale);
+the shape and data of out are set by the caller. sf is 8: the first conv
+carries the factor 256 / scale in its mult.
+*/
+void quantize_u8(tpool *p, const float *in, float scale, qtensor *out) {
+    qop_job j;
+    out->type = QT_U8;
+    out->sf = 8;
+    j.src = in;
+    j.out = out;
+    j.scale = scale;
+    tpool_run(p, quant_task, &j, out->z);
+}
@@ -0,0 +1,204 @@
+/*
+Forward pass of a quantized unet3D_m1 (scripts/quant.py: quantize_weight
++ quantize_feat) with the fixed-point kernels of qconv.c. The layers and
+the activation plan are those of unet.c; activations are channel-last
+and take one byte:
+  input: float -> uint8 (in_scale)
+  downC, center, upC: int8 at the sf of the LinearQuant after each LeakyReLU
+  upS: int8 at the sf of the LinearQuant after the 1x1 conv
+  mergeCrop: the two sources keep their own sf (qconv3d_cat)
+  final: dequantized at its sf_out, then sigmoid in float
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "engine.h"
+
+// all convs of the net, returns their count
+static int qconv_list(unet_q8 *net, qconv_param **list) {
+    int i, j, n = 0;
+    for (i = 0; i < net->depth; i++) {
+        for (j = 0; j < 2; j++) {
+            list[n++] = &net->down[i][j];
+            list[n++] = &net->upc[i][j];
+        }
+        list[n++] = &net->up[i];
+    }
+    list[n++] = &net->center[0];
+    list[n++] = &net->center[1];
+    list[n++] = &net->final;
+    return n;
+}
+
+// kernel layout of the weights (qconv_prepare)
+int unet_q8_prepare(unet_q8 *net) {
+    qconv_param *list[5 * ENGINE_MAX_DEPTH + 3];
+    int i, n = qconv_list(net, list);
+    for (i = 0; i < n; i++) {
+        list[i]->wt = NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (qconv_prepare(list[i]) != 0) {
+            unet_q8_release(net);
+            return ENGINE_ERR_MEMORY;
+        }
+    }
+    return 0;
+}
+
+void unet_q8_release(unet_q8 *net) {
+    qconv_param *list[5 * ENGINE_MAX_DEPTH + 3];
+    int i, n = qconv_list(net, list);
+    for (i = 0; i < n; i++) {
+        qconv_release(list[i]);
+    }
+}
+
+int unet_q8_shape(const unet_q8 *net, const long in_sz[3], long out_sz[3]) {
+    long skip_sz[ENGINE_MAX_DEPTH][3];
+    return unet_sizes(net->depth, in_sz, out_sz, skip_sz);
+}
+
+static void conv_size(const qtensor *in, const qconv_param *cp, long sz[3]) {
+    sz[0] = in->z - cp->k[0] + 1;
+    sz[1] = in->y - cp->k[1] + 1;
+    sz[2] = in->x - cp->k[2] + 1;
+}
+
+// conv_pair of unet.c on int8 tensors, in is released
+static int conv_pair(const unet_q8 *net, act_plan *pl, const qconv_param cp[2], qtensor *in,
+                     qtensor *in1, const long off1[3], qtensor *out) {
+    qtensor mid;
+    long sz[3];
+    conv_size(in, cp, sz);
+    if (plan_alloc_q(pl, &mid, QT_S8, cp[0].co, sz) != 0) return ENGINE_ERR_MEMORY;
+    if (!pl->record) {
+        qconv3d_cat(net->pool, cp, in, in1, off1, ACT_LEAKY, net->slope, &mid);
+    }
+    plan_release_q(pl, in);
+    if (in1 != NULL) plan_release_q(pl, in1);
+    conv_size(&mid, cp + 1, sz);
+    if (plan_alloc_q(pl, out, QT_S8, cp[1].co, sz) != 0) {
+        plan_release_q(pl, &mid);
+        return ENGINE_ERR_MEMORY;
+    }
+    if (!pl->record) {
+        qconv3d_cat(net->pool, cp + 1, &mid, NULL, NULL, ACT_LEAKY, net->slope, out);
+    }
+    plan_release_q(pl, &mid);
+    return 0;
+}
+
+static void no_buf(qtensor *t) {
+    t->data = NULL;
+    t->buf = -1;
+}
+
+// forward() of unet.c; the quantized input is the first arena buffer
+static int forward(const unet_q8 *net, act_plan *pl, const float *in, float *out) {
+    qtensor skip[ENGINE_MAX_DEPTH];
+    qtensor x, y, res;
+    tensor fres;
+    long sz[3], off[3];
+    int i, lv, ret = ENGINE_ERR_MEMORY;
+
+    for (i = 0; i < net->depth; i++) {
+        no_buf(skip + i);
+    }
+    no_buf(&x);
+    no_buf(&y);
+    if (plan_alloc_q(pl, &x, QT_U8, net->in_num, pl->in_sz) != 0) goto fail;
+    if (!pl->record) quantize_u8(net->pool, in, net->in_scale, &x);
+
+    for (i = 0; i < net->depth; i++) {
+        if (conv_pair(net, pl, net->down[i], &x, NULL, NULL, skip + i) != 0) goto fail;
+        sz[0] = skip[i].z;
+        sz[1] = skip[i].y / 2;
+        sz[2] = skip[i].x / 2;
+        if (plan_alloc_q(pl, &x, QT_S8, skip[i].c, sz) != 0) goto fail;
+        if (!pl->record) qmaxpool_122(net->pool, skip + i, &x);
+    }
+    if (conv_pair(net, pl, net->center, &x, NULL, NULL, &y) != 0) goto fail;
+    x = y;
+    no_buf(&y);
+
+    for (i = 0; i < net->depth; i++) {
+        lv = net->depth - 1 - i;
+        sz[0] = x.z;
+        sz[1] = x.y * 2;
+        sz[2] = x.x * 2;
+        if (plan_alloc_q(pl, &y, QT_S8, net->up[i].co, sz) != 0) goto fail;
+        if (!pl->record) qconv1x1_up2(net->pool, net->up + i, &x, &y);
+        plan_release_q(pl, &x);
+        off[0] = (skip[lv].z - sz[0]) / 2;
+        off[1] = (skip[lv].y - sz[1]) / 2;
+        off[2] = (skip[lv].x - sz[2]) / 2;
+        if (conv_pair(net, pl, net->upc[i], &y, skip + lv, off, &x) != 0) goto fail;
+    }
+    if (!pl->record) {
+        res.data = out;
+        res.type = QT_F32;
+        res.buf = -1;
+        qconv3d_cat(net->pool, &net->final, &x, NULL, NULL, ACT_NONE, 0.0f, &res);
+        fres.data = out;
+        fres.c = res.c;
+        fres.z = res.z;
+        fres.y = res.y;
+        fres.x = res.x;
+        sigmoid_inplace(&fres);
+    }
+    ret = 0;
+fail:
+    plan_release_q(pl, &x);
+    plan_release_q(pl, &y);
+    for (i = 0; i < net->depth; i++) {
+        plan_release_q(pl, skip + i);
+    }
+    return ret;
+}
+
+// unet_m1_plan for the int8 net; sizes stay in floats (4 int8 values)
+int unet_q8_plan(const unet_q8 *net, const long in_sz[3], act_plan *pl) {
+    long out_sz[3];
+    int d, ret;
+    if (unet_q8_shape(net, in_sz, out_sz) != 0) {
+        return ENGINE_ERR_SHAPE;
+    }
+    for (d = 0; d < 3; d++) {
+        pl->in_sz[d] = in_sz[d];
+    }
+    plan_reset(pl, 1);
+    ret = forward(net, pl, NULL, NULL);
+    if (ret != 0) return ret;
+    plan_assign(pl);
+    return 0;
+}
+
+/*
+in: (in_num, pl->in_sz) float32, out: (out_num, unet_q8_shape(pl->in_sz))
+float32, with an arena of pl->peak floats, as unet_m1_forward_plan.
+*/
+int unet_q8_forward_plan(const unet_q8 *net, act_plan *pl, float *arena, const float *in,
+                         float *out) {
+    act_plan run = *pl;
+    run.arena = arena;
+    plan_reset(&run, 0);
+    return forward(net, &run, in, out);
+}
+
+int unet_q8_forward(const unet_q8 *net, const float *in, const long in_sz[3], float *out) {
+    act_plan *pl = malloc(sizeof(act_plan));
+    float *arena = NULL;
+    int ret = ENGINE_ERR_MEMORY;
+    if (pl == NULL) return ret;
+    ret = unet_q8_plan(net, in_sz, pl);
+    if (ret == 0) {
+        arena = malloc(pl->peak * sizeof(float));
+        ret = arena != NULL ? unet_q8_forward_plan(net, pl, arena, in, out) : ENGINE_ERR_MEMORY;
+    }
+    free(arena);
+    free(pl);
+    return ret;
+}
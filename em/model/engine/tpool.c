@@ -0,0 +1,109 @@
+/*
+Persistent thread pool for the inference kernels.
+
+A run hands out task indices with an atomic counter; the calling thread
+works too and returns once every worker has left the run. Workers sleep on
+a condition variable between runs.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "engine.h"
+
+static void drain(tpool *p) {
+    long i;
+    while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n) {
+        p->fn(p->arg, i);
+    }
+}
+
+static void *tpool_worker(void *arg) {
+    tpool *p = (tpool *)arg;
+    long seen = 0;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->gen == seen && !p->stop) {
+            pthread_cond_wait(&p->start, &p->lock);
+        }
+        if (p->stop) {
+            break;
+        }
+        seen = p->gen;
+        pthread_mutex_unlock(&p->lock);
+        drain(p);
+        pthread_mutex_lock(&p->lock);
+        if (--p->active == 0) {
+            pthread_cond_signal(&p->done);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int tpool_create(tpool *p, int num_thread) {
+    int i;
+    memset(p, 0, sizeof(tpool));
+    p->num_thread = 1;
+    if (num_thread < 1) {
+        num_thread = 1;
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+    p->thread = calloc(num_thread, sizeof(pthread_t));
+    if (p->thread == NULL) {
+        return ENGINE_ERR_MEMORY;
+    }
+    for (i = 1; i < num_thread; i++) {
+        if (pthread_create(p->thread + i, NULL, tpool_worker, p) != 0) {
+            break;
+        }
+        p->num_thread++;
+    }
+    return 0;
+}
+
+void tpool_destroy(tpool *p) {
+    int i;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 1; i < p->num_thread; i++) {
+        pthread_join(p->thread[i], NULL);
+    }
+    free(p->thread);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+}
+
+void tpool_run(tpool *p, tpool_fn fn, void *arg, long n) {
+    if (p == NULL || p->num_thread == 1 || n == 1) {
+        long i;
+        for (i = 0; i < n; i++) {
+            fn(arg, i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->arg = arg;
+    p->n = n;
+    p->next = 0;
+    p->active = p->num_thread - 1;
+    p->gen++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    drain(p);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->active > 0) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
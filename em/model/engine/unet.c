@@ -0,0 +1,394 @@
+/*
+Forward pass of unet3D_m1 (em/model/deploy.py) on one sample:
+  downC: 2x (conv 3x3x3 valid + LeakyReLU), then MaxPool (1,2,2)
+  center: 2x (conv 3x3x3 valid + LeakyReLU)
+  upS: depthwise ConvTranspose (1,2,2) + conv 1x1; with the usual fixed
+       weights (constant per channel) rewritten as conv 1x1 on the coarse
+       grid + nearest replication (unet_m1_prepare)
+  mergeCrop: the first upC conv reads cat([upsampled, cropped skip])
+             straight from both tensors (conv3d_cat), then upC as downC
+  final: conv 1x1 + sigmoid
+3x3x3 convs with many channels run as Winograd F(2x2x2, 3x3x3) (winograd.c).
+All intermediate tensors live in one arena laid out by a static plan (plan.c).
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "engine.h"
+
+// output size of a depth-level unet3D_m1 for an input patch; skip sizes go
+// to skip_sz if not NULL
+int unet_sizes(int depth, const long in_sz[3], long out_sz[3], long skip_sz[][3]) {
+    long sz[3];
+    int i, d;
+    for (d = 0; d < 3; d++) {
+        sz[d] = in_sz[d];
+    }
+    for (i = 0; i < depth; i++) {
+        for (d = 0; d < 3; d++) {
+            sz[d] -= 4;
+            if (skip_sz != NULL) skip_sz[i][d] = sz[d];
+        }
+        sz[1] /= 2;
+        sz[2] /= 2;
+    }
+    for (d = 0; d < 3; d++) {
+        sz[d] -= 4;
+        if (sz[d] <= 0) return ENGINE_ERR_SHAPE;
+    }
+    for (i = depth - 1; i >= 0; i--) {
+        sz[1] *= 2;
+        sz[2] *= 2;
+        for (d = 0; d < 3; d++) {
+            if (skip_sz != NULL && skip_sz[i][d] < sz[d]) return ENGINE_ERR_SHAPE;
+            sz[d] -= 4;
+            if (sz[d] <= 0) return ENGINE_ERR_SHAPE;
+        }
+    }
+    for (d = 0; d < 3; d++) {
+        out_sz[d] = sz[d];
+    }
+    return 0;
+}
+
+int unet_m1_shape(const unet_m1 *net, const long in_sz[3], long out_sz[3]) {
+    long skip_sz[ENGINE_MAX_DEPTH][3];
+    return unet_sizes(net->depth, in_sz, out_sz, skip_sz);
+}
+
+// the 3x3x3 convs of the net, returns their count
+static int conv3_list(unet_m1 *net, conv_param **list) {
+    int i, j, n = 0;
+    for (i = 0; i < net->depth; i++) {
+        for (j = 0; j < 2; j++) {
+            list[n++] = &net->down[i][j];
+            list[n++] = &net->upc[i][j];
+        }
+    }
+    list[n++] = &net->center[0];
+    list[n++] = &net->center[1];
+    return n;
+}
+
+/*
+Inference-time rewrite of upS. up(x)[c, 2y+i, 2x+j] = x[c, y, x] * u[c, i, j];
+when u[c] is one value s_c for all (i, j) (fill_(1.0) in deploy.py), the 1x1
+conv that follows equals a 1x1 conv with weights W[o, c] * s_c on x, then
+replicated. Other weights keep the two-step path.
+
+Then the 3x3x3 convs with enough channels get Winograd weights
+(conv_winograd_prepare); a layer that fails the check stays direct.
+*/
+int unet_m1_prepare(unet_m1 *net) {
+    conv_param *conv3[4 * ENGINE_MAX_DEPTH + 2];
+    int i, c, o, k, n, ret;
+    const float *u;
+    float *w;
+    n = conv3_list(net, conv3);
+    for (i = 0; i < n; i++) {
+        if (!conv3[i]->wino_ext) {
+            conv3[i]->wino = NULL;
+            conv3[i]->wino_err = -1.0f;
+        }
+    }
+    for (i = 0; i < net->depth; i++) {
+        net->up[i].wino = NULL;
+    }
+    net->final.wino = NULL;
+    for (i = 0; i < net->depth; i++) {
+        net->up_fused[i] = 0;
+        u = net->up_w[i];
+        for (c = 0; c < net->up[i].ci; c++) {
+            for (k = 1; k < 4; k++) {
+                if (u[4 * c + k] != u[4 * c]) break;
+            }
+            if (k < 4) break;
+        }
+        if (c < net->up[i].ci) {
+            continue;
+        }
+        w = malloc(net->up[i].co * net->up[i].ci * sizeof(float));
+        if (w == NULL) {
+            unet_m1_release(net);
+            return ENGINE_ERR_MEMORY;
+        }
+        for (o = 0; o < net->up[i].co; o++) {
+            for (c = 0; c < net->up[i].ci; c++) {
+                w[o * net->up[i].ci + c] = net->up[i].w[o * net->up[i].ci + c] * u[4 * c];
+            }
+        }
+        net->upf[i] = net->up[i];
+        net->upf[i].w = w;
+        net->up_fused[i] = 1;
+    }
+    for (i = 0; i < n && net->wino_min > 0; i++) {
+        if (conv3[i]->wino_ext || conv3[i]->ci < net->wino_min ||
+            conv3[i]->co < net->wino_min) {
+            continue;
+        }
+        ret = conv_winograd_prepare(net->pool, conv3[i], net->wino_tol);
+        if (ret != 0) {
+            unet_m1_release(net);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void unet_m1_release(unet_m1 *net) {
+    conv_param *conv3[4 * ENGINE_MAX_DEPTH + 2];
+    int i, n;
+    for (i = 0; i < net->depth; i++) {
+        if (net->up_fused[i]) {
+            free((float *)net->upf[i].w);
+        }
+        net->up_fused[i] = 0;
+    }
+    n = conv3_list(net, conv3);
+    for (i = 0; i < n; i++) {
+        if (!conv3[i]->wino_ext) {
+            free(conv3[i]->wino);
+            conv3[i]->wino = NULL;
+        }
+    }
+}
+
+static void conv_size(const tensor *in, const conv_param *cp, long sz[3]) {
+    sz[0] = in->z - cp->k[0] + 1;
+    sz[1] = in->y - cp->k[1] + 1;
+    sz[2] = in->x - cp->k[2] + 1;
+}
+
+/*
+two conv + LeakyReLU layers, in -> out; the first conv also reads the
+channels of in1 (cropped at off1) if not NULL. in and in1 are released,
+in only unless keep_in. With pl->record only the buffers are logged.
+*/
+static int conv_pair(const unet_m1 *net, act_plan *pl, const conv_param cp[2], tensor *in,
+                     int keep_in, tensor *in1, const long off1[3], tensor *out) {
+    tensor mid;
+    long sz[3];
+    int ret = 0;
+    conv_size(in, cp, sz);
+    if (plan_alloc(pl, &mid, cp[0].co, sz) != 0) return ENGINE_ERR_MEMORY;
+    if (!pl->record) {
+        ret = conv3d_cat(net->pool, cp, in, in1, off1, ACT_LEAKY, net->slope, &mid);
+    }
+    if (!keep_in) plan_release(pl, in);
+    if (in1 != NULL) plan_release(pl, in1);
+    if (ret != 0) {
+        plan_release(pl, &mid);
+        return ret;
+    }
+    conv_size(&mid, cp + 1, sz);
+    if (plan_alloc(pl, out, cp[1].co, sz) != 0) {
+        plan_release(pl, &mid);
+        return ENGINE_ERR_MEMORY;
+    }
+    if (!pl->record) {
+        ret = conv3d(net->pool, cp + 1, &mid, ACT_LEAKY, net->slope, out);
+    }
+    plan_release(pl, &mid);
+    if (ret != 0) plan_release(pl, out);
+    return ret;
+}
+
+static void no_buf(tensor *t) {
+    t->data = NULL;
+    t->buf = -1;
+}
+
+// one pass over the layers: records the buffers or computes, see plan.c
+static int forward(const unet_m1 *net, act_plan *pl, const float *in, float *out) {
+    tensor skip[ENGINE_MAX_DEPTH];
+    tensor x, y, up, res;
+    long sz[3], off[3];
+    int i, lv, ret = ENGINE_ERR_MEMORY;
+
+    for (i = 0; i < net->depth; i++) {
+        no_buf(skip + i);
+    }
+    no_buf(&x);
+    no_buf(&y);
+    no_buf(&up);
+    x.data = (float *)in;
+    x.c = net->in_num;
+    x.z = pl->in_sz[0];
+    x.y = pl->in_sz[1];
+    x.x = pl->in_sz[2];
+
+    for (i = 0; i < net->depth; i++) {
+        if (conv_pair(net, pl, net->down[i], &x, i == 0, NULL, NULL, skip + i) != 0) goto fail;
+        sz[0] = skip[i].z;
+        sz[1] = skip[i].y / 2;
+        sz[2] = skip[i].x / 2;
+        if (plan_alloc(pl, &x, skip[i].c, sz) != 0) goto fail;
+        if (!pl->record) maxpool_122(net->pool, skip + i, &x);
+    }
+    if (conv_pair(net, pl, net->center, &x, 0, NULL, NULL, &y) != 0) goto fail;
+    x = y;
+    no_buf(&y);
+
+    for (i = 0; i < net->depth; i++) {
+        lv = net->depth - 1 - i;
+        // upS
+        sz[0] = x.z;
+        sz[1] = x.y * 2;
+        sz[2] = x.x * 2;
+        if (net->up_fused[i]) {
+            if (plan_alloc(pl, &y, net->upf[i].co, sz) != 0) goto fail;
+            if (!pl->record) conv1x1_up2(net->pool, net->upf + i, &x, &y);
+            plan_release(pl, &x);
+        } else {
+            if (plan_alloc(pl, &up, x.c, sz) != 0) goto fail;
+            if (!pl->record) upsample_122(net->pool, net->up_w[i], &x, &up);
+            plan_release(pl, &x);
+            if (plan_alloc(pl, &y, net->up[i].co, sz) != 0) goto fail;
+            if (!pl->record) conv3d(net->pool, net->up + i, &up, ACT_NONE, 0.0f, &y);
+            plan_release(pl, &up);
+        }
+        // mergeCrop + upC
+        off[0] = (skip[lv].z - sz[0]) / 2;
+        off[1] = (skip[lv].y - sz[1]) / 2;
+        off[2] = (skip[lv].x - sz[2]) / 2;
+        if (conv_pair(net, pl, net->upc[i], &y, 0, skip + lv, off, &x) != 0) goto fail;
+    }
+    if (!pl->record) {
+        res.data = out;
+        conv3d(net->pool, &net->final, &x, ACT_NONE, 0.0f, &res);
+        sigmoid_inplace(&res);
+    }
+    ret = 0;
+fail:
+    plan_release(pl, &x);
+    plan_release(pl, &y);
+    plan_release(pl, &up);
+    for (i = 0; i < net->depth; i++) {
+        plan_release(pl, skip + i);
+    }
+    return ret;
+}
+
+/*
+Activation plan for an input patch: buffer sizes, lifetimes and arena
+offsets; pl->peak floats of arena run unet_m1_forward_plan.
+*/
+int unet_m1_plan(const unet_m1 *net, const long in_sz[3], act_plan *pl) {
+    long out_sz[3];
+    int d, ret;
+    if (unet_m1_shape(net, in_sz, out_sz) != 0) {
+        return ENGINE_ERR_SHAPE;
+    }
+    for (d = 0; d < 3; d++) {
+        pl->in_sz[d] = in_sz[d];
+    }
+    plan_reset(pl, 1);
+    ret = forward(net, pl, NULL, NULL);
+    if (ret != 0) return ret;
+    plan_assign(pl);
+    return 0;
+}
+
+/*
+in: (in_num, pl->in_sz), out: (out_num, unet_m1_shape(pl->in_sz)), with
+an arena of pl->peak floats; nothing is allocated but the Winograd
+scratch. pl is only read, so one plan may serve several threads, each
+with its own arena.
+*/
+int unet_m1_forward_plan(const unet_m1 *net, act_plan *pl, float *arena, const float *in,
+                         float *out) {
+    act_plan run = *pl;
+    run.arena = arena;
+    plan_reset(&run, 0);
+    return forward(net, &run, in, out);
+}
+
+/*
+in: (in_num, in_sz) float32, out: (out_num, unet_m1_shape(in_sz)) float32.
+*/
+int unet_m1_forward(const unet_m1 *net, const float *in, const long in_sz[3], float *out) {
+    act_plan *pl = malloc(sizeof(act_plan));
+    float *arena = NULL;
+    int ret = ENGINE_ERR_MEMORY;
+    if (pl == NULL) return ret;
+    ret = unet_m1_plan(net, in_sz, pl);
+    if (ret == 0) {
+        arena = malloc(pl->peak * sizeof(float));
+        ret = arena != NULL ? unet_m1_forward_plan(net, pl, arena, in, out) : ENGINE_ERR_MEMORY;
+    }
+    free(arena);
+    free(pl);
+    return ret;
+}
+
+// input + output + arena, floats
+static long patch_floats(const unet_m1 *net, act_plan *pl, const long in_sz[3]) {
+    long out_sz[3];
+    if (unet_m1_plan(net, in_sz, pl) != 0) return -1;
+    unet_m1_shape(net, in_sz, out_sz);
+    return net->in_num * in_sz[0] * in_sz[1] * in_sz[2] +
+           net->out_num * out_sz[0] * out_sz[1] * out_sz[2] + pl->peak;
+}
+
+// no row or column lost to the floor of an odd size before a pooling
+static int pool_exact(const unet_m1 *net, long n) {
+    int i;
+    for (i = 0; i < net->depth; i++) {
+        n -= 4;
+        if (n % 2 != 0) return 0;
+        n /= 2;
+    }
+    return 1;
+}
+
+/*
+Largest square patch (in_sz[0], n, n) whose input, output and activation
+arena fit in budget bytes; in_sz[0] is given. The memory grows with n, so
+n is found by bisection, then lowered to the closest size that pools
+without flooring. Returns ENGINE_ERR_SHAPE if even the smallest patch
+does not fit.
+*/
+int unet_m1_max_input(const unet_m1 *net, long budget, long in_sz[3]) {
+    act_plan *pl = malloc(sizeof(act_plan));
+    long sz[3], out_sz[3], lo, hi, mid, n, m;
+    int ret = ENGINE_ERR_SHAPE;
+    if (pl == NULL) return ENGINE_ERR_MEMORY;
+    budget /= sizeof(float);
+    sz[0] = in_sz[0];
+    // smallest valid n
+    for (lo = 1; lo < 1L << 16; lo++) {
+        sz[1] = sz[2] = lo;
+        if (unet_m1_shape(net, sz, out_sz) == 0) break;
+    }
+    sz[1] = sz[2] = lo;
+    m = patch_floats(net, pl, sz);
+    if (m < 0 || m > budget) goto done;
+    hi = lo;
+    do {
+        hi *= 2;
+        sz[1] = sz[2] = hi;
+        m = patch_floats(net, pl, sz);
+    } while (m >= 0 && m <= budget && hi < 1L << 16);
+    // patch_floats(lo) fits, patch_floats(hi) does not
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        sz[1] = sz[2] = mid;
+        m = patch_floats(net, pl, sz);
+        if (m >= 0 && m <= budget) lo = mid; else hi = mid;
+    }
+    in_sz[1] = in_sz[2] = lo;
+    for (n = lo; n > lo - (2L << net->depth); n--) {
+        sz[1] = sz[2] = n;
+        if (unet_m1_shape(net, sz, out_sz) != 0) break;
+        if (pool_exact(net, n)) {
+            in_sz[1] = in_sz[2] = n;
+            break;
+        }
+    }
+    ret = 0;
+done:
+    free(pl);
+    return ret;
+}
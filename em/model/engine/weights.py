@@ -0,0 +1,81 @@
+"""
+Flat weight files: writer and python entry points.
+
+See wfile.c for the layout. Tensors are stored c-contiguous and
+little-endian under their names; the engine files of engine.save_model and
+engine.save_quant_model add config.* (and quant.*) entries.
+"""
+
+import struct
+import numpy as np
+
+from _engine import WeightFile
+
+WFILE_MAGIC = b'EMWT'
+WFILE_VERSION = 1
+WFILE_HEADER_SIZE = 64
+WFILE_ALIGN = 64
+WFILE_MAX_NAME = 48
+WFILE_MAX_DIM = 6
+
+# magic, version, count, align, table_offset, size
+HEADER_FMT = '<4sIIIQQ'
+# name, dtype, itemsize, ndim, shape[6], offset, nbytes
+ENTRY_FMT = '<48s8sII6QQQ'
+
+
+def pack_header(count, table_offset, size):
+    hdr = struct.pack(HEADER_FMT, WFILE_MAGIC, WFILE_VERSION, count, WFILE_ALIGN,
+                      table_offset, size)
+    return hdr + b'\0' * (WFILE_HEADER_SIZE - len(hdr))
+
+
+def align(fid):
+    pad = -fid.tell() % WFILE_ALIGN
+    if pad > 0:
+        fid.write(b'\0' * pad)
+
+
+def writeweights(filename, tensors):
+    """
+    Write tensors ({name: array} or [(name, array)], the file order) as a
+    flat weight file.
+    """
+    if hasattr(tensors, 'items'):
+        tensors = list(tensors.items())
+    arrays = []
+    for name, v in tensors:
+        v = np.asarray(v)
+        if v.dtype.kind not in 'biuf' or v.ndim > WFILE_MAX_DIM:
+            raise ValueError('%s: cannot store %s array of %d dims' % (name, v.dtype, v.ndim))
+        if not 0 < len(name) < WFILE_MAX_NAME:
+            raise ValueError('%s: name longer than %d' % (name, WFILE_MAX_NAME - 1))
+        arrays.append((name, np.asarray(v, dtype=v.dtype.newbyteorder('<'), order='C')))
+
+    table_offset = WFILE_HEADER_SIZE
+    offset = table_offset + len(arrays) * struct.calcsize(ENTRY_FMT)
+    table = []
+    for name, v in arrays:
+        offset += -offset % WFILE_ALIGN
+        shape = list(v.shape) + [0] * (WFILE_MAX_DIM - v.ndim)
+        table.append(struct.pack(ENTRY_FMT, name.encode(), v.dtype.str.encode(), v.itemsize,
+                                 v.ndim, *(shape + [offset, v.nbytes])))
+        offset += v.nbytes
+
+    fid = open(filename, 'wb')
+    fid.write(pack_header(len(arrays), table_offset, offset))
+    fid.write(b''.join(table))
+    for name, v in arrays:
+        align(fid)
+        fid.write(v.tobytes())
+    fid.close()
+
+
+def readweights(filename):
+    """Map a flat weight file; its tensors are read-only arrays over the mapping."""
+    return WeightFile(filename)
+
+
+def isweights(filename):
+    with open(filename, 'rb') as fid:
+        return fid.read(4) == WFILE_MAGIC
@@ -0,0 +1,103 @@
+/*
+Flat weight file reader.
+
+File layout (little-endian):
+  header (WFILE_HEADER_SIZE bytes, see wfile_header)
+  tensor table: count x wfile_entry (128 bytes), at header.table_offset
+  blobs: c-contiguous tensor data, each 64-byte aligned
+
+The file is mmap-ed read-only and the blobs are used in place: opening a
+model costs a table check and page faults on first use, and the page cache
+is shared by every process running the same weights. Written by
+engine/weights.py.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "engine.h"
+
+// name terminated, shape consistent with nbytes, blob aligned and inside the file
+static int entry_valid(const wfile *wf, const wfile_entry *e) {
+    uint64_t n = e->itemsize;
+    uint32_t d;
+    if (memchr(e->name, 0, WFILE_MAX_NAME) == NULL || e->name[0] == 0 ||
+        e->ndim > WFILE_MAX_DIM || e->itemsize == 0) {
+        return 0;
+    }
+    for (d = 0; d < e->ndim; d++) {
+        if (e->shape[d] != 0 && n > UINT64_MAX / e->shape[d]) return 0;
+        n *= e->shape[d];
+    }
+    return n == e->nbytes && e->offset % WFILE_ALIGN == 0 &&
+           e->offset >= wf->hdr.table_offset + wf->hdr.count * sizeof(wfile_entry) &&
+           e->offset <= wf->size && e->nbytes <= wf->size - e->offset;
+}
+
+int wfile_open(wfile *wf, const char *path) {
+    struct stat st;
+    uint32_t i;
+    memset(wf, 0, sizeof(wfile));
+    wf->fd = open(path, O_RDONLY);
+    if (wf->fd < 0) {
+        return WFILE_ERR_IO;
+    }
+    if (fstat(wf->fd, &st) != 0 || st.st_size < WFILE_HEADER_SIZE) {
+        wfile_close(wf);
+        return WFILE_ERR_FORMAT;
+    }
+    wf->size = st.st_size;
+    wf->base = mmap(NULL, wf->size, PROT_READ, MAP_SHARED, wf->fd, 0);
+    if (wf->base == MAP_FAILED) {
+        wfile_close(wf);
+        return WFILE_ERR_IO;
+    }
+    memcpy(&wf->hdr, wf->base, sizeof(wfile_header));
+    if (memcmp(wf->hdr.magic, WFILE_MAGIC, 4) != 0 || wf->hdr.version != WFILE_VERSION ||
+        wf->hdr.align != WFILE_ALIGN || wf->hdr.size != wf->size ||
+        wf->hdr.table_offset < WFILE_HEADER_SIZE || wf->hdr.table_offset % 8 != 0 ||
+        wf->hdr.table_offset > wf->size ||
+        wf->hdr.count > (wf->size - wf->hdr.table_offset) / sizeof(wfile_entry)) {
+        wfile_close(wf);
+        return WFILE_ERR_FORMAT;
+    }
+    wf->table = (const wfile_entry *)(wf->base + wf->hdr.table_offset);
+    for (i = 0; i < wf->hdr.count; i++) {
+        if (!entry_valid(wf, wf->table + i)) {
+            wfile_close(wf);
+            return WFILE_ERR_FORMAT;
+        }
+    }
+    // the engines read all the weights while preparing: start the reads now
+    posix_madvise((void *)wf->base, wf->size, POSIX_MADV_WILLNEED);
+    return 0;
+}
+
+void wfile_close(wfile *wf) {
+    if (wf->base != NULL && wf->base != MAP_FAILED) {
+        munmap((void *)wf->base, wf->size);
+    }
+    if (wf->fd >= 0) {
+        close(wf->fd);
+    }
+    wf->base = NULL;
+    wf->table = NULL;
+    wf->fd = -1;
+}
+
+// table index of the tensor, -1 if not in the file
+long wfile_find(const wfile *wf, const char *name) {
+    uint32_t i;
+    for (i = 0; i < wf->hdr.count; i++) {
+        if (strncmp(wf->table[i].name, name, WFILE_MAX_NAME) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -32,10 +32,14 @@ def convert_state_dict(state_dict, num_gpu):
             state_dict['module.'+k] = v
             state_dict.pop(k,None)
 
-def load_checkpoint(snapshot, num_gpu=1):
+def load_checkpoint(snapshot, num_gpu=1, cpu=False):
+    # cpu: load cuda-saved tensors on hosts without a GPU
     import torch
     if isinstance(snapshot, basestring):
-        cp = torch.load(snapshot)
+        if cpu:
+            cp = torch.load(snapshot, map_location=lambda storage, loc: storage)
+        else:
+            cp = torch.load(snapshot)
         if type(cp) is not dict:
             # model -> state_dict
             cp={'epoch':0, 'state_dict': cp.state_dict()}
@@ -124,6 +128,47 @@ def pth2pkl(mn,outN=None):
         import pickle
         pickle.dump(net,open(outN,'wb'))
 
+def pkl2state_dict_m1(weights):
+    # pkl weights -> unet3D_m1 state_dict, as load_weights_pkl_m1
+    out={}
+    def conv(key, name, bias=True):
+        out[key+'.weight'] = weights[name]['w']
+        if bias:
+            out[key+'.bias'] = weights[name]['b']
+    for i in range(3):
+        for j in range(2):
+            conv('downC.%d.%d' % (i,2*j), 'Convolution'+str(2*i+j+1))
+    for j in range(2):
+        conv('center.%d' % (2*j), 'Convolution'+str(7+j))
+    for i in range(3):
+        conv('upS.%d.0' % i, 'Deconvolution'+str(i+1), False)
+        conv('upS.%d.1' % i, 'Convolution'+str(9+i*3))
+        for j in range(2):
+            conv('upC.%d.%d' % (i,2*j), 'Convolution'+str(10+3*i+j))
+    conv('final.0', 'Convolution18')
+    return out
+
+# flat weight files of the native engine (em/model/engine/weights.py):
+# mmap-ed at load, no deserialization and one copy per host
+def pkl2flat(mn, outN, relu_slope=0.005, num_thread=1):
+    import pickle
+    from em.model.engine.engine import save_state_dict
+    save_state_dict(outN, pkl2state_dict_m1(pickle.load(open(mn,'rb'))), relu_slope=relu_slope,
+                    num_thread=num_thread)
+
+def pth2flat(mn, outN, relu_slope=0.005, num_thread=1):
+    # unet3D_m1 checkpoint or model
+    from em.model.engine.engine import save_state_dict
+    cp = load_checkpoint(mn, 1, True)
+    save_state_dict(outN, cp['state_dict'], relu_slope=relu_slope, num_thread=num_thread)
+
+def quant2flat(mn, outN, weight_method='linear'):
+    # quantized model of scripts/quant.py: int8 / log2 weights and scales
+    import torch
+    from em.model.engine.engine import save_quant_model
+    save_quant_model(outN, torch.load(mn, map_location=lambda storage, loc: storage),
+                     weight_method=weight_method)
+
 # 3. initialization
 def weight_filler(ksizes, opt_scale=2.0, opt_norm=2):
     kk=0
@@ -0,0 +1,185 @@
+# tiling planner for whole-volume inference with valid convolutions
+# each tile recomputes the context (input - output) that its neighbours also
+# compute, and a small tile loses most of its FLOPs to it: the planner walks
+# the layer sizes of unet3D_m1 / unet3D for every candidate input patch and
+# ranks (input, output, stride) by FLOPs per output voxel of the whole volume
+import numpy as np
+
+class UNetSpec(object):
+    # layer sizes of a symmetric U-Net, no weights
+    #   pad: conv padding of the (down, center, up) arms (0: valid, 1: same)
+    #   merge: 'crop' (mergeCrop, channels add up) or 'add' (mergeAdd)
+    def __init__(self, filters=[24,72,216,648], in_num=1, out_num=3, pad=(0,0,0),
+                 pool=(1,2,2), merge='crop'):
+        self.filters = list(filters)
+        self.depth = len(filters)-1
+        self.in_num = in_num
+        self.out_num = out_num
+        self.pad = pad
+        self.pool = np.array(pool, dtype=int)
+        self.merge = merge
+
+    def walk(self, in_size):
+        # tensors: [(name, channels, size)], tensors[0] is the input
+        # convs: [(name, ci, co, k, level, in, out)], tensor indices
+        # live: per step (conv or pooling), the tensors held in the order of
+        #   the native engine (unet.c): skips until their upC, the rest freed
+        #   right after use; input and output always
+        # ok: per axis, all sizes > 0 and the skips cover the upsampled sizes
+        f = self.filters
+        fin = [self.in_num] + f[:-1]
+        tensors = [('input', self.in_num, np.array(in_size, dtype=int))]
+        convs, live, skip = [], [], []
+        ok = np.ones(len(tensors[0][2]), dtype=bool)
+        def add(name, c, sz):
+            tensors.append((name, c, sz))
+            ok[:] &= sz > 0
+            return len(tensors)-1
+        def conv(name, ci, co, k, pad, lv, x, sz=None):
+            if sz is None:
+                sz = tensors[x][2] - (k-1) + 2*pad*(k//2)
+            y = add(name, co, sz)
+            convs.append((name, ci, co, k, lv, x, y))
+            live.append(sorted(set(skip + [0, x, y])))
+            return y
+        x = 0
+        for i in range(self.depth):
+            x = conv('downC.%d.0' % i, fin[i], f[i], 3, self.pad[0], i, x)
+            x = conv('downC.%d.2' % i, f[i], f[i], 3, self.pad[0], i, x)
+            skip.append(x)
+            y = add('downS.%d' % i, f[i], tensors[x][2] // self.pool)
+            live.append(sorted(set(skip + [0, y])))
+            x = y
+        x = conv('center.0', f[-2], f[-1], 3, self.pad[1], self.depth, x)
+        x = conv('center.2', f[-1], f[-1], 3, self.pad[1], self.depth, x)
+        for i in range(self.depth):
+            lv = self.depth-1-i
+            # upsampling + 1x1 conv, fused as in the engine (conv1x1_up2)
+            x = conv('upS.%d' % i, f[lv+1], f[lv], 1, 0, lv, x, tensors[x][2] * self.pool)
+            ok[:] &= tensors[skip[lv]][2] >= tensors[x][2]
+            ci = 2*f[lv] if self.merge == 'crop' else f[lv]
+            x = conv('upC.%d.0' % i, ci, f[lv], 3, self.pad[2], lv, x)
+            skip.pop()
+            x = conv('upC.%d.2' % i, f[lv], f[lv], 3, self.pad[2], lv, x)
+        x = conv('final', f[0], self.out_num, 1, 0, 0, x)
+        for l in live:
+            l.append(x)
+        return tensors, convs, live, ok
+
+    def output_size(self, in_size):
+        tensors, _, _, ok = self.walk(in_size)
+        return tensors[-1][2] if ok.all() else None
+
+    def ideal_flops(self):
+        # FLOPs per output voxel of an infinite patch: no context recomputed
+        den = float(np.prod(self.pool))
+        return sum(2.*ci*co*k**3/den**lv for _, ci, co, k, lv, _, _ in self.walk([1]*len(self.pool))[1])
+
+def unet_spec(model):
+    # spec of a unet3D_m1 or unet3D (vgg blocks) module
+    if not hasattr(model, 'down'): # unet3D_m1
+        return UNetSpec(model.filters, model.io_num[0], model.io_num[1])
+    if any(m.opt[1] != 0 for m in model.down) or model.center.opt[0] != 0 \
+       or any(m.opt[2] != 0 for m in model.up):
+        raise ValueError('the tiling planner supports vgg conv blocks only')
+    pad = [model.down[0].conv[0].pad_size, model.center.conv[0].pad_size,
+           model.up[0].conv[0].pad_size]
+    pad = [0 if p == 0 else 1 for p in pad]
+    merge = 'crop' if model.up[0].opt[1] == 0 else 'add'
+    return UNetSpec(model.filters, model.io_num[0], model.io_num[1], pad, merge=merge)
+
+class AxisTable(object):
+    # sizes of all tensors along one axis for every input size 1..n: layer
+    # sizes are separable, so the FLOPs and bytes of a (z,y,x) patch are sums
+    # of products of three table rows
+    def __init__(self, spec, axis, n):
+        self.size = np.arange(1, n+1)
+        rows, ok = [], []
+        for s in self.size:
+            tensors, _, _, o = spec.walk([s])
+            rows.append([t[2][0] for t in tensors])
+            exact = all(t[2][0] % spec.pool[axis] == 0 for t in tensors
+                        if t[0].startswith('downC') and t[0].endswith('.2'))
+            ok.append(o[0] and exact)
+        self.sizes = np.array(rows, dtype=np.float64)
+        self.ok = np.array(ok)
+
+def axis_spec(spec, axis):
+    # 1-D spec of one axis (pooling of that axis only)
+    return UNetSpec(spec.filters, spec.in_num, spec.out_num, spec.pad, [spec.pool[axis]], spec.merge)
+
+def parallel_efficiency(convs, tensors, num_thread, co_block=8, y_block=8):
+    # share of busy threads over the conv tasks of the native engine (conv.c),
+    # weighted by FLOPs
+    if num_thread <= 1:
+        return 1.
+    work, busy = 0., 0.
+    for _, ci, co, k, _, _, y in convs:
+        sz = tensors[y][2]
+        task = -(-co//co_block) * sz[0] * -(-sz[1]//y_block)
+        fl = 2.*ci*co*k**3*np.prod(sz)
+        work += fl
+        busy += fl * task / float(-(-task//num_thread) * num_thread)
+    return busy/work
+
+def tile_count(vol_out, out, stride):
+    # tiles along one axis, the last one aligned to the end of the volume
+    return 1 if vol_out <= out else -(-(vol_out-out)//stride) + 1
+
+def plan_tiles(spec, volume, num_thread=1, mem_limit=4e9, batch=1, overlap=(0,0,0), top=10):
+    # volume: input (z,y,x); mem_limit: bytes for the batch patches in flight
+    # patches are (z,n,n) with n <= min(y,x) and no voxel lost to pooling;
+    # stride = output - overlap. Returns the top options by estimated cost
+    # (FLOPs per output voxel / parallel efficiency), see report()
+    volume = np.array(volume, dtype=int)
+    n_yx = min(volume[1], volume[2])
+    tab = [AxisTable(axis_spec(spec, d), 0, volume[d] if d == 0 else n_yx) for d in range(2)]
+    tensors, convs, live, _ = spec.walk([1, 1, 1])
+    ch = np.array([t[1] for t in tensors], dtype=np.float64)
+    fl_coef = np.zeros(len(tensors))
+    for _, ci, co, k, _, _, y in convs:
+        fl_coef[y] = 2.*ci*co*k**3
+    steps = np.zeros((len(live), len(tensors)))
+    for s, l in enumerate(live):
+        steps[s, l] = 4*ch[l]
+    ideal = spec.ideal_flops()
+    ys = np.nonzero(tab[1].ok)[0]
+    Y2 = tab[1].sizes[ys]**2 # square patches
+    opts = []
+    for zi in np.nonzero(tab[0].ok)[0]:
+        Z = tab[0].sizes[zi]
+        mem = (Y2*Z).dot(steps.T).max(1) * batch
+        flops = (Y2*Z).dot(fl_coef)
+        for j in np.nonzero(mem <= mem_limit)[0]:
+            in_size = np.array([tab[0].size[zi], tab[1].size[ys[j]], tab[1].size[ys[j]]])
+            out = np.array([Z[-1], tab[1].sizes[ys[j], -1], tab[1].sizes[ys[j], -1]], dtype=int)
+            stride = np.maximum(out - np.array(overlap), 1)
+            vol_out = volume - (in_size - out)
+            n = [tile_count(vol_out[d], out[d], stride[d]) for d in range(3)]
+            total = flops[j]*np.prod(n)
+            per_voxel = total/np.prod(vol_out)
+            opts.append(dict(input=tuple(in_size), output=tuple(out), stride=tuple(stride),
+                             tiles=tuple(n), flops=total, flops_voxel=per_voxel,
+                             redundancy=per_voxel/ideal, memory=mem[j]))
+    # thread efficiency only for the cheapest candidates: one walk each
+    opts.sort(key=lambda o: o['redundancy'])
+    opts = opts[:max(top*10, 100)]
+    for o in opts:
+        tensors, convs, _, _ = spec.walk(o['input'])
+        o['parallel'] = parallel_efficiency(convs, tensors, num_thread)
+        o['cost'] = o['flops_voxel']/o['parallel']
+    opts.sort(key=lambda o: o['cost'])
+    return opts[:top]
+
+def report(opts):
+    # one line per option: redundancy = FLOPs per output voxel / ideal,
+    # eff = share of useful thread FLOPs (1/redundancy x parallel efficiency)
+    lines = ['%-14s %-12s %-12s %-10s %9s %7s %5s %5s %8s' % (
+             'input', 'output', 'stride', 'tiles', 'GFLOP', 'x ideal', 'par', 'eff', 'mem MB')]
+    for o in opts:
+        lines.append('%-14s %-12s %-12s %-10s %9.0f %7.2f %5.2f %5.2f %8.0f' % (
+            ','.join(map(str, o['input'])), ','.join(map(str, o['output'])),
+            ','.join(map(str, o['stride'])), 'x'.join(map(str, o['tiles'])),
+            o['flops']/1e9, o['redundancy'], o['parallel'],
+            o['parallel']/o['redundancy'], o['memory']/1e6))
+    return '\n'.join(lines)
@@ -18,6 +18,22 @@ def writeh5(filename, datasetname, dtarray):
     ds[:] = dtarray
     fid.close()
 
+def readvol(filename, datasetname='main', cache=None):
+    # chunked volume: memory-mapped, crops only read the chunks they touch
+    #   cache: shared ChunkCache of decompressed chunks
+    # h5: read into memory
+    from ..data.chunk.chunk import ischunk, readchunk
+    if ischunk(filename):
+        return readchunk(filename, cache)
+    return readh5(filename, datasetname)
+
+def h52chunk(filename, datasetname, output_file, chunk_size=(8,64,64), compress=True):
+    # convert slab by slab, without loading the whole dataset
+    from ..data.chunk.chunk import writechunk
+    fid = h5py.File(filename,'r')
+    writechunk(output_file, fid[datasetname], chunk_size, compress)
+    fid.close()
+
 def readh5k(filename, datasetname):
     fid=h5py.File(filename)
     data={}
@@ -61,10 +77,11 @@ def writetxt(filename, dtarray):
     a.write(dtarray)
     a.close()
 # 2. segmentation wrapper
-def segToAffinity(seg):
-    from ..lib import malis_core as malisL
-    nhood = malisL.mknhood3d()
-    return malisL.seg_to_affgraph(seg,nhood)
+def segToAffinity(seg, nhood=None, num_thread=1):
+    from .seg.seg import mknhood3d, seg_to_affgraph
+    if nhood is None:
+        nhood = mknhood3d()
+    return seg_to_affgraph(seg, nhood, num_thread=num_thread)
 
 def bwlabel(mat):
     ran = [int(mat.min()),int(mat.max())];
@@ -73,28 +90,10 @@ def bwlabel(mat):
         out[i] = np.count_nonzero(mat==i)
     return out
 
-def genSegMalis(gg3,iter_num): # given input seg map, widen the seg border    
-    from scipy.ndimage import morphology as skmorph
-    #from skimage import morphology as skmorph
-    gg3_dz = np.zeros(gg3.shape).astype(np.uint32)
-    gg3_dz[1:,:,:] = (np.diff(gg3,axis=0))
-    gg3_dy = np.zeros(gg3.shape).astype(np.uint32)
-    gg3_dy[:,1:,:] = (np.diff(gg3,axis=1))
-    gg3_dx = np.zeros(gg3.shape).astype(np.uint32)
-    gg3_dx[:,:,1:] = (np.diff(gg3,axis=2))
-
-    gg3g = ((gg3_dx+gg3_dy)>0)
-    #stel=np.array([[1, 1],[1,1]]).astype(bool)
-    #stel=np.array([[0, 1, 0],[1,1,1], [0,1,0]]).astype(bool)
-    stel=np.array([[1, 1, 1],[1,1,1], [1,1,1]]).astype(bool)
-    #stel=np.array([[1,1,1,1],[1, 1, 1, 1],[1,1,1,1],[1,1,1,1]]).astype(bool)
-    gg3gd=np.zeros(gg3g.shape)
-    for i in range(gg3g.shape[0]):
-        gg3gd[i,:,:]=skmorph.binary_dilation(gg3g[i,:,:],structure=stel,iterations=iter_num)
-    out = gg3.copy()
-    out[gg3gd==1]=0
-    #out[0,:,:]=0 # for malis
-    return out
+def genSegMalis(gg3,iter_num,num_thread=1): # given input seg map, widen the seg border
+    # zero the voxels within iter_num (3x3 dilations per slice) of an x/y label change
+    from .seg.seg import seg_widen_border
+    return seg_widen_border(gg3, iter_num, num_thread)
 
 # 3. evaluation
 def runBash(cmd):
@@ -106,13 +105,31 @@ def runBash(cmd):
     os.remove(fn)
     print out
 
-def pred_reorder(input_file, input_dataset, output_folder=None):
+def pred_reorder(input_file, input_dataset, output_folder=None, slab=16):
+    # czyx -> zyxc, streamed in z-slabs through a blocked transpose: memory ~2 slabs
+    # input: h5 or chunked volume, output: chunked+compressed h5
+    from ..data.io import cropVolume
+    from ..data.chunk.chunk import ischunk, readchunk
+    from ..data.chunk._chunk import transpose_channels
     if output_folder is None:
         output_folder = input_file[:input_file.rfind('/')]
     filename = input_file[input_file.rfind('/')+1:]
-    pred = readh5(input_file,input_dataset)
-    predt = np.transpose(pred, (1,2,3,0))
+    fid = None
+    if ischunk(input_file):
+        pred = readchunk(input_file)
+    else:
+        fid = h5py.File(input_file, 'r')
+        pred = fid[input_dataset]
+    sh = pred.shape
     output_file = output_folder + filename[:-3]+'-zyxc.h5'
     #output_file = input_file[:-3]+'-zyxc.h5'
-    writeh5(output_file,'stack',predt)
+    fout = h5py.File(output_file, 'w')
+    ds = fout.create_dataset('stack', (sh[1], sh[2], sh[3], sh[0]), dtype=pred.dtype, compression="gzip",
+                             chunks=(min(slab, sh[1]), min(64, sh[2]), min(64, sh[3]), sh[0]))
+    for z in range(0, sh[1], slab):
+        sz = [min(slab, sh[1]-z), sh[2], sh[3]]
+        ds[z:z+sz[0]] = transpose_channels(np.asarray(cropVolume(pred, sz, [z,0,0])))
+    fout.close()
+    if fid is not None:
+        fid.close()
 
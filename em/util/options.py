@@ -8,6 +8,12 @@ def optResource(parser):
                         help='number of cpu')
     parser.add_argument('-b','--batch-size', type=int,  default=1,
                         help='batch size')
+    parser.add_argument('-pft','--prefetch-thread', type=int,  default=0,
+                        help='number of native sampler threads (0: use DataLoader)')
+    parser.add_argument('-pfd','--prefetch-depth', type=int,  default=16,
+                        help='number of batches prefetched by the native sampler')
+    parser.add_argument('-pfr','--prefetch-ring', type=int,  default=0,
+                        help='number of shared-memory batch slots (0: use np_collate)')
 
 def optTrain(parser):
     parser.add_argument('-l','--loss-opt', type=int, default=0,
@@ -30,6 +36,10 @@ def optTrain(parser):
                         help='pre-train number of epoch')
     parser.add_argument('-es','--snapshot',  default='',
                         help='pre-train snapshot path')
+    parser.add_argument('-sa','--sample-alpha', type=float, default=-1,
+                        help='uniform share of boundary importance sampling (<0: uniform only)')
+    parser.add_argument('-sc','--sample-cell', default='4,32,32',
+                        help='grid cell size of the sampling index')
 
 
 def optModel(parser):
@@ -90,6 +100,8 @@ def optIO(parser, mode='train'):
                             help='dataset name in test segmentation')
     parser.add_argument('-o','--output', default='result/train/',
                         help='output path')
+    parser.add_argument('-dn','--data-norm', default='unit',
+                        help='image normalization: unit (v/255), minmax or meanstd (per volume)')
 
 def optDataAug(parser):
     # reduce the number of input arguments by stacking into one string
@@ -0,0 +1,138 @@
+"""
+Cython wrapper of the native segmentation kernels.
+"""
+
+import numpy as np
+from libc.stdint cimport uint64_t
+
+cdef extern from 'seg.h':
+    void threshold_f32(const float *aff, long n, float thres, unsigned char *edge) nogil
+    void threshold_i32(const int *aff, long n, int thres, unsigned char *edge) nogil
+    int connected_components(const unsigned char *edge, const long shape[3], int num_thread,
+                             unsigned int *parent, uint64_t *seg,
+                             uint64_t *num_seg) nogil
+    int AFF_U8, AFF_I32, AFF_F32
+    int seg_to_aff(const void *seg, int seg_bytes, const long shape[3], const int *nhood,
+                   int num_edge, int out_type, void *aff, int num_thread) nogil
+    int seg_widen(const void *seg, int seg_bytes, const long shape[3], int iter,
+                  void *out, int num_thread) nogil
+
+
+def _seg_view(seg):
+    # uint32/uint64 c-contiguous, casting other integer types to uint64
+    if seg.dtype not in (np.uint32, np.uint64):
+        seg = seg.astype(np.uint64)
+    return np.ascontiguousarray(seg)
+
+
+def seg_to_affgraph(seg, nhood, dtype=np.int32, int num_thread=1):
+    """
+    (num_edge, z, y, x) affinity of a (z,y,x) segmentation, as
+    malis.seg_to_affgraph: on if both ends are inside, nonzero and equal.
+    dtype: uint8, int32 or float32
+    """
+    cdef long shape[3]
+    cdef int [:, ::1] nh = np.ascontiguousarray(nhood, dtype=np.int32).reshape(-1, 3)
+    cdef unsigned char [::1] seg_view
+    cdef unsigned char [::1] out_view
+    cdef int out_type, seg_bytes, ret
+    seg = _seg_view(seg)
+    dtype = np.dtype(dtype)
+    out_type = {np.dtype(np.uint8): AFF_U8, np.dtype(np.int32): AFF_I32,
+                np.dtype(np.float32): AFF_F32}[dtype]
+    for x in range(3):
+        shape[x] = seg.shape[x]
+    seg_bytes = seg.dtype.itemsize
+    out = np.empty((nh.shape[0],) + seg.shape, dtype=dtype)
+    seg_view = seg.reshape(-1).view(np.uint8)
+    out_view = out.reshape(-1).view(np.uint8)
+    with nogil:
+        ret = seg_to_aff(&seg_view[0], seg_bytes, shape, &nh[0, 0], nh.shape[0],
+                         out_type, &out_view[0], num_thread)
+    if ret != 0:
+        raise MemoryError()
+    return out
+
+
+def seg_widen_border(seg, int iter_num, int num_thread=1):
+    """Zero voxels within iter_num (in-plane, chebyshev) of an x/y label change."""
+    cdef long shape[3]
+    cdef unsigned char [::1] seg_view
+    cdef unsigned char [::1] out_view
+    cdef int seg_bytes, ret
+    dtype = seg.dtype
+    seg = _seg_view(seg)
+    for x in range(3):
+        shape[x] = seg.shape[x]
+    seg_bytes = seg.dtype.itemsize
+    out = np.empty_like(seg)
+    seg_view = seg.reshape(-1).view(np.uint8)
+    out_view = out.reshape(-1).view(np.uint8)
+    with nogil:
+        ret = seg_widen(&seg_view[0], seg_bytes, shape, iter_num, &out_view[0], num_thread)
+    if ret != 0:
+        raise MemoryError()
+    return out.astype(dtype, copy=False)
+
+
+cdef class AffinityCC:
+    """
+    Connected components of (3,z,y,x) affinity graphs, keeping the edge and
+    union-find buffers between calls of the same (or smaller) size.
+    """
+    cdef object edge
+    cdef object parent
+    cdef public int num_thread
+
+    def __cinit__(self, int num_thread=1):
+        self.num_thread = num_thread
+        self.edge = np.empty(0, dtype=np.uint8)
+        self.parent = np.empty(0, dtype=np.uint32)
+
+    def __call__(self, aff, thres=None, out=None):
+        """
+        aff: (3,z,y,x) float32 or int32; an edge is on if aff > thres
+        (default 0.5 for floats, 0 for integers)
+        Returns (seg uint64 (z,y,x) labelled 1..N, N).
+        """
+        cdef long shape[3]
+        cdef long n, ntot
+        cdef uint64_t num_seg
+        cdef unsigned char [::1] edge
+        cdef unsigned int [::1] parent
+        cdef uint64_t [::1] seg
+        cdef float [::1] aff_f
+        cdef int [::1] aff_i
+        cdef float thres_f
+        cdef int thres_i
+        cdef int ret
+        assert aff.ndim == 4 and aff.shape[0] == 3
+        for x in range(3):
+            shape[x] = aff.shape[1 + x]
+        n = shape[0] * shape[1] * shape[2]
+        ntot = 3 * n
+        if self.edge.size < ntot:
+            self.edge = np.empty(ntot, dtype=np.uint8)
+            self.parent = np.empty(n, dtype=np.uint32)
+        edge = self.edge
+        parent = self.parent
+        if out is None:
+            out = np.empty(aff.shape[1:], dtype=np.uint64)
+        assert out.shape == aff.shape[1:] and out.dtype == np.uint64 and out.flags['C_CONTIGUOUS']
+        seg = out.reshape(-1)
+        if aff.dtype.kind == 'f':
+            aff_f = np.ascontiguousarray(aff, dtype=np.float32).reshape(-1)
+            thres_f = 0.5 if thres is None else thres
+            with nogil:
+                threshold_f32(&aff_f[0], ntot, thres_f, &edge[0])
+        else:
+            aff_i = np.ascontiguousarray(aff, dtype=np.int32).reshape(-1)
+            thres_i = 0 if thres is None else thres
+            with nogil:
+                threshold_i32(&aff_i[0], ntot, thres_i, &edge[0])
+        with nogil:
+            ret = connected_components(&edge[0], shape, self.num_thread, &parent[0],
+                                       &seg[0], &num_seg)
+        if ret != 0:
+            raise ValueError('volume too large for connected components')
+        return out, num_seg
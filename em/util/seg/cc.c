@@ -0,0 +1,145 @@
+/*
+Connected components of a 3D affinity graph.
+
+Edge channel c of voxel (z,y,x) joins it to its -z, -y, -x neighbour
+(malis nhood -I). Each thread runs union-find over one z block, then the
+z edges between blocks are merged serially. Roots are always the smallest
+voxel index of their set, so a single raster pass assigns consecutive
+labels 1..N in order of first voxel, as segLib does; every voxel,
+singletons included, gets a label.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "seg.h"
+
+// branch-free so the compiler vectorizes the scans
+void threshold_f32(const float *aff, long n, float thres, uint8_t *edge) {
+    long i;
+    for (i = 0; i < n; i++) {
+        edge[i] = aff[i] > thres;
+    }
+}
+
+void threshold_i32(const int32_t *aff, long n, int32_t thres, uint8_t *edge) {
+    long i;
+    for (i = 0; i < n; i++) {
+        edge[i] = aff[i] > thres;
+    }
+}
+
+static uint32_t uf_find(uint32_t *parent, uint32_t i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]]; // path halving
+        i = parent[i];
+    }
+    return i;
+}
+
+static void uf_union(uint32_t *parent, uint32_t a, uint32_t b) {
+    a = uf_find(parent, a);
+    b = uf_find(parent, b);
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+typedef struct {
+    const uint8_t *edge;
+    const long *shape;
+    uint32_t *parent;
+    long z0, z1;
+} cc_block;
+
+static void *cc_block_run(void *arg) {
+    cc_block *b = (cc_block *)arg;
+    long ny = b->shape[1], nx = b->shape[2];
+    long n = b->shape[0] * ny * nx;
+    const uint8_t *ez = b->edge, *ey = b->edge + n, *ex = b->edge + 2 * n;
+    uint32_t *parent = b->parent;
+    long z, y, x, i;
+    for (i = b->z0 * ny * nx; i < b->z1 * ny * nx; i++) {
+        parent[i] = (uint32_t)i;
+    }
+    for (z = b->z0; z < b->z1; z++) {
+        for (y = 0; y < ny; y++) {
+            i = (z * ny + y) * nx;
+            for (x = 0; x < nx; x++, i++) {
+                if (x > 0 && ex[i]) uf_union(parent, (uint32_t)i, (uint32_t)(i - 1));
+                if (y > 0 && ey[i]) uf_union(parent, (uint32_t)i, (uint32_t)(i - nx));
+                if (z > b->z0 && ez[i]) uf_union(parent, (uint32_t)i, (uint32_t)(i - ny * nx));
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+edge: (3, z, y, x) uint8 mask; parent: scratch of z*y*x; seg: uint64 output.
+Returns -1 if the volume is too large for 32-bit indices.
+*/
+int connected_components(const uint8_t *edge, const long shape[3], int num_thread,
+                         uint32_t *parent, uint64_t *seg, uint64_t *num_seg) {
+    long n = shape[0] * shape[1] * shape[2], plane = shape[1] * shape[2];
+    long i, t, z, step;
+    uint64_t next = 0;
+    cc_block *blk;
+    pthread_t *th;
+    int started = 0;
+
+    if (n >= UINT32_MAX) {
+        return -1;
+    }
+    if (num_thread < 1) num_thread = 1;
+    if (num_thread > shape[0]) num_thread = (int)shape[0];
+    if (num_thread < 1) num_thread = 1;
+    blk = malloc(num_thread * sizeof(cc_block));
+    th = malloc(num_thread * sizeof(pthread_t));
+    if (blk == NULL || th == NULL) {
+        free(blk);
+        free(th);
+        return -1;
+    }
+    step = (shape[0] + num_thread - 1) / num_thread;
+    for (t = 0; t < num_thread; t++) {
+        blk[t].edge = edge;
+        blk[t].shape = shape;
+        blk[t].parent = parent;
+        blk[t].z0 = t * step < shape[0] ? t * step : shape[0];
+        blk[t].z1 = (t + 1) * step < shape[0] ? (t + 1) * step : shape[0];
+    }
+    for (t = 1; t < num_thread; t++) {
+        if (pthread_create(th + t, NULL, cc_block_run, blk + t) != 0) {
+            break;
+        }
+        started++;
+    }
+    cc_block_run(blk);
+    for (i = 1; i <= started; i++) {
+        pthread_join(th[i], NULL);
+    }
+    // blocks whose thread did not start run here
+    for (t = started + 1; t < num_thread; t++) {
+        cc_block_run(blk + t);
+    }
+
+    // merge across block borders
+    for (t = 1; t < num_thread; t++) {
+        z = blk[t].z0;
+        if (z >= shape[0]) break;
+        for (i = z * plane; i < (z + 1) * plane; i++) {
+            if (edge[i]) uf_union(parent, (uint32_t)i, (uint32_t)(i - plane));
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        uint32_t r = uf_find(parent, (uint32_t)i);
+        seg[i] = r == (uint32_t)i ? ++next : seg[r];
+    }
+    *num_seg = next;
+    free(blk);
+    free(th);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef EM_SEG_H
+#define EM_SEG_H
+
+#include <stdint.h>
+
+void threshold_f32(const float *aff, long n, float thres, uint8_t *edge);
+void threshold_i32(const int32_t *aff, long n, int32_t thres, uint8_t *edge);
+int connected_components(const uint8_t *edge, const long shape[3], int num_thread,
+                         uint32_t *parent, uint64_t *seg, uint64_t *num_seg);
+
+#define AFF_U8  0
+#define AFF_I32 1
+#define AFF_F32 2
+
+int seg_to_aff(const void *seg, int seg_bytes, const long shape[3], const int *nhood,
+               int num_edge, int out_type, void *aff, int num_thread);
+int seg_widen(const void *seg, int seg_bytes, const long shape[3], int iter,
+              void *out, int num_thread);
+
+#endif
@@ -0,0 +1,38 @@
+"""
+Native segmentation kernels: connected components of affinity graphs,
+segmentation to affinity and MALIS border widening.
+"""
+
+import numpy as np
+
+from _seg import AffinityCC, seg_to_affgraph, seg_widen_border
+
+_cc = None
+
+
+def connected_components_affgraph(aff, thres=None, out=None, num_thread=1):
+    """
+    Drop-in for segLib.seg_core.connected_components_affgraph with the
+    3-connected nhood: returns (seg, sizes), seg uint64 labelled 1..N and
+    sizes[i] the voxel count of label i+1. Buffers are reused per process.
+    """
+    global _cc
+    if _cc is None:
+        _cc = AffinityCC(num_thread)
+    _cc.num_thread = num_thread
+    seg, num_seg = _cc(aff, thres, out)
+    return seg, np.bincount(seg.reshape(-1), minlength=num_seg+1)[1:]
+
+
+def mknhood3d(radius=1):
+    # as malis.mknhood3d: offsets (dz,dy,dx) of the edges of each voxel
+    ceilrad = np.ceil(radius)
+    x = np.arange(-ceilrad,ceilrad+1,1)
+    y = np.arange(-ceilrad,ceilrad+1,1)
+    z = np.arange(-ceilrad,ceilrad+1,1)
+    [i,j,k] = np.meshgrid(z,y,x)
+    idxkeep = (i**2+j**2+k**2)<=radius**2
+    i=i[idxkeep].ravel(); j=j[idxkeep].ravel(); k=k[idxkeep].ravel()
+    zeroIdx = len(i)//2 # offsets before the center
+    nhood = np.vstack((k[:zeroIdx],i[:zeroIdx],j[:zeroIdx])).T.astype(np.int32)
+    return np.ascontiguousarray(np.flipud(nhood))
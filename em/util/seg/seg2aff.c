@@ -0,0 +1,246 @@
+/*
+Segmentation -> affinity graph and MALIS border widening.
+
+Both run one pass per z slice, with slices split across pthreads. seg is
+uint32 or uint64 (seg_bytes 4 or 8).
+
+seg_to_aff follows malis.seg_to_affgraph: edge e of voxel v is on if v and
+v + nhood[e] are in the volume, nonzero and equal.
+
+seg_widen follows misc.genSegMalis: voxels within iter (chebyshev, in-plane)
+of an x or y label change are set to 0. The border mask of a slice is kept
+as packed 64-bit rows and dilated by shifts and ORs.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seg.h"
+
+typedef struct seg_job seg_job;
+struct seg_job {
+    void (*run)(seg_job *j, long z);
+    const void *seg;
+    int seg_bytes;
+    const long *shape;
+    const int *nhood;
+    int num_edge;
+    int out_type;
+    int iter;
+    void *out;
+    long z0, z1;
+    int error;
+};
+
+static void *job_run(void *arg) {
+    seg_job *j = (seg_job *)arg;
+    long z;
+    for (z = j->z0; z < j->z1 && !j->error; z++) {
+        j->run(j, z);
+    }
+    return NULL;
+}
+
+// split z over num_thread copies of tmpl; the calling thread takes the first
+static int run_slices(const seg_job *tmpl, int num_thread) {
+    seg_job *jobs;
+    pthread_t *th;
+    long step, t, nz = tmpl->shape[0];
+    int started = 0, err = 0;
+    if (num_thread < 1) num_thread = 1;
+    if (num_thread > nz) num_thread = nz > 0 ? (int)nz : 1;
+    jobs = malloc(num_thread * sizeof(seg_job));
+    th = malloc(num_thread * sizeof(pthread_t));
+    if (jobs == NULL || th == NULL) {
+        free(jobs);
+        free(th);
+        return -1;
+    }
+    step = (nz + num_thread - 1) / num_thread;
+    for (t = 0; t < num_thread; t++) {
+        jobs[t] = *tmpl;
+        jobs[t].z0 = t * step < nz ? t * step : nz;
+        jobs[t].z1 = (t + 1) * step < nz ? (t + 1) * step : nz;
+    }
+    for (t = 1; t < num_thread; t++) {
+        if (pthread_create(th + t, NULL, job_run, jobs + t) != 0) {
+            break;
+        }
+        started++;
+    }
+    job_run(jobs);
+    for (t = 1; t <= started; t++) {
+        pthread_join(th[t], NULL);
+    }
+    for (t = started + 1; t < num_thread; t++) {
+        job_run(jobs + t);
+    }
+    for (t = 0; t < num_thread; t++) {
+        err |= jobs[t].error;
+    }
+    free(jobs);
+    free(th);
+    return err ? -1 : 0;
+}
+
+/************************************************************************/
+// seg -> affinity
+
+#define AFF_SLICE(TS, TO)                                                      \
+    do {                                                                       \
+        const TS *s = (const TS *)j->seg;                                      \
+        TO *a = (TO *)j->out;                                                  \
+        for (e = 0; e < j->num_edge; e++) {                                    \
+            dz = j->nhood[3 * e];                                              \
+            dy = j->nhood[3 * e + 1];                                          \
+            dx = j->nhood[3 * e + 2];                                          \
+            TO *arow = a + (e * nz + z) * ny * nx;                             \
+            if (z + dz < 0 || z + dz >= nz) {                                  \
+                memset(arow, 0, ny * nx * sizeof(TO));                         \
+                continue;                                                      \
+            }                                                                  \
+            x0 = dx < 0 ? -dx : 0;                                             \
+            x1 = dx > 0 ? nx - dx : nx;                                        \
+            for (y = 0; y < ny; y++, arow += nx) {                             \
+                if (y + dy < 0 || y + dy >= ny || x1 <= x0) {                  \
+                    memset(arow, 0, nx * sizeof(TO));                          \
+                    continue;                                                  \
+                }                                                              \
+                const TS *p = s + (z * ny + y) * nx;                           \
+                const TS *q = s + ((z + dz) * ny + y + dy) * nx + dx;          \
+                for (x = 0; x < x0; x++) arow[x] = 0;                          \
+                for (x = x0; x < x1; x++) {                                    \
+                    arow[x] = (TO)(p[x] != 0 && p[x] == q[x]);                 \
+                }                                                              \
+                for (x = x1; x < nx; x++) arow[x] = 0;                         \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+#define AFF_SLICE_OUT(TS)                                                      \
+    do {                                                                       \
+        switch (j->out_type) {                                                 \
+        case AFF_U8: AFF_SLICE(TS, uint8_t); break;                            \
+        case AFF_I32: AFF_SLICE(TS, int32_t); break;                           \
+        default: AFF_SLICE(TS, float); break;                                  \
+        }                                                                      \
+    } while (0)
+
+static void aff_slice(seg_job *j, long z) {
+    long nz = j->shape[0], ny = j->shape[1], nx = j->shape[2];
+    long e, dz, dy, dx, y, x, x0, x1;
+    if (j->seg_bytes == 4) {
+        AFF_SLICE_OUT(uint32_t);
+    } else {
+        AFF_SLICE_OUT(uint64_t);
+    }
+}
+
+/*
+aff: (num_edge, z, y, x) of out_type; nhood: num_edge x (dz, dy, dx).
+*/
+int seg_to_aff(const void *seg, int seg_bytes, const long shape[3], const int *nhood,
+               int num_edge, int out_type, void *aff, int num_thread) {
+    seg_job j;
+    memset(&j, 0, sizeof(j));
+    j.run = aff_slice;
+    j.seg = seg;
+    j.seg_bytes = seg_bytes;
+    j.shape = shape;
+    j.nhood = nhood;
+    j.num_edge = num_edge;
+    j.out_type = out_type;
+    j.out = aff;
+    return run_slices(&j, num_thread);
+}
+
+/************************************************************************/
+// border widening
+
+#define BORDER_SLICE(TS)                                                       \
+    do {                                                                       \
+        const TS *s = (const TS *)j->seg + z * ny * nx;                        \
+        for (y = 0; y < ny; y++) {                                             \
+            const TS *p = s + y * nx;                                          \
+            uint64_t *m = mask + y * nw;                                       \
+            for (x = 1; x < nx; x++) {                                         \
+                if (p[x] != p[x - 1] || (y > 0 && p[x] != p[x - nx])) {        \
+                    m[x >> 6] |= 1ULL << (x & 63);                             \
+                }                                                              \
+            }                                                                  \
+            if (y > 0 && p[0] != p[-nx]) m[0] |= 1ULL;                         \
+        }                                                                      \
+    } while (0)
+
+static void widen_slice(seg_job *j, long z) {
+    long ny = j->shape[1], nx = j->shape[2], nw = (nx + 63) / 64;
+    long y, x, w, k, r;
+    uint64_t *mask = calloc(ny * nw, sizeof(uint64_t));
+    uint64_t *hor = malloc(ny * nw * sizeof(uint64_t));
+    uint64_t *tmp = malloc(nw * sizeof(uint64_t));
+    uint64_t last = (nx & 63) ? (1ULL << (nx & 63)) - 1 : ~0ULL;
+    uint64_t v;
+    uint8_t *o8 = (uint8_t *)j->out + z * ny * nx * j->seg_bytes;
+
+    if (mask == NULL || hor == NULL || tmp == NULL) {
+        free(mask);
+        free(hor);
+        free(tmp);
+        j->error = 1;
+        return;
+    }
+    // label changes along x or y (as the np.diff pair in genSegMalis)
+    if (j->seg_bytes == 4) {
+        BORDER_SLICE(uint32_t);
+    } else {
+        BORDER_SLICE(uint64_t);
+    }
+    // horizontal dilation: iter shifts by one bit each way
+    memcpy(hor, mask, ny * nw * sizeof(uint64_t));
+    for (y = 0; y < ny; y++) {
+        uint64_t *h = hor + y * nw;
+        for (k = 0; k < j->iter; k++) {
+            for (w = 0; w < nw; w++) {
+                tmp[w] = h[w] | (h[w] << 1) | (h[w] >> 1);
+                if (w > 0) tmp[w] |= h[w - 1] >> 63;
+                if (w + 1 < nw) tmp[w] |= h[w + 1] << 63;
+            }
+            tmp[nw - 1] &= last;
+            memcpy(h, tmp, nw * sizeof(uint64_t));
+        }
+    }
+    // vertical dilation: OR over rows y-iter..y+iter, then clear the voxels
+    memcpy(o8, (const uint8_t *)j->seg + z * ny * nx * j->seg_bytes, ny * nx * j->seg_bytes);
+    for (y = 0; y < ny; y++) {
+        for (w = 0; w < nw; w++) {
+            v = 0;
+            for (r = y - j->iter; r <= y + j->iter; r++) {
+                if (r >= 0 && r < ny) v |= hor[r * nw + w];
+            }
+            while (v) {
+                x = w * 64 + __builtin_ctzll(v);
+                v &= v - 1;
+                memset(o8 + (y * nx + x) * j->seg_bytes, 0, j->seg_bytes);
+            }
+        }
+    }
+    free(mask);
+    free(hor);
+    free(tmp);
+}
+
+int seg_widen(const void *seg, int seg_bytes, const long shape[3], int iter,
+              void *out, int num_thread) {
+    seg_job j;
+    memset(&j, 0, sizeof(j));
+    j.run = widen_slice;
+    j.seg = seg;
+    j.seg_bytes = seg_bytes;
+    j.shape = shape;
+    j.iter = iter;
+    j.out = out;
+    return run_slices(&j, num_thread);
+}
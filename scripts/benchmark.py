@@ -21,11 +21,50 @@ def get_args():
                         help='model weight')
     parser.add_argument('-o','--output',  default='',
                         help='output name')
-    parser.add_argument('-n','--num',  type=int, default=0,
-                        help='number of iteration for benchmark')
+    parser.add_argument('-n','--num',  type=int, default=1,
+                        help='number of iteration for benchmark (0: no timing)')
+    parser.add_argument('-nt','--native-thread', type=int, default=0,
+                        help='unet3D_m1 on the native CPU engine with this many threads (0: torch)')
+    parser.add_argument('-ql','--quant-linear', default='',
+                        help='native: also the int8 kernels, quant.py output (-qm linear) of the same weights')
+    parser.add_argument('-qg','--quant-log2', default='',
+                        help='native: also the shift kernels, quant.py output (-qm log2 -wb 4)')
     args = parser.parse_args()
     return args
 
+def benchmark_native(args, net, x):
+    # float engine, then the quantized ones on the same input: ms per
+    # forward and the relative error of their output to the float one.
+    # --output gets the float output, as the torch path; quantized ones
+    # go to <output>.<name>
+    from em.model.engine.engine import from_model, from_quant_model
+    batch_shape = x.shape[:-4]
+    x = x.reshape(x.shape[-4:])
+    nets = [('float', from_model(net, args.native_thread))]
+    for name, path, method in [('int8', args.quant_linear, 'linear'),
+                               ('log2', args.quant_log2, 'log2')]:
+        if path != '':
+            nets.append((name, from_quant_model(torch.load(path), num_thread=args.native_thread,
+                                                weight_method=method)))
+    y_ref = None
+    for name, eng in nets:
+        y = eng(x)
+        if y_ref is None:
+            y_ref = y
+        if args.output != '':
+            fn = args.output if name == 'float' else args.output + '.' + name
+            pickle.dump(y.reshape(batch_shape + y.shape), open(fn, 'wb'))
+        err = np.linalg.norm(y-y_ref)/np.linalg.norm(y_ref)
+        if args.num <= 0:
+            print '%-6s error %.4f' % (name, err)
+            continue
+        tt = np.zeros((args.num))
+        for i in range(args.num):
+            st = time.time()
+            eng(x)
+            tt[i] = time.time()-st
+        print '%-6s %.1f %.1f ms, error %.4f' % (name, tt.mean()*1000, tt.std()*1000, err)
+
 
 if __name__ == "__main__":
     # config 
@@ -36,8 +75,6 @@ if __name__ == "__main__":
         data = pickle.load(open(args.test_data,'rb'))
     elif args.test_data[-3:]=='h5':
         data = np.array(h5py.File(args.test_data,args)[test_name])
-    x = Variable(torch.from_numpy(data.astype(np.float32)).cuda())
-
     # load model
     ww=pickle.load(open(args.weight,'rb'))
     if args.model==0:
@@ -46,15 +83,22 @@ if __name__ == "__main__":
     elif args.model==1:
         net = unet3D_m1(filters=[24,72,216,648])
         load_weights_pkl_m1(net, ww) 
-    net.cuda()
-    net.eval()
-    y = net(x)
-    if args.output != '': 
-        pickle.dump(y.data.cpu().numpy(),open(args.output,'wb'))
-    # benchmark speed
-    tt = np.zeros((args.num))
-    for i in range(args.num):
-        st = time.time()
+    if args.native_thread > 0:
+        if args.model != 1:
+            raise ValueError('the native engine runs unet3D_m1 only')
+        benchmark_native(args, net, data.astype(np.float32))
+    else:
+        x = Variable(torch.from_numpy(data.astype(np.float32)).cuda())
+        net.cuda()
+        net.eval()
         y = net(x)
-        tt[i] = time.time()-st
-    print tt.mean()*1000,tt.std()*1000
+        if args.output != '': 
+            pickle.dump(y.data.cpu().numpy(),open(args.output,'wb'))
+        # benchmark speed
+        if args.num > 0:
+            tt = np.zeros((args.num))
+            for i in range(args.num):
+                st = time.time()
+                y = net(x)
+                tt[i] = time.time()-st
+            print tt.mean()*1000,tt.std()*1000
@@ -0,0 +1,73 @@
+import numpy as np
+import argparse, h5py
+
+from em.model.tiling import UNetSpec, plan_tiles, report
+
+def get_args():
+    parser = argparse.ArgumentParser(description='Tile/stride planner for whole-volume inference')
+    parser.add_argument('-m','--model-id', type=int, default=1,
+                        help='model: 0=unet3D, 1=unet3D_m1')
+    parser.add_argument('-a','--opt-arch', type=str,  default='0-0@0@0-0-0@0',
+                        help='unet3D model type')
+    parser.add_argument('-mp','--opt-param', type=str,  default='0@0@0@0',
+                        help='unet3D model param')
+    parser.add_argument('-f', '--num-filter', default='24,72,216,648',
+                        help='number of filters per layer')
+    parser.add_argument('-ps', '--pad-size', type=int, default=0,
+                        help='unet3D pad size')
+    parser.add_argument('-pos','--pool-stride', type=str,  default='1,2,2',
+                        help='pool stride')
+    parser.add_argument('-v','--volume', default='',
+                        help='volume size z,y,x')
+    parser.add_argument('-i','--input', default='',
+                        help='or the volume itself: h5 file')
+    parser.add_argument('-dnd','--data-dataset-name',  default='main',
+                        help='dataset name in the h5 file')
+    parser.add_argument('-nt','--num-thread', type=int, default=1,
+                        help='threads per patch (native engine task split)')
+    parser.add_argument('-mm','--mem-limit', type=float, default=4,
+                        help='memory for the activations of the patches in flight, GB')
+    parser.add_argument('-b','--batch-size', type=int, default=1,
+                        help='patches in flight')
+    parser.add_argument('-ov','--overlap', default='0,0,0',
+                        help='overlap of neighbouring outputs (blending), z,y,x')
+    parser.add_argument('-n','--num-option', type=int, default=10,
+                        help='number of options to report')
+    return parser.parse_args()
+
+def get_spec(args):
+    filters = [int(x) for x in args.num_filter.split(',')]
+    pool = [int(x) for x in args.pool_stride.split(',')]
+    if args.model_id == 1:
+        return UNetSpec(filters, pool=pool)
+    opt_arch = [[int(x) for x in y.split('-')] for y in args.opt_arch.split('@')]
+    opt_param = [[int(x) for x in y.split('-')] for y in args.opt_param.split('@')]
+    if opt_arch[0][1] != 0 or opt_arch[1][0] != 0 or opt_arch[2][2] != 0:
+        raise ValueError('the tiling planner supports vgg conv blocks only')
+    pad = [int(args.pad_size > 0), int(args.pad_size > 0 or opt_param[1][0] == 1),
+           int(args.pad_size > 0 or opt_param[2][0] == 1)]
+    return UNetSpec(filters, pad=pad, pool=pool, merge=['crop', 'add'][opt_arch[2][1]])
+
+def main():
+    args = get_args()
+    spec = get_spec(args)
+    if args.volume != '':
+        volume = [int(x) for x in args.volume.split(',')]
+    else:
+        volume = h5py.File(args.input, 'r')[args.data_dataset_name].shape[-3:]
+    overlap = [int(x) for x in args.overlap.split(',')]
+    opts = plan_tiles(spec, volume, args.num_thread, args.mem_limit*1e9, args.batch_size,
+                      overlap, args.num_option)
+    if len(opts) == 0:
+        print 'no patch fits in %.1f GB' % args.mem_limit
+        return
+    print 'volume %s, ideal %.1f GFLOP per 1000 output voxels' % (
+        ','.join(map(str, volume)), spec.ideal_flops()*1e3/1e9)
+    print report(opts)
+    o = opts[0]
+    print 'test_affinity: -mi %s -mo %s -ss %s' % (
+        ','.join(map(str, o['input'])), ','.join(map(str, o['output'])),
+        ','.join(map(str, o['stride'])))
+
+if __name__ == "__main__":
+    main()
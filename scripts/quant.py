@@ -28,10 +28,14 @@ def get_args():
                         help='filter numbers')
     parser.add_argument('-pb','--param-bits', type=int, default=8, 
                         help='bit-width for parameters')
+    parser.add_argument('-wb','--weight-bits', type=int, default=0, 
+                        help='bit-width for weights if different (e.g. 4 for log2)')
     parser.add_argument('-qb','--quant-bias', type=int, default=0, 
                         help='quantize bias')
     parser.add_argument('-qm','--quant-method', default='linear', 
-                        help='linear|minmax|log|tanh')
+                        help='linear|minmax|log|log2|tanh (log2: weights only, linear features)')
+    parser.add_argument('-cm','--calib-method', default='batch', 
+                        help='feature scale calibration: batch|percentile|minmax|kl (linear)')
     parser.add_argument('-o','--output',  default='',
                         help='output name')
     parser.add_argument('--overflow_rate', type=float, default=0.0, 
@@ -90,12 +94,14 @@ def main():
             pass
         elif args.do_issac==0: #  simulation
             state_dict = unet_ref['state_dict']
-            state_dict_quant = quantize_weight(state_dict, bits=args.param_bits, do_bias=args.quant_bias==1, overflow_rate=args.overflow_rate, quant_method=args.quant_method)
+            weight_bits = args.param_bits if args.weight_bits == 0 else args.weight_bits
+            state_dict_quant = quantize_weight(state_dict, bits=weight_bits, do_bias=args.quant_bias==1, overflow_rate=args.overflow_rate, quant_method=args.quant_method)
 
             print '2. quantize feature' 
             # modify model: add extra layers to quantize feature
             model0, model_io_size = get_model(args, state_dict_quant)
-            quantize_feat(model0, bits=args.param_bits, overflow_rate=args.overflow_rate, quant_method=args.quant_method, counter=args.batch_num)
+            feat_method = 'linear' if args.quant_method == 'log2' else args.quant_method
+            quantize_feat(model0, bits=args.param_bits, overflow_rate=args.overflow_rate, quant_method=feat_method, counter=args.batch_num, calib=args.calib_method)
             
             print '3. infer quantization param'
             model = model0
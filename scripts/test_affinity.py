@@ -8,9 +8,13 @@ from torch.autograd import Variable
 from em.model.io import load_checkpoint, pth2issac
 from em.model.unet import unet3D
 from em.model.deploy import unet3D_m1, unet3D_m2, unet3D_m2_v2
+from em.model.engine.engine import from_model, from_file
+from em.model.engine.weights import isweights
 from em.model.loss import weightedMSE_np, malisWeight, labelWeight
 from em.data.volumeData import VolumeDatasetTest, np_collate
-from em.data.io import getVar, getData, getLabel, cropCentralN, setPred
+from em.data.io import getVar, getData, getLabel, cropCentralN, setPred, setPredSep, normPredSep, SlabStitcher
+from em.data.stitch.stitch import inverse_weight_sum
+from em.data.chunk.chunk import ChunkWriter
 from em.util.misc import writeh5, writetxt
 
 def get_args():
@@ -37,6 +41,10 @@ def get_args():
                         help='dataset name in data')
     parser.add_argument('-o','--output', default='result/my-pred.h5',
                         help='output path')
+    parser.add_argument('-oc','--output-chunk', type=int, default=0,
+                        help='output format: 0=h5, 1=chunked float32, 2=chunked uint8 (streamed by z-slab)')
+    parser.add_argument('-ot','--output-thread', type=int, default=2,
+                        help='number of compression threads of the chunked output')
     parser.add_argument('-sn','--seg-name',  default='seg-groundtruth2-malis_crop.h5',
                         help='segmentation label')
     parser.add_argument('-snd','--seg-dataset-name',  default='main',
@@ -45,6 +53,8 @@ def get_args():
                         help='sample stride')
     parser.add_argument('-bw','--blend-opt', default='-1',
                         help='blend option')
+    parser.add_argument('-bs','--blend-sep', type=int, default=0,
+                        help='separable blend weights: normalized per block, no weight volume')
     parser.add_argument('-ta','--test-aug', type=int, default=0,
                         help='test augmentation')
 
@@ -81,6 +91,8 @@ def get_args():
                         help='number of gpu')
     parser.add_argument('-c','--num-cpu', type=int,  default=16,
                         help='number of cpu')
+    parser.add_argument('-nt','--native-thread', type=int,  default=0,
+                        help='run unet3D_m1 on the native CPU engine with this many threads (0: torch); -s may be a flat weight file')
     parser.add_argument('-e', '--batch-end', type=int,  default=-1,
                         help='last batch to test')
     args = parser.parse_args()
@@ -90,6 +102,8 @@ def init(args):
     model_io_size = np.array([[int(x) for x in args.model_input.split(',')],
                               [int(x) for x in args.model_output.split(',')]])
 
+    if args.native_thread > 0: # native engine: numpy in, numpy out
+        return model_io_size, None
     # pre-allocate torch cuda tensor
     test_var = Variable(torch.zeros(args.batch_size, 1, model_io_size[0][0], model_io_size[0][1], model_io_size[0][2]).cuda(), requires_grad=False)
     return model_io_size, test_var
@@ -104,7 +118,7 @@ def get_data(args, model_io_size, test_var=None):
     color_clip = [(0.05,0.95), (0.05,0.95), None][args.data_color_opt]
     
     do_shuffle = False # test in serial
-    sample_stride = model_io_size[1] if args.sample_stride=='' else [int(x) for x in args.sample_stride.split(',')] # no overlap
+    sample_stride = get_stride(args, model_io_size[1])
     extra_pad = 0 # no need to pad
     output_size = None
     if args.task_opt in [0,0.1]: 
@@ -168,6 +182,9 @@ def get_data(args, model_io_size, test_var=None):
     return test_loader, output_size, batch_num
 
 def get_model(args, test_var):
+    if args.native_thread>0 and isweights(args.snapshot):
+        # flat weight file (scripts/translate.py): mapped, not loaded
+        return from_file(args.snapshot, args.native_thread)
     # create model
     num_filter = [int(x) for x in args.num_filter.split(',')]
 
@@ -191,9 +208,14 @@ def get_model(args, test_var):
         elif args.model_id == 2:
             model = unet3D_m2(filters=num_filter, has_BN = args.has_BN==1)
         # load parameter
-        cp = load_checkpoint(args.snapshot, 1)
+        cp = load_checkpoint(args.snapshot, 1, args.native_thread>0)
         model.load_state_dict(cp['state_dict'])
 
+    if args.native_thread>0:
+        if not isinstance(model, unet3D_m1):
+            raise ValueError('the native engine runs unet3D_m1 only')
+        return from_model(model, args.native_thread)
+
     if args.num_gpu>0:
         model.cuda()
         if args.do_issac==1:
@@ -230,6 +252,34 @@ def get_blend(sz,blend_opt):
 
     return ww
 
+def get_blend_sep(sz, blend_opt):
+    # 1D factors (wz,wy,wx) of get_blend: exact for 0 and 1 (exp of a sum)
+    # 2 clamps each axis to its plateau, so the flat region is a cross rather than a box
+    ww = []
+    for d in range(3):
+        if blend_opt[0]==0:
+            v = np.linspace(0,1,sz[d])
+            w = np.exp((v*(1-v))**blend_opt[1])
+        elif blend_opt[0]==1:
+            v = np.linspace(-0.5,0.5,sz[d])
+            w = np.exp(-blend_opt[1] * v**2)
+        elif blend_opt[0]==2:
+            w = 1.0/sz[d]+1-abs(np.linspace(-1,1,sz[d]))
+            sz2 = int(np.floor(sz[d]*blend_opt[1]))
+            if sz2 > 0:
+                w[sz2:-sz2] = w[sz2]
+        ww.append(w.astype(np.float32))
+    return ww
+
+def get_stride(args, pred_sz):
+    return pred_sz if args.sample_stride=='' else [int(x) for x in args.sample_stride.split(',')] # no overlap
+
+def get_stitcher(args, output_size, pred_sz, ww, ww_sep=None):
+    # pred is written slab by slab while the prediction goes on
+    writer = ChunkWriter(args.output, output_size, np.float32, num_thread=args.output_thread,
+                         quantize=args.output_chunk==2)
+    return SlabStitcher(output_size, pred_sz, writer, ww, ww_sep, get_stride(args, pred_sz))
+
 def main():
     args = get_args()
     if not os.path.exists(args.output[:args.output.rfind('/')]):
@@ -246,7 +296,8 @@ def main():
             print '-- start prediction --'
             print '2. load model'
             model = get_model(args, test_var)
-            model.eval()
+            if args.native_thread == 0:
+                model.eval()
 
             print '3. start testing'
             st0 = time.time()
@@ -257,42 +308,77 @@ def main():
             num_pre=0
             num_total = test_loader.__len__() 
             blend_opt = [float(x) for x in args.blend_opt.split(',')]
-            pred = np.zeros(output_size[0], dtype=np.float32)
+            do_stream = args.output_chunk > 0
             pred_ww = None
             ww = None
+            ww_sep = None
             if blend_opt[0]>=0:
-                pred_ww = np.zeros(output_size[0], dtype=np.float32)
-                ww = get_blend(model_io_size[1], blend_opt)
+                if args.blend_sep==1:
+                    ww_sep = get_blend_sep(model_io_size[1], blend_opt)
+                else:
+                    ww = get_blend(model_io_size[1], blend_opt)
+            if do_stream:
+                pred = get_stitcher(args, output_size[0], model_io_size[1], ww, ww_sep)
+            else:
+                pred = np.zeros(output_size[0], dtype=np.float32)
+                if ww is not None:
+                    pred_ww = np.zeros(output_size[0], dtype=np.float32)
 
             for batch_id, data in enumerate(test_loader):
                 # prediction 
                 num_b = data[3].shape[0]
-                test_var.data[:num_b].copy_(torch.from_numpy(data[0][:num_b]))
-                y_pred = model(test_var).data.cpu().numpy()
+                if args.native_thread > 0:
+                    y_pred = model(data[0][:num_b])
+                else:
+                    test_var.data[:num_b].copy_(torch.from_numpy(data[0][:num_b]))
+                    y_pred = model(test_var).data.cpu().numpy()
 
                 # put into pred
                 num_bd = np.count_nonzero(data[3][:,0]==did) 
-                setPred(pred, y_pred, model_io_size[1], data[3], num_bd, 0, pred_ww, ww)
+                if do_stream:
+                    pred.add(y_pred, data[3], num_bd, 0)
+                elif ww_sep is not None:
+                    setPredSep(pred, y_pred, model_io_size[1], data[3], ww_sep, num_bd, 0)
+                else:
+                    setPred(pred, y_pred, model_io_size[1], data[3], num_bd, 0, pred_ww, ww)
                 print "finish batch: [%d/%d/%d] " % (did, batch_id-num_pre, batch_num[did])
                 if num_bd == 0 or num_b != num_bd or batch_id==num_total-1: 
                     # need to save previous prediction
                     print 'save dataset: '+str(did+1)+'/'+str(len(batch_num))
-                    if pred_ww is not None:
-                        pred = pred/pred_ww
-                    writeh5(args.output, 'main', pred)
+                    if do_stream:
+                        pred.close()
+                    else:
+                        if pred_ww is not None:
+                            pred = pred/pred_ww
+                        elif ww_sep is not None:
+                            normPredSep(pred, inverse_weight_sum(ww_sep, pred.shape[1:],
+                                                     model_io_size[1], get_stride(args, model_io_size[1])))
+                        writeh5(args.output, 'main', pred)
                     et = time.time()
                     print 'time: '+str(et-st)+' sec'
                     st = time.time()
                     if batch_id < num_total-1: #start new dataset
                         did += 1
                         num_pre = batch_id
-                        pred = np.zeros(output_size[did], dtype=np.float32)
-                        setPred(pred, y_pred, model_io_size[1], data[3], num_b, num_bd, pred_ww, ww)
+                        if do_stream:
+                            pred = get_stitcher(args, output_size[did], model_io_size[1], ww, ww_sep)
+                            pred.add(y_pred, data[3], num_b, num_bd)
+                        else:
+                            pred = np.zeros(output_size[did], dtype=np.float32)
+                            if ww_sep is not None:
+                                setPredSep(pred, y_pred, model_io_size[1], data[3], ww_sep, num_b, num_bd)
+                            else:
+                                if pred_ww is not None:
+                                    pred_ww = np.zeros(output_size[did], dtype=np.float32)
+                                setPred(pred, y_pred, model_io_size[1], data[3], num_b, num_bd, pred_ww, ww)
                         print "finish batch: [%d/%d/%d] " % (did, batch_id-num_pre, batch_num[did])
                         sys.stdout.flush()
 
                 if batch_id == args.batch_end:
                     # early stop for debug
+                    if do_stream:
+                        pred.close()
+                        break
                     pp = data[3][-1]
                     pred=pred[:,:pp[1]+model_io_size[1][0]]
                     writeh5(args.output, 'main', pred)
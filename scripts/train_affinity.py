@@ -12,8 +12,11 @@ from em.model.deploy import unet3D_m1, unet3D_m2, unet3D_m2_v2
 from em.model.optim import decay_lr
 from em.model.loss import weightedMSE,malisWeight,labelWeight
 from em.data.volumeData import VolumeDatasetTrain, VolumeDatasetTest, np_collate
-from em.data.io import getVar, getImg, getLabel, cropCentralN
+from em.data.io import getVar, getImg, getLabel, cropCentralN, getNorm, cropNormVolume
 from em.data.augmentation import DataAugment
+from em.data.prefetch._prefetch import PatchSampler, ring_from_sample
+from em.data.chunk._chunk import ChunkVolume
+from em.data.sampling.sampling import getIndex
 from em.util.vis_data import visSliceSeg
 from em.util.options import addResource
 
@@ -50,6 +53,14 @@ def init(args):
     train_vars = getVar(args.batch_size, model_io_size, [True, True, not (args.loss_opt == 0 and args.loss_weight_opt == 0)])
     return model_io_size, train_vars
 
+def normBatches(batches, norm):
+    # uint8 sampler batches -> float32, with the norm of each patch's volume
+    for img, label, seg, pos in batches:
+        out = np.empty(img.shape, dtype=np.float32)
+        for b in range(img.shape[0]):
+            cropNormVolume(img[b], img.shape[-3:], [0,0,0], norm[pos[b,0]], out=out[b])
+        yield [out, label, seg, pos]
+
 def get_img(args, model_io_size, opt='train'):
     # two dataLoader, can't be both multiple-cpu (pytorch issue)
     if opt=='train':
@@ -83,6 +94,8 @@ def get_img(args, model_io_size, opt='train'):
     train_img = getImg(img_name, img_dataset_name)
     train_label = getLabel(seg_name, seg_dataset_name, suf_aff)
     train_img, train_label = cropCentralN(train_img, train_label)
+    # per-volume image normalization, applied while cropping
+    norm = [getNorm(x, args.data_norm) for x in train_img]
 
     # 2. get dataAug
     aug_opt = [int(x) for x in args.aug_opt.split('@')]
@@ -92,9 +105,37 @@ def get_img(args, model_io_size, opt='train'):
 
     # if malis, then need seg
     do_seg = args.loss_opt==1 # need seg if do malis loss
+    if opt=='train' and args.prefetch_thread > 0 and not do_seg:
+        # native threads: crop + flip only (aug_opt[0]), no python augmentation
+        if any(aug_opt[1:]) or args.sample_alpha >= 0:
+            raise ValueError('--prefetch-thread: the native sampler only flips (--aug-opt '
+                             'x@0@0@0), no --sample-alpha sampling')
+        # chunked volumes are read by the sampler threads, not loaded
+        contig = lambda x: x if isinstance(x, ChunkVolume) else np.ascontiguousarray(x)
+        sampler = PatchSampler([contig(x) for x in train_img],
+                               [contig(x) for x in train_label],
+                               model_io_size[0], model_io_size[1],
+                               num_thread=args.prefetch_thread, depth=args.prefetch_depth,
+                               seed=np.random.randint(2**31), batch_size=args.batch_size,
+                               flip=aug_opt[0] != 0, label_aff=True)
+        return normBatches(sampler.batches(), norm)
     dataset = VolumeDatasetTrain(train_img, train_label, do_seg, args.volume_total, \
                                  model_io_size[0], model_io_size[1], data_aug=data_aug)
+    dataset.setNorm(norm)
+    if opt=='train' and args.sample_alpha >= 0:
+        sample_cell = [int(x) for x in args.sample_cell.split(',')]
+        dataset.setSampleIndex([getIndex(seg_name[x]+suf_aff, train_label[x], sample_cell, args.sample_alpha)
+                                for x in range(len(train_label))])
     # to have evaluation during training (two dataloader), has to set num_worker=0
+    if args.prefetch_ring > 0:
+        # workers write batches into shared slots: DataLoader keeps up to
+        # 2*num_worker batches in flight, plus the one the trainer holds
+        assert args.prefetch_ring >= 2*num_worker+2
+        ring = ring_from_sample(dataset[0], args.batch_size, args.prefetch_ring)
+        img_loader =  torch.utils.data.DataLoader(
+                dataset, batch_size=args.batch_size, shuffle=True, collate_fn = ring.collate,
+                num_workers=num_worker, pin_memory=False)
+        return ring.batches(img_loader)
     img_loader =  torch.utils.data.DataLoader(
             dataset, batch_size=args.batch_size, shuffle=True, collate_fn = np_collate,
             num_workers=num_worker, pin_memory=True)
@@ -2,13 +2,14 @@ import argparse
 import pickle
 
 from em.model.io import caffe2pkl, keras2pkl, pth2pkl, load_weights_pkl,load_weights_pkl_m1, save_checkpoint
+from em.model.io import pkl2flat, pth2flat, quant2flat
 from em.model.unet import unet3D,unet3D_m1
 
 # translate model from other packages
 def get_args():
     parser = argparse.ArgumentParser(description='Training Model')
     parser.add_argument('-op','--opt', type=float,  default=0,
-                        help='caffe->pkl')
+                        help='caffe->pkl (0), pkl->pth (1), unet3D_m1 -> flat weight file: pkl (2), pth (2.1), quant.py model (2.2)')
     parser.add_argument('-w','--weight', type=str,  default='',
                         help='weight pkl file')
 
@@ -22,6 +23,10 @@ def get_args():
                         help='caffe model')
     parser.add_argument('-pm','--pth-model', type=str,  default='',
                         help='caffe model')
+    parser.add_argument('-qm','--quant-method', type=str,  default='linear',
+                        help='quant.py weight method of the model (linear, log2)')
+    parser.add_argument('-rs','--relu-slope', type=float,  default=0.005,
+                        help='LeakyReLU slope of the model')
     parser.add_argument('-o','--output', type=str,  default='',
                         help='output')
 
@@ -60,6 +65,12 @@ def main():
         ww=pickle.load(open(args.weight+'.pkl','rb'))
         load_weights_pkl_m1(model,ww)
         save_checkpoint(model, args.output+'.pth')
+    elif args.opt==2: 
+        pkl2flat(args.weight+'.pkl', args.output+'.emw', args.relu_slope)
+    elif args.opt==2.1: 
+        pth2flat(args.pth_model, args.output+'.emw', args.relu_slope)
+    elif args.opt==2.2: 
+        quant2flat(args.pth_model, args.output+'.emw', args.quant_method)
 
 
 if __name__ == "__main__":
@@ -5,12 +5,71 @@ from Cython.Distutils import build_ext
 import numpy as np
 
 def getExt_model():
-    return []
+    return [Extension('em.model.engine._engine',
+                 sources=['em/model/engine/_engine.pyx', 'em/model/engine/tpool.c',
+                          'em/model/engine/conv.c', 'em/model/engine/ops.c',
+                          'em/model/engine/unet.c', 'em/model/engine/winograd.c',
+                          'em/model/engine/plan.c', 'em/model/engine/qconv.c',
+                          'em/model/engine/qunet.c', 'em/model/engine/wfile.c'],
+                 include_dirs=['em/model/engine'],
+                 libraries=['m', 'pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra'])]
 
 
 def getExt_data():
     return [Extension('em.data.augmentation.warping',
                  sources=['em/data/augmentation/warping/_warping.pyx'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.augmentation.occlusion._occlusion',
+                 sources=['em/data/augmentation/occlusion/_occlusion.pyx'],
+                 include_dirs=['em/data/augmentation/occlusion'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.augmentation.section._section',
+                 sources=['em/data/augmentation/section/_section.pyx'],
+                 include_dirs=['em/data/augmentation/section'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.chunk._chunk',
+                 sources=['em/data/chunk/_chunk.pyx', 'em/data/chunk/chunk.c',
+                          'em/data/chunk/chunkcache.c', 'em/data/chunk/normalize.c',
+                          'em/data/chunk/transpose.c', 'em/data/chunk/chunkwriter.c'],
+                 include_dirs=['em/data/chunk'],
+                 libraries=['z', 'pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.prefetch._prefetch',
+                 sources=['em/data/prefetch/_prefetch.pyx', 'em/data/prefetch/prefetch.c',
+                          'em/data/prefetch/ring.c',
+                          'em/data/chunk/chunk.c', 'em/data/chunk/chunkcache.c'],
+                 include_dirs=['em/data/prefetch', 'em/data/chunk'],
+                 libraries=['z', 'pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.sampling._sampling',
+                 sources=['em/data/sampling/_sampling.pyx', 'em/data/sampling/sampling.c'],
+                 include_dirs=['em/data/sampling'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.stitch._stitch',
+                 sources=['em/data/stitch/_stitch.pyx', 'em/data/stitch/blend.c'],
+                 include_dirs=['em/data/stitch'],
+                 libraries=['pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra']),
+            Extension('em.data.mosaic._mosaic',
+                 sources=['em/data/mosaic/_mosaic.pyx', 'em/data/mosaic/mosaic.c'],
+                 include_dirs=['em/data/mosaic'],
+                 libraries=['png', 'jpeg', 'pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra'])]
+
+def getExt_app():
+    return [Extension('em.app.quantization.calib._calib',
+                 sources=['em/app/quantization/calib/_calib.pyx',
+                          'em/app/quantization/calib/calib.c'],
+                 include_dirs=['em/app/quantization/calib'],
+                 libraries=['m', 'pthread'],
+                 extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra'])]
+
+def getExt_util():
+    return [Extension('em.util.seg._seg',
+                 sources=['em/util/seg/_seg.pyx', 'em/util/seg/cc.c', 'em/util/seg/seg2aff.c'],
+                 include_dirs=['em/util/seg'],
+                 libraries=['pthread'],
                  extra_compile_args=['-std=c99', '-fno-strict-aliasing', '-O3', '-Wall', '-Wextra'])]
 
 def setup_cython():
@@ -18,6 +77,8 @@ def setup_cython():
     ext_modules = []
     ext_modules += getExt_model()
     ext_modules += getExt_data()
+    ext_modules += getExt_app()
+    ext_modules += getExt_util()
 
     setup(name='em_pytorch',
        version='1.0',
@@ -0,0 +1,72 @@
+# Histogram calibration (em/app/quantization/calib) against the sort-based
+# compute_integral_part: ceil(log2) of the overflow_rate quantile of |x|.
+
+import numpy as np
+
+from em.app.quantization.calib import histogram, hist_add, hist_exponent, hist_sf
+
+
+def exponent_ref(x, overflow_rate):
+    # quant_core.compute_integral_part before the histogram
+    v = np.sort(np.abs(np.asarray(x, dtype=np.float32)).reshape(-1))[::-1]
+    return int(np.ceil(np.log2(float(v[int(overflow_rate*len(v))]) + 1e-12)))
+
+
+def samples():
+    np.random.seed(0)
+    yield np.random.randn(1000).astype(np.float32)
+    yield (np.random.randn(3, 50, 7)*1e-3).astype(np.float32)
+    yield (np.random.rand(2000)*300).astype(np.float32)
+    # exact powers of two, and zeros
+    yield np.float32(2.0)**np.random.randint(-20, 21, 500)
+    yield np.concatenate([np.zeros(100), np.float32(2.0)**np.arange(-8, 9)]).astype(np.float32)
+    yield np.array([0.5, 1, 2, 4, 8, 1024, 2**20], dtype=np.float32)
+    yield np.zeros(10, dtype=np.float32)
+
+
+def test_exponent():
+    for x in samples():
+        for rate in [0.0, 0.01, 0.1, 0.5]:
+            ref = exponent_ref(x, rate)
+            for num_thread in [1, 3]:
+                hist = histogram()
+                hist_add(hist, x, num_thread)
+                assert hist.sum() == x.size
+                assert hist_exponent(hist, rate) == ref, (x[:5], rate)
+            for bits in [4, 8]:
+                assert hist_sf(hist, bits, 'percentile', rate) == bits-1-ref
+            assert hist_sf(hist, 8, 'minmax') == 7-exponent_ref(x, 0.0)
+
+
+def test_boundaries():
+    # each side of every octave boundary, one value at a time
+    v = []
+    for e in range(-149, 128):
+        p = np.float32(2.0)**e if e > -127 else np.float32(2.0**e)
+        v += [p, np.nextafter(p, np.float32(0)), np.nextafter(p, np.float32(np.inf))]
+    v += list(np.float32(10.0)**np.random.uniform(-44, 38, 200))
+    for x in v:
+        if not np.isfinite(x):
+            continue
+        hist = histogram()
+        hist_add(hist, np.array([x], dtype=np.float32))
+        assert hist_exponent(hist) == exponent_ref([x], 0.0), x
+
+
+def test_batches():
+    # histograms of several batches add up to the one of their union
+    x = list(samples())[:4]
+    hist = histogram()
+    for b in x:
+        hist_add(hist, b)
+    allx = np.concatenate([b.reshape(-1) for b in x])
+    for rate in [0.0, 0.001, 0.05]:
+        assert hist_exponent(hist, rate) == exponent_ref(allx, rate)
+    assert isinstance(hist_sf(hist, 8, 'kl'), int)
+
+
+if __name__ == "__main__":
+    test_exponent()
+    test_boundaries()
+    test_batches()
+    print('test_calib: ok')
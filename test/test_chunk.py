@@ -0,0 +1,170 @@
+# Chunked volumes (em/data/chunk): write with writechunk and ChunkWriter,
+# read back random crops, in and out of the volume, against numpy slicing.
+
+import os
+import pickle
+import struct
+import tempfile
+
+import numpy as np
+
+from em.data.chunk.chunk import writechunk, readchunk
+from em.data.chunk._chunk import ChunkWriter, ChunkCache, ChunkVolume
+
+
+def crop_ref(data, st, sz):
+    # numpy crop of [st, st+sz) in zyx, 0 outside the volume
+    out = np.zeros(data.shape[:-3] + tuple(sz), dtype=data.dtype)
+    src = []
+    dst = []
+    for d in range(3):
+        n = data.shape[-3+d]
+        lo, hi = max(st[d], 0), min(st[d]+sz[d], n)
+        if lo >= hi:
+            return out
+        src.append(slice(lo, hi))
+        dst.append(slice(lo-st[d], hi-st[d]))
+    out[(Ellipsis,) + tuple(dst)] = data[(Ellipsis,) + tuple(src)]
+    return out
+
+
+def check_crops(vol, data, num=50):
+    sh = data.shape[-3:]
+    assert tuple(vol.shape) == data.shape and vol.dtype == data.dtype
+    assert (np.asarray(vol) == data).all()
+    for i in range(num):
+        sz = [np.random.randint(1, sh[d]+5) for d in range(3)]
+        # starts from before the volume to past its end
+        st = [np.random.randint(-sz[d]-2, sh[d]+2) for d in range(3)]
+        out = vol.crop(st, sz)
+        ref = crop_ref(data, st, sz)
+        assert out.shape == ref.shape and (out == ref).all(), (st, sz)
+
+
+def volumes():
+    np.random.seed(0)
+    yield np.random.randint(0, 256, (19, 45, 37)).astype(np.uint8)
+    yield np.random.rand(2, 13, 30, 41).astype(np.float32)
+    yield np.random.randint(0, 2**40, (9, 20, 20)).astype(np.uint64)
+
+
+def test_writechunk(tmpdir):
+    for data in volumes():
+        for compress in [False, True]:
+            fn = os.path.join(str(tmpdir), 'w.chunk')
+            writechunk(fn, data, chunk_size=(4, 16, 16), compress=compress)
+            check_crops(readchunk(fn), data)
+            check_crops(readchunk(fn, ChunkCache(1 << 20, 4*16*16*8*2)), data)
+
+
+def test_chunkwriter(tmpdir):
+    for data in volumes():
+        for compress in [False, True]:
+            fn = os.path.join(str(tmpdir), 'cw.chunk')
+            w = ChunkWriter(fn, data.shape, data.dtype, chunk_size=(4, 16, 16),
+                            compress=compress, num_thread=3, max_pending=2)
+            # slabs not aligned with the chunk rows
+            z = 0
+            while z < data.shape[-3]:
+                nz = np.random.randint(1, 7)
+                w.write(data[..., z:z+nz, :, :])
+                z += nz
+            w.close()
+            check_crops(readchunk(fn), data)
+
+
+def test_quantize(tmpdir):
+    np.random.seed(3)
+    data = (np.random.rand(2, 9, 20, 21)*1.2-0.1).astype(np.float32)
+    data[0, 1, 2, 3:6] = [np.nan, np.inf, -np.inf]
+    fn = os.path.join(str(tmpdir), 'q.chunk')
+    w = ChunkWriter(fn, data.shape, chunk_size=(4, 16, 16), num_thread=2, quantize=True)
+    w.write(data)
+    w.close()
+    v = data*np.float32(255) + np.float32(0.5)
+    v[np.isnan(v)] = 0
+    check_crops(readchunk(fn), np.clip(v, 0, 255).astype(np.uint8), 10)
+
+
+def test_cache(tmpdir):
+    data = next(volumes())
+    fn = os.path.join(str(tmpdir), 'c.chunk')
+    writechunk(fn, data, chunk_size=(4, 16, 16), compress=True)
+    for budget, slot in [(0, 1024), (1 << 20, 0), (1024, 1 << 20), (-1, -1)]:
+        try:
+            ChunkCache(budget, slot)
+            assert False, (budget, slot)
+        except ValueError:
+            pass
+    cache = ChunkCache(1 << 20, 4*16*16)
+    vols = pickle.loads(pickle.dumps([readchunk(fn, cache), readchunk(fn, cache)]))
+    # a new cache, shared by the volumes pickled together
+    assert vols[0].cache is vols[1].cache and vols[0].cache is not cache
+    assert vols[0].cache.budget == cache.budget and vols[0].cache.slot_bytes == cache.slot_bytes
+    check_crops(vols[0], data)
+    check_crops(vols[1], data, 10)
+    assert vols[1].cache.stats()['hits'] > 0
+    assert pickle.loads(pickle.dumps(readchunk(fn))).cache is None
+
+
+def rewrite(src, dst, edit):
+    # copy of a chunked file with edit(bytearray) applied
+    buf = bytearray(open(src, 'rb').read())
+    edit(buf)
+    with open(dst, 'wb') as f:
+        f.write(buf)
+
+
+def expect_ioerror(fn, crop=True):
+    try:
+        vol = ChunkVolume(fn)
+        if crop:
+            vol.crop((0, 0, 0), vol.shape[-3:])
+    except IOError:
+        return
+    assert False, fn
+
+
+def test_corrupt(tmpdir):
+    # header: chunk (z,y,x) uint32 at 56, index_offset uint64 at 72;
+    # index: (offset, nbytes) uint64 per chunk
+    data = next(volumes())
+    raw = os.path.join(str(tmpdir), 'raw.chunk')
+    zlib_fn = os.path.join(str(tmpdir), 'zlib.chunk')
+    bad = os.path.join(str(tmpdir), 'bad.chunk')
+    writechunk(raw, data, chunk_size=(4, 16, 16), compress=False)
+    writechunk(zlib_fn, data, chunk_size=(4, 16, 16), compress=True)
+    index = lambda buf: struct.unpack_from('<Q', buf, 72)[0]
+    # zero chunk size
+    rewrite(raw, bad, lambda buf: struct.pack_into('<I', buf, 60, 0))
+    expect_ioerror(bad, crop=False)
+    # raw blob one byte short
+    def short(buf):
+        nbytes = struct.unpack_from('<Q', buf, index(buf)+8)[0]
+        struct.pack_into('<Q', buf, index(buf)+8, nbytes-1)
+    rewrite(raw, bad, short)
+    expect_ioerror(bad)
+    # compressed blobs of a full and an edge chunk swapped: both inflate,
+    # to the wrong size
+    def swap(buf):
+        # the index ends the file
+        i0 = index(buf)
+        i1 = len(buf) - 16
+        e0, e1 = bytes(buf[i0:i0+16]), bytes(buf[i1:i1+16])
+        buf[i0:i0+16], buf[i1:i1+16] = e1, e0
+    rewrite(zlib_fn, bad, swap)
+    expect_ioerror(bad)
+    check_crops(readchunk(zlib_fn), data, 5)
+
+
+if __name__ == "__main__":
+    tmp = tempfile.mkdtemp()
+    test_writechunk(tmp)
+    test_chunkwriter(tmp)
+    test_quantize(tmp)
+    test_cache(tmp)
+    test_corrupt(tmp)
+    for f in os.listdir(tmp):
+        os.remove(os.path.join(tmp, f))
+    os.rmdir(tmp)
+    print('test_chunk: ok')
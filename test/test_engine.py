@@ -0,0 +1,206 @@
+# CPU inference engine (em/model/engine) against a float64 numpy forward
+# pass of unet3D_m1 (em/model/deploy.py), without torch.
+
+import numpy as np
+
+from em.model.engine.engine import weight_names, conv_names, from_state_dict, from_quant_state
+
+FILTERS = [4, 8, 16]
+SLOPE = 0.005
+IN_SIZE = (28, 52, 52)
+
+
+def conv3d(x, w, b):
+    # valid conv of x (ci,z,y,x) with w (co,ci,kz,ky,kx), float64
+    k = w.shape[2:]
+    sz = [x.shape[1+d]-k[d]+1 for d in range(3)]
+    out = np.zeros((w.shape[0],) + tuple(sz))
+    for dz in range(k[0]):
+        for dy in range(k[1]):
+            for dx in range(k[2]):
+                v = x[:, dz:dz+sz[0], dy:dy+sz[1], dx:dx+sz[2]]
+                out += np.tensordot(w[:, :, dz, dy, dx], v, axes=(1, 0))
+    return out + b[:, None, None, None]
+
+
+def leaky(x):
+    return np.where(x > 0, x, x*SLOPE)
+
+
+def maxpool(x):
+    # MaxPool3d((1,2,2), (1,2,2))
+    c, z, y, xx = x.shape
+    x = x[:, :, :y//2*2, :xx//2*2]
+    return x.reshape(c, z, y//2, 2, xx//2, 2).max(5).max(3)
+
+
+def upsample(x, w):
+    # depthwise ConvTranspose3d((1,2,2), (1,2,2)), w (c,1,1,2,2)
+    c, z, y, xx = x.shape
+    out = np.empty((c, z, 2*y, 2*xx))
+    for i in range(2):
+        for j in range(2):
+            out[:, :, i::2, j::2] = x*w[:, 0, 0, i, j][:, None, None, None]
+    return out
+
+
+def merge_crop(skip, x):
+    # block.mergeCrop: [upsampled, centered crop of the skip]
+    o = [(skip.shape[d]-x.shape[d])//2 for d in range(1, 4)]
+    return np.concatenate([x, skip[:, o[0]:o[0]+x.shape[1], o[1]:o[1]+x.shape[2],
+                                   o[2]:o[2]+x.shape[3]]], 0)
+
+
+def unet_ref(sd, x, quant=None):
+    """
+    unet3D_m1 forward of (in_num,z,y,x), float64. quant(name, v), if given,
+    is applied to each conv output (name.o) and LeakyReLU output (name.a).
+    """
+    q = quant if quant is not None else (lambda name, v: v)
+    w = lambda name: sd[name].astype(np.float64)
+    def block(name, x):
+        x = q(name + '.o', conv3d(x, w(name + '.weight'), w(name + '.bias')))
+        return q(name + '.a', leaky(x))
+    depth = len([k for k in sd if k.startswith('downC.') and k.endswith('.0.weight')])
+    skip = []
+    for i in range(depth):
+        x = block('downC.%d.2' % i, block('downC.%d.0' % i, x))
+        skip.append(x)
+        x = maxpool(x)
+    x = block('center.2', block('center.0', x))
+    for i in range(depth):
+        x = upsample(x, w('upS.%d.0.weight' % i))
+        x = q('upS.%d.1.o' % i, conv3d(x, w('upS.%d.1.weight' % i), w('upS.%d.1.bias' % i)))
+        x = merge_crop(skip[depth-1-i], x)
+        x = block('upC.%d.2' % i, block('upC.%d.0' % i, x))
+    x = q('final.0.o', conv3d(x, w('final.0.weight'), w('final.0.bias')))
+    return 1/(1+np.exp(-x))
+
+
+def random_state(rng, filters=FILTERS, const_up=True):
+    depth = len(filters)-1
+    fin = [1] + filters[:-1]
+    sd = {}
+    def mk(name, co, ci, k):
+        sd[name + '.weight'] = (rng.randn(co, ci, k, k, k)/np.sqrt(ci*k**3)).astype(np.float32)
+        sd[name + '.bias'] = (rng.randn(co)*0.1).astype(np.float32)
+    for i in range(depth):
+        mk('downC.%d.0' % i, filters[i], fin[i], 3)
+        mk('downC.%d.2' % i, filters[i], filters[i], 3)
+    mk('center.0', filters[-1], filters[-2], 3)
+    mk('center.2', filters[-1], filters[-1], 3)
+    for i in range(depth):
+        lv = depth-1-i
+        c = filters[lv+1]
+        if const_up:
+            up = np.ones((c, 1, 1, 2, 2))*rng.uniform(0.5, 1.5, (c, 1, 1, 1, 1))
+        else:
+            up = rng.uniform(0.5, 1.5, (c, 1, 1, 2, 2))
+        sd['upS.%d.0.weight' % i] = up.astype(np.float32)
+        mk('upS.%d.1' % i, filters[lv], c, 1)
+        mk('upC.%d.0' % i, filters[lv], 2*filters[lv], 3)
+        mk('upC.%d.2' % i, filters[lv], filters[lv], 3)
+    mk('final.0', 3, filters[0], 1)
+    assert sorted(sd) == sorted(weight_names(depth))
+    return sd
+
+
+def test_unet_m1():
+    rng = np.random.RandomState(0)
+    x = rng.rand(1, *IN_SIZE).astype(np.float32)
+    for const_up in [True, False]:
+        sd = random_state(rng, const_up=const_up)
+        ref = unet_ref(sd, x.astype(np.float64))
+        # winograd: 0 direct convs only, 4 every conv with ci, co >= 4
+        for winograd, tol in [(0, 1e-5), (4, 1e-3)]:
+            for num_thread in [1, 3]:
+                net = from_state_dict(sd, FILTERS, 1, 3, SLOPE, num_thread, winograd)
+                assert net.up_fused == [const_up]*(len(FILTERS)-1)
+                assert (len(net.winograd) > 0) == (winograd > 0)
+                out = net.forward(x)
+                assert out.shape == ref.shape, (out.shape, ref.shape)
+                err = np.abs(out-ref).max()
+                assert err < tol, (const_up, winograd, num_thread, err)
+                # batch of two, and the plan kept for the same size
+                out2 = net.forward(np.stack([x, x[:, ::-1]]))
+                assert np.array_equal(out2[0], out)
+
+
+def check_plan(plan):
+    buf = plan['buffers']
+    assert plan['live'] <= plan['peak'] <= plan['total']
+    for i, (size, first, last, offset) in enumerate(buf):
+        assert offset >= 0 and offset+size <= plan['peak'] and first < last
+        for size1, first1, last1, offset1 in buf[:i]:
+            if first < last1 and first1 < last:
+                # live at the same time: disjoint in the arena
+                assert offset+size <= offset1 or offset1+size1 <= offset, \
+                        (buf[i], (size1, first1, last1, offset1))
+
+
+def test_plan():
+    rng = np.random.RandomState(1)
+    for const_up in [True, False]:
+        net = from_state_dict(random_state(rng, const_up=const_up), FILTERS, 1, 3, SLOPE, 1, 4)
+        for sz in [IN_SIZE, (24, 61, 45), (31, 92, 92)]:
+            plan = net.plan(sz)
+            check_plan(plan)
+            assert plan['peak'] < plan['total']
+
+
+def linear_quantize(v, sf, bits=8):
+    # quant_core.linear_quantize: floor(v*2^sf+0.5), clamped, back to float
+    bound = 2.0**(bits-1)
+    return np.clip(np.floor(v*2.0**sf+0.5), -bound, bound-1)*2.0**-sf
+
+
+def quantize_weight(w, method):
+    # weights of a model after quantize_weight (8 bits, overflow_rate 0)
+    w = w.astype(np.float64)
+    if method == 'log2':
+        # log2_quantize: sign*2^round(log2|w|), the 2^(bits-1)-1 top exponents
+        e = np.floor(np.log2(np.abs(w)+1e-20)+0.5)
+        return np.where(e >= e.max()-6, np.sign(w)*2.0**e, 0)
+    return linear_quantize(w, 7-int(np.ceil(np.log2(np.abs(w).max()+1e-12))))
+
+
+def test_unet_q8():
+    # UNetM1Q8 against the LinearQuant model: each conv and LeakyReLU output
+    # quantized to 8 bits at its calibrated sf
+    rng = np.random.RandomState(2)
+    depth = len(FILTERS)-1
+    for method in ['linear', 'log2']:
+        sd = random_state(rng)
+        for k in sd:
+            if k.startswith('upS.') and k.endswith('.0.weight'):
+                sd[k] = np.ones_like(sd[k])
+            elif k.endswith('.weight'):
+                sd[k] = quantize_weight(sd[k], method).astype(np.float32)
+        sf = {}
+        def calibrate(name, v):
+            sf[name] = min(sf.get(name, 99), 7-int(np.ceil(np.log2(np.abs(v).max()+1e-12))))
+            return linear_quantize(v, sf[name])
+        # input on the uint8 grid, as the engine reads it (in_scale 255)
+        inputs = [np.floor(rng.rand(1, *IN_SIZE)*256).clip(0, 255)/255. for i in range(3)]
+        for x in inputs[:2]:
+            unet_ref(sd, x, calibrate)
+        feat_sf = dict((n, (sf[n + '.o'], sf.get(n + '.a', sf[n + '.o'])))
+                       for n in conv_names(depth))
+        ref = unet_ref(sd, inputs[2], lambda name, v: linear_quantize(v, sf[name]))
+        for num_thread in [1, 3]:
+            net = from_quant_state(sd, feat_sf, {}, FILTERS, 1, 3, SLOPE, num_thread,
+                                   weight_method=method)
+            assert net.wlog == [int(method == 'log2' and n[:3] != 'upS')
+                                for n in conv_names(depth)]
+            out = net.forward(inputs[2].astype(np.float32))
+            assert out.shape == ref.shape
+            err = np.abs(out-ref).max()
+            assert err < 1e-6, (method, num_thread, err)
+            check_plan(net.plan(IN_SIZE))
+
+
+if __name__ == "__main__":
+    test_unet_m1()
+    test_plan()
+    test_unet_q8()
+    print('test_engine: ok')
@@ -0,0 +1,101 @@
+# Tiled mosaic reader (em/data/mosaic): crops across tile borders against
+# numpy, pickling, and reads from a forked process (DataLoader workers).
+
+import os
+import pickle
+import shutil
+import signal
+import struct
+import tempfile
+import zlib
+
+import numpy as np
+
+from em.data.mosaic._mosaic import MosaicVolume
+
+
+def write_png(fn, img):
+    # 8-bit gray PNG, no filter
+    def chunk(tag, data):
+        return struct.pack('>I', len(data)) + tag + data + \
+               struct.pack('>I', zlib.crc32(tag + data) & 0xffffffff)
+    h, w = img.shape
+    raw = b''.join(b'\x00' + img[y].tobytes() for y in range(h))
+    with open(fn, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, 8, 0, 0, 0, 0)))
+        f.write(chunk(b'IDAT', zlib.compress(raw)))
+        f.write(chunk(b'IEND', b''))
+
+
+def make_mosaic(tmp, depth=5, n_rows=3, n_cols=4, tile=(13, 17)):
+    np.random.seed(0)
+    vol = np.random.randint(0, 256, (depth, n_rows*tile[0], n_cols*tile[1])).astype(np.uint8)
+    paths = []
+    for z in range(depth):
+        sec = []
+        for r in range(n_rows):
+            row = []
+            for c in range(n_cols):
+                if (z+r+c) % 7 == 3:
+                    # missing tile: zeros
+                    vol[z, r*tile[0]:(r+1)*tile[0], c*tile[1]:(c+1)*tile[1]] = 0
+                    row.append(None)
+                    continue
+                fn = os.path.join(tmp, 't%d_%d_%d.png' % (z, r, c))
+                write_png(fn, vol[z, r*tile[0]:(r+1)*tile[0], c*tile[1]:(c+1)*tile[1]])
+                row.append(fn)
+            sec.append(row)
+        paths.append(sec)
+    return paths, tile, vol
+
+
+def check_crops(mv, vol, num=30):
+    sh = vol.shape
+    for i in range(num):
+        sz = [np.random.randint(1, sh[d]+3) for d in range(3)]
+        st = [np.random.randint(-2, sh[d]) for d in range(3)]
+        ref = np.zeros(sz, dtype=np.uint8)
+        lo = [max(st[d], 0) for d in range(3)]
+        hi = [min(st[d]+sz[d], sh[d]) for d in range(3)]
+        if min(hi[d]-lo[d] for d in range(3)) > 0:
+            ref[lo[0]-st[0]:hi[0]-st[0], lo[1]-st[1]:hi[1]-st[1], lo[2]-st[2]:hi[2]-st[2]] = \
+                vol[lo[0]:hi[0], lo[1]:hi[1], lo[2]:hi[2]]
+        assert (mv.crop(st, sz) == ref).all(), (st, sz)
+
+
+def test_mosaic(tmp):
+    paths, tile, vol = make_mosaic(tmp)
+    for num_thread in [0, 1, 3]:
+        mv = MosaicVolume(paths, tile, num_thread, cache_section=2)
+        assert mv.shape == vol.shape
+        check_crops(mv, vol)
+        assert (np.asarray(mv) == vol).all()
+        check_crops(pickle.loads(pickle.dumps(mv)), vol, 5)
+
+
+def test_fork(tmp):
+    # the parent's decoder threads do not exist in the child
+    paths, tile, vol = make_mosaic(tmp)
+    mv = MosaicVolume(paths, tile, 2, cache_section=2)
+    check_crops(mv, vol, 5)
+    pid = os.fork()
+    if pid == 0:
+        signal.alarm(20)
+        ok = False
+        try:
+            check_crops(mv, vol)
+            ok = True
+        finally:
+            os._exit(0 if ok else 1)
+    _, status = os.waitpid(pid, 0)
+    assert status == 0, status
+    check_crops(mv, vol, 5)
+
+
+if __name__ == "__main__":
+    tmp = tempfile.mkdtemp()
+    test_mosaic(tmp)
+    test_fork(tmp)
+    shutil.rmtree(tmp)
+    print('test_mosaic: ok')
@@ -0,0 +1,73 @@
+# Fused crop + normalize (em/data/chunk/normalize.c) of uint8 arrays and
+# chunked volumes against numpy, and the per-volume norms of getNorm.
+
+import os
+import shutil
+import tempfile
+
+import numpy as np
+
+from em.data.io import getNorm, cropNormVolume
+from em.data.chunk.chunk import writechunk, readchunk
+from em.data.chunk._chunk import crop_normalize
+
+
+def normalize_ref(data, st, sz, offset, scale, down, dtype):
+    # block means of the down-sampled grid (0 outside), then (v-offset)*scale
+    # in float32, rounded to dtype
+    n = int(np.prod(down))
+    src_st = [st[d]*down[d] for d in range(3)]
+    src_sz = [sz[d]*down[d] for d in range(3)]
+    box = np.zeros(data.shape[:-3] + tuple(src_sz), dtype=np.int64)
+    lo = [max(src_st[d], 0) for d in range(3)]
+    hi = [min(src_st[d]+src_sz[d], data.shape[-3+d]) for d in range(3)]
+    if min(hi[d]-lo[d] for d in range(3)) > 0:
+        box[..., lo[0]-src_st[0]:hi[0]-src_st[0], lo[1]-src_st[1]:hi[1]-src_st[1],
+            lo[2]-src_st[2]:hi[2]-src_st[2]] = data[..., lo[0]:hi[0], lo[1]:hi[1], lo[2]:hi[2]]
+    box = box.reshape(box.shape[:-3] + (sz[0], down[0], sz[1], down[1], sz[2], down[2]))
+    s = box.sum(-1).sum(-2).sum(-3)
+    v = (s.astype(np.float32)/np.float32(n) - np.float32(offset))*np.float32(scale)
+    return v.astype(dtype)
+
+
+def test_crop_normalize():
+    np.random.seed(0)
+    tmp = tempfile.mkdtemp()
+    try:
+        for shape in [(14, 37, 41), (2, 9, 30, 22)]:
+            data = np.random.randint(0, 256, shape).astype(np.uint8)
+            fn = os.path.join(tmp, 'n.chunk')
+            writechunk(fn, data, chunk_size=(4, 16, 16), compress=True)
+            for vol in [data, readchunk(fn)]:
+                for down in [(1, 1, 1), (1, 2, 2)]:
+                    for dtype in [np.float32, np.float16]:
+                        for i in range(10):
+                            sh = [shape[-3+d]//down[d] for d in range(3)]
+                            sz = [np.random.randint(1, sh[d]+3) for d in range(3)]
+                            st = [np.random.randint(-2, sh[d]) for d in range(3)]
+                            offset, scale = np.random.rand()*100, 1./np.random.randint(1, 300)
+                            out = crop_normalize(vol, st, sz, offset, scale, down, dtype=dtype)
+                            ref = normalize_ref(data, st, sz, offset, scale, down, dtype)
+                            assert out.dtype == ref.dtype and out.shape == ref.shape
+                            assert (out == ref).all(), (shape, down, dtype, st, sz)
+    finally:
+        shutil.rmtree(tmp)
+
+
+def test_norm():
+    np.random.seed(1)
+    data = np.random.randint(10, 200, (1, 19, 23, 17)).astype(np.uint8)
+    v = data.astype(np.float64)
+    for mode, ref in [('unit', (0., 1./255)),
+                      ('minmax', (v.min(), 1./(v.max()-v.min()))),
+                      ('meanstd', (v.mean(), 1./v.std()))]:
+        norm = getNorm(data, mode, slab=4)
+        assert np.allclose(norm, ref), (mode, norm, ref)
+        out = cropNormVolume(data, data.shape[1:], [0, 0, 0], norm)
+        assert np.allclose(out, (v-ref[0])*ref[1], atol=1e-4), mode
+
+
+if __name__ == "__main__":
+    test_crop_normalize()
+    test_norm()
+    print('test_normalize: ok')
@@ -0,0 +1,61 @@
+# Box occlusion (em/data/augmentation/occlusion): boxes drawn in the union
+# box of all keys, applied to each key's image, against numpy slicing.
+
+import numpy as np
+
+from em.data.augmentation.occlusion import occlusion
+
+
+def image(shape, pad=64):
+    # c-contiguous image followed by a guard band of -1
+    n = int(np.prod(shape))
+    buf = np.full(n+pad, -1, dtype=np.float32)
+    buf[:n] = np.random.rand(n)
+    return buf, buf[:n].reshape(shape)
+
+
+def apply_ref(img, box, op, param):
+    # fill and alpha boxes, clipped to the image
+    out = img.copy()
+    for b in range(len(op)):
+        lo = np.maximum(box[b,:3], 0)
+        hi = np.minimum(box[b,3:], img.shape[-3:])
+        if (hi <= lo).any():
+            continue
+        s = (Ellipsis, slice(lo[0], hi[0]), slice(lo[1], hi[1]), slice(lo[2], hi[2]))
+        if op[b] == occlusion.BOX_FILL:
+            out[s] = param[b]
+        else:
+            out[s] *= param[b]
+    return out
+
+
+def test_two_keys():
+    np.random.seed(0)
+    # union box of the keys, as in BoxOcclusion.augment
+    keys = [(2, 12, 40, 40), (1, 6, 20, 17)]
+    dim = np.max([k[1:] for k in keys], axis=0)
+    for it in range(20):
+        box, rule = occlusion.draw_boxes(dim, 6, 20, 2, np.prod(dim)*0.5, [2, 2, 0.3, 0, 0])
+        for sh in keys:
+            # fill and alpha: exact
+            op = np.where(rule == 0, occlusion.BOX_FILL, occlusion.BOX_ALPHA).astype(np.int32)
+            param = np.random.rand(len(op)).astype(np.float32)
+            buf, img = image(sh)
+            ref = apply_ref(img, box, op, param)
+            assert occlusion.BoxOccluder(it).apply(img, box, op, param) == len(op)
+            assert (img == ref).all() and (buf[img.size:] == -1).all(), (it, sh)
+            # noise: only inside the clipped boxes
+            op = (occlusion.BOX_NOISE_ADD + (rule % 2)).astype(np.int32)
+            param[:] = 0.3
+            buf, img = image(sh)
+            mask = apply_ref(np.ones_like(img), box, np.zeros_like(op), np.zeros_like(param))
+            orig = img.copy()
+            occlusion.BoxOccluder(it).apply(img, box, op, param)
+            assert (img[mask == 1] == orig[mask == 1]).all() and (buf[img.size:] == -1).all()
+            assert (img[mask == 0] != orig[mask == 0]).any()
+
+
+if __name__ == "__main__":
+    test_two_keys()
+    print('test_occlusion: ok')
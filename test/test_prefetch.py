@@ -0,0 +1,95 @@
+# Native patch sampler and batch ring (em/data/prefetch): sampled batches
+# against cropVolume, affinity-aware flips against the affinity of the
+# flipped segmentation.
+
+import numpy as np
+
+from em.data.io import cropVolume
+from em.data.prefetch._prefetch import PatchSampler, ring_from_sample
+
+
+def seg_to_aff(seg):
+    # (3,z,y,x) affinity, malis nhood -I: channel c joins v to v - e_c
+    aff = np.zeros((3,) + seg.shape, dtype=np.float32)
+    aff[0, 1:] = (seg[1:] == seg[:-1]) & (seg[1:] > 0)
+    aff[1, :, 1:] = (seg[:, 1:] == seg[:, :-1]) & (seg[:, 1:] > 0)
+    aff[2, :, :, 1:] = (seg[:, :, 1:] == seg[:, :, :-1]) & (seg[:, :, 1:] > 0)
+    return aff
+
+
+def random_seg(shape):
+    # blocks of 2 voxels, some background
+    sh = [(x+1)//2 for x in shape]
+    seg = np.random.randint(0, 5, sh).astype(np.uint32)
+    seg = seg.repeat(2, 0).repeat(2, 1).repeat(2, 2)
+    return seg[:shape[0], :shape[1], :shape[2]].copy()
+
+
+def test_sampler_crop():
+    np.random.seed(0)
+    imgs = [np.random.randint(0, 256, (1,) + sh).astype(np.uint8)
+            for sh in [(12, 40, 40), (9, 33, 51)]]
+    labels = [np.random.rand(3, *x.shape[1:]).astype(np.float32) for x in imgs]
+    img_size, label_size, stride = (5, 16, 16), (3, 10, 12), (1, 2, 3)
+    off = [(img_size[d]-label_size[d])//2 for d in range(3)]
+    sp = PatchSampler(imgs, labels, img_size, label_size, num_thread=3, depth=3,
+                      stride=stride, batch_size=4)
+    seen = set()
+    for img, label, seg, pos in sp.batches(25):
+        assert img.shape == (4, 1) + img_size and label.shape == (4, 3) + label_size
+        assert seg is None
+        for b in range(4):
+            v, p = pos[b, 0], pos[b, 1:]
+            seen.add(v)
+            assert all(p[d] % stride[d] == 0 for d in range(3))
+            assert (img[b] == cropVolume(imgs[v], img_size, p)).all()
+            assert (label[b] == cropVolume(labels[v], label_size, p + off)).all()
+    sp.close()
+    assert seen == set([0, 1])
+
+
+def test_sampler_flip_aff():
+    # flipped affinity patch == affinity of the flipped segmentation patch
+    np.random.seed(1)
+    segs = [random_seg(sh) for sh in [(10, 24, 24), (8, 17, 30)]]
+    labels = [seg_to_aff(x) for x in segs]
+    img_size, label_size = (6, 10, 10), (4, 8, 8)
+    sp = PatchSampler([x[None] for x in segs], labels, img_size, label_size, num_thread=2,
+                      depth=4, batch_size=8, flip=True, label_aff=True)
+    flipped = 0
+    for img, label, seg, pos in sp.batches(20):
+        for b in range(8):
+            v, p = pos[b, 0], pos[b, 1:]
+            ref = seg_to_aff(img[b, 0])[:, 1:5, 1:9, 1:9]
+            assert (label[b] == ref).all(), (v, p)
+            flipped += not (img[b] == cropVolume(segs[v][None], img_size, p)).all()
+    sp.close()
+    assert flipped > 0
+
+
+def test_batch_ring():
+    np.random.seed(2)
+    samples = [[np.random.rand(1, 4, 6, 6).astype(np.float32), None,
+                None, np.random.randint(0, 9, 4)] for i in range(7)]
+    ring = ring_from_sample(samples[0], 3, 2)
+    loader = [ring.collate(samples[i:i+3]) for i in [0, 3]]
+    n = 0
+    for img, label, seg, pos in ring.batches(loader):
+        assert label is None and seg is None and len(img) == 3
+        for b in range(3):
+            assert (img[b] == samples[n][0]).all() and (pos[b] == samples[n][3]).all()
+            n += 1
+    # a short last batch
+    s = ring.collate(samples[6:])
+    img, label, seg, pos = ring.acquire(s)
+    assert len(img) == 1 and (img[0] == samples[6][0]).all()
+    ring.release(s)
+    stats = ring.stats()
+    assert stats['claimed'] == stats['released'] == 3
+
+
+if __name__ == "__main__":
+    test_sampler_crop()
+    test_sampler_flip_aff()
+    test_batch_ring()
+    print('test_prefetch: ok')
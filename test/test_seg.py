@@ -0,0 +1,67 @@
+# Connected components of affinity graphs (em/util/seg/cc.c) against a
+# breadth-first search over the same graph.
+
+from collections import deque
+
+import numpy as np
+
+from em.util.seg._seg import AffinityCC
+
+
+def bfs_components(aff, thres=0.5):
+    """
+    Reference labelling: channel c of voxel (z,y,x) joins it to its -z, -y, -x
+    neighbour; labels 1..N in raster order of the first voxel.
+    """
+    edge = aff > thres
+    sh = aff.shape[1:]
+    seg = np.zeros(sh, dtype=np.uint64)
+    num = 0
+    for start in np.ndindex(*sh):
+        if seg[start]:
+            continue
+        num += 1
+        seg[start] = num
+        queue = deque([start])
+        while queue:
+            v = queue.popleft()
+            for c in range(3):
+                # edge stored at v, to v - e_c
+                if v[c] > 0 and edge[(c,) + v]:
+                    u = list(v); u[c] -= 1; u = tuple(u)
+                    if not seg[u]:
+                        seg[u] = num
+                        queue.append(u)
+                # edge stored at v + e_c, to v
+                if v[c] + 1 < sh[c]:
+                    u = list(v); u[c] += 1; u = tuple(u)
+                    if edge[(c,) + u] and not seg[u]:
+                        seg[u] = num
+                        queue.append(u)
+    return seg, num
+
+
+def test_affinity_cc(shape=(11, 17, 19), num_threads=(1, 2, 3, 8)):
+    np.random.seed(0)
+    for p in [0.2, 0.5, 0.8]:
+        aff = (np.random.rand(*((3,) + shape)) < p).astype(np.float32)
+        ref, num = bfs_components(aff)
+        for nt in num_threads:
+            seg, n = AffinityCC(nt)(aff)
+            assert n == num, (p, nt, n, num)
+            assert (seg == ref).all(), (p, nt)
+            # int32 affinities, threshold 0
+            seg, n = AffinityCC(nt)(aff.astype(np.int32))
+            assert n == num and (seg == ref).all(), (p, nt)
+    # buffers kept between calls of different sizes
+    cc = AffinityCC(4)
+    for sh in [(6, 9, 9), (3, 5, 7), (8, 12, 4)]:
+        aff = (np.random.rand(*((3,) + sh)) < 0.5).astype(np.float32)
+        seg, n = cc(aff)
+        ref, num = bfs_components(aff)
+        assert n == num and (seg == ref).all(), sh
+
+
+if __name__ == "__main__":
+    test_affinity_cc()
+    print('test_seg: ok')
@@ -0,0 +1,139 @@
+# Test-time stitching (em/data/stitch): dense, assign and separable blends
+# of patches on the test grid, against numpy accumulation, and SlabStitcher
+# streaming into a ChunkWriter against stitching the whole volume.
+
+import os
+import shutil
+import tempfile
+
+import numpy as np
+
+from em.data.io import SlabStitcher, setPred, setPredSep, normPredSep
+from em.data.chunk.chunk import readchunk
+from em.data.chunk._chunk import ChunkWriter
+from em.data.stitch.stitch import grid_starts, inverse_weight_sum
+from em.data.stitch._stitch import blend_patches, blend_patches_sep, normalize_sep
+
+SHAPE = (2, 13, 29, 31)
+PSZ = (5, 12, 12)
+STRIDE = (3, 8, 8)
+
+
+def grid_pos(shape=SHAPE, psz=PSZ, stride=STRIDE):
+    st = [grid_starts(shape[1+d], psz[d], stride[d]) for d in range(3)]
+    return np.array([[0, z, y, x] for z in st[0] for y in st[1] for x in st[2]])
+
+
+def box(p, psz=PSZ):
+    return (slice(None), slice(p[1], p[1]+psz[0]), slice(p[2], p[2]+psz[1]),
+            slice(p[3], p[3]+psz[2]))
+
+
+def test_grid_starts():
+    # the last start is clamped to the end of the volume
+    assert list(grid_starts(13, 5, 3)) == [0, 3, 6, 8]
+    assert list(grid_starts(12, 12, 8)) == [0]
+    assert list(grid_starts(31, 12, 8)) == [0, 8, 16, 19]
+    try:
+        grid_starts(4, 5, 3)
+        assert False
+    except AssertionError as e:
+        assert 'smaller' in str(e)
+
+
+def test_blend():
+    np.random.seed(0)
+    pos = grid_pos()
+    y_pred = np.random.rand(len(pos), SHAPE[0], *PSZ).astype(np.float32)
+    ww = np.random.rand(*PSZ).astype(np.float32) + 0.1
+    for num_thread in [1, 3]:
+        # dense weights, 1 or c weight channels
+        for nc in [1, SHAPE[0]]:
+            pred = np.zeros(SHAPE, dtype=np.float32)
+            pred_ww = np.zeros((nc,) + SHAPE[1:], dtype=np.float32)
+            blend_patches(pred, y_pred, PSZ, pos, pred_ww, ww, num_thread)
+            ref = np.zeros(SHAPE, dtype=np.float32)
+            ref_ww = np.zeros((nc,) + SHAPE[1:], dtype=np.float32)
+            for j, p in enumerate(pos):
+                ref[box(p)] += y_pred[j]*ww
+                ref_ww[box(p)] += ww
+            assert np.allclose(pred, ref, rtol=1e-6) and np.allclose(pred_ww, ref_ww, rtol=1e-6)
+        # assign: later patches overwrite
+        pred = np.zeros(SHAPE, dtype=np.float32)
+        blend_patches(pred, y_pred, PSZ, pos, num_thread=num_thread)
+        ref = np.zeros(SHAPE, dtype=np.float32)
+        for j, p in enumerate(pos):
+            ref[box(p)] = y_pred[j]
+        assert (pred == ref).all()
+
+
+def test_blend_sep():
+    np.random.seed(1)
+    pos = grid_pos()
+    y_pred = np.random.rand(len(pos), SHAPE[0], *PSZ).astype(np.float32)
+    ww_sep = [np.random.rand(PSZ[d]).astype(np.float32) + 0.1 for d in range(3)]
+    ww = ww_sep[0][:, None, None]*ww_sep[1][None, :, None]*ww_sep[2][None, None, :]
+    ref = np.zeros(SHAPE, dtype=np.float64)
+    ref_ww = np.zeros(SHAPE[1:], dtype=np.float64)
+    for j, p in enumerate(pos):
+        ref[box(p)] += y_pred[j]*ww
+        ref_ww[box(p)[1:]] += ww
+    inv = inverse_weight_sum(ww_sep, SHAPE[1:], PSZ, STRIDE)
+    # the weight sum is the product of the per-axis sums
+    assert [len(x) for x in inv] == list(SHAPE[1:])
+    assert np.allclose(np.einsum('z,y,x->zyx', *inv), 1/ref_ww, rtol=1e-5)
+    for num_thread in [1, 3]:
+        pred = np.zeros(SHAPE, dtype=np.float32)
+        blend_patches_sep(pred, y_pred, PSZ, pos, ww_sep, num_thread)
+        assert np.allclose(pred, ref, rtol=1e-5)
+        # normalize in two windows of output planes, as SlabStitcher does
+        for z0, nz in [(0, 7), (7, SHAPE[1]-7)]:
+            win = np.ascontiguousarray(pred[:, z0:z0+nz])
+            normalize_sep(win, nz, z0, inv)
+            assert np.allclose(win, ref[:, z0:z0+nz]/ref_ww[z0:z0+nz], rtol=1e-5)
+
+
+def test_slab_stitcher():
+    # patches in z order (VolumeDatasetTest), added in batches of any size
+    np.random.seed(2)
+    pos = grid_pos()
+    y_pred = np.random.rand(len(pos), SHAPE[0], *PSZ).astype(np.float32)
+    ww = np.random.rand(*PSZ).astype(np.float32) + 0.1
+    ww_sep = [np.random.rand(PSZ[d]).astype(np.float32) + 0.1 for d in range(3)]
+    tmp = tempfile.mkdtemp()
+    try:
+        for mode in ['dense', 'sep']:
+            # whole volume in memory
+            pred = np.zeros(SHAPE, dtype=np.float32)
+            if mode == 'dense':
+                pred_ww = np.zeros(SHAPE, dtype=np.float32)
+                setPred(pred, y_pred, PSZ, pos, None, 0, pred_ww, ww)
+                ref = pred/np.maximum(pred_ww, 1e-6)
+            else:
+                setPredSep(pred, y_pred, PSZ, pos, ww_sep)
+                ref = normPredSep(pred, inverse_weight_sum(ww_sep, SHAPE[1:], PSZ, STRIDE))
+            # streamed: finished planes go to the writer
+            fn = os.path.join(tmp, mode + '.chunk')
+            writer = ChunkWriter(fn, SHAPE, chunk_size=(4, 16, 16), num_thread=2)
+            if mode == 'dense':
+                ss = SlabStitcher(SHAPE, PSZ, writer, ww=ww)
+            else:
+                ss = SlabStitcher(SHAPE, PSZ, writer, ww_sep=ww_sep, stride=STRIDE)
+            j = 0
+            while j < len(pos):
+                n = np.random.randint(1, 9)
+                ss.add(y_pred[j:j+n], pos[j:j+n])
+                j += n
+            ss.close()
+            out = np.asarray(readchunk(fn))
+            assert np.allclose(out, ref, rtol=1e-5, atol=1e-6), mode
+    finally:
+        shutil.rmtree(tmp)
+
+
+if __name__ == "__main__":
+    test_grid_starts()
+    test_blend()
+    test_blend_sep()
+    test_slab_stitcher()
+    print('test_stitch: ok')